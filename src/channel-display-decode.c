@@ -0,0 +1,617 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 The spice-gtk contributors
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common/lz.h"
+#include "common/pixman_utils.h"
+
+#include "spice-client.h"
+#include "spice-common.h"
+#include "spice-channel-priv.h"
+#include "spice-buffer-pool.h"
+#include "gio-coroutine.h"
+#include "decode.h"
+
+#include "channel-display-priv.h"
+
+/*
+ * Image decompression on a thread pool.
+ *
+ * The display channel hands the self-contained images of its draw
+ * messages (QUIC, LZ RGB and JPEG) to the pool as the messages arrive,
+ * and commits the draws in order once their images are decoded, see
+ * display_handle_draw_msg(). The images depending on the decoding order
+ * (GLZ and its zlib wrapping, which reference the previous images of the
+ * window) and the palette ones are left to the canvas, on the coroutine.
+ *
+ * A worker decodes into the format the canvas would cache the image in,
+ * so the result can be handed to the canvas through the image cache. It
+ * declines, leaving the decoding to the canvas, for any other format.
+ *
+ * The pixels are allocated from a buffer pool shared by the workers:
+ * decoded images are short lived unless cached, and mostly of a few
+ * sizes, the pool saves mapping and faulting in fresh memory each time.
+ */
+
+#define DECODE_MAX_THREADS          8
+
+/* below this size, the handover to a worker costs more than it saves */
+#define DECODE_MIN_PIXELS           (64 * 64)
+
+#define DECODE_POOL_MAX_SIZE        (64 * 1024 * 1024)
+#define DECODE_POOL_MAX_CACHED      (64 * 1024 * 1024)
+
+struct display_decode_job_private {
+    display_decode_job          job;
+    gint                        ref_count;
+    GMainContext                *context;   /* of the waiting coroutine */
+};
+
+typedef struct DecodeContext {
+    QuicUsrContext              quic_usr;
+    LzUsrContext                lz_usr;
+    QuicContext                 *quic;
+    LzContext                   *lz;
+    SpiceJpegDecoder            *jpeg;
+
+    jmp_buf                     jmp_env;
+    char                        message[512];
+    SpiceChunks                 *chunks;
+    guint32                     current_chunk;
+    pixman_image_t              *surface;   /* being decoded */
+} DecodeContext;
+
+static GThreadPool *decode_pool;
+static SpiceBufferPool *surface_pool;
+static guint decode_threads;
+
+static GMutex decode_lock;
+static GCond decode_cond;
+
+/* ------------------------------------------------------------------ */
+/* worker side */
+
+G_GNUC_NORETURN G_GNUC_PRINTF(2, 3)
+static void quic_usr_error(QuicUsrContext *usr, const char *fmt, ...)
+{
+    DecodeContext *ctx = SPICE_CONTAINEROF(usr, DecodeContext, quic_usr);
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(ctx->message, sizeof(ctx->message), fmt, ap);
+    va_end(ap);
+    longjmp(ctx->jmp_env, 1);
+}
+
+G_GNUC_PRINTF(2, 3)
+static void quic_usr_warn(QuicUsrContext *usr, const char *fmt, ...)
+{
+    DecodeContext *ctx = SPICE_CONTAINEROF(usr, DecodeContext, quic_usr);
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(ctx->message, sizeof(ctx->message), fmt, ap);
+    va_end(ap);
+    g_warning("%s", ctx->message);
+}
+
+G_GNUC_PRINTF(2, 3)
+static void quic_usr_info(QuicUsrContext *usr, const char *fmt, ...)
+{
+}
+
+static void *quic_usr_malloc(QuicUsrContext *usr, int size)
+{
+    return g_malloc(size);
+}
+
+static void quic_usr_free(QuicUsrContext *usr, void *ptr)
+{
+    g_free(ptr);
+}
+
+static int quic_usr_more_space(QuicUsrContext *usr, uint32_t **io_ptr, int rows_completed)
+{
+    DecodeContext *ctx = SPICE_CONTAINEROF(usr, DecodeContext, quic_usr);
+
+    if (ctx->current_chunk == ctx->chunks->num_chunks - 1)
+        return 0;
+
+    ctx->current_chunk++;
+    *io_ptr = (uint32_t *)ctx->chunks->chunk[ctx->current_chunk].data;
+
+    return ctx->chunks->chunk[ctx->current_chunk].len >> 2;
+}
+
+static int quic_usr_more_lines(QuicUsrContext *usr, uint8_t **lines)
+{
+    return 0;
+}
+
+G_GNUC_NORETURN G_GNUC_PRINTF(2, 3)
+static void lz_usr_error(LzUsrContext *usr, const char *fmt, ...)
+{
+    DecodeContext *ctx = SPICE_CONTAINEROF(usr, DecodeContext, lz_usr);
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(ctx->message, sizeof(ctx->message), fmt, ap);
+    va_end(ap);
+    longjmp(ctx->jmp_env, 1);
+}
+
+G_GNUC_PRINTF(2, 3)
+static void lz_usr_warn(LzUsrContext *usr, const char *fmt, ...)
+{
+    DecodeContext *ctx = SPICE_CONTAINEROF(usr, DecodeContext, lz_usr);
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(ctx->message, sizeof(ctx->message), fmt, ap);
+    va_end(ap);
+    g_warning("%s", ctx->message);
+}
+
+G_GNUC_PRINTF(2, 3)
+static void lz_usr_info(LzUsrContext *usr, const char *fmt, ...)
+{
+}
+
+static void *lz_usr_malloc(LzUsrContext *usr, int size)
+{
+    return g_malloc(size);
+}
+
+static void lz_usr_free(LzUsrContext *usr, void *ptr)
+{
+    g_free(ptr);
+}
+
+static int lz_usr_more_space(LzUsrContext *usr, uint8_t **io_ptr)
+{
+    return 0;
+}
+
+static int lz_usr_more_lines(LzUsrContext *usr, uint8_t **lines)
+{
+    return 0;
+}
+
+static void decode_context_free(gpointer data)
+{
+    DecodeContext *ctx = data;
+
+    quic_destroy(ctx->quic);
+    lz_destroy(ctx->lz);
+    jpeg_decoder_destroy(ctx->jpeg);
+    g_free(ctx);
+}
+
+/* freed when the worker thread exits */
+static GPrivate decode_context = G_PRIVATE_INIT(decode_context_free);
+
+/* the decoders of the calling worker thread */
+static DecodeContext *decode_context_get(void)
+{
+    DecodeContext *ctx = g_private_get(&decode_context);
+
+    if (ctx != NULL)
+        return ctx;
+
+    ctx = g_new0(DecodeContext, 1);
+    ctx->quic_usr.error = quic_usr_error;
+    ctx->quic_usr.warn = quic_usr_warn;
+    ctx->quic_usr.info = quic_usr_info;
+    ctx->quic_usr.malloc = quic_usr_malloc;
+    ctx->quic_usr.free = quic_usr_free;
+    ctx->quic_usr.more_space = quic_usr_more_space;
+    ctx->quic_usr.more_lines = quic_usr_more_lines;
+    ctx->quic = quic_create(&ctx->quic_usr);
+
+    ctx->lz_usr.error = lz_usr_error;
+    ctx->lz_usr.warn = lz_usr_warn;
+    ctx->lz_usr.info = lz_usr_info;
+    ctx->lz_usr.malloc = lz_usr_malloc;
+    ctx->lz_usr.free = lz_usr_free;
+    ctx->lz_usr.more_space = lz_usr_more_space;
+    ctx->lz_usr.more_lines = lz_usr_more_lines;
+    ctx->lz = lz_create(&ctx->lz_usr);
+
+    ctx->jpeg = jpeg_decoder_new();
+
+    g_private_set(&decode_context, ctx);
+
+    return ctx;
+}
+
+static void decode_surface_release(pixman_image_t *image, void *data)
+{
+    spice_buffer_pool_free(surface_pool, data);
+}
+
+/* a 32 bits per pixel surface using pooled memory, the rows bottom up
+ * in memory if !top_down, as the LZ images come */
+static pixman_image_t *decode_surface_new(pixman_format_code_t format,
+                                          int width, int height, gboolean top_down)
+{
+    int stride = width * 4;
+    uint8_t *data = spice_buffer_pool_alloc(surface_pool, (gsize)stride * height);
+    pixman_image_t *image;
+
+    if (top_down)
+        image = pixman_image_create_bits(format, width, height, (uint32_t *)data, stride);
+    else
+        image = pixman_image_create_bits(format, width, height,
+                                         (uint32_t *)(data + (gsize)stride * (height - 1)),
+                                         -stride);
+    if (image == NULL) {
+        spice_buffer_pool_free(surface_pool, data);
+        return NULL;
+    }
+    pixman_image_set_destroy_function(image, decode_surface_release, data);
+
+    return image;
+}
+
+static pixman_image_t *decode_quic(DecodeContext *ctx, SpiceImage *image)
+{
+    SpiceChunks *chunks = image->u.quic.data;
+    QuicImageType type, as_type;
+    pixman_format_code_t format;
+    int width, height;
+
+    ctx->chunks = chunks;
+    ctx->current_chunk = 0;
+    if (quic_decode_begin(ctx->quic, (uint32_t *)chunks->chunk[0].data,
+                          chunks->chunk[0].len >> 2, &type, &width, &height) == QUIC_ERROR)
+        return NULL;
+
+    switch (type) {
+    case QUIC_IMAGE_TYPE_RGBA:
+        as_type = QUIC_IMAGE_TYPE_RGBA;
+        format = PIXMAN_LE_a8r8g8b8;
+        break;
+    case QUIC_IMAGE_TYPE_RGB32:
+    case QUIC_IMAGE_TYPE_RGB24:
+        as_type = QUIC_IMAGE_TYPE_RGB32;
+        format = PIXMAN_LE_x8r8g8b8;
+        break;
+    default:
+        /* 16 bits and gray images are kept as is when cached */
+        return NULL;
+    }
+
+    if ((uint32_t)width != image->descriptor.width ||
+        (uint32_t)height != image->descriptor.height)
+        return NULL;
+
+    ctx->surface = decode_surface_new(format, width, height, TRUE);
+    if (ctx->surface == NULL)
+        return NULL;
+
+    if (quic_decode(ctx->quic, as_type,
+                    (uint8_t *)pixman_image_get_data(ctx->surface),
+                    pixman_image_get_stride(ctx->surface)) == QUIC_ERROR)
+        return NULL;
+
+    return g_steal_pointer(&ctx->surface);
+}
+
+static pixman_image_t *decode_lz_rgb(DecodeContext *ctx, SpiceImage *image)
+{
+    SpiceChunks *chunks = image->u.lz_rgb.data;
+    LzImageType type, as_type;
+    pixman_format_code_t format;
+    int width, height, n_comp_pixels, top_down;
+    uint8_t *dest;
+
+    if (chunks->num_chunks != 1)
+        return NULL;
+
+    lz_decode_begin(ctx->lz, chunks->chunk[0].data, chunks->chunk[0].len,
+                    &type, &width, &height, &n_comp_pixels, &top_down, NULL);
+
+    switch (type) {
+    case LZ_IMAGE_TYPE_RGBA:
+        as_type = LZ_IMAGE_TYPE_RGBA;
+        format = PIXMAN_LE_a8r8g8b8;
+        break;
+    case LZ_IMAGE_TYPE_RGB32:
+    case LZ_IMAGE_TYPE_RGB24:
+        as_type = LZ_IMAGE_TYPE_RGB32;
+        format = PIXMAN_LE_x8r8g8b8;
+        break;
+    default:
+        return NULL;
+    }
+
+    /* padded rows are left to the canvas */
+    if ((uint32_t)width != image->descriptor.width ||
+        (uint32_t)height != image->descriptor.height ||
+        n_comp_pixels != width * height)
+        return NULL;
+
+    ctx->surface = decode_surface_new(format, width, height, top_down);
+    if (ctx->surface == NULL)
+        return NULL;
+
+    /* the decoder writes the rows in stream order */
+    dest = (uint8_t *)pixman_image_get_data(ctx->surface);
+    if (!top_down)
+        dest += pixman_image_get_stride(ctx->surface) * (height - 1);
+    lz_decode(ctx->lz, as_type, dest);
+
+    return g_steal_pointer(&ctx->surface);
+}
+
+static pixman_image_t *decode_jpeg(DecodeContext *ctx, SpiceImage *image)
+{
+    SpiceChunks *chunks = image->u.jpeg.data;
+    int width, height;
+
+    if (chunks->num_chunks != 1)
+        return NULL;
+
+    ctx->jpeg->ops->begin_decode(ctx->jpeg, chunks->chunk[0].data, chunks->chunk[0].len,
+                                 &width, &height);
+    if ((uint32_t)width != image->descriptor.width ||
+        (uint32_t)height != image->descriptor.height)
+        return NULL;
+
+    ctx->surface = decode_surface_new(PIXMAN_LE_x8r8g8b8, width, height, TRUE);
+    if (ctx->surface == NULL)
+        return NULL;
+
+    ctx->jpeg->ops->decode(ctx->jpeg, (uint8_t *)pixman_image_get_data(ctx->surface),
+                           pixman_image_get_stride(ctx->surface), SPICE_BITMAP_FMT_32BIT);
+
+    return g_steal_pointer(&ctx->surface);
+}
+
+/* what the canvas does for any decoded image, it skips it for the cached ones */
+static void decode_set_high_bits(SpiceImage *image, pixman_image_t *surface)
+{
+    uint32_t *row = pixman_image_get_data(surface);
+    int stride = pixman_image_get_stride(surface) / 4;
+    int width = pixman_image_get_width(surface);
+    int height = pixman_image_get_height(surface);
+    int x, y;
+
+    if (!(image->descriptor.flags & SPICE_IMAGE_FLAGS_HIGH_BITS_SET) ||
+        pixman_image_get_format(surface) != PIXMAN_LE_x8r8g8b8)
+        return;
+
+    for (y = 0; y < height; y++, row += stride)
+        for (x = 0; x < width; x++)
+            row[x] |= 0xff000000U;
+}
+
+static void decode_job_unref(display_decode_job *job)
+{
+    struct display_decode_job_private *p = (struct display_decode_job_private *)job;
+
+    if (!g_atomic_int_dec_and_test(&p->ref_count))
+        return;
+
+    g_clear_pointer(&job->surface, pixman_image_unref);
+    g_source_unref(job->event);
+    g_main_context_unref(p->context);
+    g_free(p);
+}
+
+/* context of the waiting coroutine, setting the event there avoids
+ * racing with its attachment */
+static gboolean decode_job_wake(gpointer data)
+{
+    display_decode_job *job = data;
+
+    g_coroutine_event_set(job->event);
+
+    return FALSE;
+}
+
+static pixman_image_t *decode_image(DecodeContext *ctx, SpiceImage *image)
+{
+    pixman_image_t *surface = NULL;
+
+    if (setjmp(ctx->jmp_env)) {
+        /* the canvas will most likely fail too, and report it */
+        SPICE_DEBUG("decode of image %" G_GUINT64_FORMAT " failed: %s",
+                    (guint64)image->descriptor.id, ctx->message);
+        g_clear_pointer(&ctx->surface, pixman_image_unref);
+        return NULL;
+    }
+
+    switch (image->descriptor.type) {
+    case SPICE_IMAGE_TYPE_QUIC:
+        surface = decode_quic(ctx, image);
+        break;
+    case SPICE_IMAGE_TYPE_LZ_RGB:
+        surface = decode_lz_rgb(ctx, image);
+        break;
+    case SPICE_IMAGE_TYPE_JPEG:
+        surface = decode_jpeg(ctx, image);
+        break;
+    default:
+        g_warn_if_reached();
+        break;
+    }
+    g_clear_pointer(&ctx->surface, pixman_image_unref);
+
+    if (surface)
+        decode_set_high_bits(image, surface);
+
+    return surface;
+}
+
+static void decode_job_run(gpointer data, gpointer user_data)
+{
+    display_decode_job *job = data;
+    struct display_decode_job_private *p = data;
+    gint64 start = g_get_monotonic_time();
+    pixman_image_t *surface;
+    GSource *idle;
+
+    surface = decode_image(decode_context_get(), job->image);
+
+    g_mutex_lock(&decode_lock);
+    job->surface = surface;
+    job->decode_us = g_get_monotonic_time() - start;
+    job->done = TRUE;
+    g_cond_broadcast(&decode_cond);
+    g_mutex_unlock(&decode_lock);
+
+    /* the idle holds the reference of the worker */
+    idle = g_idle_source_new();
+    g_source_set_priority(idle, G_PRIORITY_DEFAULT);
+    g_source_set_callback(idle, decode_job_wake, job, (GDestroyNotify)decode_job_unref);
+    g_source_attach(idle, p->context);
+    g_source_unref(idle);
+}
+
+/* ------------------------------------------------------------------ */
+/* coroutine side */
+
+static gpointer decode_pool_init(gpointer data)
+{
+    const gchar *threads = g_getenv("SPICE_DECODE_THREADS");
+
+    if (threads)
+        decode_threads = MIN(atoi(threads), DECODE_MAX_THREADS);
+    else
+        decode_threads = MIN(g_get_num_processors(), DECODE_MAX_THREADS);
+
+    /* a single thread would only add latency */
+    if (decode_threads < 2) {
+        SPICE_DEBUG("image decoding on the channel coroutine");
+        decode_threads = 0;
+        return NULL;
+    }
+
+    SPICE_DEBUG("image decoding on %u threads", decode_threads);
+    surface_pool = spice_buffer_pool_new(DECODE_POOL_MAX_SIZE, DECODE_POOL_MAX_CACHED);
+    decode_pool = g_thread_pool_new(decode_job_run, NULL, decode_threads, FALSE, NULL);
+
+    return NULL;
+}
+
+/*
+ * Returns the number of workers decoding images, 0 if the images are
+ * decoded by the canvas. Set with SPICE_DECODE_THREADS, the default is
+ * the number of processors.
+ */
+G_GNUC_INTERNAL
+guint display_decode_threads(void)
+{
+    static GOnce once = G_ONCE_INIT;
+
+    g_once(&once, decode_pool_init, NULL);
+
+    return decode_threads;
+}
+
+/*
+ * Queues the decoding of @image if it is worth it, or returns NULL.
+ * @image must stay valid until the job is done, see
+ * display_decode_job_wait() and display_decode_job_wait_blocking().
+ */
+G_GNUC_INTERNAL
+display_decode_job *display_decode_job_new(SpiceImage *image)
+{
+    struct display_decode_job_private *p;
+    display_decode_job *job;
+
+    if (image == NULL || display_decode_threads() == 0)
+        return NULL;
+
+    switch (image->descriptor.type) {
+    case SPICE_IMAGE_TYPE_QUIC:
+    case SPICE_IMAGE_TYPE_LZ_RGB:
+    case SPICE_IMAGE_TYPE_JPEG:
+        break;
+    default:
+        return NULL;
+    }
+
+    if ((guint64)image->descriptor.width * image->descriptor.height < DECODE_MIN_PIXELS)
+        return NULL;
+
+    p = g_new0(struct display_decode_job_private, 1);
+    p->ref_count = 2; /* the caller and the worker */
+    p->context = g_main_context_ref(spice_main_context());
+    job = &p->job;
+    job->image = image;
+    job->event = g_coroutine_event_new();
+
+    g_thread_pool_push(decode_pool, job, NULL);
+
+    return job;
+}
+
+/* coroutine context
+ *
+ * Yields until @job is done, @wait_us is set to the time spent waiting.
+ * Returns FALSE if the wait got cancelled, the job may still be running
+ * then. */
+G_GNUC_INTERNAL
+gboolean display_decode_job_wait(display_decode_job *job, gint64 *wait_us)
+{
+    gint64 start;
+    gboolean done;
+
+    *wait_us = 0;
+
+    g_mutex_lock(&decode_lock);
+    done = job->done;
+    g_mutex_unlock(&decode_lock);
+    if (done)
+        return TRUE;
+
+    start = g_get_monotonic_time();
+    done = g_coroutine_event_wait(g_coroutine_self(), job->event);
+    *wait_us = g_get_monotonic_time() - start;
+
+    return done;
+}
+
+/* any context, blocks until @job is done */
+G_GNUC_INTERNAL
+void display_decode_job_wait_blocking(display_decode_job *job)
+{
+    g_mutex_lock(&decode_lock);
+    while (!job->done)
+        g_cond_wait(&decode_cond, &decode_lock);
+    g_mutex_unlock(&decode_lock);
+}
+
+/* @job must be done, the result surface is unreferenced */
+G_GNUC_INTERNAL
+void display_decode_job_free(display_decode_job *job)
+{
+    if (job == NULL)
+        return;
+
+    g_warn_if_fail(job->done);
+    job->image = NULL;
+    decode_job_unref(job);
+}
@@ -324,15 +324,17 @@ static void schedule_frame(SpiceGstDecoder *decoder)
 
         if (spice_mmtime_diff(gstframe->encoded_frame->mm_time, now) >= 0)
         {
-            decoder->timer_id = g_spice_timeout_add(gstframe->encoded_frame->mm_time - now,
-                                                    display_frame, decoder);
+            decoder->timer_id = stream_present_add(decoder->base.stream,
+                                                   gstframe->encoded_frame->mm_time,
+                                                   display_frame, decoder);
         }
         else if (decoder->display_frame && !decoder->pending_samples)
         {
             /* Still attempt to display the least out of date frame so the
              * video is not completely frozen for an extended period of time.
              */
-            decoder->timer_id = g_spice_timeout_add(0, display_frame, decoder);
+            decoder->timer_id = stream_present_add(decoder->base.stream, now,
+                                                   display_frame, decoder);
         }
         else
         {
@@ -896,7 +898,7 @@ static void spice_gst_decoder_reschedule(VideoDecoder *video_decoder)
 
     if (timer_id != 0)
     {
-        g_source_remove(timer_id);
+        stream_present_remove(decoder->base.stream, timer_id);
     }
     schedule_frame(decoder);
 }
@@ -917,7 +919,7 @@ static void spice_gst_decoder_destroy(VideoDecoder *video_decoder)
      */
     if (decoder->timer_id)
     {
-        g_source_remove(decoder->timer_id);
+        stream_present_remove(decoder->base.stream, decoder->timer_id);
     }
     g_mutex_clear(&decoder->queues_mutex);
     g_queue_free_full(decoder->decoding_queue, (GDestroyNotify)free_gst_frame);
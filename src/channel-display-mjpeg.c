@@ -21,8 +21,31 @@
 #include "spice-channel-priv.h"
 
 #include "channel-display-priv.h"
+#include "decode-mjpeg.h"
 
-/* MJpeg decoder implementation */
+/* MJpeg decoder implementation
+ *
+ * The frames are decoded ahead of their presentation time by a thread
+ * dedicated to the stream, into a small pool of output buffers. The
+ * channel context then only has to blit the decoded frame when it is
+ * due. Frames already late when a buffer becomes available are dropped
+ * without being decoded.
+ */
+
+/* one frame being displayed, one being decoded and one ready ahead */
+#define MJPEG_OUTPUT_BUFFERS 3
+
+typedef struct MJpegOutput
+{
+    SpiceFrame *frame;
+    guint generation;
+    gboolean failed;
+
+    JDIMENSION width;
+    JDIMENSION height;
+    uint8_t *data;
+    gsize size;
+} MJpegOutput;
 
 typedef struct MJpegDecoder
 {
@@ -33,17 +56,24 @@ typedef struct MJpegDecoder
     struct jpeg_source_mgr mjpeg_src;
     struct jpeg_decompress_struct mjpeg_cinfo;
     struct jpeg_error_mgr mjpeg_jerr;
+    SpiceFrame *decoding_frame;    /* decoding thread only */
+    guint slices;
+
+    GThreadPool *decode_thread;
 
-    /* ---------- Frame queue ---------- */
+    /* ---------- Frame queues (channel context) ---------- */
 
-    GQueue *msgq;
-    SpiceFrame *cur_frame;
+    GQueue *msgq;                  /* waiting for an output buffer */
+    GQueue *free_outputs;
+    GQueue *ready_outputs;         /* decoded, in presentation order */
+    guint generation;              /* bumped when the queues are dropped */
     guint timer_id;
 
-    /* ---------- Output frame data ---------- */
+    /* ---------- Handover from the decoding thread ---------- */
 
-    uint8_t *out_frame;
-    uint32_t out_size;
+    GMutex lock;
+    GQueue *decoded_outputs;
+    guint decoded_id;
 } MJpegDecoder;
 
 /* ---------- The JPEG library callbacks ---------- */
@@ -51,8 +81,8 @@ typedef struct MJpegDecoder
 static void mjpeg_src_init(struct jpeg_decompress_struct *cinfo)
 {
     MJpegDecoder *decoder = SPICE_CONTAINEROF(cinfo->src, MJpegDecoder, mjpeg_src);
-    cinfo->src->bytes_in_buffer = decoder->cur_frame->size;
-    cinfo->src->next_input_byte = decoder->cur_frame->data;
+    cinfo->src->bytes_in_buffer = decoder->decoding_frame->size;
+    cinfo->src->next_input_byte = decoder->decoding_frame->data;
 }
 
 static boolean mjpeg_src_fill(struct jpeg_decompress_struct *cinfo)
@@ -75,103 +105,157 @@ static void mjpeg_src_term(struct jpeg_decompress_struct *cinfo)
 /* ---------- Decoder proper ---------- */
 
 static void mjpeg_decoder_schedule(MJpegDecoder *decoder);
+static void mjpeg_decoder_decode_ahead(MJpegDecoder *decoder);
 
-/* main context */
-static gboolean mjpeg_decoder_decode_frame(gpointer video_decoder)
+/* decoding thread */
+static gboolean mjpeg_decoder_decode_output(MJpegDecoder *decoder, MJpegOutput *output)
 {
-    MJpegDecoder *decoder = (MJpegDecoder *)video_decoder;
     JDIMENSION width, height;
-    uint8_t *dest;
-    uint8_t *lines[4];
+    gboolean ok;
 
+    decoder->decoding_frame = output->frame;
     jpeg_read_header(&decoder->mjpeg_cinfo, 1);
     width = decoder->mjpeg_cinfo.image_width;
     height = decoder->mjpeg_cinfo.image_height;
-    if (decoder->out_size < width * height * 4)
+    if (output->size < (gsize)width * height * 4)
     {
-        g_free(decoder->out_frame);
-        decoder->out_size = width * height * 4;
-        decoder->out_frame = g_malloc(decoder->out_size);
+        g_free(output->data);
+        output->size = (gsize)width * height * 4;
+        output->data = g_malloc(output->size);
     }
-    dest = decoder->out_frame;
-
-#ifdef JCS_EXTENSIONS
-    // requires jpeg-turbo
-#if SPICE_ENDIAN == SPICE_ENDIAN_LITTLE
-    decoder->mjpeg_cinfo.out_color_space = JCS_EXT_BGRX;
-#else
-    decoder->mjpeg_cinfo.out_color_space = JCS_EXT_XRGB;
-#endif
-#else
-#warning "You should consider building with libjpeg-turbo"
-    decoder->mjpeg_cinfo.out_color_space = JCS_RGB;
-#endif
-
-#ifndef SPICE_QUALITY
-    decoder->mjpeg_cinfo.dct_method = JDCT_IFAST;
-    decoder->mjpeg_cinfo.do_fancy_upsampling = FALSE;
-    decoder->mjpeg_cinfo.do_block_smoothing = FALSE;
-    decoder->mjpeg_cinfo.dither_mode = JDITHER_ORDERED;
-#endif
-    // TODO: in theory should check cinfo.output_height match with our height
-    jpeg_start_decompress(&decoder->mjpeg_cinfo);
-    /* rec_outbuf_height is the recommended size of the output buffer we
-     * pass to libjpeg for optimum performance
-     */
-    if (decoder->mjpeg_cinfo.rec_outbuf_height > G_N_ELEMENTS(lines))
+    output->width = width;
+    output->height = height;
+
+    /* frames with restart markers are split and decoded in parallel */
+    if (decoder->slices > 1 &&
+        mjpeg_decode_slices(output->frame->data, output->frame->size,
+                            output->data, width, height, decoder->slices))
     {
         jpeg_abort_decompress(&decoder->mjpeg_cinfo);
-        g_return_val_if_reached(G_SOURCE_REMOVE);
+        decoder->decoding_frame = NULL;
+        return TRUE;
     }
 
-    while (decoder->mjpeg_cinfo.output_scanline < decoder->mjpeg_cinfo.output_height)
+    mjpeg_decompress_setup(&decoder->mjpeg_cinfo);
+    ok = mjpeg_decompress_read(&decoder->mjpeg_cinfo, output->data, width * 4);
+    decoder->decoding_frame = NULL;
+
+    return ok;
+}
+
+static gboolean mjpeg_decoder_outputs_decoded(gpointer video_decoder);
+
+/* decoding thread */
+static void mjpeg_decoder_decode_func(gpointer data, gpointer user_data)
+{
+    MJpegOutput *output = data;
+    MJpegDecoder *decoder = user_data;
+
+    output->failed = !mjpeg_decoder_decode_output(decoder, output);
+
+    g_mutex_lock(&decoder->lock);
+    g_queue_push_tail(decoder->decoded_outputs, output);
+    if (decoder->decoded_id == 0)
     {
-        /* only used when JCS_EXTENSIONS is undefined */
-        G_GNUC_UNUSED unsigned int lines_read;
+        decoder->decoded_id = spice_channel_idle_add(decoder->base.stream->channel,
+                                                     mjpeg_decoder_outputs_decoded,
+                                                     decoder);
+    }
+    g_mutex_unlock(&decoder->lock);
+}
 
-        for (unsigned int j = 0; j < decoder->mjpeg_cinfo.rec_outbuf_height; j++)
-        {
-            lines[j] = dest;
-#ifdef JCS_EXTENSIONS
-            dest += 4 * width;
-#else
-            dest += 3 * width;
-#endif
-        }
-        lines_read = jpeg_read_scanlines(&decoder->mjpeg_cinfo, lines,
-                                         decoder->mjpeg_cinfo.rec_outbuf_height);
-#ifndef JCS_EXTENSIONS
+static void mjpeg_output_release(MJpegDecoder *decoder, MJpegOutput *output)
+{
+    g_clear_pointer(&output->frame, spice_frame_free);
+    g_queue_push_tail(decoder->free_outputs, output);
+}
+
+/* channel context */
+static gboolean mjpeg_decoder_outputs_decoded(gpointer video_decoder)
+{
+    MJpegDecoder *decoder = (MJpegDecoder *)video_decoder;
+    MJpegOutput *output;
+    GQueue decoded = G_QUEUE_INIT;
+
+    g_mutex_lock(&decoder->lock);
+    decoder->decoded_id = 0;
+    while ((output = g_queue_pop_head(decoder->decoded_outputs)))
+    {
+        g_queue_push_tail(&decoded, output);
+    }
+    g_mutex_unlock(&decoder->lock);
+
+    while ((output = g_queue_pop_head(&decoded)))
+    {
+        /* decoded for a queue dropped since then, or undecodable */
+        if (output->generation != decoder->generation || output->failed)
         {
-            uint8_t *s = lines[0];
-            uint32_t *d = SPICE_ALIGNED_CAST(uint32_t *, s);
-
-            for (unsigned int j = lines_read * width; j > 0;)
-            {
-                j -= 1; // reverse order, bad for cache?
-                d[j] = s[j * 3 + 0] << 16 |
-                       s[j * 3 + 1] << 8 |
-                       s[j * 3 + 2];
-            }
+            mjpeg_output_release(decoder, output);
+            continue;
         }
-#endif
-        dest = &(decoder->out_frame[decoder->mjpeg_cinfo.output_scanline * width * 4]);
+        g_queue_push_tail(decoder->ready_outputs, output);
     }
-    jpeg_finish_decompress(&decoder->mjpeg_cinfo);
 
-    /* Display the frame and dispose of it */
-    stream_display_frame(decoder->base.stream, decoder->cur_frame,
-                         width, height, SPICE_UNKNOWN_STRIDE, decoder->out_frame);
-    g_clear_pointer(&decoder->cur_frame, spice_frame_free);
+    mjpeg_decoder_schedule(decoder);
+    mjpeg_decoder_decode_ahead(decoder);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* channel context */
+static gboolean mjpeg_decoder_display_frame(gpointer video_decoder)
+{
+    MJpegDecoder *decoder = (MJpegDecoder *)video_decoder;
+    MJpegOutput *output = g_queue_pop_head(decoder->ready_outputs);
+
     decoder->timer_id = 0;
+    g_return_val_if_fail(output != NULL, G_SOURCE_REMOVE);
+
+    /* Display the frame and dispose of it */
+    stream_display_frame(decoder->base.stream, output->frame,
+                         output->width, output->height, SPICE_UNKNOWN_STRIDE, output->data);
+    mjpeg_output_release(decoder, output);
 
     /* Schedule the next frame */
     mjpeg_decoder_schedule(decoder);
+    mjpeg_decoder_decode_ahead(decoder);
 
     return G_SOURCE_REMOVE;
 }
 
 /* ---------- VideoDecoder's queue scheduling ---------- */
 
+/* Hands the queued frames to the decoding thread as output buffers
+ * become available, dropping the ones that are already late.
+ */
+static void mjpeg_decoder_decode_ahead(MJpegDecoder *decoder)
+{
+    guint32 time = stream_get_time(decoder->base.stream);
+
+    while (!g_queue_is_empty(decoder->msgq) &&
+           !g_queue_is_empty(decoder->free_outputs))
+    {
+        SpiceFrame *frame = g_queue_pop_head(decoder->msgq);
+        MJpegOutput *output;
+
+        if (spice_mmtime_diff(time, frame->mm_time) > 0)
+        {
+            SPICE_DEBUG("%s: too late by %u ms (ts: %u, mmtime: %u), dropping before decoding",
+                        __FUNCTION__, time - frame->mm_time,
+                        frame->mm_time, time);
+            stream_dropped_frame_on_playback(decoder->base.stream);
+            spice_frame_free(frame);
+            continue;
+        }
+
+        output = g_queue_pop_head(decoder->free_outputs);
+        output->frame = frame;
+        output->generation = decoder->generation;
+        output->failed = FALSE;
+        g_thread_pool_push(decoder->decode_thread, output, NULL);
+    }
+}
+
 static void mjpeg_decoder_schedule(MJpegDecoder *decoder)
 {
     if (decoder->timer_id)
@@ -180,28 +264,25 @@ static void mjpeg_decoder_schedule(MJpegDecoder *decoder)
     }
 
     guint32 time = stream_get_time(decoder->base.stream);
-    SpiceFrame *frame = decoder->cur_frame;
-    decoder->cur_frame = NULL;
-    do
+    MJpegOutput *output;
+
+    while ((output = g_queue_peek_head(decoder->ready_outputs)))
     {
-        if (frame)
+        SpiceFrame *frame = output->frame;
+
+        if (spice_mmtime_diff(time, frame->mm_time) <= 0)
         {
-            if (spice_mmtime_diff(time, frame->mm_time) <= 0)
-            {
-                guint32 d = frame->mm_time - time;
-                decoder->cur_frame = frame;
-                decoder->timer_id = g_spice_timeout_add(d, mjpeg_decoder_decode_frame, decoder);
-                break;
-            }
-
-            SPICE_DEBUG("%s: rendering too late by %u ms (ts: %u, mmtime: %u), dropping ",
-                        __FUNCTION__, time - frame->mm_time,
-                        frame->mm_time, time);
-            stream_dropped_frame_on_playback(decoder->base.stream);
-            spice_frame_free(frame);
+            decoder->timer_id = stream_present_add(decoder->base.stream, frame->mm_time,
+                                                   mjpeg_decoder_display_frame, decoder);
+            break;
         }
-        frame = g_queue_pop_head(decoder->msgq);
-    } while (frame);
+
+        SPICE_DEBUG("%s: rendering too late by %u ms (ts: %u, mmtime: %u), dropping ",
+                    __FUNCTION__, time - frame->mm_time,
+                    frame->mm_time, time);
+        stream_dropped_frame_on_playback(decoder->base.stream);
+        mjpeg_output_release(decoder, g_queue_pop_head(decoder->ready_outputs));
+    }
 }
 
 /* mjpeg_decoder_drop_queue() helper */
@@ -212,14 +293,21 @@ static void spice_frame_unref_func(gpointer data, gpointer user_data)
 
 static void mjpeg_decoder_drop_queue(MJpegDecoder *decoder)
 {
+    MJpegOutput *output;
+
     if (decoder->timer_id != 0)
     {
-        g_source_remove(decoder->timer_id);
+        stream_present_remove(decoder->base.stream, decoder->timer_id);
         decoder->timer_id = 0;
     }
-    g_clear_pointer(&decoder->cur_frame, spice_frame_free);
     g_queue_foreach(decoder->msgq, spice_frame_unref_func, NULL);
     g_queue_clear(decoder->msgq);
+    while ((output = g_queue_pop_head(decoder->ready_outputs)))
+    {
+        mjpeg_output_release(decoder, output);
+    }
+    /* the frames being decoded are released once done */
+    decoder->generation++;
 }
 
 /* ---------- VideoDecoder's public API ---------- */
@@ -255,7 +343,7 @@ static gboolean mjpeg_decoder_queue_frame(VideoDecoder *video_decoder,
     }
 
     g_queue_push_tail(decoder->msgq, frame);
-    mjpeg_decoder_schedule(decoder);
+    mjpeg_decoder_decode_ahead(decoder);
     return TRUE;
 }
 
@@ -266,10 +354,20 @@ static void mjpeg_decoder_reschedule(VideoDecoder *video_decoder)
     SPICE_DEBUG("%s", __FUNCTION__);
     if (decoder->timer_id != 0)
     {
-        g_source_remove(decoder->timer_id);
+        stream_present_remove(decoder->base.stream, decoder->timer_id);
         decoder->timer_id = 0;
     }
     mjpeg_decoder_schedule(decoder);
+    mjpeg_decoder_decode_ahead(decoder);
+}
+
+static void mjpeg_output_free(gpointer data)
+{
+    MJpegOutput *output = data;
+
+    g_clear_pointer(&output->frame, spice_frame_free);
+    g_free(output->data);
+    g_free(output);
 }
 
 static void mjpeg_decoder_destroy(VideoDecoder *video_decoder)
@@ -277,9 +375,18 @@ static void mjpeg_decoder_destroy(VideoDecoder *video_decoder)
     MJpegDecoder *decoder = (MJpegDecoder *)video_decoder;
 
     mjpeg_decoder_drop_queue(decoder);
+    /* waits for the frames handed to the thread */
+    g_thread_pool_free(decoder->decode_thread, FALSE, TRUE);
+    if (decoder->decoded_id != 0)
+    {
+        spice_channel_source_remove(decoder->base.stream->channel, decoder->decoded_id);
+    }
     g_queue_free(decoder->msgq);
+    g_queue_free_full(decoder->decoded_outputs, mjpeg_output_free);
+    g_queue_free_full(decoder->ready_outputs, mjpeg_output_free);
+    g_queue_free_full(decoder->free_outputs, mjpeg_output_free);
+    g_mutex_clear(&decoder->lock);
     jpeg_destroy_decompress(&decoder->mjpeg_cinfo);
-    g_free(decoder->out_frame);
     g_free(decoder);
 }
 
@@ -297,6 +404,14 @@ VideoDecoder *create_mjpeg_decoder(int codec_type, display_stream *stream)
     decoder->base.stream = stream;
 
     decoder->msgq = g_queue_new();
+    decoder->ready_outputs = g_queue_new();
+    decoder->decoded_outputs = g_queue_new();
+    decoder->free_outputs = g_queue_new();
+    for (int i = 0; i < MJPEG_OUTPUT_BUFFERS; i++)
+    {
+        g_queue_push_tail(decoder->free_outputs, g_new0(MJpegOutput, 1));
+    }
+    g_mutex_init(&decoder->lock);
 
     decoder->mjpeg_cinfo.err = jpeg_std_error(&decoder->mjpeg_jerr);
     jpeg_create_decompress(&decoder->mjpeg_cinfo);
@@ -308,6 +423,12 @@ VideoDecoder *create_mjpeg_decoder(int codec_type, display_stream *stream)
     decoder->mjpeg_src.term_source = mjpeg_src_term;
     decoder->mjpeg_cinfo.src = &decoder->mjpeg_src;
 
+    decoder->slices = mjpeg_slices_get_default();
+
+    /* a single thread, the frames are decoded in order */
+    decoder->decode_thread = g_thread_pool_new(mjpeg_decoder_decode_func, decoder,
+                                               1, TRUE, NULL);
+
     /* All the other fields are initialized to zero by g_new0(). */
 
     /* makes the draw-area visible */
@@ -28,6 +28,7 @@
 #include "client_sw_canvas.h"
 #include "common/quic.h"
 #include "common/rop3.h"
+#include "spice-surface-pool.h"
 
 #include <gst/gst.h>
 
@@ -96,18 +97,52 @@ typedef struct display_surface {
     enum SpiceSurfaceFmt        format;
     int                         width, height, stride, size;
     uint8_t                     *data;
+    SpiceSurfacePool            *pool;          /* where data comes from */
+    int                         shm_fd;         /* or the shared memory file */
+    bool                        needs_clear;    /* data recycled, not cleared yet */
     SpiceCanvas                 *canvas;
     SpiceGlzDecoder             *glz_decoder;
     SpiceZlibDecoder            *zlib_decoder;
     SpiceJpegDecoder            *jpeg_decoder;
 } display_surface;
 
+/* Image decompression off the channel coroutine, see
+ * channel-display-decode.c. A job decodes one image of a draw message
+ * on the worker pool, the message is kept alive until the job is done. */
+typedef struct display_decode_job {
+    SpiceImage                  *image;
+    pixman_image_t              *surface;   /* result, NULL if the canvas should decode */
+    gint64                      decode_us;
+    gboolean                    done;
+    GSource                     *event;     /* set once done */
+} display_decode_job;
+
+typedef struct display_decode_stats {
+    guint64                     images;     /* decoded by the workers */
+    guint64                     bytes;      /* of decoded pixels */
+    guint64                     declined;   /* left to the canvas by the workers */
+    gint64                      decode_us;  /* spent in the workers */
+    guint64                     waits;      /* commits that waited for a worker */
+    gint64                      wait_us;
+    guint                       max_pending;
+} display_decode_stats;
+
+guint display_decode_threads(void);
+display_decode_job *display_decode_job_new(SpiceImage *image);
+void display_decode_job_wait_blocking(display_decode_job *job);
+gboolean display_decode_job_wait(display_decode_job *job, gint64 *wait_us);
+void display_decode_job_free(display_decode_job *job);
+
 typedef struct drops_sequence_stats {
     uint32_t len;
     uint32_t start_mm_time;
     uint32_t duration;
 } drops_sequence_stats;
 
+/* the buckets of the stream histograms, in ms: < 1, [1, 2), [2, 4),
+ * ... [32, 64), >= 64 */
+#define STREAM_HISTOGRAM_BUCKETS 8
+
 struct display_stream {
     /* from messages */
     uint32_t                    id;
@@ -134,6 +169,15 @@ struct display_stream {
 
     uint32_t             playback_sync_drops_seq_len;
 
+    /* lateness of the frames on arrival and on presentation, and jitter
+     * of the presentation intervals, see stream_histogram_add() */
+    uint32_t             arrive_late_hist[STREAM_HISTOGRAM_BUCKETS];
+    uint32_t             present_late_hist[STREAM_HISTOGRAM_BUCKETS];
+    uint32_t             present_jitter_hist[STREAM_HISTOGRAM_BUCKETS];
+    uint32_t             num_presented;
+    gint64               last_present_time;
+    uint32_t             last_present_mm_time;
+
     /* playback quality report to server */
     gboolean report_is_active;
     uint32_t report_id;
@@ -195,6 +239,8 @@ guint32 stream_get_time(display_stream *st);
 void stream_dropped_frame_on_playback(display_stream *st);
 #define SPICE_UNKNOWN_STRIDE 0
 void stream_display_frame(display_stream *st, SpiceFrame *frame, uint32_t width, uint32_t height, int stride, uint8_t* data);
+guint stream_present_add(display_stream *st, guint32 mm_time, GSourceFunc func, gpointer data);
+void stream_present_remove(display_stream *st, guint id);
 guintptr get_window_handle(display_stream *st);
 gboolean hand_pipeline_to_widget(display_stream *st,  GstPipeline *pipeline);
 
@@ -61,14 +61,35 @@ struct _SpiceDisplayChannelPrivate
     SpicePaletteCache palette_cache;
     SpiceImageSurfaces image_surfaces;
     SpiceGlzDecoderWindow *glz_window;
+    SpiceSurfacePool *surface_pool;
+    gboolean shared_primary;
+    pixman_region32_t damage;   /* of the primary, not notified yet */
+    GSource *damage_source;     /* armed by its ready time, see emit_invalidate() */
+    gint64 damage_last_flush;
+    guint invalidate_max_rate;
+    /* also guards the streams array and the stream statistics, which
+     * the "stream-stats" getter reads from the main thread */
+    GMutex present_lock;
+    GList *present_queue;       /* StreamPresent, by due time */
+    guint present_timer_id;
+    gint64 present_timer_due;
+    guint present_last_id;
     display_stream **streams;
     int nstreams;
+    /* the channel may run on an I/O thread while the getters are called
+     * from the main thread: the surfaces, the mark and the monitors are
+     * changed under state_lock, and the getters read them under it */
+    GMutex state_lock;
     gboolean mark;
     guint mark_false_event_id;
     GArray *monitors;
     guint monitors_max;
     gboolean enable_adaptive_streaming;
     SpiceGlScanout scanout;
+    GQueue pending_draws;
+    display_decode_job *decoded;
+    display_decode_stats decode_stats;
+    gboolean missing_image;     /* the current draw lacks an image, see wait_image() */
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(SpiceDisplayChannel, spice_display_channel, SPICE_TYPE_CHANNEL)
@@ -82,6 +103,10 @@ enum
     PROP_MONITORS,
     PROP_MONITORS_MAX,
     PROP_GL_SCANOUT,
+    PROP_DECODE_STATS,
+    PROP_SHARED_PRIMARY,
+    PROP_INVALIDATE_MAX_RATE,
+    PROP_STREAM_STATS,
 };
 
 enum
@@ -93,6 +118,7 @@ enum
     SPICE_DISPLAY_GL_DRAW,
     SPICE_DISPLAY_STREAMING_MODE,
     SPICE_DISPLAY_OVERLAY,
+    SPICE_DISPLAY_INVALIDATE_REGION,
 
     SPICE_DISPLAY_LAST_SIGNAL,
 };
@@ -110,7 +136,13 @@ static void spice_display_channel_set_capabilities(SpiceChannel *channel);
 static void destroy_canvas(display_surface *surface);
 static void display_stream_destroy(gpointer st);
 static void display_session_mm_time_reset_cb(SpiceSession *session, gpointer data);
+static void display_damage_discard(SpiceChannel *channel);
+static void display_damage_flush(SpiceChannel *channel, gboolean force);
+static void display_present_discard(SpiceChannel *channel);
 static SpiceGlScanout *spice_gl_scanout_copy(const SpiceGlScanout *scanout);
+static void display_discard_pending(SpiceChannel *channel);
+static void spice_display_handle_msg(SpiceChannel *channel, SpiceMsgIn *in);
+static void spice_display_iterate_read(SpiceChannel *channel);
 
 G_DEFINE_BOXED_TYPE(SpiceGlScanout, spice_gl_scanout,
                     (GBoxedCopyFunc)spice_gl_scanout_copy,
@@ -150,10 +182,18 @@ static void spice_display_channel_dispose(GObject *object)
 
     if (c->mark_false_event_id != 0)
     {
-        g_spice_source_remove(c->mark_false_event_id);
+        spice_channel_source_remove(SPICE_CHANNEL(object), c->mark_false_event_id);
         c->mark_false_event_id = 0;
     }
 
+    display_damage_discard(SPICE_CHANNEL(object));
+    if (c->damage_source != NULL)
+    {
+        g_source_destroy(c->damage_source);
+        g_clear_pointer(&c->damage_source, g_source_unref);
+    }
+    display_present_discard(SPICE_CHANNEL(object));
+
     if (c->scanout.fd >= 0)
     {
         close(c->scanout.fd);
@@ -169,10 +209,16 @@ static void spice_display_channel_finalize(GObject *object)
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(object)->priv;
 
     g_clear_pointer(&c->monitors, g_array_unref);
+    display_discard_pending(SPICE_CHANNEL(object));
     clear_surfaces(SPICE_CHANNEL(object), FALSE);
     g_hash_table_unref(c->surfaces);
     clear_streams(SPICE_CHANNEL(object));
+    display_present_discard(SPICE_CHANNEL(object));
+    g_mutex_clear(&c->present_lock);
+    g_mutex_clear(&c->state_lock);
     g_clear_pointer(&c->palettes, cache_free);
+    g_clear_pointer(&c->surface_pool, spice_surface_pool_unref);
+    pixman_region32_fini(&c->damage);
 
     if (G_OBJECT_CLASS(spice_display_channel_parent_class)->finalize)
         G_OBJECT_CLASS(spice_display_channel_parent_class)->finalize(object);
@@ -185,6 +231,7 @@ static void spice_display_channel_constructed(GObject *object)
 
     g_return_if_fail(s != NULL);
     spice_session_get_caches(s, &c->images, &c->glz_window);
+    c->surface_pool = spice_surface_pool_ref(spice_session_get_surface_pool(s));
     c->palettes = cache_new(g_free);
 
     g_return_if_fail(c->glz_window != NULL);
@@ -202,6 +249,68 @@ static void spice_display_channel_constructed(GObject *object)
         G_OBJECT_CLASS(spice_display_channel_parent_class)->constructed(object);
 }
 
+static GVariant *spice_display_decode_stats(SpiceDisplayChannel *channel)
+{
+    display_decode_stats *stats = &channel->priv->decode_stats;
+    GVariantBuilder builder;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add(&builder, "{sv}", "threads", g_variant_new_uint32(display_decode_threads()));
+    g_variant_builder_add(&builder, "{sv}", "images", g_variant_new_uint64(stats->images));
+    g_variant_builder_add(&builder, "{sv}", "decoded-bytes", g_variant_new_uint64(stats->bytes));
+    g_variant_builder_add(&builder, "{sv}", "declined", g_variant_new_uint64(stats->declined));
+    g_variant_builder_add(&builder, "{sv}", "decode-us", g_variant_new_int64(stats->decode_us));
+    g_variant_builder_add(&builder, "{sv}", "waits", g_variant_new_uint64(stats->waits));
+    g_variant_builder_add(&builder, "{sv}", "wait-us", g_variant_new_int64(stats->wait_us));
+    g_variant_builder_add(&builder, "{sv}", "max-pending", g_variant_new_uint32(stats->max_pending));
+
+    return g_variant_builder_end(&builder);
+}
+
+static GVariant *stream_histogram_variant(const uint32_t *hist)
+{
+    return g_variant_new_fixed_array(G_VARIANT_TYPE_UINT32, hist,
+                                     STREAM_HISTOGRAM_BUCKETS, sizeof(uint32_t));
+}
+
+static GVariant *spice_display_stream_stats(SpiceDisplayChannel *channel)
+{
+    SpiceDisplayChannelPrivate *c = channel->priv;
+    GVariantBuilder builder;
+    int i;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+    g_mutex_lock(&c->present_lock);
+    for (i = 0; i < c->nstreams; i++)
+    {
+        display_stream *st = c->streams[i];
+        GVariantBuilder stream;
+        gchar *id;
+
+        if (st == NULL)
+            continue;
+
+        g_variant_builder_init(&stream, G_VARIANT_TYPE_VARDICT);
+        g_variant_builder_add(&stream, "{sv}", "frames", g_variant_new_uint32(st->num_input_frames));
+        g_variant_builder_add(&stream, "{sv}", "arrive-late", g_variant_new_uint32(st->arrive_late_count));
+        g_variant_builder_add(&stream, "{sv}", "drops-on-playback", g_variant_new_uint32(st->num_drops_on_playback));
+        g_variant_builder_add(&stream, "{sv}", "presented", g_variant_new_uint32(st->num_presented));
+        g_variant_builder_add(&stream, "{sv}", "arrive-late-histogram",
+                              stream_histogram_variant(st->arrive_late_hist));
+        g_variant_builder_add(&stream, "{sv}", "present-late-histogram",
+                              stream_histogram_variant(st->present_late_hist));
+        g_variant_builder_add(&stream, "{sv}", "present-jitter-histogram",
+                              stream_histogram_variant(st->present_jitter_hist));
+
+        id = g_strdup_printf("%u", st->id);
+        g_variant_builder_add(&builder, "{sv}", id, g_variant_builder_end(&stream));
+        g_free(id);
+    }
+    g_mutex_unlock(&c->present_lock);
+
+    return g_variant_builder_end(&builder);
+}
+
 static void spice_display_get_property(GObject *object,
                                        guint prop_id,
                                        GValue *value,
@@ -214,22 +323,34 @@ static void spice_display_get_property(GObject *object,
     {
     case PROP_WIDTH:
     {
+        g_mutex_lock(&c->state_lock);
         g_value_set_uint(value, c->primary ? c->primary->width : 0);
+        g_mutex_unlock(&c->state_lock);
         break;
     }
     case PROP_HEIGHT:
     {
+        g_mutex_lock(&c->state_lock);
         g_value_set_uint(value, c->primary ? c->primary->height : 0);
+        g_mutex_unlock(&c->state_lock);
         break;
     }
     case PROP_MONITORS:
     {
-        g_value_set_boxed(value, c->monitors);
+        GArray *monitors = g_array_new(FALSE, TRUE, sizeof(SpiceDisplayMonitorConfig));
+
+        /* a copy, the channel changes its array in place */
+        g_mutex_lock(&c->state_lock);
+        g_array_append_vals(monitors, c->monitors->data, c->monitors->len);
+        g_mutex_unlock(&c->state_lock);
+        g_value_take_boxed(value, monitors);
         break;
     }
     case PROP_MONITORS_MAX:
     {
+        g_mutex_lock(&c->state_lock);
         g_value_set_uint(value, c->monitors_max);
+        g_mutex_unlock(&c->state_lock);
         break;
     }
     case PROP_GL_SCANOUT:
@@ -237,6 +358,26 @@ static void spice_display_get_property(GObject *object,
         g_value_set_static_boxed(value, spice_display_channel_get_gl_scanout(channel));
         break;
     }
+    case PROP_DECODE_STATS:
+    {
+        g_value_set_variant(value, spice_display_decode_stats(channel));
+        break;
+    }
+    case PROP_SHARED_PRIMARY:
+    {
+        g_value_set_boolean(value, c->shared_primary);
+        break;
+    }
+    case PROP_INVALIDATE_MAX_RATE:
+    {
+        g_value_set_uint(value, c->invalidate_max_rate);
+        break;
+    }
+    case PROP_STREAM_STATS:
+    {
+        g_value_set_variant(value, spice_display_stream_stats(channel));
+        break;
+    }
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
         break;
@@ -248,8 +389,16 @@ static void spice_display_set_property(GObject *object,
                                        const GValue *value,
                                        GParamSpec *pspec)
 {
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(object)->priv;
+
     switch (prop_id)
     {
+    case PROP_SHARED_PRIMARY:
+        c->shared_primary = g_value_get_boolean(value);
+        break;
+    case PROP_INVALIDATE_MAX_RATE:
+        c->invalidate_max_rate = g_value_get_uint(value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
         break;
@@ -260,6 +409,7 @@ static void spice_display_set_property(GObject *object,
 static void spice_display_channel_reset(SpiceChannel *channel, gboolean migrating)
 {
     /* palettes, images, and glz_window are cleared in the session */
+    display_discard_pending(channel);
     clear_streams(channel);
     clear_surfaces(channel, TRUE);
 
@@ -279,6 +429,8 @@ static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
 
     channel_class->channel_up = spice_display_channel_up;
     channel_class->channel_reset = spice_display_channel_reset;
+    channel_class->handle_msg = spice_display_handle_msg;
+    channel_class->iterate_read = spice_display_iterate_read;
 
     g_object_class_install_property(gobject_class, PROP_HEIGHT,
                                     g_param_spec_uint("height",
@@ -343,6 +495,98 @@ static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
                                                        G_PARAM_READABLE |
                                                            G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceDisplayChannel:decode-stats:
+     *
+     * Statistics of the image decoding done off the channel coroutine,
+     * as a vardict:
+     *
+     * - "threads" (uint32): the decoding threads, shared by the display
+     *   channels, 0 if the images are decoded by the canvas
+     * - "images", "decoded-bytes" (uint64): images decoded by the
+     *   threads and their size, "declined" (uint64): images handed to the
+     *   threads but left to the canvas, for their format
+     * - "decode-us" (int64): time spent decoding by the threads
+     * - "waits" (uint64), "wait-us" (int64): draws that had to wait for
+     *   their image to be decoded, and the total time spent waiting
+     * - "max-pending" (uint32): the most draws held back at once
+     *
+     * Since: 0.43
+     */
+    g_object_class_install_property(gobject_class, PROP_DECODE_STATS,
+                                    g_param_spec_variant("decode-stats",
+                                                         "Decode statistics",
+                                                         "Image decoding statistics",
+                                                         G_VARIANT_TYPE_VARDICT,
+                                                         NULL,
+                                                         G_PARAM_READABLE |
+                                                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplayChannel:shared-primary:
+     *
+     * Whether the primary surfaces created from now on are allocated in
+     * shared memory, so that another process can map them, see
+     * spice_display_channel_get_primary_fd(). Ignored where shared
+     * memory files are not supported.
+     *
+     * Since: 0.43
+     */
+    g_object_class_install_property(gobject_class, PROP_SHARED_PRIMARY,
+                                    g_param_spec_boolean("shared-primary",
+                                                         "Shared primary",
+                                                         "Allocate the primary surface in shared memory",
+                                                         FALSE,
+                                                         G_PARAM_READWRITE |
+                                                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplayChannel:invalidate-max-rate:
+     *
+     * The updates of the primary surface are gathered and notified once
+     * the received messages are processed, and at most this many times
+     * per second, 0 for no limit. A display mark is always notified
+     * with the pending updates.
+     *
+     * Since: 0.43
+     */
+    g_object_class_install_property(gobject_class, PROP_INVALIDATE_MAX_RATE,
+                                    g_param_spec_uint("invalidate-max-rate",
+                                                      "Invalidate max rate",
+                                                      "Maximum rate of the update notifications (Hz)",
+                                                      0, 1000, 0,
+                                                      G_PARAM_READWRITE |
+                                                          G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplayChannel:stream-stats:
+     *
+     * Statistics of the video streams being played, as a dictionary
+     * of dictionaries keyed by the stream id:
+     *
+     * - "frames" (uint32): the frames received
+     * - "arrive-late" (uint32): frames received after their
+     *   presentation time
+     * - "drops-on-playback" (uint32): frames dropped by the decoder
+     * - "presented" (uint32): frames presented
+     * - "arrive-late-histogram", "present-late-histogram" (au): how
+     *   late the frames were on arrival and on presentation, and
+     *   "present-jitter-histogram" (au): how much the intervals between
+     *   the presentations differ from the intervals between the frame
+     *   times. The buckets are in ms: < 1, [1, 2), [2, 4) ... [32, 64)
+     *   and >= 64.
+     *
+     * Since: 0.43
+     */
+    g_object_class_install_property(gobject_class, PROP_STREAM_STATS,
+                                    g_param_spec_variant("stream-stats",
+                                                         "Stream statistics",
+                                                         "Video stream presentation statistics",
+                                                         G_VARIANT_TYPE_VARDICT,
+                                                         NULL,
+                                                         G_PARAM_READABLE |
+                                                             G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceDisplayChannel::display-primary-create:
      * @display: the #SpiceDisplayChannel that emitted the signal
@@ -356,6 +600,10 @@ static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
      *
      * The #SpiceDisplayChannel::display-primary-create signal
      * provides main display buffer data.
+     *
+     * When #SpiceDisplayChannel:shared-primary is set, the buffer may be
+     * shared with another process with
+     * spice_display_channel_get_primary_fd().
      **/
     signals[SPICE_DISPLAY_PRIMARY_CREATE] =
         g_signal_new("display-primary-create",
@@ -400,6 +648,10 @@ static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
      * The #SpiceDisplayChannel::display-invalidate signal is emitted
      * when the rectangular region x/y/w/h of the primary buffer is
      * updated.
+     *
+     * The updates are gathered, see
+     * #SpiceDisplayChannel::display-invalidate-region to be notified of
+     * all of them at once.
      **/
     signals[SPICE_DISPLAY_INVALIDATE] =
         g_signal_new("display-invalidate",
@@ -508,6 +760,30 @@ static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
                      1,
                      GST_TYPE_PIPELINE);
 
+    /**
+     * SpiceDisplayChannel::display-invalidate-region:
+     * @display: the #SpiceDisplayChannel that emitted the signal
+     * @rects: (type GArray(SpiceDisplayRect)): the updated areas
+     *
+     * The #SpiceDisplayChannel::display-invalidate-region signal is
+     * emitted with the areas of the primary buffer updated since the
+     * last emission, once the messages received so far are processed,
+     * see #SpiceDisplayChannel:invalidate-max-rate. The areas don't
+     * overlap.
+     *
+     * Since: 0.43
+     **/
+    signals[SPICE_DISPLAY_INVALIDATE_REGION] =
+        g_signal_new("display-invalidate-region",
+                     G_OBJECT_CLASS_TYPE(gobject_class),
+                     G_SIGNAL_RUN_FIRST,
+                     0,
+                     NULL, NULL,
+                     g_cclosure_marshal_VOID__BOXED,
+                     G_TYPE_NONE,
+                     1,
+                     G_TYPE_ARRAY);
+
     channel_set_handlers(SPICE_CHANNEL_CLASS(klass));
 }
 
@@ -550,25 +826,73 @@ gboolean spice_display_channel_get_primary(SpiceChannel *channel, guint32 surfac
     g_return_val_if_fail(primary != NULL, FALSE);
 
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
-    display_surface *surface = find_surface(c, surface_id);
+    display_surface *surface;
+    gboolean found, is_primary = FALSE;
 
-    if (surface == NULL)
-        return FALSE;
+    g_mutex_lock(&c->state_lock);
+    surface = find_surface(c, surface_id);
+    found = surface != NULL;
+    if (found && surface->primary)
+    {
+        is_primary = TRUE;
+        primary->format = surface->format;
+        primary->width = surface->width;
+        primary->height = surface->height;
+        primary->stride = surface->stride;
+        primary->shmid = -1;
+        primary->data = surface->data;
+        primary->marked = c->mark;
+    }
+    g_mutex_unlock(&c->state_lock);
 
-    g_return_val_if_fail(surface->primary, FALSE);
+    if (!found)
+        return FALSE;
 
-    primary->format = surface->format;
-    primary->width = surface->width;
-    primary->height = surface->height;
-    primary->stride = surface->stride;
-    primary->shmid = -1;
-    primary->data = surface->data;
-    primary->marked = c->mark;
+    g_return_val_if_fail(is_primary, FALSE);
     CHANNEL_DEBUG(channel, "get primary %p", primary->data);
 
     return TRUE;
 }
 
+/**
+ * spice_display_channel_get_primary_fd: (method)
+ * @channel: (type SpiceDisplayChannel): a #SpiceDisplayChannel
+ * @surface_id: a surface id
+ *
+ * Retrieve the shared memory file holding the pixels of the primary
+ * display surface @surface_id, when #SpiceDisplayChannel:shared-primary
+ * is set. The file can be mapped by another process with the size and
+ * layout given by spice_display_channel_get_primary(), the monitors of
+ * #SpiceDisplayChannel:monitors being areas of the same buffer.
+ *
+ * The content is updated in place: after a
+ * #SpiceDisplayChannel::display-invalidate signal the area is ready to
+ * be read. The mapping remains valid after
+ * #SpiceDisplayChannel::display-primary-destroy, but is no longer
+ * updated.
+ *
+ * Returns: a new file descriptor, to be closed by the caller, or -1 if
+ * the primary surface is not in shared memory.
+ *
+ * Since: 0.43
+ */
+gint spice_display_channel_get_primary_fd(SpiceChannel *channel, guint32 surface_id)
+{
+    g_return_val_if_fail(SPICE_IS_DISPLAY_CHANNEL(channel), -1);
+
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    display_surface *surface;
+    gint fd = -1;
+
+    g_mutex_lock(&c->state_lock);
+    surface = find_surface(c, surface_id);
+    if (surface != NULL && surface->primary && surface->shm_fd >= 0)
+        fd = dup(surface->shm_fd);
+    g_mutex_unlock(&c->state_lock);
+
+    return fd;
+}
+
 /**
  * spice_display_change_preferred_compression: (method)
  * @channel: (type SpiceDisplayChannel): a #SpiceDisplayChannel
@@ -795,41 +1119,67 @@ static void image_put(SpiceImageCache *cache, uint64_t id, pixman_image_t *image
     cache_add(c->images, id, pixman_image_ref(image));
 }
 
-typedef struct _WaitImageData
+/* coroutine context
+ *
+ * Returns a new reference on image @id, waiting until another display
+ * channel puts it in the shared cache if needed. */
+static pixman_image_t *wait_image(SpiceImageCache *cache, uint64_t id, gboolean lossy)
 {
-    gboolean lossy;
-    SpiceImageCache *cache;
-    uint64_t id;
+    SpiceDisplayChannelPrivate *c =
+        SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
     pixman_image_t *image;
-} WaitImageData;
+    gboolean image_lossy;
+    gint64 start = 0;
 
-static gboolean wait_image(gpointer data)
-{
-    gboolean lossy;
-    WaitImageData *wait = data;
-    SpiceDisplayChannelPrivate *c =
-        SPICE_CONTAINEROF(wait->cache, SpiceDisplayChannelPrivate, image_cache);
-    pixman_image_t *image = cache_find_lossy(c->images, wait->id, &lossy);
+    /* decoded by a worker, see display_commit_draw() */
+    if (c->decoded && c->decoded->image->descriptor.id == id)
+        return pixman_image_ref(c->decoded->surface);
 
-    if (!image || (lossy && !wait->lossy))
-        return FALSE;
+    for (;;)
+    {
+        GSource *event;
+        gboolean woken;
 
-    wait->image = pixman_image_ref(image);
+        image = cache_find_lossy(c->images, id, &image_lossy);
+        if (image && (lossy || !image_lossy))
+            break;
 
-    return TRUE;
+        /* dropped to stay within the cache budget, it won't come back */
+        if (image == NULL && cache_is_evicted(c->images, id))
+        {
+            SPICE_DEBUG("image %" G_GUINT64_FORMAT " was evicted", id);
+            c->missing_image = TRUE;
+            return NULL;
+        }
+
+        if (start == 0)
+            start = g_get_monotonic_time();
+
+        /* woken up on the next put or replace of @id */
+        event = g_coroutine_event_new();
+        cache_add_waiter(c->images, id, event);
+        woken = g_coroutine_event_wait(g_coroutine_self(), event);
+        if (!woken)
+            cache_remove_waiter(c->images, id, event);
+        g_source_unref(event);
+
+        if (!woken)
+        {
+            SPICE_DEBUG("wait %s got cancelled", lossy ? "image" : "lossless");
+            c->missing_image = TRUE;
+            return NULL;
+        }
+    }
+
+    if (start != 0)
+        cache_wait_done(c->images, g_get_monotonic_time() - start);
+
+    return pixman_image_ref(image);
 }
 
 static pixman_image_t *image_get(SpiceImageCache *cache, uint64_t id)
 {
-    WaitImageData wait = {
-        .lossy = TRUE,
-        .cache = cache,
-        .id = id,
-        .image = NULL};
-    if (!g_coroutine_condition_wait(g_coroutine_self(), wait_image, &wait))
-        SPICE_DEBUG("wait image got cancelled");
-
-    return wait.image;
+    return wait_image(cache, id, TRUE);
 }
 
 static void palette_put(SpicePaletteCache *cache, SpicePalette *palette)
@@ -890,15 +1240,60 @@ static void image_replace_lossy(SpiceImageCache *cache, uint64_t id,
 
 static pixman_image_t *image_get_lossless(SpiceImageCache *cache, uint64_t id)
 {
-    WaitImageData wait = {
-        .lossy = FALSE,
-        .cache = cache,
-        .id = id,
-        .image = NULL};
-    if (!g_coroutine_condition_wait(g_coroutine_self(), wait_image, &wait))
-        SPICE_DEBUG("wait lossless got cancelled");
+    return wait_image(cache, id, FALSE);
+}
+
+/*
+ * The buffer of a surface may be recycled from a previous one and hold
+ * its pixels: it is cleared before anything reads or partially paints
+ * it. The clear is skipped when @covered, the draw that was just applied
+ * replaced every pixel of the surface.
+ */
+static void surface_clear_pending(display_surface *surface, gboolean covered)
+{
+    if (!surface->needs_clear)
+        return;
+
+    surface->needs_clear = false;
+    if (!covered)
+        memset(surface->data, 0, surface->size);
+    spice_surface_pool_count_clear(surface->pool, covered);
+}
+
+/* Whether the draw @in paints every pixel of @surface without reading it */
+static gboolean display_draw_covers(display_surface *surface, SpiceMsgIn *in)
+{
+    SpiceMsgDisplayBase *base = spice_msg_in_parsed(in);
+
+    if (base->clip.type != SPICE_CLIP_TYPE_NONE ||
+        base->box.left > 0 || base->box.top > 0 ||
+        base->box.right < surface->width || base->box.bottom < surface->height)
+        return FALSE;
 
-    return wait.image;
+    switch (spice_msg_in_type(in))
+    {
+    case SPICE_MSG_DISPLAY_DRAW_FILL:
+    {
+        SpiceFill *fill = &((SpiceMsgDisplayDrawFill *)base)->data;
+        return fill->rop_descriptor == SPICE_ROPD_OP_PUT &&
+               fill->brush.type != SPICE_BRUSH_TYPE_NONE &&
+               fill->mask.bitmap == NULL;
+    }
+    case SPICE_MSG_DISPLAY_DRAW_COPY:
+    {
+        SpiceCopy *copy = &((SpiceMsgDisplayDrawCopy *)base)->data;
+        /* a copy from a surface may read the uncleared one */
+        return copy->rop_descriptor == SPICE_ROPD_OP_PUT &&
+               copy->mask.bitmap == NULL &&
+               copy->src_bitmap->descriptor.type != SPICE_IMAGE_TYPE_SURFACE;
+    }
+    case SPICE_MSG_DISPLAY_DRAW_BLACKNESS:
+        return ((SpiceMsgDisplayDrawBlackness *)base)->data.mask.bitmap == NULL;
+    case SPICE_MSG_DISPLAY_DRAW_WHITENESS:
+        return ((SpiceMsgDisplayDrawWhiteness *)base)->data.mask.bitmap == NULL;
+    default:
+        return FALSE;
+    }
 }
 
 static SpiceCanvas *surfaces_get(SpiceImageSurfaces *surfaces,
@@ -910,7 +1305,12 @@ static SpiceCanvas *surfaces_get(SpiceImageSurfaces *surfaces,
     display_surface *s =
         find_surface(c, surface_id);
 
-    return s ? s->canvas : NULL;
+    if (s == NULL)
+        return NULL;
+
+    /* about to be read as the source of a draw */
+    surface_clear_pending(s, FALSE);
+    return s->canvas;
 }
 
 static SpiceImageCacheOps image_cache_ops = {
@@ -988,6 +1388,9 @@ static void spice_display_channel_init(SpiceDisplayChannel *channel)
     c->image_surfaces.ops = &image_surfaces_ops;
     c->monitors_max = 1;
     c->scanout.fd = -1;
+    pixman_region32_init(&c->damage);
+    g_mutex_init(&c->present_lock);
+    g_mutex_init(&c->state_lock);
 
     if (g_getenv("SPICE_DISABLE_ADAPTIVE_STREAMING"))
     {
@@ -1005,6 +1408,7 @@ static void spice_display_channel_init(SpiceDisplayChannel *channel)
 static int create_canvas(SpiceChannel *channel, display_surface *surface)
 {
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    gboolean zeroed;
 
     if (surface->primary)
     {
@@ -1018,16 +1422,36 @@ static int create_canvas(SpiceChannel *channel, display_surface *surface)
                 return 0;
             }
 
+            display_damage_discard(channel);
             g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_DESTROY], 0);
 
+            g_mutex_lock(&c->state_lock);
             g_hash_table_remove(c->surfaces, GINT_TO_POINTER(c->primary->surface_id));
             c->primary = NULL;
+            g_mutex_unlock(&c->state_lock);
         }
 
         CHANNEL_DEBUG(channel, "Create primary canvas");
     }
 
-    surface->data = g_malloc0(surface->size);
+    surface->shm_fd = -1;
+    if (surface->primary && c->shared_primary)
+    {
+        surface->data = spice_surface_shm_alloc(surface->size, &surface->shm_fd);
+        if (surface->data == NULL)
+            CHANNEL_DEBUG(channel, "Shared primary unavailable, using private memory");
+    }
+    if (surface->data == NULL)
+    {
+        surface->pool = spice_surface_pool_ref(c->surface_pool);
+        surface->data = spice_surface_pool_alloc(surface->pool, surface->size, &zeroed);
+        surface->needs_clear = !zeroed;
+    }
+    if (surface->primary)
+    {
+        /* handed to the widget right away */
+        surface_clear_pending(surface, FALSE);
+    }
 
     g_return_val_if_fail(c->glz_window, 0);
     g_warn_if_fail(surface->canvas == NULL);
@@ -1052,23 +1476,31 @@ static int create_canvas(SpiceChannel *channel, display_surface *surface)
                                              surface->zlib_decoder);
 
     g_return_val_if_fail(surface->canvas != NULL, 0);
+    client_sw_canvas_enable_bands(surface->canvas);
+    g_mutex_lock(&c->state_lock);
     g_hash_table_insert(c->surfaces, GINT_TO_POINTER(surface->surface_id), surface);
-
     if (surface->primary)
     {
         g_warn_if_fail(c->primary == NULL);
         c->primary = surface;
+    }
+    g_mutex_unlock(&c->state_lock);
+
+    if (surface->primary)
+    {
         g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_CREATE], 0,
                                 surface->format, surface->width, surface->height,
                                 surface->stride, -1, surface->data);
 
         if (!spice_channel_test_capability(channel, SPICE_DISPLAY_CAP_MONITORS_CONFIG))
         {
+            g_mutex_lock(&c->state_lock);
             g_array_set_size(c->monitors, 1);
             SpiceDisplayMonitorConfig *config = &g_array_index(c->monitors, SpiceDisplayMonitorConfig, 0);
             config->x = config->y = 0;
             config->width = surface->width;
             config->height = surface->height;
+            g_mutex_unlock(&c->state_lock);
             g_coroutine_object_notify(G_OBJECT(channel), "monitors");
         }
     }
@@ -1085,8 +1517,18 @@ static void destroy_canvas(display_surface *surface)
     zlib_decoder_destroy(surface->zlib_decoder);
     jpeg_decoder_destroy(surface->jpeg_decoder);
 
-    g_clear_pointer(&surface->data, g_free);
     g_clear_pointer(&surface->canvas, surface->canvas->ops->destroy);
+    if (surface->shm_fd >= 0)
+    {
+        spice_surface_shm_free(surface->data, surface->size, surface->shm_fd);
+        surface->shm_fd = -1;
+    }
+    else if (surface->data != NULL)
+    {
+        spice_surface_pool_free(surface->pool, surface->data, surface->size);
+    }
+    surface->data = NULL;
+    g_clear_pointer(&surface->pool, spice_surface_pool_unref);
 }
 
 static display_surface *find_surface(SpiceDisplayChannelPrivate *c, guint32 surface_id)
@@ -1106,10 +1548,14 @@ static void clear_surfaces(SpiceChannel *channel, gboolean keep_primary)
 
     if (!keep_primary)
     {
+        g_mutex_lock(&c->state_lock);
         c->primary = NULL;
+        g_mutex_unlock(&c->state_lock);
+        display_damage_discard(channel);
         g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_DESTROY], 0);
     }
 
+    g_mutex_lock(&c->state_lock);
     g_hash_table_iter_init(&iter, c->surfaces);
     while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&surface))
     {
@@ -1122,15 +1568,161 @@ static void clear_surfaces(SpiceChannel *channel, gboolean keep_primary)
 
         g_hash_table_iter_remove(&iter);
     }
+    g_mutex_unlock(&c->state_lock);
 }
 
 /* coroutine context */
+/*
+ * Updates of the primary surface are gathered in a region, and notified
+ * once the messages received so far are handled, or by a timer when the
+ * rate of the notifications is limited or when the update doesn't come
+ * from a message (stream frames).
+ */
+
+/* past this, the damage is notified as its extents */
+#define DISPLAY_DAMAGE_MAX_RECTS 32
+
+static gboolean display_damage_timeout(gpointer data)
+{
+    SpiceChannel *channel = data;
+
+    display_damage_flush(channel, TRUE);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean display_damage_dispatch(GSource *source, GSourceFunc callback,
+                                        gpointer user_data)
+{
+    /* idle until emit_invalidate() arms it again */
+    g_source_set_ready_time(source, -1);
+
+    return callback(user_data);
+}
+
+static GSourceFuncs display_damage_funcs = {
+    .dispatch = display_damage_dispatch,
+};
+
+/* main or coroutine context */
+static void display_damage_disarm(SpiceChannel *channel)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+
+    if (c->damage_source != NULL)
+        g_source_set_ready_time(c->damage_source, -1);
+}
+
+/* main or coroutine context */
+static void display_damage_discard(SpiceChannel *channel)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+
+    display_damage_disarm(channel);
+    pixman_region32_clear(&c->damage);
+}
+
+/* main or coroutine context */
+static void display_damage_flush(SpiceChannel *channel, gboolean force)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    SpiceDisplayChannelClass *klass = SPICE_DISPLAY_CHANNEL_GET_CLASS(channel);
+    pixman_box32_t *boxes;
+    GArray *rects;
+    gint64 now;
+    int i, n;
+
+    if (!pixman_region32_not_empty(&c->damage))
+        return;
+
+    now = g_get_monotonic_time();
+    if (!force && c->invalidate_max_rate != 0 &&
+        now - c->damage_last_flush < G_USEC_PER_SEC / c->invalidate_max_rate)
+    {
+        /* too soon, the timer will do it */
+        return;
+    }
+
+    display_damage_disarm(channel);
+    c->damage_last_flush = now;
+
+    if (c->primary != NULL)
+    {
+        pixman_region32_intersect_rect(&c->damage, &c->damage, 0, 0,
+                                       c->primary->width, c->primary->height);
+    }
+
+    boxes = pixman_region32_rectangles(&c->damage, &n);
+    if (n > DISPLAY_DAMAGE_MAX_RECTS)
+    {
+        pixman_box32_t extents = *pixman_region32_extents(&c->damage);
+
+        pixman_region32_reset(&c->damage, &extents);
+        boxes = pixman_region32_rectangles(&c->damage, &n);
+    }
+
+    rects = g_array_sized_new(FALSE, FALSE, sizeof(SpiceDisplayRect), n);
+    for (i = 0; i < n; i++)
+    {
+        SpiceDisplayRect rect = {
+            .x = boxes[i].x1,
+            .y = boxes[i].y1,
+            .width = boxes[i].x2 - boxes[i].x1,
+            .height = boxes[i].y2 - boxes[i].y1,
+        };
+        g_array_append_val(rects, rect);
+    }
+    pixman_region32_clear(&c->damage);
+
+    if (n == 0)
+    {
+        g_array_unref(rects);
+        return;
+    }
+
+    /* each emission may be a round trip to the main thread, skip them
+     * when only the region is used */
+    if (klass->display_invalidate != NULL ||
+        g_signal_has_handler_pending(channel, signals[SPICE_DISPLAY_INVALIDATE], 0, FALSE))
+    {
+        for (i = 0; i < n; i++)
+        {
+            SpiceDisplayRect *rect = &g_array_index(rects, SpiceDisplayRect, i);
+            g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
+                                    rect->x, rect->y, rect->width, rect->height);
+        }
+    }
+    g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_INVALIDATE_REGION], 0, rects);
+    g_array_unref(rects);
+}
+
+/* main or coroutine context */
 static void emit_invalidate(SpiceChannel *channel, SpiceRect *bbox)
 {
-    g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
-                            bbox->left, bbox->top,
-                            bbox->right - bbox->left,
-                            bbox->bottom - bbox->top);
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    gint64 ready_time = 0;
+
+    pixman_region32_union_rect(&c->damage, &c->damage,
+                               bbox->left, bbox->top,
+                               bbox->right - bbox->left,
+                               bbox->bottom - bbox->top);
+
+    /* a single source is armed and disarmed, rather than a timer added
+     * for each batch of draws */
+    if (c->damage_source == NULL)
+    {
+        c->damage_source = g_source_new(&display_damage_funcs, sizeof(GSource));
+        g_source_set_callback(c->damage_source, display_damage_timeout, channel, NULL);
+        g_source_attach(c->damage_source, spice_channel_get_context(channel));
+    }
+    else if (g_source_get_ready_time(c->damage_source) != -1)
+    {
+        return;
+    }
+
+    if (c->invalidate_max_rate != 0)
+        ready_time = c->damage_last_flush + G_USEC_PER_SEC / c->invalidate_max_rate;
+    g_source_set_ready_time(c->damage_source, ready_time);
 }
 
 /* ------------------------------------------------------------------ */
@@ -1174,9 +1766,23 @@ static void spice_display_channel_up(SpiceChannel *channel)
         display_surface *surface =                                        \
             find_surface(SPICE_DISPLAY_CHANNEL(channel)->priv,            \
                          op->base.surface_id);                            \
+        gboolean covers;                                                  \
         g_return_if_fail(surface != NULL);                                \
+        covers = surface->needs_clear &&                                  \
+                 display_draw_covers(surface, in);                        \
+        if (surface->needs_clear && !covers)                              \
+        {                                                                 \
+            surface_clear_pending(surface, FALSE);                        \
+        }                                                                 \
+        SPICE_DISPLAY_CHANNEL(channel)->priv->missing_image = FALSE;      \
         surface->canvas->ops->draw_##type(surface->canvas, &op->base.box, \
                                           &op->base.clip, &op->data);     \
+        if (covers)                                                       \
+        {                                                                 \
+            /* still cleared if the draw lacked an image */               \
+            surface_clear_pending(surface,                                \
+                !SPICE_DISPLAY_CHANNEL(channel)->priv->missing_image);    \
+        }                                                                 \
         if (surface->primary)                                             \
         {                                                                 \
             emit_invalidate(channel, &op->base.box);                      \
@@ -1213,7 +1819,10 @@ static void display_handle_mark(SpiceChannel *channel, SpiceMsgIn *in)
     g_warn_if_fail(c->mark == FALSE);
 #endif
 
+    g_mutex_lock(&c->state_lock);
     c->mark = TRUE;
+    g_mutex_unlock(&c->state_lock);
+    display_damage_flush(channel, TRUE);
     g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_MARK], 0, TRUE);
 }
 
@@ -1230,7 +1839,9 @@ static void display_handle_reset(SpiceChannel *channel, SpiceMsgIn *in)
 
     cache_clear(c->palettes);
 
+    g_mutex_lock(&c->state_lock);
     c->mark = FALSE;
+    g_mutex_unlock(&c->state_lock);
     g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_MARK], 0, FALSE);
 }
 
@@ -1242,6 +1853,7 @@ static void display_handle_copy_bits(SpiceChannel *channel, SpiceMsgIn *in)
     display_surface *surface = find_surface(c, op->base.surface_id);
 
     g_return_if_fail(surface != NULL);
+    surface_clear_pending(surface, FALSE);
     surface->canvas->ops->copy_bits(surface->canvas, &op->base.box,
                                     &op->base.clip, &op->src_pos);
     if (surface->primary)
@@ -1401,21 +2013,42 @@ static display_stream *display_stream_create(SpiceChannel *channel,
 static void destroy_stream(SpiceChannel *channel, int id)
 {
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    display_stream *st;
 
     g_return_if_fail(c != NULL);
     g_return_if_fail(c->streams != NULL);
     g_return_if_fail(c->nstreams > id);
 
-    g_clear_pointer(&c->streams[id], display_stream_destroy);
+    /* destroyed unlocked, the decoder removes its pending presentations */
+    g_mutex_lock(&c->present_lock);
+    st = c->streams[id];
+    c->streams[id] = NULL;
+    g_mutex_unlock(&c->present_lock);
+
+    g_clear_pointer(&st, display_stream_destroy);
 }
 
 static void display_handle_stream_create(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
     SpiceMsgDisplayStreamCreate *op = spice_msg_in_parsed(in);
+    display_stream *st;
 
     CHANNEL_DEBUG(channel, "%s: id %u", __FUNCTION__, op->id);
 
+    g_return_if_fail(op->id >= c->nstreams || c->streams[op->id] == NULL);
+
+    st = display_stream_create(channel, op->id, op->surface_id,
+                               op->flags, op->codec_type,
+                               &op->dest, &op->clip);
+    if (st == NULL)
+    {
+        g_warning("could not create the %u video stream", op->id);
+        report_invalid_stream(channel, op->id);
+        return;
+    }
+
+    g_mutex_lock(&c->present_lock);
     if (op->id >= c->nstreams)
     {
         int n = c->nstreams;
@@ -1430,17 +2063,8 @@ static void display_handle_stream_create(SpiceChannel *channel, SpiceMsgIn *in)
         c->streams = realloc(c->streams, c->nstreams * sizeof(c->streams[0]));
         memset(c->streams + n, 0, (c->nstreams - n) * sizeof(c->streams[0]));
     }
-    g_return_if_fail(c->streams[op->id] == NULL);
-
-    c->streams[op->id] = display_stream_create(channel, op->id, op->surface_id,
-                                               op->flags, op->codec_type,
-                                               &op->dest, &op->clip);
-    if (c->streams[op->id] == NULL)
-    {
-        g_warning("could not create the %u video stream", op->id);
-        destroy_stream(channel, op->id);
-        report_invalid_stream(channel, op->id);
-    }
+    c->streams[op->id] = st;
+    g_mutex_unlock(&c->present_lock);
 }
 
 static const SpiceRect *stream_get_dest(display_stream *st, SpiceMsgIn *frame_msg)
@@ -1491,7 +2115,11 @@ guint32 stream_get_time(display_stream *st)
 G_GNUC_INTERNAL
 void stream_dropped_frame_on_playback(display_stream *st)
 {
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(st->channel)->priv;
+
+    g_mutex_lock(&c->present_lock);
     st->num_drops_on_playback++;
+    g_mutex_unlock(&c->present_lock);
 }
 
 /* main context */
@@ -1509,6 +2137,7 @@ void stream_display_frame(display_stream *st, SpiceFrame *frame,
         stride = -stride;
     }
 
+    surface_clear_pending(st->surface, FALSE);
     st->surface->canvas->ops->put_image(st->surface->canvas,
                                         &frame->dest, data,
                                         width, height, stride,
@@ -1516,11 +2145,202 @@ void stream_display_frame(display_stream *st, SpiceFrame *frame,
 
     if (st->surface->primary)
     {
-        g_signal_emit(st->channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
-                      frame->dest.left, frame->dest.top,
-                      frame->dest.right - frame->dest.left,
-                      frame->dest.bottom - frame->dest.top);
+        emit_invalidate(st->channel, &frame->dest);
+    }
+}
+
+/*
+ * Presentation of the stream frames.
+ *
+ * Rather than each decoder running its own timer, the decoded frames
+ * are presented by a single scheduler per channel, serving the streams
+ * of all its surfaces: when it wakes up, it presents the frames of all
+ * the streams due within the next STREAM_PRESENT_TICK_MS together, and
+ * then notifies the damage at once. This keeps several videos playing
+ * concurrently from waking up and redrawing independently.
+ */
+
+/* frames due this close are presented in the same batch */
+#define STREAM_PRESENT_TICK_MS 4
+
+typedef struct StreamPresent {
+    guint id;
+    display_stream *st;
+    guint32 mm_time;
+    gint64 due;                 /* monotonic time */
+    GSourceFunc func;
+    gpointer data;
+} StreamPresent;
+
+/* the log2 bucket of a duration in ms */
+static void stream_histogram_add(uint32_t *hist, gint64 ms)
+{
+    guint bucket = 0;
+
+    while (ms >= 1 && bucket < STREAM_HISTOGRAM_BUCKETS - 1)
+    {
+        ms >>= 1;
+        bucket++;
+    }
+    hist[bucket]++;
+}
+
+/* channel context, present_lock must be held */
+static void stream_present_stats(display_stream *st, guint32 mm_time,
+                                 gint64 due, gint64 now)
+{
+    stream_histogram_add(st->present_late_hist, (now - due) / 1000);
+
+    if (st->num_presented != 0)
+    {
+        gint64 interval = (now - st->last_present_time) / 1000;
+        gint64 expected = spice_mmtime_diff(mm_time, st->last_present_mm_time);
+
+        stream_histogram_add(st->present_jitter_hist, ABS(interval - expected));
+    }
+    st->num_presented++;
+    st->last_present_time = now;
+    st->last_present_mm_time = mm_time;
+}
+
+static gboolean display_present_timeout(gpointer data);
+
+/* present_lock must be held */
+static void display_present_arm(SpiceChannel *channel)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    StreamPresent *next;
+    gint64 now;
+
+    if (c->present_queue == NULL)
+        return;
+
+    next = c->present_queue->data;
+    if (c->present_timer_id != 0)
+    {
+        if (c->present_timer_due <= next->due)
+            return;
+        spice_channel_source_remove(channel, c->present_timer_id);
+    }
+
+    now = g_get_monotonic_time();
+    c->present_timer_due = next->due;
+    c->present_timer_id = spice_channel_timeout_add(channel,
+                                                    MAX(next->due - now, 0) / 1000,
+                                                    display_present_timeout, channel);
+}
+
+static gint stream_present_compare(gconstpointer a, gconstpointer b)
+{
+    const StreamPresent *pa = a, *pb = b;
+
+    return pa->due < pb->due ? -1 : pa->due > pb->due;
+}
+
+/* channel context */
+static gboolean display_present_timeout(gpointer data)
+{
+    SpiceChannel *channel = data;
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    GList *batch = NULL, *l;
+    gint64 now = g_get_monotonic_time();
+
+    g_mutex_lock(&c->present_lock);
+    c->present_timer_id = 0;
+    while (c->present_queue != NULL)
+    {
+        StreamPresent *present = c->present_queue->data;
+
+        if (present->due > now + STREAM_PRESENT_TICK_MS * 1000)
+            break;
+        c->present_queue = g_list_delete_link(c->present_queue, c->present_queue);
+        stream_present_stats(present->st, present->mm_time, present->due, now);
+        batch = g_list_prepend(batch, present);
+    }
+    display_present_arm(channel);
+    g_mutex_unlock(&c->present_lock);
+
+    /* the callbacks may schedule their next frame */
+    batch = g_list_reverse(batch);
+    for (l = batch; l != NULL; l = l->next)
+    {
+        StreamPresent *present = l->data;
+
+        present->func(present->data);
+    }
+    g_list_free_full(batch, g_free);
+
+    display_damage_flush(channel, FALSE);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* any context
+ *
+ * Calls @func with @data on the channel context once @mm_time is due, in
+ * the same batch as the other streams due then. The return value of
+ * @func is ignored. Returns an id for stream_present_remove(). */
+G_GNUC_INTERNAL
+guint stream_present_add(display_stream *st, guint32 mm_time,
+                         GSourceFunc func, gpointer data)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(st->channel)->priv;
+    StreamPresent *present = g_new0(StreamPresent, 1);
+    gint32 delay = spice_mmtime_diff(mm_time, stream_get_time(st));
+
+    present->st = st;
+    present->mm_time = mm_time;
+    present->due = g_get_monotonic_time() + (gint64)MAX(delay, 0) * 1000;
+    present->func = func;
+    present->data = data;
+
+    g_mutex_lock(&c->present_lock);
+    if (++c->present_last_id == 0)
+        c->present_last_id = 1;
+    present->id = c->present_last_id;
+    c->present_queue = g_list_insert_sorted(c->present_queue, present,
+                                            stream_present_compare);
+    display_present_arm(st->channel);
+    g_mutex_unlock(&c->present_lock);
+
+    return present->id;
+}
+
+/* any context, ids already presented are ignored */
+G_GNUC_INTERNAL
+void stream_present_remove(display_stream *st, guint id)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(st->channel)->priv;
+    GList *l;
+
+    g_mutex_lock(&c->present_lock);
+    for (l = c->present_queue; l != NULL; l = l->next)
+    {
+        StreamPresent *present = l->data;
+
+        if (present->id == id)
+        {
+            c->present_queue = g_list_delete_link(c->present_queue, l);
+            g_free(present);
+            break;
+        }
+    }
+    g_mutex_unlock(&c->present_lock);
+}
+
+static void display_present_discard(SpiceChannel *channel)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+
+    g_mutex_lock(&c->present_lock);
+    if (c->present_timer_id != 0)
+    {
+        spice_channel_source_remove(channel, c->present_timer_id);
+        c->present_timer_id = 0;
     }
+    g_list_free_full(c->present_queue, g_free);
+    c->present_queue = NULL;
+    g_mutex_unlock(&c->present_lock);
 }
 
 G_GNUC_INTERNAL
@@ -1530,8 +2350,8 @@ gboolean hand_pipeline_to_widget(display_stream *st, GstPipeline *pipeline)
 
     if (st->surface->streaming_mode)
     {
-        g_signal_emit(st->channel, signals[SPICE_DISPLAY_OVERLAY], 0,
-                      pipeline, &res);
+        g_coroutine_signal_emit(st->channel, signals[SPICE_DISPLAY_OVERLAY], 0,
+                                pipeline, &res);
     }
     return res;
 }
@@ -1724,26 +2544,45 @@ static void display_stream_stats_debug(display_stream *st)
                       __FUNCTION__,
                       drops_duration_total);
     }
+
+#define HIST_FORMAT "%u %u %u %u %u %u %u %u"
+#define HIST_ARGS(h) h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7]
+    G_STATIC_ASSERT(STREAM_HISTOGRAM_BUCKETS == 8);
+    CHANNEL_DEBUG(st->channel,
+                  "%s: #presented=%u arrive-late=[" HIST_FORMAT "] "
+                  "present-late=[" HIST_FORMAT "] present-jitter=[" HIST_FORMAT "]",
+                  __FUNCTION__,
+                  st->num_presented,
+                  HIST_ARGS(st->arrive_late_hist),
+                  HIST_ARGS(st->present_late_hist),
+                  HIST_ARGS(st->present_jitter_hist));
+#undef HIST_FORMAT
+#undef HIST_ARGS
 }
 
 static void display_stream_stats_save(display_stream *st,
                                       guint32 frame_mmtime,
                                       guint32 current_mmtime)
 {
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(st->channel)->priv;
     gint32 margin = frame_mmtime - current_mmtime;
 
     if (!st->num_input_frames)
     {
         st->first_frame_mm_time = frame_mmtime;
     }
+    g_mutex_lock(&c->present_lock);
     st->num_input_frames++;
+    stream_histogram_add(st->arrive_late_hist, MAX(-margin, 0));
+    if (margin < 0)
+        st->arrive_late_count++;
+    g_mutex_unlock(&c->present_lock);
 
     if (margin < 0)
     {
         CHANNEL_DEBUG(st->channel, "stream data too late by %u ms (ts: %u, mmtime: %u)",
                       current_mmtime - frame_mmtime, frame_mmtime, current_mmtime);
         st->arrive_late_time += current_mmtime - frame_mmtime;
-        st->arrive_late_count++;
 
         /* Late frames are counted as drops in the stats but aren't necessarily dropped - depends
          * on codec and decoder
@@ -1898,8 +2737,10 @@ static void clear_streams(SpiceChannel *channel)
     {
         destroy_stream(channel, i);
     }
+    g_mutex_lock(&c->present_lock);
     g_clear_pointer(&c->streams, g_free);
     c->nstreams = 0;
+    g_mutex_unlock(&c->present_lock);
 }
 
 /* coroutine context */
@@ -2028,6 +2869,229 @@ static void display_handle_draw_composite(SpiceChannel *channel, SpiceMsgIn *in)
     DRAW(composite);
 }
 
+/* ------------------------------------------------------------------ */
+
+/* draws held back while their image is decoded, beyond that the oldest
+ * is committed before reading on */
+#define DISPLAY_MAX_PENDING_DRAWS 32
+
+typedef struct display_pending_draw {
+    SpiceMsgIn *in;
+    display_decode_job *job;
+} display_pending_draw;
+
+/* the source image of a draw to a 32 bits surface, the decoders don't
+ * convert to other formats */
+static SpiceImage *display_draw_image(SpiceChannel *channel, SpiceMsgIn *in)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    SpiceMsgDisplayBase *base = spice_msg_in_parsed(in);
+    display_surface *surface;
+
+    switch (spice_msg_in_type(in))
+    {
+    case SPICE_MSG_DISPLAY_DRAW_OPAQUE:
+    case SPICE_MSG_DISPLAY_DRAW_COPY:
+    case SPICE_MSG_DISPLAY_DRAW_BLEND:
+    case SPICE_MSG_DISPLAY_DRAW_ROP3:
+    case SPICE_MSG_DISPLAY_DRAW_TRANSPARENT:
+    case SPICE_MSG_DISPLAY_DRAW_ALPHA_BLEND:
+    case SPICE_MSG_DISPLAY_DRAW_COMPOSITE:
+        break;
+    default:
+        return NULL;
+    }
+
+    surface = find_surface(c, base->surface_id);
+    if (surface == NULL ||
+        (surface->format != SPICE_SURFACE_FMT_32_xRGB &&
+         surface->format != SPICE_SURFACE_FMT_32_ARGB))
+        return NULL;
+
+    switch (spice_msg_in_type(in))
+    {
+    case SPICE_MSG_DISPLAY_DRAW_OPAQUE:
+        return ((SpiceMsgDisplayDrawOpaque *)base)->data.src_bitmap;
+    case SPICE_MSG_DISPLAY_DRAW_COPY:
+        return ((SpiceMsgDisplayDrawCopy *)base)->data.src_bitmap;
+    case SPICE_MSG_DISPLAY_DRAW_BLEND:
+        return ((SpiceMsgDisplayDrawBlend *)base)->data.src_bitmap;
+    case SPICE_MSG_DISPLAY_DRAW_ROP3:
+        return ((SpiceMsgDisplayDrawRop3 *)base)->data.src_bitmap;
+    case SPICE_MSG_DISPLAY_DRAW_TRANSPARENT:
+        return ((SpiceMsgDisplayDrawTransparent *)base)->data.src_bitmap;
+    case SPICE_MSG_DISPLAY_DRAW_ALPHA_BLEND:
+        return ((SpiceMsgDisplayDrawAlphaBlend *)base)->data.src_bitmap;
+    case SPICE_MSG_DISPLAY_DRAW_COMPOSITE:
+        return ((SpiceMsgDisplayDrawComposite *)base)->data.src_bitmap;
+    default:
+        g_return_val_if_reached(NULL);
+    }
+}
+
+static gboolean display_is_draw(SpiceMsgIn *in)
+{
+    switch (spice_msg_in_type(in))
+    {
+    case SPICE_MSG_DISPLAY_DRAW_FILL:
+    case SPICE_MSG_DISPLAY_DRAW_OPAQUE:
+    case SPICE_MSG_DISPLAY_DRAW_COPY:
+    case SPICE_MSG_DISPLAY_DRAW_BLEND:
+    case SPICE_MSG_DISPLAY_DRAW_BLACKNESS:
+    case SPICE_MSG_DISPLAY_DRAW_WHITENESS:
+    case SPICE_MSG_DISPLAY_DRAW_INVERS:
+    case SPICE_MSG_DISPLAY_DRAW_ROP3:
+    case SPICE_MSG_DISPLAY_DRAW_STROKE:
+    case SPICE_MSG_DISPLAY_DRAW_TEXT:
+    case SPICE_MSG_DISPLAY_DRAW_TRANSPARENT:
+    case SPICE_MSG_DISPLAY_DRAW_ALPHA_BLEND:
+    case SPICE_MSG_DISPLAY_DRAW_COMPOSITE:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+static void display_pending_draw_free(display_pending_draw *draw)
+{
+    if (draw->job)
+    {
+        display_decode_job_wait_blocking(draw->job);
+        display_decode_job_free(draw->job);
+    }
+    spice_msg_in_unref(draw->in);
+    g_free(draw);
+}
+
+/* coroutine context
+ *
+ * Hands the decoded image over to the canvas, as the canvas would have
+ * cached it, and draws. */
+static void display_commit_draw(SpiceChannel *channel, display_pending_draw *draw)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    display_decode_job *job = draw->job;
+
+    if (job)
+    {
+        SpiceImageDescriptor *descriptor = &job->image->descriptor;
+        gint64 wait_us;
+
+        if (!display_decode_job_wait(job, &wait_us))
+        {
+            SPICE_DEBUG("wait for decode got cancelled");
+            display_pending_draw_free(draw);
+            return;
+        }
+        if (wait_us > 0)
+        {
+            c->decode_stats.waits++;
+            c->decode_stats.wait_us += wait_us;
+        }
+        c->decode_stats.decode_us += job->decode_us;
+
+        if (job->surface)
+        {
+            c->decode_stats.images++;
+            c->decode_stats.bytes += (gsize)ABS(pixman_image_get_stride(job->surface)) *
+                                     pixman_image_get_height(job->surface);
+
+            if (descriptor->flags & SPICE_IMAGE_FLAGS_CACHE_ME)
+            {
+                if (descriptor->type == SPICE_IMAGE_TYPE_JPEG)
+                    image_put_lossy(&c->image_cache, descriptor->id, job->surface);
+                else
+                    image_put(&c->image_cache, descriptor->id, job->surface);
+            }
+            else if (descriptor->flags & SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME)
+            {
+                image_replace_lossy(&c->image_cache, descriptor->id, job->surface);
+            }
+
+            /* the canvas gets it back from wait_image() */
+            descriptor->flags &= ~(SPICE_IMAGE_FLAGS_CACHE_ME | SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME);
+            descriptor->type = SPICE_IMAGE_TYPE_FROM_CACHE;
+            c->decoded = job;
+        }
+        else
+        {
+            c->decode_stats.declined++;
+        }
+    }
+
+    SPICE_CHANNEL_CLASS(spice_display_channel_parent_class)->handle_msg(channel, draw->in);
+    c->decoded = NULL;
+
+    display_pending_draw_free(draw);
+}
+
+/* coroutine context */
+static void display_commit_pending(SpiceChannel *channel)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    display_pending_draw *draw;
+
+    while ((draw = g_queue_pop_head(&c->pending_draws)) != NULL)
+        display_commit_draw(channel, draw);
+}
+
+/* main or coroutine context */
+static void display_discard_pending(SpiceChannel *channel)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    display_pending_draw *draw;
+
+    while ((draw = g_queue_pop_head(&c->pending_draws)) != NULL)
+        display_pending_draw_free(draw);
+}
+
+/* coroutine context
+ *
+ * The images of the draws are decoded by the workers as the messages
+ * arrive, the draws themselves wait in order for their turn: until a
+ * message that isn't a draw comes, or there is nothing more to read. */
+static void spice_display_handle_msg(SpiceChannel *channel, SpiceMsgIn *in)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    display_pending_draw *draw;
+    display_decode_job *job;
+
+    if (!display_is_draw(in))
+    {
+        display_commit_pending(channel);
+        SPICE_CHANNEL_CLASS(spice_display_channel_parent_class)->handle_msg(channel, in);
+        return;
+    }
+
+    job = display_decode_job_new(display_draw_image(channel, in));
+    if (job == NULL && g_queue_is_empty(&c->pending_draws))
+    {
+        SPICE_CHANNEL_CLASS(spice_display_channel_parent_class)->handle_msg(channel, in);
+        return;
+    }
+
+    draw = g_new0(display_pending_draw, 1);
+    spice_msg_in_ref(in);
+    draw->in = in;
+    draw->job = job;
+    g_queue_push_tail(&c->pending_draws, draw);
+    c->decode_stats.max_pending = MAX(c->decode_stats.max_pending,
+                                      g_queue_get_length(&c->pending_draws));
+
+    if (g_queue_get_length(&c->pending_draws) > DISPLAY_MAX_PENDING_DRAWS)
+        display_commit_draw(channel, g_queue_pop_head(&c->pending_draws));
+}
+
+/* coroutine context */
+static void spice_display_iterate_read(SpiceChannel *channel)
+{
+    SPICE_CHANNEL_CLASS(spice_display_channel_parent_class)->iterate_read(channel);
+
+    /* nothing more to read for now, don't hold the draws back */
+    display_commit_pending(channel);
+    display_damage_flush(channel, FALSE);
+}
+
 /* coroutine context */
 static void display_handle_surface_create(SpiceChannel *channel, SpiceMsgIn *in)
 {
@@ -2050,7 +3114,7 @@ static void display_handle_surface_create(SpiceChannel *channel, SpiceMsgIn *in)
         create_canvas(channel, surface);
         if (c->mark_false_event_id != 0)
         {
-            g_spice_source_remove(c->mark_false_event_id);
+            spice_channel_source_remove(channel, c->mark_false_event_id);
             c->mark_false_event_id = 0;
         }
     }
@@ -2066,8 +3130,10 @@ static gboolean display_mark_false(gpointer data)
     SpiceChannel *channel = data;
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
 
+    g_mutex_lock(&c->state_lock);
     c->mark = FALSE;
-    g_signal_emit(channel, signals[SPICE_DISPLAY_MARK], 0, FALSE);
+    g_mutex_unlock(&c->state_lock);
+    g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_MARK], 0, FALSE);
 
     c->mark_false_event_id = 0;
     return FALSE;
@@ -2098,11 +3164,16 @@ static void display_handle_surface_destroy(SpiceChannel *channel, SpiceMsgIn *in
         {
             c->mark_false_event_id = g_spice_timeout_add_seconds(1, display_mark_false, channel);
         }
+        g_mutex_lock(&c->state_lock);
         c->primary = NULL;
+        g_mutex_unlock(&c->state_lock);
+        display_damage_discard(channel);
         g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_DESTROY], 0);
     }
 
+    g_mutex_lock(&c->state_lock);
     g_hash_table_remove(c->surfaces, GINT_TO_POINTER(surface->surface_id));
+    g_mutex_unlock(&c->state_lock);
 }
 
 #define CLAMP_CHECK(x, low, high) (((x) > (high)) ? TRUE : (((x) < (low)) ? TRUE : FALSE))
@@ -2124,6 +3195,7 @@ static void display_handle_monitors_config(SpiceChannel *channel, SpiceMsgIn *in
 
     CHANNEL_DEBUG(channel, "received new monitors config from guest: n: %d/%d", config->count, config->max_allowed);
 
+    g_mutex_lock(&c->state_lock);
     c->monitors_max = config->max_allowed;
     if (CLAMP_CHECK(c->monitors_max, 1, MONITORS_MAX))
     {
@@ -2153,6 +3225,7 @@ static void display_handle_monitors_config(SpiceChannel *channel, SpiceMsgIn *in
         mc->width = head->width;
         mc->height = head->height;
     }
+    g_mutex_unlock(&c->state_lock);
 
     g_coroutine_object_notify(G_OBJECT(channel), "monitors");
 }
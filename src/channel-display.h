@@ -80,6 +80,26 @@ struct _SpiceDisplayMonitorConfig {
     guint height;
 };
 
+/**
+ * SpiceDisplayRect:
+ * @x: x position of the area
+ * @y: y position of the area
+ * @width: width of the area
+ * @height: height of the area
+ *
+ * An area of the primary surface, see
+ * #SpiceDisplayChannel::display-invalidate-region.
+ *
+ * Since: 0.43
+ **/
+typedef struct _SpiceDisplayRect SpiceDisplayRect;
+struct _SpiceDisplayRect {
+    gint x;
+    gint y;
+    gint width;
+    gint height;
+};
+
 /**
  * SpiceDisplayPrimary:
  * @format: primary buffer format
@@ -148,6 +168,8 @@ GType	        spice_display_channel_get_type(void);
 SPICE_GTK_AVAILABLE_IN_0_35
 gboolean        spice_display_channel_get_primary(SpiceChannel *channel, guint32 surface_id,
                                                   SpiceDisplayPrimary *primary);
+SPICE_GTK_AVAILABLE_IN_0_43
+gint            spice_display_channel_get_primary_fd(SpiceChannel *channel, guint32 surface_id);
 
 SPICE_GTK_AVAILABLE_IN_0_35
 void spice_display_channel_change_preferred_compression(SpiceChannel *channel, gint compression);
@@ -29,6 +29,7 @@
 #include "spice-channel-priv.h"
 #include "spice-session-priv.h"
 #include "spice-audio-priv.h"
+#include "spice-agent-msg.h"
 #include "spice-file-transfer-task-priv.h"
 #include "spice-util-priv.h"
 
@@ -112,7 +113,8 @@ struct _SpiceMainChannelPrivate
     gint timer_id;
     GQueue *agent_msg_queue;
     GHashTable *file_xfer_tasks;
-    GHashTable *flushing;
+    GQueue *file_xfer_waiting; /* tasks waiting for their turn to read a chunk */
+    guint file_xfer_reading;   /* tasks reading a chunk for the agent queue */
 
     guint switch_host_delayed_id;
     guint migrate_delayed_id;
@@ -188,7 +190,6 @@ static void migrate_channel_event_cb(SpiceChannel *channel, SpiceChannelEvent ev
                                      spice_migrate *mig);
 static gboolean main_migrate_handshake_done(spice_migrate *mig);
 static void spice_main_channel_send_migration_handshake(SpiceChannel *channel);
-static void file_xfer_flushed(SpiceMainChannel *channel, gboolean success);
 static void file_xfer_read_async_cb(GObject *source_object,
                                     GAsyncResult *res,
                                     gpointer user_data);
@@ -269,7 +270,7 @@ static void spice_main_channel_init(SpiceMainChannel *channel)
     c = channel->priv = spice_main_channel_get_instance_private(channel);
     c->agent_msg_queue = g_queue_new();
     c->file_xfer_tasks = g_hash_table_new(g_direct_hash, g_direct_equal);
-    c->flushing = g_hash_table_new(g_direct_hash, g_direct_equal);
+    c->file_xfer_waiting = g_queue_new();
     c->cancellable_volume_info = g_cancellable_new();
 
     spice_main_channel_set_capabilties(SPICE_CHANNEL(channel));
@@ -389,8 +390,8 @@ static void spice_main_channel_dispose(GObject *obj)
         c->migrate_delayed_id = 0;
     }
 
+    g_queue_clear(c->file_xfer_waiting);
     g_clear_pointer(&c->file_xfer_tasks, g_hash_table_unref);
-    g_clear_pointer(&c->flushing, g_hash_table_unref);
 
     g_cancellable_cancel(c->cancellable_volume_info);
     g_clear_object(&c->cancellable_volume_info);
@@ -406,6 +407,7 @@ static void spice_main_channel_finalize(GObject *obj)
     spice_migrate_unref(c->migrate_data);
     g_free(c->agent_msg_data);
     agent_free_msg_queue(SPICE_MAIN_CHANNEL(obj));
+    g_queue_free(c->file_xfer_waiting);
 
     if (G_OBJECT_CLASS(spice_main_channel_parent_class)->finalize)
         G_OBJECT_CLASS(spice_main_channel_parent_class)->finalize(obj);
@@ -433,7 +435,6 @@ static void spice_main_channel_reset_agent(SpiceMainChannel *channel)
     c->agent_msg_size = 0;
 
     spice_main_channel_reset_all_xfer_operations(channel);
-    file_xfer_flushed(channel, FALSE);
     memset(c->clipboard_serial, 0, sizeof(c->clipboard_serial));
 }
 
@@ -887,60 +888,34 @@ static void agent_free_msg_queue(SpiceMainChannel *channel)
     g_clear_pointer(&c->agent_msg_queue, g_queue_free);
 }
 
-static gboolean flush_foreach_remove(gpointer key G_GNUC_UNUSED,
-                                     gpointer value, gpointer user_data)
-{
-    gboolean success = GPOINTER_TO_UINT(user_data);
-    GTask *result = value;
-    g_task_return_boolean(result, success);
+/* Messages of a chunk of file data, and how many of those are kept in the
+ * agent queue. The transfers read their next chunk as the agent tokens drain
+ * the queue, one chunk each in turn, while SpiceFileTransferTask reads the
+ * following ones from the disk. */
+#define FILE_XFER_CHUNK_MSGS (FILE_XFER_CHUNK_SIZE / VD_AGENT_MAX_DATA_SIZE + 1)
+#define FILE_XFER_QUEUE_MSGS (2 * FILE_XFER_CHUNK_MSGS)
 
-    return TRUE;
-}
-
-static void file_xfer_flushed(SpiceMainChannel *channel, gboolean success)
+/* main or coroutine context */
+static void file_xfer_schedule(SpiceMainChannel *channel)
 {
     SpiceMainChannelPrivate *c = channel->priv;
-    g_hash_table_foreach_remove(c->flushing, flush_foreach_remove,
-                                GUINT_TO_POINTER(success));
-}
 
-static void file_xfer_flush_async(SpiceFileTransferTask *xfer_task,
-                                  GAsyncReadyCallback callback,
-                                  gpointer user_data)
-{
-    GTask *task;
-    SpiceMainChannel *channel;
-    SpiceMainChannelPrivate *c;
-    gboolean was_empty;
-
-    channel = spice_file_transfer_task_get_channel(xfer_task);
-    task = g_task_new(xfer_task,
-                      spice_file_transfer_task_get_cancellable(xfer_task),
-                      callback,
-                      user_data);
-
-    c = channel->priv;
-    was_empty = g_queue_is_empty(c->agent_msg_queue);
-    if (was_empty)
-    {
-        g_task_return_boolean(task, TRUE);
-        g_object_unref(task);
+    /* disposed, see file_xfer_read_async_cb() */
+    if (c->file_xfer_tasks == NULL || c->agent_msg_queue == NULL)
         return;
-    }
-
-    /* wait until the last message currently in the queue has been sent */
-    g_hash_table_insert(c->flushing, g_queue_peek_tail(c->agent_msg_queue), task);
-}
-
-static gboolean file_xfer_flush_finish(SpiceFileTransferTask *xfer_task,
-                                       GAsyncResult *result,
-                                       GError **error)
-{
-    GTask *task = G_TASK(result);
 
-    g_return_val_if_fail(g_task_is_valid(result, xfer_task), FALSE);
+    while (!g_queue_is_empty(c->file_xfer_waiting) &&
+           g_queue_get_length(c->agent_msg_queue) +
+           c->file_xfer_reading * FILE_XFER_CHUNK_MSGS < FILE_XFER_QUEUE_MSGS)
+    {
+        SpiceFileTransferTask *xfer_task = g_queue_pop_head(c->file_xfer_waiting);
+        guint32 task_id = spice_file_transfer_task_get_id(xfer_task);
+        FileTransferOperation *xfer_op;
 
-    return g_task_propagate_boolean(task, error);
+        xfer_op = g_hash_table_lookup(c->file_xfer_tasks, GUINT_TO_POINTER(task_id));
+        c->file_xfer_reading++;
+        spice_file_transfer_task_read_async(xfer_task, file_xfer_read_async_cb, xfer_op);
+    }
 }
 
 /* coroutine context */
@@ -952,26 +927,13 @@ static void agent_send_msg_queue(SpiceMainChannel *channel)
     while (c->agent_tokens > 0 &&
            !g_queue_is_empty(c->agent_msg_queue))
     {
-        GTask *task;
         c->agent_tokens--;
         out = g_queue_pop_head(c->agent_msg_queue);
         spice_msg_out_send_internal(out);
-
-        task = g_hash_table_lookup(c->flushing, out);
-        if (task)
-        {
-            /* if there's a flush task waiting for this message, finish it */
-            g_hash_table_remove(c->flushing, out);
-            g_task_return_boolean(task, TRUE);
-            g_object_unref(task);
-        }
-    }
-    if (g_queue_is_empty(c->agent_msg_queue) &&
-        g_hash_table_size(c->flushing) != 0)
-    {
-        g_warning("unexpected flush task in list, clearing");
-        file_xfer_flushed(channel, TRUE);
     }
+
+    /* refill the queue with file data */
+    file_xfer_schedule(channel);
 }
 
 /* any context: the message is not flushed immediately,
@@ -986,67 +948,22 @@ G_GNUC_NULL_TERMINATED
 static void agent_msg_queue_many(SpiceMainChannel *channel, int type, const void *data, ...)
 {
     va_list args;
-    SpiceMainChannelPrivate *c = channel->priv;
-    SpiceMsgOut *out;
-    VDAgentMessage msg;
-    guint8 *payload;
-    gsize paysize, s, mins, size = 0;
-    const guint8 *d;
-
-    G_STATIC_ASSERT(VD_AGENT_MAX_DATA_SIZE > sizeof(VDAgentMessage));
 
     va_start(args, data);
-    for (d = data; d != NULL; d = va_arg(args, void *))
-    {
-        size += va_arg(args, gsize);
-    }
+    spice_agent_msg_queue_valist(SPICE_CHANNEL(channel), channel->priv->agent_msg_queue,
+                                 type, data, args);
     va_end(args);
+}
 
-    msg.protocol = VD_AGENT_PROTOCOL;
-    msg.type = type;
-    msg.opaque = 0;
-    msg.size = size;
-
-    paysize = MIN(VD_AGENT_MAX_DATA_SIZE, size + sizeof(VDAgentMessage));
-    out = spice_msg_out_new(SPICE_CHANNEL(channel), SPICE_MSGC_MAIN_AGENT_DATA);
-    payload = spice_marshaller_reserve_space(out->marshaller, paysize);
-    memcpy(payload, &msg, sizeof(VDAgentMessage));
-    payload += sizeof(VDAgentMessage);
-    paysize -= sizeof(VDAgentMessage);
-    if (paysize == 0)
-    {
-        g_queue_push_tail(c->agent_msg_queue, out);
-        out = NULL;
-    }
-
-    va_start(args, data);
-    for (d = data; size > 0; d = va_arg(args, void *))
-    {
-        s = va_arg(args, gsize);
-        while (s > 0)
-        {
-            if (out == NULL)
-            {
-                paysize = MIN(VD_AGENT_MAX_DATA_SIZE, size);
-                out = spice_msg_out_new(SPICE_CHANNEL(channel), SPICE_MSGC_MAIN_AGENT_DATA);
-                payload = spice_marshaller_reserve_space(out->marshaller, paysize);
-            }
-            mins = MIN(paysize, s);
-            memcpy(payload, d, mins);
-            d += mins;
-            payload += mins;
-            s -= mins;
-            size -= mins;
-            paysize -= mins;
-            if (paysize == 0)
-            {
-                g_queue_push_tail(c->agent_msg_queue, out);
-                out = NULL;
-            }
-        }
-    }
-    va_end(args);
-    g_warn_if_fail(out == NULL);
+/* any context: like agent_msg_queue_many() with @header and @bytes, but
+   @bytes is not copied, the messages hold a reference on it until they are
+   sent */
+static void agent_msg_queue_bytes(SpiceMainChannel *channel, int type,
+                                  const void *header, gsize header_size,
+                                  GBytes *bytes)
+{
+    spice_agent_msg_queue_bytes(SPICE_CHANNEL(channel), channel->priv->agent_msg_queue,
+                                type, header, header_size, bytes);
 }
 
 static int monitors_cmp(const void *p1, const void *p2, gpointer user_data)
@@ -1903,43 +1820,18 @@ static void main_handle_agent_disconnected(SpiceChannel *channel, SpiceMsgIn *in
     agent_stopped(SPICE_MAIN_CHANNEL(channel));
 }
 
-static void file_xfer_data_flushed_cb(GObject *source_object,
-                                      GAsyncResult *res,
-                                      gpointer user_data)
-{
-    SpiceFileTransferTask *xfer_task = SPICE_FILE_TRANSFER_TASK(source_object);
-    GError *error = NULL;
-
-    file_xfer_flush_finish(xfer_task, res, &error);
-    if (error)
-    {
-        spice_file_transfer_task_completed(xfer_task, error);
-        return;
-    }
-
-    /* task might be completed while on idle */
-    if (!spice_file_transfer_task_is_completed(xfer_task))
-    {
-        file_transfer_operation_send_progress(xfer_task);
-        /* Read more data */
-        spice_file_transfer_task_read_async(xfer_task, file_xfer_read_async_cb, user_data);
-    }
-}
-
 static void file_xfer_queue_msg_to_agent(SpiceMainChannel *channel,
                                          guint32 task_id,
-                                         gchar *buffer,
-                                         gint data_size)
+                                         GBytes *data)
 {
     VDAgentFileXferDataMessage msg;
 
     g_return_if_fail(channel != NULL);
 
     msg.id = task_id;
-    msg.size = data_size;
-    agent_msg_queue_many(channel, VD_AGENT_FILE_XFER_DATA,
-                         &msg, sizeof(msg),
-                         buffer, (gsize)data_size, NULL);
+    msg.size = g_bytes_get_size(data);
+    agent_msg_queue_bytes(channel, VD_AGENT_FILE_XFER_DATA,
+                          &msg, sizeof(msg), data);
     spice_channel_wakeup(SPICE_CHANNEL(channel), FALSE);
 }
 
@@ -1951,42 +1843,70 @@ static void file_xfer_read_async_cb(GObject *source_object,
     FileTransferOperation *xfer_op;
     SpiceFileTransferTask *xfer_task;
     SpiceMainChannel *channel;
-    gssize count;
-    char *buffer;
+    gsize count;
+    GBytes *data;
     GError *error = NULL;
 
     xfer_task = SPICE_FILE_TRANSFER_TASK(source_object);
     xfer_op = user_data;
 
     channel = spice_file_transfer_task_get_channel(xfer_task);
-    count = spice_file_transfer_task_read_finish(xfer_task, res, &buffer, &error);
-    if (count < 0)
+    channel->priv->file_xfer_reading--;
+    data = spice_file_transfer_task_read_finish_bytes(xfer_task, res, &error);
+    if (channel->priv->file_xfer_tasks == NULL)
+    {
+        /* the channel was disposed during the read, the task keeps it
+         * alive but it has nowhere to send the data */
+        if (data != NULL)
+            g_bytes_unref(data);
+        g_clear_error(&error);
+        return;
+    }
+    if (data == NULL)
     {
         spice_channel_wakeup(SPICE_CHANNEL(channel), FALSE);
         spice_file_transfer_task_completed(xfer_task, error);
+        file_xfer_schedule(channel);
         return;
     }
 
+    if (spice_file_transfer_task_is_completed(xfer_task))
+    {
+        /* completed during the read, like on a reset of the agent
+         * connection: the operation may be gone, don't send its data */
+        g_bytes_unref(data);
+        file_xfer_schedule(channel);
+        return;
+    }
+
+    count = g_bytes_get_size(data);
     if (count == 0 && spice_file_transfer_task_get_total_bytes(xfer_task) > 0)
     {
         /* If we have sent all payload to the agent, we should not send 0 bytes
          * as it will cause https://bugs.freedesktop.org/show_bug.cgi?id=97227.
          * Only when file has 0 bytes of size is when we should send 0 bytes to
          * agent, see: https://bugzilla.redhat.com/show_bug.cgi?id=1135099 */
+        g_bytes_unref(data);
+        file_xfer_schedule(channel);
         return;
     }
 
-    file_xfer_queue_msg_to_agent(channel, spice_file_transfer_task_get_id(xfer_task), buffer, count);
+    file_xfer_queue_msg_to_agent(channel, spice_file_transfer_task_get_id(xfer_task), data);
+    g_bytes_unref(data);
     if (count == 0 || spice_file_transfer_task_is_completed(xfer_task))
     {
         /* on EOF just wait for VD_AGENT_FILE_XFER_STATUS from agent
          * in case the task was completed, nothing to do. */
+        file_xfer_schedule(channel);
         return;
     }
 
     xfer_op->stats.total_sent += count;
+    file_transfer_operation_send_progress(xfer_task);
 
-    file_xfer_flush_async(xfer_task, file_xfer_data_flushed_cb, xfer_op);
+    /* wait for its turn to read more data */
+    g_queue_push_tail(channel->priv->file_xfer_waiting, xfer_task);
+    file_xfer_schedule(channel);
 }
 
 /* coroutine context */
@@ -1995,20 +1915,19 @@ static void main_agent_handle_xfer_status(SpiceMainChannel *channel,
                                           VDAgentFileXferStatusMessage *msg)
 {
     SpiceFileTransferTask *xfer_task;
-    FileTransferOperation *xfer_op;
     GError *error = NULL;
 
     SPICE_DEBUG("xfer-task %u received response %u", msg->id, msg->result);
 
     xfer_task = spice_main_channel_find_xfer_task_by_task_id(channel, msg->id);
     g_return_if_fail(xfer_task != NULL);
-    xfer_op = g_hash_table_lookup(channel->priv->file_xfer_tasks, GUINT_TO_POINTER(msg->id));
 
     switch (msg->result)
     {
     case VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA:
         g_return_if_fail(spice_file_transfer_task_is_completed(xfer_task) == FALSE);
-        spice_file_transfer_task_read_async(xfer_task, file_xfer_read_async_cb, xfer_op);
+        g_queue_push_tail(channel->priv->file_xfer_waiting, xfer_task);
+        file_xfer_schedule(channel);
         return;
     case VD_AGENT_FILE_XFER_STATUS_CANCELLED:
         error = g_error_new_literal(SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
@@ -3476,6 +3395,7 @@ static void file_transfer_operation_task_finished(SpiceFileTransferTask *xfer_ta
     g_return_if_fail(channel != NULL);
     task_id = spice_file_transfer_task_get_id(xfer_task);
     g_return_if_fail(task_id != 0);
+    g_queue_remove(channel->priv->file_xfer_waiting, xfer_task);
 
     if (error)
     {
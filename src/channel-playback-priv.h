@@ -19,3 +19,6 @@
 gboolean spice_playback_channel_is_active(SpicePlaybackChannel *channel);
 guint32 spice_playback_channel_get_latency(SpicePlaybackChannel *channel);
 void spice_playback_channel_sync_latency(SpicePlaybackChannel *channel);
+GBytes *spice_playback_channel_ref_data(SpicePlaybackChannel *channel);
+void spice_playback_channel_data_copied(SpicePlaybackChannel *channel, gsize bytes);
+void spice_playback_channel_set_queued(SpicePlaybackChannel *channel, guint32 queued_ms);
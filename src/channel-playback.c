@@ -25,6 +25,8 @@
 
 #include "common/snd_codec.h"
 #include "channel-playback-priv.h"
+#include "spice-buffer-pool.h"
+#include "spice-jitter-buffer.h"
 
 /**
  * SECTION:channel-playback
@@ -56,6 +58,21 @@ struct _SpicePlaybackChannelPrivate {
     gboolean                    is_active;
     guint32                     latency;
     guint32                     min_latency;
+
+    /* the sinks queue depth, steered by dropping or stretching the data */
+    SpiceJitterBuffer           *jitter;
+    gboolean                    jitter_enabled;
+    guint                       frame_size;
+
+    /* the PCM data being emitted, see spice_playback_channel_ref_data() */
+    GBytes                      *data;
+    SpiceBufferPool             *pcm_pool;
+
+    /* stats */
+    guint64                     packets;
+    guint64                     bytes;
+    guint64                     shared_bytes;
+    guint64                     copied_bytes;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(SpicePlaybackChannel, spice_playback_channel, SPICE_TYPE_CHANNEL)
@@ -67,6 +84,8 @@ enum {
     PROP_VOLUME,
     PROP_MUTE,
     PROP_MIN_LATENCY,
+    PROP_DATA_STATS,
+    PROP_JITTER_STATS,
 };
 
 /* Signals */
@@ -86,6 +105,16 @@ static void channel_set_handlers(SpiceChannelClass *klass);
 
 #define SPICE_PLAYBACK_DEFAULT_LATENCY_MS 200
 
+/* the most PCM data a decoded packet holds */
+#define PLAYBACK_PCM_MAX_SIZE (SND_CODEC_MAX_FRAME_SIZE * 2 * 2)
+
+/* A pooled buffer for the decoded PCM data of a packet, it keeps the
+ * pool alive as the sinks may release it after the channel is gone. */
+typedef struct PlaybackPcmBlock {
+    SpiceBufferPool *pool;
+    gpointer padding;
+} PlaybackPcmBlock;
+
 static void spice_playback_channel_set_capabilities(SpiceChannel *channel)
 {
     if (!g_getenv("SPICE_DISABLE_OPUS"))
@@ -98,6 +127,11 @@ static void spice_playback_channel_set_capabilities(SpiceChannel *channel)
 static void spice_playback_channel_init(SpicePlaybackChannel *channel)
 {
     channel->priv = spice_playback_channel_get_instance_private(channel);
+    /* a few hundred ms of audio in flight in the sinks */
+    channel->priv->pcm_pool = spice_buffer_pool_new(sizeof(PlaybackPcmBlock) + PLAYBACK_PCM_MAX_SIZE,
+                                                    64 * (sizeof(PlaybackPcmBlock) + PLAYBACK_PCM_MAX_SIZE));
+    channel->priv->jitter = spice_jitter_buffer_new();
+    channel->priv->jitter_enabled = !g_getenv("SPICE_DISABLE_PLAYBACK_JITTER");
 
     spice_playback_channel_set_capabilities(SPICE_CHANNEL(channel));
 }
@@ -109,11 +143,59 @@ static void spice_playback_channel_finalize(GObject *obj)
     snd_codec_destroy(&c->codec);
 
     g_clear_pointer(&c->volume, g_free);
+    g_clear_pointer(&c->pcm_pool, spice_buffer_pool_unref);
+    g_clear_pointer(&c->jitter, spice_jitter_buffer_free);
 
     if (G_OBJECT_CLASS(spice_playback_channel_parent_class)->finalize)
         G_OBJECT_CLASS(spice_playback_channel_parent_class)->finalize(obj);
 }
 
+static GVariant *spice_playback_channel_data_stats(SpicePlaybackChannel *channel)
+{
+    SpicePlaybackChannelPrivate *c = channel->priv;
+    SpiceBufferPoolStats pool_stats;
+    GVariantBuilder builder;
+
+    spice_buffer_pool_get_stats(c->pcm_pool, &pool_stats);
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add(&builder, "{sv}", "timestamp", g_variant_new_int64(g_get_monotonic_time()));
+    g_variant_builder_add(&builder, "{sv}", "packets", g_variant_new_uint64(c->packets));
+    g_variant_builder_add(&builder, "{sv}", "bytes", g_variant_new_uint64(c->bytes));
+    g_variant_builder_add(&builder, "{sv}", "shared-bytes", g_variant_new_uint64(c->shared_bytes));
+    g_variant_builder_add(&builder, "{sv}", "copied-bytes", g_variant_new_uint64(c->copied_bytes));
+    g_variant_builder_add(&builder, "{sv}", "pcm-pool-hits", g_variant_new_uint64(pool_stats.hits));
+
+    return g_variant_builder_end(&builder);
+}
+
+static GVariant *spice_playback_channel_jitter_stats(SpicePlaybackChannel *channel)
+{
+    SpicePlaybackChannelPrivate *c = channel->priv;
+    SpiceJitterBufferStats stats;
+    GVariantBuilder builder;
+
+    spice_jitter_buffer_get_stats(c->jitter, &stats);
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add(&builder, "{sv}", "timestamp", g_variant_new_int64(g_get_monotonic_time()));
+    g_variant_builder_add(&builder, "{sv}", "packets", g_variant_new_uint64(stats.packets));
+    g_variant_builder_add(&builder, "{sv}", "underruns", g_variant_new_uint64(stats.underruns));
+    g_variant_builder_add(&builder, "{sv}", "overruns", g_variant_new_uint64(stats.overruns));
+    g_variant_builder_add(&builder, "{sv}", "dropped-frames", g_variant_new_uint64(stats.dropped_frames));
+    g_variant_builder_add(&builder, "{sv}", "stretched-frames", g_variant_new_uint64(stats.stretched_frames));
+    g_variant_builder_add(&builder, "{sv}", "silence-frames", g_variant_new_uint64(stats.silence_frames));
+    g_variant_builder_add(&builder, "{sv}", "jitter-ms", g_variant_new_uint32(stats.jitter_ms));
+    g_variant_builder_add(&builder, "{sv}", "target-ms", g_variant_new_uint32(stats.target_ms));
+    g_variant_builder_add(&builder, "{sv}", "depth-ms", g_variant_new_uint32(stats.depth_ms));
+    g_variant_builder_add(&builder, "{sv}", "min-depth-ms", g_variant_new_uint32(stats.min_depth_ms));
+    g_variant_builder_add(&builder, "{sv}", "max-depth-ms", g_variant_new_uint32(stats.max_depth_ms));
+    g_variant_builder_add(&builder, "{sv}", "latency-ms",
+                          g_variant_new_uint32(spice_playback_channel_get_latency(channel)));
+
+    return g_variant_builder_end(&builder);
+}
+
 static void spice_playback_channel_get_property(GObject    *gobject,
                                                 guint       prop_id,
                                                 GValue     *value,
@@ -135,6 +217,12 @@ static void spice_playback_channel_get_property(GObject    *gobject,
     case PROP_MIN_LATENCY:
         g_value_set_uint(value, c->min_latency);
         break;
+    case PROP_DATA_STATS:
+        g_value_set_variant(value, spice_playback_channel_data_stats(channel));
+        break;
+    case PROP_JITTER_STATS:
+        g_value_set_variant(value, spice_playback_channel_jitter_stats(channel));
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -215,6 +303,72 @@ static void spice_playback_channel_class_init(SpicePlaybackChannelClass *klass)
                            0, G_MAXUINT32, SPICE_PLAYBACK_DEFAULT_LATENCY_MS,
                            G_PARAM_READWRITE |
                            G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpicePlaybackChannel:data-stats:
+     *
+     * Statistics of the audio data delivered to the sinks, as a vardict:
+     *
+     * - "timestamp" (int64): monotonic time of the snapshot, in us
+     * - "packets", "bytes" (uint64): the packets received and their
+     *   PCM data, after decoding
+     * - "shared-bytes" (uint64): PCM data the sinks referenced without
+     *   copying it
+     * - "copied-bytes" (uint64): PCM data the sinks had to copy
+     * - "pcm-pool-hits" (uint64): decoded packets whose buffer was
+     *   recycled
+     *
+     * The counters are cumulative, the rates are obtained by comparing
+     * two snapshots.
+     *
+     * Since: 0.43
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_DATA_STATS,
+         g_param_spec_variant("data-stats",
+                              "Data statistics",
+                              "Audio data delivery statistics",
+                              G_VARIANT_TYPE_VARDICT,
+                              NULL,
+                              G_PARAM_READABLE |
+                              G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpicePlaybackChannel:jitter-stats:
+     *
+     * Statistics of the playback jitter buffer, which keeps the audio
+     * queued by the sinks close to a target depth following the packet
+     * arrival jitter, as a vardict:
+     *
+     * - "timestamp" (int64): monotonic time of the snapshot, in us
+     * - "packets" (uint64): the packets received
+     * - "underruns" (uint64): packets arriving after the sinks ran dry
+     * - "overruns" (uint64): packets dropped, too much audio was queued
+     * - "dropped-frames", "stretched-frames", "silence-frames" (uint64):
+     *   audio frames dropped, added or removed by time-stretching, and
+     *   silence queued after the underruns
+     * - "jitter-ms", "target-ms" (uint32): the packet arrival jitter and
+     *   the queue depth aimed for
+     * - "depth-ms", "min-depth-ms", "max-depth-ms" (uint32): the queue
+     *   depth when the last packet arrived, and its extremes
+     * - "latency-ms" (uint32): the playback latency, the queue depth
+     *   including the sink buffer or else the sink latency, as used for
+     *   the video synchronization
+     *
+     * The queue depth is only known with sinks reporting it, like the
+     * GStreamer one; otherwise the packets are played untouched.
+     *
+     * Since: 0.43
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_JITTER_STATS,
+         g_param_spec_variant("jitter-stats",
+                              "Jitter buffer statistics",
+                              "Playback jitter buffer statistics",
+                              G_VARIANT_TYPE_VARDICT,
+                              NULL,
+                              G_PARAM_READABLE |
+                              G_PARAM_STATIC_STRINGS));
     /**
      * SpicePlaybackChannel::playback-start:
      * @channel: the #SpicePlaybackChannel that emitted the signal
@@ -293,6 +447,34 @@ static void spice_playback_channel_class_init(SpicePlaybackChannelClass *klass)
 
 /* ------------------------------------------------------------------ */
 
+/* any thread, when the last sink releases the data */
+static void pcm_block_free(gpointer data)
+{
+    PlaybackPcmBlock *block = data;
+    SpiceBufferPool *pool = block->pool;
+
+    spice_buffer_pool_free(pool, block);
+    spice_buffer_pool_unref(pool);
+}
+
+/* the data stretched to @frames frames, after @silence frames of silence */
+static GBytes *pcm_stretch(SpicePlaybackChannelPrivate *c, GBytes *bytes,
+                           guint frames, guint silence)
+{
+    gsize in_size, size = (gsize)(silence + frames) * c->frame_size;
+    const gint16 *in = g_bytes_get_data(bytes, &in_size);
+    PlaybackPcmBlock *block = spice_buffer_pool_alloc(c->pcm_pool, sizeof(*block) + size);
+    guint8 *out = (guint8 *)(block + 1);
+
+    memset(out, 0, silence * c->frame_size);
+    spice_jitter_buffer_stretch(in, in_size / c->frame_size,
+                                (gint16 *)(out + silence * c->frame_size), frames,
+                                c->frame_size / sizeof(gint16));
+    block->pool = spice_buffer_pool_ref(c->pcm_pool);
+
+    return g_bytes_new_with_free_func(out, size, pcm_block_free, block);
+}
+
 /* coroutine context */
 static void playback_handle_data(SpiceChannel *channel, SpiceMsgIn *in)
 {
@@ -311,21 +493,54 @@ static void playback_handle_data(SpiceChannel *channel, SpiceMsgIn *in)
 
     uint8_t *data = packet->data;
     int n = packet->data_size;
-    uint8_t pcm[SND_CODEC_MAX_FRAME_SIZE * 2 * 2];
 
     if (c->mode != SPICE_AUDIO_DATA_MODE_RAW) {
-        n = sizeof(pcm);
-        data = pcm;
+        PlaybackPcmBlock *block = spice_buffer_pool_alloc(c->pcm_pool,
+                                                          sizeof(*block) + PLAYBACK_PCM_MAX_SIZE);
+
+        n = PLAYBACK_PCM_MAX_SIZE;
+        data = (uint8_t *)(block + 1);
 
         if (snd_codec_decode(c->codec, packet->data, packet->data_size,
-                    pcm, &n) != SND_CODEC_OK) {
+                    data, &n) != SND_CODEC_OK) {
             g_warning("snd_codec_decode() error");
+            spice_buffer_pool_free(c->pcm_pool, block);
             return;
         }
+        block->pool = spice_buffer_pool_ref(c->pcm_pool);
+        c->data = g_bytes_new_with_free_func(data, n, pcm_block_free, block);
+    } else {
+        /* the sinks keep the message */
+        spice_msg_in_ref(in);
+        c->data = g_bytes_new_with_free_func(data, n, (GDestroyNotify)spice_msg_in_unref, in);
+    }
+    c->packets++;
+
+    if (c->jitter_enabled && c->frame_size > 0 && n > 0 && n % c->frame_size == 0) {
+        guint frames = n / c->frame_size, silence;
+        guint out = spice_jitter_buffer_packet(c->jitter, g_get_monotonic_time(),
+                                               packet->time, frames, &silence);
+
+        if (out == 0) {
+            CHANNEL_DEBUG(channel, "playback queue overrun, dropping %u frames", frames);
+            g_clear_pointer(&c->data, g_bytes_unref);
+            goto end;
+        }
+        if (out != frames || silence > 0) {
+            GBytes *stretched = pcm_stretch(c, c->data, out, silence);
+
+            g_bytes_unref(c->data);
+            c->data = stretched;
+            data = (uint8_t *)g_bytes_get_data(stretched, NULL);
+            n = g_bytes_get_size(stretched);
+        }
     }
+    c->bytes += n;
 
     g_coroutine_signal_emit(channel, signals[SPICE_PLAYBACK_DATA], 0, data, n);
+    g_clear_pointer(&c->data, g_bytes_unref);
 
+end:
     if ((c->frame_count++ % 100) == 0) {
         g_coroutine_signal_emit(channel, signals[SPICE_PLAYBACK_GET_DELAY], 0);
     }
@@ -365,6 +580,9 @@ static void playback_handle_start(SpiceChannel *channel, SpiceMsgIn *in)
     c->last_time = start->time;
     c->is_active = TRUE;
     c->min_latency = SPICE_PLAYBACK_DEFAULT_LATENCY_MS;
+    c->frame_size = start->format == SPICE_AUDIO_FMT_S16 ? start->channels * sizeof(gint16) : 0;
+    if (start->frequency > 0)
+        spice_jitter_buffer_restart(c->jitter, start->frequency);
     snd_codec_destroy(&c->codec);
 
     if (c->mode != SPICE_AUDIO_DATA_MODE_RAW) {
@@ -474,13 +692,21 @@ gboolean spice_playback_channel_is_active(SpicePlaybackChannel *channel)
     return channel->priv->is_active;
 }
 
+/* the audio queued by the sink when it reports it, or the sink latency.
+ * The queue reported goes up to what is being played, it covers the
+ * sink latency already */
 G_GNUC_INTERNAL
 guint32 spice_playback_channel_get_latency(SpicePlaybackChannel *channel)
 {
+    guint32 depth;
+
     g_return_val_if_fail(SPICE_IS_PLAYBACK_CHANNEL(channel), 0);
     if (!channel->priv->is_active) {
         return 0;
     }
+    if (spice_jitter_buffer_get_depth(channel->priv->jitter, g_get_monotonic_time(), &depth)) {
+        return MAX(channel->priv->latency, depth);
+    }
     return channel->priv->latency;
 }
 
@@ -492,3 +718,52 @@ void spice_playback_channel_sync_latency(SpicePlaybackChannel *channel)
     SPICE_DEBUG("%s: notify latency update %u", __FUNCTION__, channel->priv->min_latency);
     g_coroutine_object_notify(G_OBJECT(SPICE_CHANNEL(channel)), "min-latency");
 }
+
+/*
+ * spice_playback_channel_ref_data:
+ *
+ * During the emission of #SpicePlaybackChannel::playback-data, returns
+ * a reference on the emitted data, so that a sink can queue it without
+ * copying it. The data must not be modified.
+ *
+ * Returns: (transfer full): the data or %NULL outside of the emission
+ */
+G_GNUC_INTERNAL
+GBytes *spice_playback_channel_ref_data(SpicePlaybackChannel *channel)
+{
+    SpicePlaybackChannelPrivate *c;
+
+    g_return_val_if_fail(SPICE_IS_PLAYBACK_CHANNEL(channel), NULL);
+    c = channel->priv;
+
+    if (c->data == NULL)
+        return NULL;
+
+    c->shared_bytes += g_bytes_get_size(c->data);
+    return g_bytes_ref(c->data);
+}
+
+/* accounts the data a sink had to copy */
+G_GNUC_INTERNAL
+void spice_playback_channel_data_copied(SpicePlaybackChannel *channel, gsize bytes)
+{
+    g_return_if_fail(SPICE_IS_PLAYBACK_CHANNEL(channel));
+
+    channel->priv->copied_bytes += bytes;
+}
+
+/*
+ * spice_playback_channel_set_queued:
+ *
+ * Reports the audio queued by a sink, right after it was given the data
+ * of #SpicePlaybackChannel::playback-data, down to what it is playing:
+ * the audio held by the device buffer is included. It lets the jitter
+ * buffer steer the queue depth, and gives the playback latency.
+ */
+G_GNUC_INTERNAL
+void spice_playback_channel_set_queued(SpicePlaybackChannel *channel, guint32 queued_ms)
+{
+    g_return_if_fail(SPICE_IS_PLAYBACK_CHANNEL(channel));
+
+    spice_jitter_buffer_set_depth(channel->priv->jitter, g_get_monotonic_time(), queued_ms);
+}
@@ -24,6 +24,7 @@
 #include "spice-session-priv.h"
 
 #include "common/snd_codec.h"
+#include "spice-buffer-pool.h"
 
 /**
  * SECTION:channel-record
@@ -40,22 +41,69 @@
  * is received.
  *
  * The audio is sent to the guest by calling spice_record_send_data()
- * with the recorded PCM data.
+ * with the recorded PCM data. It is encoded on a thread of the channel
+ * and sent from the channel context.
  *
  * Note: You may be interested to let the #SpiceAudio class play and
  * record audio channels for your application.
  */
 
+/* an encoded packet, in a pooled buffer sent by reference */
+typedef struct RecordPacket {
+    SpiceBufferPool             *pool;
+    guint32                     time;
+    gsize                       size;
+} RecordPacket;
+
+typedef struct RecordStats {
+    guint64                     frames;
+    guint64                     dropped_frames;
+    guint64                     batches;
+    guint64                     packets;
+    guint64                     pcm_bytes;
+    guint64                     encoded_bytes;
+    guint64                     encode_us;
+    guint64                     max_batch_us;
+} RecordStats;
+
 struct _SpiceRecordChannelPrivate {
     int                         mode;
     gboolean                    started;
-    SndCodec                    codec;
+    SndCodec                    codec;      /* encoding thread, once started */
     gsize                       frame_bytes;
-    guint8                      *last_frame;
-    gsize                       last_frame_current;
     guint8                      nchannels;
     guint16                     *volume;
     guint8                      mute;
+    guint                       batch_latency;
+    guint                       max_latency;
+
+    /* PCM ring of ring_frames frames: the frame at ring_write is being
+     * filled by spice_record_channel_send_data(), the ring_count frames
+     * from ring_read wait for the encoding thread */
+    guint8                      *ring;
+    guint32                     *ring_times;
+    guint                       ring_frames;
+    guint                       ring_write;
+    gsize                       ring_write_offset;
+    guint                       batch_frames;
+    gint64                      batch_us;       /* duration of batch_frames */
+
+    GThreadPool                 *encode_thread;
+    guint8                      *encode_pcm;    /* encoding thread only */
+    guint32                     *encode_times;
+    SpiceBufferPool             *packet_pool;
+
+    /* ---------- shared with the encoding thread ---------- */
+    GMutex                      lock;
+    GCond                       cond;           /* a batch is full, or stopping */
+    guint                       ring_read;
+    guint                       ring_count;
+    gint64                      ring_count_start; /* when the oldest frame came */
+    gboolean                    encoding;
+    gboolean                    stopping;
+    GQueue                      encoded;        /* RecordPacket, to be sent */
+    guint                       encoded_id;
+    RecordStats                 stats;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(SpiceRecordChannel, spice_record_channel, SPICE_TYPE_CHANNEL)
@@ -66,6 +114,9 @@ enum {
     PROP_NCHANNELS,
     PROP_VOLUME,
     PROP_MUTE,
+    PROP_BATCH_LATENCY,
+    PROP_MAX_LATENCY,
+    PROP_ENCODE_STATS,
 };
 
 /* Signals */
@@ -79,9 +130,16 @@ enum {
 static guint signals[SPICE_RECORD_LAST_SIGNAL];
 
 static void channel_set_handlers(SpiceChannelClass *klass);
+static void record_encoder_stop(SpiceRecordChannel *channel);
 
 /* ------------------------------------------------------------------ */
 
+#define SPICE_RECORD_DEFAULT_MAX_LATENCY_MS 200
+#define SPICE_RECORD_MAX_LATENCY_MS 10000
+
+/* the biggest packets, raw batches, kept in the pool */
+#define RECORD_PACKET_POOL_MAX_SIZE (64 * 1024)
+
 static void spice_record_channel_set_capabilities(SpiceChannel *channel)
 {
     if (!g_getenv("SPICE_DISABLE_OPUS"))
@@ -92,7 +150,21 @@ static void spice_record_channel_set_capabilities(SpiceChannel *channel)
 
 static void spice_record_channel_init(SpiceRecordChannel *channel)
 {
+    SpiceRecordChannelPrivate *c;
+    const gchar *batch;
+
     channel->priv = spice_record_channel_get_instance_private(channel);
+    c = channel->priv;
+
+    c->max_latency = SPICE_RECORD_DEFAULT_MAX_LATENCY_MS;
+    batch = g_getenv("SPICE_RECORD_BATCH_MS");
+    if (batch != NULL)
+        c->batch_latency = MIN(g_ascii_strtoull(batch, NULL, 10), c->max_latency);
+    c->packet_pool = spice_buffer_pool_new(RECORD_PACKET_POOL_MAX_SIZE,
+                                           4 * RECORD_PACKET_POOL_MAX_SIZE);
+    g_mutex_init(&c->lock);
+    g_cond_init(&c->cond);
+    g_queue_init(&c->encoded);
 
     spice_record_channel_set_capabilities(SPICE_CHANNEL(channel));
 }
@@ -101,16 +173,46 @@ static void spice_record_channel_finalize(GObject *obj)
 {
     SpiceRecordChannelPrivate *c = SPICE_RECORD_CHANNEL(obj)->priv;
 
-    g_clear_pointer(&c->last_frame, g_free);
+    record_encoder_stop(SPICE_RECORD_CHANNEL(obj));
 
     snd_codec_destroy(&c->codec);
 
     g_clear_pointer(&c->volume, g_free);
+    g_clear_pointer(&c->packet_pool, spice_buffer_pool_unref);
+    g_mutex_clear(&c->lock);
+    g_cond_clear(&c->cond);
 
     if (G_OBJECT_CLASS(spice_record_channel_parent_class)->finalize)
         G_OBJECT_CLASS(spice_record_channel_parent_class)->finalize(obj);
 }
 
+static GVariant *spice_record_channel_encode_stats(SpiceRecordChannel *channel)
+{
+    SpiceRecordChannelPrivate *c = channel->priv;
+    SpiceBufferPoolStats pool_stats;
+    GVariantBuilder builder;
+    RecordStats stats;
+
+    g_mutex_lock(&c->lock);
+    stats = c->stats;
+    g_mutex_unlock(&c->lock);
+    spice_buffer_pool_get_stats(c->packet_pool, &pool_stats);
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add(&builder, "{sv}", "timestamp", g_variant_new_int64(g_get_monotonic_time()));
+    g_variant_builder_add(&builder, "{sv}", "frames", g_variant_new_uint64(stats.frames));
+    g_variant_builder_add(&builder, "{sv}", "dropped-frames", g_variant_new_uint64(stats.dropped_frames));
+    g_variant_builder_add(&builder, "{sv}", "batches", g_variant_new_uint64(stats.batches));
+    g_variant_builder_add(&builder, "{sv}", "packets", g_variant_new_uint64(stats.packets));
+    g_variant_builder_add(&builder, "{sv}", "pcm-bytes", g_variant_new_uint64(stats.pcm_bytes));
+    g_variant_builder_add(&builder, "{sv}", "encoded-bytes", g_variant_new_uint64(stats.encoded_bytes));
+    g_variant_builder_add(&builder, "{sv}", "encode-time", g_variant_new_uint64(stats.encode_us));
+    g_variant_builder_add(&builder, "{sv}", "max-batch-time", g_variant_new_uint64(stats.max_batch_us));
+    g_variant_builder_add(&builder, "{sv}", "packet-pool-hits", g_variant_new_uint64(pool_stats.hits));
+
+    return g_variant_builder_end(&builder);
+}
+
 static void spice_record_channel_get_property(GObject    *gobject,
                                               guint       prop_id,
                                               GValue     *value,
@@ -129,6 +231,15 @@ static void spice_record_channel_get_property(GObject    *gobject,
     case PROP_MUTE:
         g_value_set_boolean(value, c->mute);
         break;
+    case PROP_BATCH_LATENCY:
+        g_value_set_uint(value, c->batch_latency);
+        break;
+    case PROP_MAX_LATENCY:
+        g_value_set_uint(value, c->max_latency);
+        break;
+    case PROP_ENCODE_STATS:
+        g_value_set_variant(value, spice_record_channel_encode_stats(channel));
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -140,6 +251,8 @@ static void spice_record_channel_set_property(GObject      *gobject,
                                               const GValue *value,
                                               GParamSpec   *pspec)
 {
+    SpiceRecordChannelPrivate *c = SPICE_RECORD_CHANNEL(gobject)->priv;
+
     switch (prop_id) {
     case PROP_VOLUME:
         /* TODO: request guest volume change */
@@ -147,6 +260,12 @@ static void spice_record_channel_set_property(GObject      *gobject,
     case PROP_MUTE:
         /* TODO: request guest mute change */
         break;
+    case PROP_BATCH_LATENCY:
+        c->batch_latency = g_value_get_uint(value);
+        break;
+    case PROP_MAX_LATENCY:
+        c->max_latency = g_value_get_uint(value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -157,7 +276,7 @@ static void channel_reset(SpiceChannel *channel, gboolean migrating)
 {
     SpiceRecordChannelPrivate *c = SPICE_RECORD_CHANNEL(channel)->priv;
 
-    g_clear_pointer(&c->last_frame, g_free);
+    record_encoder_stop(SPICE_RECORD_CHANNEL(channel));
 
     g_coroutine_signal_emit(channel, signals[SPICE_RECORD_STOP], 0);
     c->started = FALSE;
@@ -202,6 +321,81 @@ static void spice_record_channel_class_init(SpiceRecordChannelClass *klass)
                               FALSE,
                               G_PARAM_READWRITE |
                               G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceRecordChannel:batch-latency:
+     *
+     * The most audio, in ms, held to be encoded and sent in batches,
+     * rather than frame by frame. Raw audio is then sent in one message
+     * per batch, fewer wakeups and messages for links not needing the
+     * lowest latency. The default, 0, sends each frame as soon as it is
+     * recorded; it can also be set with SPICE_RECORD_BATCH_MS.
+     *
+     * Changes are used from the next #SpiceRecordChannel::record-start.
+     *
+     * Since: 0.43
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_BATCH_LATENCY,
+         g_param_spec_uint("batch-latency",
+                           "Batch latency (ms)",
+                           "Most audio held to encode and send in batches",
+                           0, SPICE_RECORD_MAX_LATENCY_MS, 0,
+                           G_PARAM_READWRITE |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceRecordChannel:max-latency:
+     *
+     * The most audio, in ms, waiting to be encoded. When the encoding
+     * falls behind, the oldest audio is dropped rather than delayed
+     * further.
+     *
+     * Changes are used from the next #SpiceRecordChannel::record-start.
+     *
+     * Since: 0.43
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_MAX_LATENCY,
+         g_param_spec_uint("max-latency",
+                           "Max latency (ms)",
+                           "Most audio waiting to be encoded",
+                           1, SPICE_RECORD_MAX_LATENCY_MS, SPICE_RECORD_DEFAULT_MAX_LATENCY_MS,
+                           G_PARAM_READWRITE |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceRecordChannel:encode-stats:
+     *
+     * Statistics of the audio encoding, as a vardict:
+     *
+     * - "timestamp" (int64): monotonic time of the snapshot, in us
+     * - "frames" (uint64): the audio frames recorded
+     * - "dropped-frames" (uint64): frames dropped as the encoding was
+     *   later than #SpiceRecordChannel:max-latency
+     * - "batches" (uint64): runs of the encoding thread
+     * - "packets" (uint64): the messages sent
+     * - "pcm-bytes", "encoded-bytes" (uint64): the audio data before and
+     *   after encoding
+     * - "encode-time", "max-batch-time" (uint64): the time spent
+     *   encoding, and the longest batch, in us
+     * - "packet-pool-hits" (uint64): packets whose buffer was recycled
+     *
+     * The counters are cumulative, the rates are obtained by comparing
+     * two snapshots.
+     *
+     * Since: 0.43
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_ENCODE_STATS,
+         g_param_spec_variant("encode-stats",
+                              "Encoding statistics",
+                              "Audio encoding statistics",
+                              G_VARIANT_TYPE_VARDICT,
+                              NULL,
+                              G_PARAM_READABLE |
+                              G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceRecordChannel::record-start:
      * @channel: the #SpiceRecordChannel that emitted the signal
@@ -242,6 +436,235 @@ static void spice_record_channel_class_init(SpiceRecordChannelClass *klass)
     channel_set_handlers(SPICE_CHANNEL_CLASS(klass));
 }
 
+/* ------------------------------------------------------------------ */
+/* encoding thread                                                    */
+
+/* any thread, when the message is sent */
+static void record_packet_free(uint8_t *data, void *opaque)
+{
+    RecordPacket *packet = opaque;
+    SpiceBufferPool *pool = packet->pool;
+
+    spice_buffer_pool_free(pool, packet);
+    spice_buffer_pool_unref(pool);
+}
+
+static RecordPacket *record_packet_new(SpiceRecordChannelPrivate *c, gsize size, guint32 time)
+{
+    RecordPacket *packet = spice_buffer_pool_alloc(c->packet_pool, sizeof(*packet) + size);
+
+    packet->pool = spice_buffer_pool_ref(c->packet_pool);
+    packet->time = time;
+    packet->size = size;
+
+    return packet;
+}
+
+static void record_packet_release(gpointer data)
+{
+    RecordPacket *packet = data;
+
+    record_packet_free((uint8_t *)(packet + 1), packet);
+}
+
+/* main context */
+static gboolean record_send_encoded(gpointer data)
+{
+    SpiceRecordChannel *channel = data;
+    SpiceRecordChannelPrivate *c = channel->priv;
+    SpiceMsgcRecordPacket p = {0, };
+    GQueue packets = G_QUEUE_INIT;
+    RecordPacket *packet;
+
+    g_mutex_lock(&c->lock);
+    packets = c->encoded;
+    g_queue_init(&c->encoded);
+    c->encoded_id = 0;
+    g_mutex_unlock(&c->lock);
+
+    while ((packet = g_queue_pop_head(&packets)) != NULL) {
+        SpiceMsgOut *msg;
+
+        if (spice_channel_get_read_only(SPICE_CHANNEL(channel))) {
+            record_packet_release(packet);
+            continue;
+        }
+
+        p.time = packet->time;
+        msg = spice_msg_out_new(SPICE_CHANNEL(channel), SPICE_MSGC_RECORD_DATA);
+        msg->marshallers->msgc_record_data(msg->marshaller, &p);
+        spice_marshaller_add_by_ref_full(msg->marshaller, (uint8_t *)(packet + 1), packet->size,
+                                         record_packet_free, packet);
+        spice_msg_out_send(msg);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+/* encoding thread, encodes @count frames of encode_pcm */
+static gboolean record_encode_frames(SpiceRecordChannelPrivate *c, guint count, GQueue *packets)
+{
+    RecordPacket *packet;
+    guint i;
+
+    if (c->mode == SPICE_AUDIO_DATA_MODE_RAW) {
+        /* a single message for the batch */
+        packet = record_packet_new(c, count * c->frame_bytes, c->encode_times[0]);
+        memcpy(packet + 1, c->encode_pcm, packet->size);
+        g_queue_push_tail(packets, packet);
+        return TRUE;
+    }
+
+    for (i = 0; i < count; i++) {
+        int len = SND_CODEC_MAX_COMPRESSED_BYTES;
+
+        packet = record_packet_new(c, len, c->encode_times[i]);
+        if (snd_codec_encode(c->codec, c->encode_pcm + i * c->frame_bytes, c->frame_bytes,
+                             (uint8_t *)(packet + 1), &len) != SND_CODEC_OK) {
+            record_packet_release(packet);
+            return FALSE;
+        }
+        packet->size = len;
+        g_queue_push_tail(packets, packet);
+    }
+
+    return TRUE;
+}
+
+/* encoding thread, runs while frames are waiting. A partial batch is
+ * held until it is full, or for as long as a full batch lasts: a
+ * recording that pauses or delivers little audio isn't delayed more */
+static void record_encode_func(gpointer data, gpointer user_data)
+{
+    SpiceRecordChannel *channel = data;
+    SpiceRecordChannelPrivate *c = channel->priv;
+
+    g_mutex_lock(&c->lock);
+    while (c->ring_count > 0 && !c->stopping) {
+        guint i, count = c->ring_count;
+        GQueue packets = G_QUEUE_INIT;
+        gint64 start, elapsed;
+        gboolean ok;
+        GList *l;
+
+        if (count < c->batch_frames &&
+            g_get_monotonic_time() < c->ring_count_start + c->batch_us) {
+            g_cond_wait_until(&c->cond, &c->lock, c->ring_count_start + c->batch_us);
+            continue;
+        }
+
+        /* take all the waiting frames, the ring keeps being filled */
+        for (i = 0; i < count; i++) {
+            guint frame = (c->ring_read + i) % c->ring_frames;
+
+            memcpy(c->encode_pcm + i * c->frame_bytes,
+                   c->ring + frame * c->frame_bytes, c->frame_bytes);
+            c->encode_times[i] = c->ring_times[frame];
+        }
+        c->ring_read = (c->ring_read + count) % c->ring_frames;
+        c->ring_count = 0;
+        g_mutex_unlock(&c->lock);
+
+        start = g_get_monotonic_time();
+        ok = record_encode_frames(c, count, &packets);
+        elapsed = g_get_monotonic_time() - start;
+        if (!ok)
+            g_warning("encode failed");
+
+        g_mutex_lock(&c->lock);
+        c->stats.batches++;
+        c->stats.pcm_bytes += count * c->frame_bytes;
+        c->stats.encode_us += elapsed;
+        c->stats.max_batch_us = MAX(c->stats.max_batch_us, elapsed);
+        for (l = packets.head; l != NULL; l = l->next) {
+            RecordPacket *packet = l->data;
+
+            c->stats.packets++;
+            c->stats.encoded_bytes += packet->size;
+            g_queue_push_tail(&c->encoded, packet);
+        }
+        g_list_free(packets.head);
+        if (c->encoded_id == 0 && !g_queue_is_empty(&c->encoded)) {
+            c->encoded_id = spice_channel_idle_add(SPICE_CHANNEL(channel),
+                                                   record_send_encoded, channel);
+        }
+    }
+    c->encoding = FALSE;
+    g_mutex_unlock(&c->lock);
+}
+
+/* main context, hands the recorded frames to the encoding thread */
+static void record_encoder_kick(SpiceRecordChannel *channel)
+{
+    SpiceRecordChannelPrivate *c = channel->priv;
+
+    g_mutex_lock(&c->lock);
+    if (!c->encoding && c->ring_count > 0) {
+        c->encoding = TRUE;
+        g_thread_pool_push(c->encode_thread, channel, NULL);
+    } else if (c->ring_count >= c->batch_frames) {
+        /* the thread may be holding a partial batch */
+        g_cond_signal(&c->cond);
+    }
+    g_mutex_unlock(&c->lock);
+}
+
+/* coroutine context */
+static void record_encoder_start(SpiceRecordChannel *channel, guint frame_size, guint frequency)
+{
+    SpiceRecordChannelPrivate *c = channel->priv;
+    guint frame_us = MAX((guint64)frame_size * G_USEC_PER_SEC / frequency, 1);
+
+    c->batch_frames = MAX((guint64)MIN(c->batch_latency, c->max_latency) * 1000 / frame_us, 1);
+    c->batch_us = (gint64)c->batch_frames * frame_us;
+    c->ring_frames = MAX((guint64)c->max_latency * 1000 / frame_us, c->batch_frames) + 1;
+    c->ring = g_malloc0(c->ring_frames * c->frame_bytes);
+    c->ring_times = g_new0(guint32, c->ring_frames);
+    c->ring_write = 0;
+    c->ring_write_offset = 0;
+    c->ring_read = 0;
+    c->ring_count = 0;
+    c->stopping = FALSE;
+    c->encode_pcm = g_malloc(c->ring_frames * c->frame_bytes);
+    c->encode_times = g_new(guint32, c->ring_frames);
+
+    /* a single thread, the frames are encoded in order */
+    c->encode_thread = g_thread_pool_new(record_encode_func, NULL, 1, FALSE, NULL);
+
+    CHANNEL_DEBUG(channel, "encoding batches of %u frames, %u frames queued at most",
+                  c->batch_frames, c->ring_frames - 1);
+}
+
+/* main or coroutine context, waits for the encoding thread and drops
+ * the audio not sent yet */
+static void record_encoder_stop(SpiceRecordChannel *channel)
+{
+    SpiceRecordChannelPrivate *c = channel->priv;
+    RecordPacket *packet;
+
+    if (c->encode_thread != NULL) {
+        /* don't wait for a partial batch to be held long enough */
+        g_mutex_lock(&c->lock);
+        c->stopping = TRUE;
+        g_cond_signal(&c->cond);
+        g_mutex_unlock(&c->lock);
+        g_thread_pool_free(c->encode_thread, FALSE, TRUE);
+        c->encode_thread = NULL;
+    }
+    if (c->encoded_id != 0) {
+        spice_channel_source_remove(SPICE_CHANNEL(channel), c->encoded_id);
+        c->encoded_id = 0;
+    }
+    while ((packet = g_queue_pop_head(&c->encoded)) != NULL)
+        record_packet_release(packet);
+    c->encoding = FALSE;
+
+    g_clear_pointer(&c->ring, g_free);
+    g_clear_pointer(&c->ring_times, g_free);
+    g_clear_pointer(&c->encode_pcm, g_free);
+    g_clear_pointer(&c->encode_times, g_free);
+}
+
 /* main context */
 static void spice_record_mode(SpiceRecordChannel *channel, uint32_t time,
                               uint32_t mode, uint8_t *data, uint32_t data_size)
@@ -323,81 +746,53 @@ void spice_record_channel_send_data(SpiceRecordChannel *channel, gpointer data,
                                     gsize bytes, uint32_t time)
 {
     SpiceRecordChannelPrivate *rc;
-    SpiceMsgcRecordPacket p = {0, };
 
     g_return_if_fail(SPICE_IS_RECORD_CHANNEL(channel));
     rc = channel->priv;
-    if (rc->last_frame == NULL) {
+    if (rc->ring == NULL) {
         CHANNEL_DEBUG(channel, "recording didn't start or was reset");
         return;
     }
 
     g_return_if_fail(spice_channel_get_read_only(SPICE_CHANNEL(channel)) == FALSE);
 
-    uint8_t *encode_buf = NULL;
-
     if (!rc->started) {
         spice_record_mode(channel, time, rc->mode, NULL, 0);
         spice_record_start_mark(channel, time);
         rc->started = TRUE;
     }
 
-    if (rc->mode != SPICE_AUDIO_DATA_MODE_RAW)
-        encode_buf = g_alloca(SND_CODEC_MAX_COMPRESSED_BYTES);
-
-    p.time = time;
-
     while (bytes > 0) {
-        gsize n;
-        int frame_size;
-        SpiceMsgOut *msg;
-        uint8_t *frame;
-
-        if (rc->last_frame_current > 0) {
-            /* complete previous frame */
-            n = MIN(bytes, rc->frame_bytes - rc->last_frame_current);
-            memcpy(rc->last_frame + rc->last_frame_current, data, n);
-            rc->last_frame_current += n;
-            if (rc->last_frame_current < rc->frame_bytes)
-                /* if the frame is still incomplete, return */
-                break;
-            frame = rc->last_frame;
-            frame_size = rc->frame_bytes;
-        } else {
-            n = MIN(bytes, rc->frame_bytes);
-            frame_size = n;
-            frame = data;
-        }
+        guint8 *frame = rc->ring + rc->ring_write * rc->frame_bytes;
+        gsize n = MIN(bytes, rc->frame_bytes - rc->ring_write_offset);
 
-        if (rc->last_frame_current == 0 &&
-            n < rc->frame_bytes) {
-            /* start a new frame */
-            memcpy(rc->last_frame, data, n);
-            rc->last_frame_current = n;
+        memcpy(frame + rc->ring_write_offset, data, n);
+        rc->ring_write_offset += n;
+        bytes -= n;
+        data = (guint8*)data + n;
+        if (rc->ring_write_offset < rc->frame_bytes)
+            /* if the frame is still incomplete, return */
             break;
-        }
-
-        if (rc->mode != SPICE_AUDIO_DATA_MODE_RAW) {
-            int len = SND_CODEC_MAX_COMPRESSED_BYTES;
-            if (snd_codec_encode(rc->codec, frame, frame_size, encode_buf, &len) != SND_CODEC_OK) {
-                g_warning("encode failed");
-                return;
-            }
-            frame = encode_buf;
-            frame_size = len;
-        }
 
-        msg = spice_msg_out_new(SPICE_CHANNEL(channel), SPICE_MSGC_RECORD_DATA);
-        msg->marshallers->msgc_record_data(msg->marshaller, &p);
-        spice_marshaller_add(msg->marshaller, frame, frame_size);
-        spice_msg_out_send(msg);
-
-        if (rc->last_frame_current == rc->frame_bytes)
-            rc->last_frame_current = 0;
+        rc->ring_times[rc->ring_write] = time;
+        rc->ring_write_offset = 0;
 
-        bytes -= n;
-        data = (guint8*)data + n;
+        g_mutex_lock(&rc->lock);
+        if (rc->ring_count == rc->ring_frames - 1) {
+            /* the encoding is too late, drop the oldest frame */
+            rc->ring_read = (rc->ring_read + 1) % rc->ring_frames;
+            rc->ring_count--;
+            rc->stats.dropped_frames++;
+        }
+        if (rc->ring_count == 0)
+            rc->ring_count_start = g_get_monotonic_time();
+        rc->ring_count++;
+        rc->stats.frames++;
+        rc->ring_write = (rc->ring_write + 1) % rc->ring_frames;
+        g_mutex_unlock(&rc->lock);
     }
+
+    record_encoder_kick(channel);
 }
 
 /* ------------------------------------------------------------------ */
@@ -416,7 +811,9 @@ static void record_handle_start(SpiceChannel *channel, SpiceMsgIn *in)
                   spice_audio_data_mode_to_string(c->mode));
 
     g_return_if_fail(start->format == SPICE_AUDIO_FMT_S16);
+    g_return_if_fail(start->frequency > 0);
 
+    record_encoder_stop(SPICE_RECORD_CHANNEL(channel));
     snd_codec_destroy(&c->codec);
 
     if (c->mode != SPICE_AUDIO_DATA_MODE_RAW) {
@@ -427,10 +824,8 @@ static void record_handle_start(SpiceChannel *channel, SpiceMsgIn *in)
         frame_size = snd_codec_frame_size(c->codec);
     }
 
-    g_free(c->last_frame);
     c->frame_bytes = frame_size * 16 * start->channels / 8;
-    c->last_frame = g_malloc0(c->frame_bytes);
-    c->last_frame_current = 0;
+    record_encoder_start(SPICE_RECORD_CHANNEL(channel), frame_size, start->frequency);
 
     g_coroutine_signal_emit(channel, signals[SPICE_RECORD_START], 0,
                             start->format, start->channels, start->frequency);
@@ -17,3 +17,345 @@
 #define SW_CANVAS_CACHE
 
 #include "common/sw_canvas.c"
+
+#include <stdlib.h>
+#include <glib.h>
+
+#include "client_sw_canvas.h"
+
+/*
+ * Banded rasterisation.
+ *
+ * The drawing ops of the canvas (canvas_base.c) fetch and decode their
+ * images, then go through the ops table for the pixel work, with the
+ * images ready and the area to paint as a region or a list of boxes.
+ * The banded ops table wraps these pixel ops: a large area is split in
+ * horizontal bands painted in parallel by a thread pool, and the op
+ * returns once all the bands are done, so the next op sees its result.
+ *
+ * Only the fill and blit ops are split: they paint their boxes one by
+ * one into the canvas from a source that isn't the canvas itself, and
+ * leave the pixman images as they found them. copy_region() and the
+ * *_from_surface() ops may read what another band writes, and the scale
+ * and blend ops set the clip region of the canvas image and the
+ * transform, filter and repeat of the source image for the time of the
+ * op, so all of these run on the calling thread like the drawing ops.
+ *
+ * pixman computes some properties of an image on its first use. The
+ * calling thread paints the first rows of the area before the workers
+ * start, which gets the images validated outside of the workers.
+ */
+
+#define BAND_MAX_COUNT          16
+
+/* below this area, the op runs on the calling thread */
+#define BAND_MIN_PIXELS         (512 * 512)
+#define BAND_MIN_ROWS           32
+
+/* painted by the calling thread first, see above */
+#define BAND_WARMUP_ROWS        4
+
+typedef void (*band_func)(gpointer args, const pixman_box32_t *band);
+
+typedef struct BandCall {
+    band_func func;
+    gpointer args;
+    GMutex lock;
+    GCond cond;
+    guint pending;
+} BandCall;
+
+typedef struct Band {
+    BandCall *call;
+    pixman_box32_t box;
+} Band;
+
+static SpiceCanvasOps *sw_ops;
+static SpiceCanvasOps banded_ops;
+static GThreadPool *band_pool;
+static guint band_count;     /* of the last canvas enabled */
+
+static void band_run(gpointer data, gpointer user_data)
+{
+    Band *band = data;
+    BandCall *call = band->call;
+
+    call->func(call->args, &band->box);
+
+    g_mutex_lock(&call->lock);
+    if (--call->pending == 0)
+        g_cond_signal(&call->cond);
+    g_mutex_unlock(&call->lock);
+}
+
+/* runs @func over @extents, in bands if it is worth it, and returns once done */
+static void band_call(const pixman_box32_t *extents, band_func func, gpointer args)
+{
+    Band bands[BAND_MAX_COUNT];
+    BandCall call;
+    pixman_box32_t warmup;
+    int width = extents->x2 - extents->x1;
+    int y, rows, n, i;
+
+    rows = extents->y2 - extents->y1 - BAND_WARMUP_ROWS;
+    n = MIN((int)g_atomic_int_get(&band_count), rows / BAND_MIN_ROWS);
+    if (n < 2 || (gint64)width * (extents->y2 - extents->y1) < BAND_MIN_PIXELS) {
+        func(args, NULL);
+        return;
+    }
+
+    warmup = *extents;
+    warmup.y2 = extents->y1 + BAND_WARMUP_ROWS;
+    func(args, &warmup);
+
+    call.func = func;
+    call.args = args;
+    call.pending = n - 1;
+    g_mutex_init(&call.lock);
+    g_cond_init(&call.cond);
+
+    y = warmup.y2;
+    for (i = 0; i < n; i++) {
+        bands[i].call = &call;
+        bands[i].box.x1 = extents->x1;
+        bands[i].box.x2 = extents->x2;
+        bands[i].box.y1 = y;
+        bands[i].box.y2 = i == n - 1 ? extents->y2 : y + rows / n;
+        y = bands[i].box.y2;
+    }
+
+    /* the last band is painted by the calling thread */
+    for (i = 0; i < n - 1; i++)
+        g_thread_pool_push(band_pool, &bands[i], NULL);
+    func(args, &bands[n - 1].box);
+
+    g_mutex_lock(&call.lock);
+    while (call.pending > 0)
+        g_cond_wait(&call.cond, &call.lock);
+    g_mutex_unlock(&call.lock);
+
+    g_mutex_clear(&call.lock);
+    g_cond_clear(&call.cond);
+}
+
+/* @region clipped to @band, or @region itself if @band is NULL */
+static pixman_region32_t *band_region(pixman_region32_t *band_region,
+                                      pixman_region32_t *region,
+                                      const pixman_box32_t *band)
+{
+    if (band == NULL)
+        return region;
+
+    pixman_region32_init_rect(band_region, band->x1, band->y1,
+                              band->x2 - band->x1, band->y2 - band->y1);
+    pixman_region32_intersect(band_region, band_region, region);
+
+    return band_region;
+}
+
+/* @rects clipped to @band into @band_rects, returns their number */
+static int band_rects(pixman_box32_t *band_rects, const pixman_box32_t *rects,
+                      int n_rects, const pixman_box32_t *band)
+{
+    int i, n = 0;
+
+    for (i = 0; i < n_rects; i++) {
+        pixman_box32_t box = rects[i];
+
+        box.y1 = MAX(box.y1, band->y1);
+        box.y2 = MIN(box.y2, band->y2);
+        if (box.y1 < box.y2 && box.x1 < box.x2)
+            band_rects[n++] = box;
+    }
+
+    return n;
+}
+
+static void rects_extents(pixman_box32_t *extents, const pixman_box32_t *rects, int n_rects)
+{
+    int i;
+
+    *extents = rects[0];
+    for (i = 1; i < n_rects; i++) {
+        extents->x1 = MIN(extents->x1, rects[i].x1);
+        extents->y1 = MIN(extents->y1, rects[i].y1);
+        extents->x2 = MAX(extents->x2, rects[i].x2);
+        extents->y2 = MAX(extents->y2, rects[i].y2);
+    }
+}
+
+/* ------------------------------------------------------------------ */
+
+typedef struct FillArgs {
+    SpiceCanvas *canvas;
+    pixman_box32_t *rects;
+    int n_rects;
+    uint32_t color;
+    pixman_image_t *tile;
+    int offset_x, offset_y;
+    SpiceROP rop;
+    gboolean with_rop;
+} FillArgs;
+
+static void fill_band(gpointer data, const pixman_box32_t *band)
+{
+    FillArgs *a = data;
+    pixman_box32_t *rects = a->rects;
+    int n_rects = a->n_rects;
+
+    if (band) {
+        rects = g_newa(pixman_box32_t, a->n_rects);
+        n_rects = band_rects(rects, a->rects, a->n_rects, band);
+        if (n_rects == 0)
+            return;
+    }
+
+    if (a->tile && a->with_rop)
+        sw_ops->fill_tiled_rects_rop(a->canvas, rects, n_rects, a->tile,
+                                     a->offset_x, a->offset_y, a->rop);
+    else if (a->tile)
+        sw_ops->fill_tiled_rects(a->canvas, rects, n_rects, a->tile,
+                                 a->offset_x, a->offset_y);
+    else if (a->with_rop)
+        sw_ops->fill_solid_rects_rop(a->canvas, rects, n_rects, a->color, a->rop);
+    else
+        sw_ops->fill_solid_rects(a->canvas, rects, n_rects, a->color);
+}
+
+static void fill_call(FillArgs *args)
+{
+    pixman_box32_t extents;
+
+    /* the boxes are on the stack of each band */
+    if (args->n_rects == 0 || args->n_rects > 1024) {
+        fill_band(args, NULL);
+        return;
+    }
+
+    rects_extents(&extents, args->rects, args->n_rects);
+    band_call(&extents, fill_band, args);
+}
+
+static void banded_fill_solid_rects(SpiceCanvas *canvas, pixman_box32_t *rects,
+                                    int n_rects, uint32_t color)
+{
+    FillArgs args = { canvas, rects, n_rects, color, NULL, 0, 0, 0, FALSE };
+
+    fill_call(&args);
+}
+
+static void banded_fill_solid_rects_rop(SpiceCanvas *canvas, pixman_box32_t *rects,
+                                        int n_rects, uint32_t color, SpiceROP rop)
+{
+    FillArgs args = { canvas, rects, n_rects, color, NULL, 0, 0, rop, TRUE };
+
+    fill_call(&args);
+}
+
+static void banded_fill_tiled_rects(SpiceCanvas *canvas, pixman_box32_t *rects,
+                                    int n_rects, pixman_image_t *tile,
+                                    int offset_x, int offset_y)
+{
+    FillArgs args = { canvas, rects, n_rects, 0, tile, offset_x, offset_y, 0, FALSE };
+
+    fill_call(&args);
+}
+
+static void banded_fill_tiled_rects_rop(SpiceCanvas *canvas, pixman_box32_t *rects,
+                                        int n_rects, pixman_image_t *tile,
+                                        int offset_x, int offset_y, SpiceROP rop)
+{
+    FillArgs args = { canvas, rects, n_rects, 0, tile, offset_x, offset_y, rop, TRUE };
+
+    fill_call(&args);
+}
+
+typedef struct BlitArgs {
+    SpiceCanvas *canvas;
+    pixman_region32_t *region;
+    pixman_image_t *src_image;
+    int offset_x, offset_y;
+    SpiceROP rop;
+    gboolean with_rop;
+} BlitArgs;
+
+static void blit_band(gpointer data, const pixman_box32_t *band)
+{
+    BlitArgs *a = data;
+    pixman_region32_t clipped, *region;
+
+    region = band_region(&clipped, a->region, band);
+    if (a->with_rop)
+        sw_ops->blit_image_rop(a->canvas, region, a->src_image,
+                               a->offset_x, a->offset_y, a->rop);
+    else
+        sw_ops->blit_image(a->canvas, region, a->src_image,
+                           a->offset_x, a->offset_y);
+    if (region != a->region)
+        pixman_region32_fini(region);
+}
+
+static void banded_blit_image(SpiceCanvas *canvas, pixman_region32_t *region,
+                              pixman_image_t *src_image, int offset_x, int offset_y)
+{
+    BlitArgs args = { canvas, region, src_image, offset_x, offset_y, 0, FALSE };
+
+    band_call(pixman_region32_extents(region), blit_band, &args);
+}
+
+static void banded_blit_image_rop(SpiceCanvas *canvas, pixman_region32_t *region,
+                                  pixman_image_t *src_image, int offset_x, int offset_y,
+                                  SpiceROP rop)
+{
+    BlitArgs args = { canvas, region, src_image, offset_x, offset_y, rop, TRUE };
+
+    band_call(pixman_region32_extents(region), blit_band, &args);
+}
+
+/* ------------------------------------------------------------------ */
+
+static gpointer banded_ops_init(gpointer data)
+{
+    SpiceCanvasOps *ops = data;
+
+    sw_ops = ops;
+    banded_ops = *ops;
+    banded_ops.fill_solid_rects = banded_fill_solid_rects;
+    banded_ops.fill_solid_rects_rop = banded_fill_solid_rects_rop;
+    banded_ops.fill_tiled_rects = banded_fill_tiled_rects;
+    banded_ops.fill_tiled_rects_rop = banded_fill_tiled_rects_rop;
+    banded_ops.blit_image = banded_blit_image;
+    banded_ops.blit_image_rop = banded_blit_image_rop;
+
+    /* the calling thread paints a band too */
+    band_pool = g_thread_pool_new(band_run, NULL, BAND_MAX_COUNT - 1, FALSE, NULL);
+
+    return NULL;
+}
+
+/*
+ * Makes the large pixel ops of @canvas run in bands on a thread pool.
+ * The number of bands is set with SPICE_CANVAS_BANDS, read for each new
+ * canvas, the default is the number of processors. With 1, @canvas is
+ * left as is.
+ */
+void client_sw_canvas_enable_bands(SpiceCanvas *canvas)
+{
+    static GOnce once = G_ONCE_INIT;
+    const char *bands = g_getenv("SPICE_CANVAS_BANDS");
+    guint count;
+
+    if (bands)
+        count = CLAMP(atoi(bands), 1, BAND_MAX_COUNT);
+    else
+        count = MIN(g_get_num_processors(), BAND_MAX_COUNT);
+
+    if (count < 2)
+        return;
+
+    g_once(&once, banded_ops_init, canvas->ops);
+    g_atomic_int_set(&band_count, count);
+
+    if (canvas->ops == sw_ops)
+        canvas->ops = &banded_ops;
+}
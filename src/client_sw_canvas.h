@@ -19,3 +19,5 @@
 #define SW_CANVAS_CACHE
 
 #include <common/sw_canvas.h>
+
+void client_sw_canvas_enable_bands(SpiceCanvas *canvas);
@@ -88,11 +88,15 @@ void coroutine_init(struct coroutine *co)
 	cc_init(&co->cc);
 }
 
-static struct coroutine leader;
-static struct coroutine *current = &leader;
+/* Each thread running coroutines (the main thread and any channel I/O
+ * thread) has its own leader */
+static __thread struct coroutine leader;
+static __thread struct coroutine *current;
 
 struct coroutine *coroutine_self(void)
 {
+	if (current == NULL)
+		current = &leader;
 	return current;
 }
 
@@ -258,6 +258,9 @@ static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
             } else {
                 ref = glz_decoder_window_bits(window, image_id,
                                               image_dist, pixel_ofs);
+                /* the referenced image is missing, already reported */
+                if (ref == NULL)
+                    return 0;
             }
 
             g_return_val_if_fail(ref != NULL, 0);
@@ -76,106 +76,235 @@ static void glz_image_destroy(struct glz_image *img)
 
 /* ------------------------------------------------------------------ */
 
-#define INIT_IMAGES_CAPACITY 100
-#define WIN_OVERFLOW_FACTOR 1.5
-#define WIN_REALLOC_FACTOR 1.5
+/* The window is a ring of image slots indexed by id, holding the ids
+ * [oldest, oldest + capacity). The images of the different displays
+ * share the window and may arrive out of order, leaving empty slots
+ * until they are received; the ring only grows when the ids in the
+ * window span more than its capacity, up to MAX_IMAGES_CAPACITY.
+ * When the window is started from the first image received, the
+ * older images of the other displays are still to come: the window is
+ * moved down for them, until the server releases these ids. */
+
+#define MIN_IMAGES_CAPACITY 64
+#define MAX_IMAGES_CAPACITY (64 * 1024)
+/* expected size of the smallest images, to size the ring from the
+ * window size: 64x64 pixels */
+#define MIN_IMAGE_BYTES (64 * 64 * 4)
+
+struct glz_waiter {
+    uint64_t                id;
+    GSource                 *event;
+};
+
+static void glz_waiter_free(struct glz_waiter *waiter)
+{
+    g_source_unref(waiter->event);
+    g_free(waiter);
+}
 
 struct SpiceGlzDecoderWindow {
     struct glz_image        **images;
-    uint32_t                nimages;
+    uint32_t                nimages;    /* ring capacity, power of 2 */
     uint64_t                oldest;
-    uint64_t                tail_gap;
+    uint64_t                newest;     /* ids of the images in the window: [oldest, newest] */
+    uint64_t                released;   /* the server doesn't use the images before it */
+    uint64_t                tail_gap;   /* all images before it were received */
+    GSList                  *waiters;   /* struct glz_waiter, see glz_decoder_window_bits() */
+    SpiceGlzDecoderWindowStats stats;
 };
 
-static void glz_decoder_window_resize(SpiceGlzDecoderWindow *w)
+static uint32_t glz_decoder_window_capacity(uint32_t window_size)
 {
-    struct glz_image  **new_images;
-    int i, new_slot;
+    uint32_t nimages = MIN_IMAGES_CAPACITY;
 
-    SPICE_DEBUG("%s: array resize %u -> %u", __FUNCTION__,
-                w->nimages, w->nimages * 2);
-    new_images = g_new0(struct glz_image*, w->nimages * 2);
-    for (i = 0; i < w->nimages; i++) {
-        if (w->images[i] == NULL) {
-            /*
-             * We can have empty slots when images come in out of order, this
-             * can happen when a vm has multiple displays, since each display
-             * uses its own socket there is no guarantee that images
-             * originating from different displays are received in id order.
-             */
+    while (nimages < MAX_IMAGES_CAPACITY && nimages * MIN_IMAGE_BYTES < window_size)
+        nimages *= 2;
+
+    return nimages;
+}
+
+static inline struct glz_image **glz_decoder_window_slot(SpiceGlzDecoderWindow *w,
+                                                         uint64_t id)
+{
+    return &w->images[id & (w->nimages - 1)];
+}
+
+static void glz_decoder_window_resize(SpiceGlzDecoderWindow *w, uint32_t nimages)
+{
+    struct glz_image **images = w->images;
+    uint32_t i, old_nimages = w->nimages;
+
+    SPICE_DEBUG("%s: ring resize %u -> %u", __FUNCTION__, old_nimages, nimages);
+
+    w->images = g_new0(struct glz_image*, nimages);
+    w->nimages = nimages;
+    for (i = 0; i < old_nimages; i++) {
+        if (images[i] != NULL)
+            *glz_decoder_window_slot(w, images[i]->hdr.id) = images[i];
+    }
+    g_free(images);
+    w->stats.capacity = nimages;
+}
+
+/* wake up the displays waiting for the image @id, and drop the
+ * waiters of cancelled waits. When the image was dropped, the woken
+ * displays don't find it and fail the decoding. */
+static void glz_decoder_window_wake(SpiceGlzDecoderWindow *w, uint64_t id)
+{
+    GSList *l, *next;
+
+    for (l = w->waiters; l != NULL; l = next) {
+        struct glz_waiter *waiter = l->data;
+
+        next = l->next;
+        if (waiter->id != id && !g_source_is_destroyed(waiter->event))
             continue;
-        }
-        new_slot = w->images[i]->hdr.id % (w->nimages * 2);
-        new_images[new_slot] = w->images[i];
+
+        g_coroutine_event_set(waiter->event);
+        glz_waiter_free(waiter);
+        w->waiters = g_slist_delete_link(w->waiters, l);
     }
-    g_free(w->images);
-    w->images = new_images;
-    w->nimages *= 2;
 }
 
 static void glz_decoder_window_add(SpiceGlzDecoderWindow *w,
                                    struct glz_image *img)
 {
-    int slot = img->hdr.id % w->nimages;
+    uint64_t id = img->hdr.id;
+    struct glz_image **slot;
+    uint64_t oldest, newest;
+
+    if (id < w->released) {
+        g_warning("glz image %" G_GUINT64_FORMAT " is older than the window", id);
+        glz_image_destroy(img);
+        glz_decoder_window_wake(w, id);
+        return;
+    }
 
-    if (w->images[slot]) {
-        /* need more space */
-        glz_decoder_window_resize(w);
-        slot = img->hdr.id % w->nimages;
+    if (w->stats.images == 0) {
+        /* nothing to keep, start the ring from this image */
+        w->oldest = id;
+        w->newest = id;
+        w->tail_gap = id;
     }
 
-    w->images[slot] = img;
+    oldest = MIN(w->oldest, id);
+    newest = MAX(w->newest, id);
+    if (newest - oldest >= MAX_IMAGES_CAPACITY) {
+        g_warning("glz image %" G_GUINT64_FORMAT " is too far from the window [%"
+                  G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT "]", id, w->oldest, w->newest);
+        glz_image_destroy(img);
+        glz_decoder_window_wake(w, id);
+        return;
+    }
+
+    if (newest - oldest >= w->nimages) {
+        uint32_t nimages = w->nimages;
+        while (newest - oldest >= nimages)
+            nimages *= 2;
+        glz_decoder_window_resize(w, nimages);
+    }
+
+    if (id < w->oldest) {
+        /* an image of another display, sent before the first one
+         * received: the images between are still to come too */
+        w->oldest = id;
+        w->tail_gap = id;
+    }
+    w->newest = newest;
+
+    slot = glz_decoder_window_slot(w, id);
+    if (*slot != NULL) {
+        /* the server sent the same id twice: keep the last image */
+        g_warning("glz image %" G_GUINT64_FORMAT " replaces image %" G_GUINT64_FORMAT,
+                  id, (*slot)->hdr.id);
+        w->stats.images--;
+        w->stats.bytes -= (*slot)->hdr.gross_pixels * 4;
+        glz_image_destroy(*slot);
+    }
+    *slot = img;
+
+    w->stats.images++;
+    w->stats.bytes += img->hdr.gross_pixels * 4;
+    w->stats.max_bytes = MAX(w->stats.max_bytes, w->stats.bytes);
 
     /* close the gap */
-    while (w->tail_gap <= img->hdr.id && w->images[w->tail_gap % w->nimages] != NULL)
+    while (w->tail_gap <= id && *glz_decoder_window_slot(w, w->tail_gap) != NULL)
         w->tail_gap++;
-}
 
-struct wait_for_image_data {
-    SpiceGlzDecoderWindow     *window;
-    uint64_t                   id;
-};
+    glz_decoder_window_wake(w, id);
+}
 
-static gboolean wait_for_image(gpointer data)
+static struct glz_image *glz_decoder_window_find(SpiceGlzDecoderWindow *w, uint64_t id)
 {
-    struct wait_for_image_data *wait = data;
-    int slot = wait->id % wait->window->nimages;
-    struct glz_image *image = wait->window->images[slot];
-    gboolean ready = image && image->hdr.id == wait->id;
+    struct glz_image *image;
+
+    if (id < w->oldest || id - w->oldest >= w->nimages)
+        return NULL;
 
-    return ready;
+    image = *glz_decoder_window_slot(w, id);
+    return image && image->hdr.id == id ? image : NULL;
 }
 
+/* coroutine context */
 static void *glz_decoder_window_bits(SpiceGlzDecoderWindow *w, uint64_t id,
                                      uint32_t dist, uint32_t offset)
 {
-    struct wait_for_image_data data = {
-        .window = w,
-        .id = id - dist,
-    };
-
-    if (!g_coroutine_condition_wait(g_coroutine_self(), wait_for_image, &data))
-        SPICE_DEBUG("wait for image cancelled");
-
-    int slot = (id - dist) % w->nimages;
+    struct glz_image *image = glz_decoder_window_find(w, id - dist);
+
+    if (image == NULL) {
+        /* the image comes from another display channel, which didn't
+         * receive it yet: sleep until glz_decoder_window_add() */
+        struct glz_waiter *waiter = g_new(struct glz_waiter, 1);
+        GSource *event = g_coroutine_event_new();
+        gint64 start = g_get_monotonic_time(), stall;
+        gboolean woken;
+
+        /* the waiter is freed by glz_decoder_window_wake() */
+        waiter->id = id - dist;
+        waiter->event = g_source_ref(event);
+        w->waiters = g_slist_prepend(w->waiters, waiter);
+        woken = g_coroutine_event_wait(g_coroutine_self(), event);
+        g_source_unref(event);
+
+        stall = g_get_monotonic_time() - start;
+        w->stats.stalls++;
+        w->stats.stall_us += stall;
+        w->stats.max_stall_us = MAX(w->stats.max_stall_us, stall);
+
+        image = glz_decoder_window_find(w, id - dist);
+        if (image == NULL) {
+            /* the wait was cancelled, or the image was dropped by
+             * glz_decoder_window_add(): fail this decoding */
+            if (woken)
+                g_warning("glz image %" G_GUINT64_FORMAT " was dropped, can't decode image %"
+                          G_GUINT64_FORMAT, id - dist, id);
+            else
+                SPICE_DEBUG("wait for image cancelled");
+            return NULL;
+        }
+    }
 
-    g_return_val_if_fail(w->images[slot] != NULL, NULL);
-    g_return_val_if_fail(w->images[slot]->hdr.id == id - dist, NULL);
-    g_return_val_if_fail(w->images[slot]->hdr.gross_pixels >= offset, NULL);
+    g_return_val_if_fail(image->hdr.gross_pixels >= offset, NULL);
 
-    return w->images[slot]->data + offset * 4;
+    return image->data + offset * 4;
 }
 
 static void glz_decoder_window_release(SpiceGlzDecoderWindow *w,
                                        uint64_t oldest)
 {
-    int slot;
-
-    while (w->oldest < oldest) {
-        slot = w->oldest % w->nimages;
-        g_clear_pointer(&w->images[slot], glz_image_destroy);
+    struct glz_image **slot;
+
+    while (w->oldest < oldest && w->stats.images > 0) {
+        slot = glz_decoder_window_slot(w, w->oldest);
+        if (*slot != NULL) {
+            w->stats.images--;
+            w->stats.bytes -= (*slot)->hdr.gross_pixels * 4;
+            g_clear_pointer(slot, glz_image_destroy);
+        }
         w->oldest++;
     }
+    w->oldest = MAX(w->oldest, oldest);
+    w->released = MAX(w->released, oldest);
 }
 
 /* ------------------------------------------------------------------ */
@@ -376,7 +505,7 @@ static void decode(SpiceGlzDecoder *decoder,
 
     { /* release old images from last tail_gap, only if the gap is closed  */
         uint64_t oldest;
-        struct glz_image *image = d->window->images[(d->window->tail_gap - 1) % d->window->nimages];
+        struct glz_image *image = glz_decoder_window_find(d->window, d->window->tail_gap - 1);
 
         g_return_if_fail(image != NULL);
 
@@ -393,7 +522,7 @@ static SpiceGlzDecoderOps glz_decoder_ops = {
 
 void glz_decoder_window_clear(SpiceGlzDecoderWindow *w)
 {
-    int i;
+    uint32_t i;
 
     g_return_if_fail(w->nimages == 0 || w->images != NULL);
 
@@ -403,10 +532,17 @@ void glz_decoder_window_clear(SpiceGlzDecoderWindow *w)
         }
     }
 
-    w->nimages = 16;
+    /* the pending waiters are kept, the images may come again */
     g_free(w->images);
+    w->nimages = glz_decoder_window_capacity(w->stats.window_size);
     w->images = g_new0(struct glz_image*, w->nimages);
+    w->oldest = 0;
+    w->newest = 0;
+    w->released = 0;
     w->tail_gap = 0;
+    w->stats.capacity = w->nimages;
+    w->stats.images = 0;
+    w->stats.bytes = 0;
 }
 
 SpiceGlzDecoderWindow *glz_decoder_window_new(void)
@@ -416,12 +552,28 @@ SpiceGlzDecoderWindow *glz_decoder_window_new(void)
     return w;
 }
 
+/* sizes the ring for a window of @window_size bytes, as announced to
+ * the server */
+void glz_decoder_window_set_size(SpiceGlzDecoderWindow *w, uint32_t window_size)
+{
+    w->stats.window_size = window_size;
+    if (w->stats.images == 0)
+        glz_decoder_window_clear(w);
+}
+
+void glz_decoder_window_get_stats(SpiceGlzDecoderWindow *w,
+                                  SpiceGlzDecoderWindowStats *stats)
+{
+    *stats = w->stats;
+}
+
 void glz_decoder_window_destroy(SpiceGlzDecoderWindow *w)
 {
     if (w == NULL)
         return;
 
     glz_decoder_window_clear(w);
+    g_slist_free_full(w->waiters, (GDestroyNotify)glz_waiter_free);
     g_free(w->images);
     g_free(w);
 }
@@ -32,6 +32,16 @@
 #include <stdio.h>
 #include <jpeglib.h>
 
+#if !defined(JCS_EXTENSIONS) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* libjpeg never recommends more than 4 rows per call (2x vertical
+ * upsampling with 2 rows at a time), same limit as the mjpeg decoder */
+#define MAX_BATCH_ROWS 4
+
 typedef struct GlibJpegDecoder
 {
     SpiceJpegDecoder              base;
@@ -73,7 +83,9 @@ static void begin_decode(SpiceJpegDecoder *decoder,
     *out_height = d->_height;
 }
 
-/* TODO: move it elsewhere and reuse it in get_pixbuf(), optimize? */
+#ifndef JCS_EXTENSIONS
+/* Without libjpeg-turbo the decoder only outputs RGB, which needs to be
+ * swizzled to the BGR/BGRX layout of the surfaces. */
 typedef void (*converter_rgb_t)(uint8_t* src, uint8_t* dest, int width);
 
 static void convert_rgb_to_bgr(uint8_t* src, uint8_t* dest, int width)
@@ -101,34 +113,128 @@ static void convert_rgb_to_bgrx(uint8_t* src, uint8_t* dest, int width)
     }
 }
 
+#ifdef HAVE_X86_SIMD
+/* 4 pixels per shuffle. The 16 bytes loads and stores go 4 bytes past
+ * the pixels handled, so stop 6 pixels before the end of the row and
+ * leave the rest to the scalar loop. */
+__attribute__((target("ssse3")))
+static void convert_rgb_to_bgr_ssse3(uint8_t* src, uint8_t* dest, int width)
+{
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7,
+                                          6, 11, 10, 9, 12, 13, 14, 15);
+    int x;
+
+    for (x = 0; x + 6 <= width; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + x * 3));
+        _mm_storeu_si128((__m128i *)(dest + x * 3), _mm_shuffle_epi8(v, shuffle));
+    }
+    convert_rgb_to_bgr(src + x * 3, dest + x * 3, width - x);
+}
+
+__attribute__((target("ssse3")))
+static void convert_rgb_to_bgrx_ssse3(uint8_t* src, uint8_t* dest, int width)
+{
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1,
+                                          8, 7, 6, -1, 11, 10, 9, -1);
+    int x;
+
+    for (x = 0; x + 6 <= width; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + x * 3));
+        _mm_storeu_si128((__m128i *)(dest + x * 4), _mm_shuffle_epi8(v, shuffle));
+    }
+    convert_rgb_to_bgrx(src + x * 3, dest + x * 4, width - x);
+}
+
+static gboolean have_ssse3(void)
+{
+    static gsize ssse3 = 0;
+
+    if (g_once_init_enter(&ssse3)) {
+        __builtin_cpu_init();
+        g_once_init_leave(&ssse3, __builtin_cpu_supports("ssse3") ? 2 : 1);
+    }
+    return ssse3 == 2;
+}
+#endif
+
+static converter_rgb_t get_converter(int format)
+{
+    switch (format) {
+    case SPICE_BITMAP_FMT_24BIT:
+#ifdef HAVE_X86_SIMD
+        if (have_ssse3())
+            return convert_rgb_to_bgr_ssse3;
+#endif
+        return convert_rgb_to_bgr;
+    case SPICE_BITMAP_FMT_32BIT:
+#ifdef HAVE_X86_SIMD
+        if (have_ssse3())
+            return convert_rgb_to_bgrx_ssse3;
+#endif
+        return convert_rgb_to_bgrx;
+    default:
+        return NULL;
+    }
+}
+#endif
+
 static void decode(SpiceJpegDecoder *decoder,
                    uint8_t* dest, int stride, int format)
 {
     GlibJpegDecoder *d = SPICE_CONTAINEROF(decoder, GlibJpegDecoder, base);
-    uint8_t* scan_line = g_alloca(d->_width * 3);
-    converter_rgb_t converter = NULL;
-    int row;
+    JSAMPROW rows[MAX_BATCH_ROWS];
+    unsigned int i, n_rows;
+#ifndef JCS_EXTENSIONS
+    converter_rgb_t converter = get_converter(format);
+    uint8_t* batch;
 
+    if (converter == NULL) {
+        g_warning("bad bitmap format, %d", format);
+        return;
+    }
+#else
+    /* libjpeg-turbo writes the surface layout directly; the padding
+     * byte of BGRX is set to 0xff, which x8r8g8b8 ignores */
     switch (format) {
     case SPICE_BITMAP_FMT_24BIT:
-        converter = convert_rgb_to_bgr;
+        d->_cinfo.out_color_space = JCS_EXT_BGR;
         break;
     case SPICE_BITMAP_FMT_32BIT:
-        converter = convert_rgb_to_bgrx;
+        d->_cinfo.out_color_space = JCS_EXT_BGRX;
         break;
     default:
         g_warning("bad bitmap format, %d", format);
         return;
     }
-
-    g_return_if_fail(converter != NULL);
+#endif
 
     jpeg_start_decompress(&d->_cinfo);
 
-    for (row = 0; row < d->_height; row++) {
-        jpeg_read_scanlines(&d->_cinfo, &scan_line, 1);
-        converter(scan_line, dest, d->_width);
-        dest += stride;
+    /* rec_outbuf_height is the number of rows libjpeg produces at once,
+     * asking for less makes it buffer and copy them internally */
+    n_rows = MIN(d->_cinfo.rec_outbuf_height, MAX_BATCH_ROWS);
+#ifndef JCS_EXTENSIONS
+    batch = g_alloca(d->_width * 3 * n_rows);
+    for (i = 0; i < n_rows; i++)
+        rows[i] = batch + i * d->_width * 3;
+#endif
+
+    while (d->_cinfo.output_scanline < d->_cinfo.output_height) {
+        unsigned int n_read, n;
+
+        n = MIN(n_rows, d->_cinfo.output_height - d->_cinfo.output_scanline);
+#ifdef JCS_EXTENSIONS
+        for (i = 0; i < n; i++)
+            rows[i] = dest + i * stride;
+#endif
+        n_read = jpeg_read_scanlines(&d->_cinfo, rows, n);
+        if (n_read == 0)
+            break;
+#ifndef JCS_EXTENSIONS
+        for (i = 0; i < n_read; i++)
+            converter(rows[i], dest + i * stride, d->_width);
+#endif
+        dest += n_read * stride;
     }
 
     jpeg_finish_decompress(&d->_cinfo);
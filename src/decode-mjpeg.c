@@ -0,0 +1,544 @@
+/*
+   Copyright (C) 2026 The spice-gtk contributors
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <setjmp.h>
+
+#include "spice-common.h"
+#include "decode-mjpeg.h"
+
+/*
+ * Slice parallel decoding of the MJPEG stream frames.
+ *
+ * A baseline JPEG scan with a restart interval (DRI) is a sequence of
+ * independently entropy coded intervals of MCUs, separated by the RSTn
+ * markers: the DC predictions are reset at each of them. When intervals
+ * start at the beginning of MCU rows, the frame can be cut there into
+ * bands. Each band is rebuilt as a standalone JPEG image: the headers of
+ * the frame with the height of the band in the SOF, its intervals with
+ * the restart markers renumbered from RST0, and an EOI. The bands are
+ * then decoded by the slice threads straight at their place in the
+ * output.
+ *
+ * Without fancy upsampling, a band decodes to exactly the same pixels
+ * as the rows of the whole frame. With it (SPICE_QUALITY builds), the
+ * chroma of the rows at the band boundaries is interpolated from one
+ * side only.
+ */
+
+#define MJPEG_MARKER_SOF0   0xc0
+#define MJPEG_MARKER_SOF1   0xc1
+#define MJPEG_MARKER_DHT    0xc4
+#define MJPEG_MARKER_RST0   0xd0
+#define MJPEG_MARKER_RST7   0xd7
+#define MJPEG_MARKER_SOI    0xd8
+#define MJPEG_MARKER_EOI    0xd9
+#define MJPEG_MARKER_SOS    0xda
+#define MJPEG_MARKER_DQT    0xdb
+#define MJPEG_MARKER_DRI    0xdd
+#define MJPEG_MARKER_APP0   0xe0
+#define MJPEG_MARKER_APP15  0xef
+#define MJPEG_MARKER_COM    0xfe
+
+/* below this size, the handover to the threads costs more than it saves */
+#define MJPEG_SLICE_MIN_ROWS 32
+
+G_GNUC_INTERNAL
+void mjpeg_decompress_setup(struct jpeg_decompress_struct *cinfo)
+{
+#ifdef JCS_EXTENSIONS
+    // requires jpeg-turbo
+#if SPICE_ENDIAN == SPICE_ENDIAN_LITTLE
+    cinfo->out_color_space = JCS_EXT_BGRX;
+#else
+    cinfo->out_color_space = JCS_EXT_XRGB;
+#endif
+#else
+#warning "You should consider building with libjpeg-turbo"
+    cinfo->out_color_space = JCS_RGB;
+#endif
+
+#ifndef SPICE_QUALITY
+    cinfo->dct_method = JDCT_IFAST;
+    cinfo->do_fancy_upsampling = FALSE;
+    cinfo->do_block_smoothing = FALSE;
+    cinfo->dither_mode = JDITHER_ORDERED;
+#endif
+}
+
+G_GNUC_INTERNAL
+gboolean mjpeg_decompress_read(struct jpeg_decompress_struct *cinfo,
+                               guint8 *dest, gsize stride)
+{
+    uint8_t *lines[4];
+
+    // TODO: in theory should check cinfo.output_height match with our height
+    jpeg_start_decompress(cinfo);
+    /* rec_outbuf_height is the recommended size of the output buffer we
+     * pass to libjpeg for optimum performance
+     */
+    if (cinfo->rec_outbuf_height > G_N_ELEMENTS(lines)) {
+        jpeg_abort_decompress(cinfo);
+        g_return_val_if_reached(FALSE);
+    }
+
+    while (cinfo->output_scanline < cinfo->output_height) {
+        unsigned int n = MIN((unsigned int)cinfo->rec_outbuf_height,
+                             cinfo->output_height - cinfo->output_scanline);
+        unsigned int lines_read;
+
+        for (unsigned int j = 0; j < n; j++) {
+            lines[j] = dest + j * stride;
+        }
+        lines_read = jpeg_read_scanlines(cinfo, lines, n);
+        if (lines_read == 0) {
+            jpeg_abort_decompress(cinfo);
+            return FALSE;
+        }
+#ifndef JCS_EXTENSIONS
+        /* expand the RGB lines in place, from the end */
+        for (unsigned int j = 0; j < lines_read; j++) {
+            uint8_t *s = lines[j];
+            uint32_t *d = SPICE_ALIGNED_CAST(uint32_t *, s);
+
+            for (unsigned int x = cinfo->output_width; x > 0;) {
+                x -= 1;
+                d[x] = s[x * 3 + 0] << 16 |
+                       s[x * 3 + 1] << 8 |
+                       s[x * 3 + 2];
+            }
+        }
+#endif
+        dest += lines_read * stride;
+    }
+    jpeg_finish_decompress(cinfo);
+
+    return TRUE;
+}
+
+G_GNUC_INTERNAL
+guint mjpeg_slices_get_default(void)
+{
+    static gsize slices = 0;
+
+    if (g_once_init_enter(&slices)) {
+        const gchar *env = g_getenv("SPICE_MJPEG_SLICES");
+        gint n = env ? atoi(env) : (gint)g_get_num_processors();
+
+        g_once_init_leave(&slices, CLAMP(n, 1, MJPEG_MAX_SLICES));
+    }
+    return slices;
+}
+
+/* ------------------------------------------------------------------ */
+/* frame parsing */
+
+typedef struct MJpegFrameLayout {
+    gsize header_size;          /* SOI to the end of the SOS segment */
+    gsize height_offset;        /* of the SOF height field */
+    guint restart_interval;     /* in MCUs */
+    guint mcus_per_row;
+    guint mcu_rows;
+    guint mcu_height;
+
+    /* the intervals of the scan, interval i spans
+     * [starts[i], ends[i]) with its RST marker right after */
+    GArray *starts;
+    GArray *ends;
+} MJpegFrameLayout;
+
+static guint read_be16(const guint8 *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+static gboolean parse_sof(MJpegFrameLayout *layout, const guint8 *seg, guint len,
+                          gsize seg_offset, guint width, guint height,
+                          guint *n_components, guint *h_max, guint *v_max)
+{
+    guint i;
+
+    /* precision, height, width, components */
+    if (len < 6 || seg[0] != 8 ||
+        read_be16(seg + 1) != height || read_be16(seg + 3) != width) {
+        return FALSE;
+    }
+    *n_components = seg[5];
+    if (*n_components == 0 || len < 6 + *n_components * 3) {
+        return FALSE;
+    }
+    *h_max = *v_max = 1;
+    for (i = 0; i < *n_components; i++) {
+        guint sampling = seg[6 + i * 3 + 1];
+
+        *h_max = MAX(*h_max, sampling >> 4);
+        *v_max = MAX(*v_max, sampling & 0xf);
+    }
+    layout->height_offset = seg_offset + 1;
+    return TRUE;
+}
+
+/* Finds the headers and the restart intervals of a frame, FALSE if it
+ * is not a single scan baseline frame with restart markers. */
+static gboolean mjpeg_frame_parse(MJpegFrameLayout *layout,
+                                  const guint8 *data, gsize size,
+                                  guint width, guint height)
+{
+    guint n_components = 0, h_max = 1, v_max = 1, mcu_width;
+    gsize pos = 2, interval_start, scan_end;
+    guint n_intervals;
+
+    if (size < 4 || data[0] != 0xff || data[1] != MJPEG_MARKER_SOI) {
+        return FALSE;
+    }
+
+    /* the marker segments, up to the start of the scan */
+    for (;;) {
+        guint marker, len;
+
+        if (pos + 4 > size || data[pos] != 0xff) {
+            return FALSE;
+        }
+        marker = data[pos + 1];
+        if (marker == 0xff) {
+            /* fill byte */
+            pos++;
+            continue;
+        }
+        len = read_be16(data + pos + 2);
+        if (len < 2 || pos + 2 + len > size) {
+            return FALSE;
+        }
+
+        switch (marker) {
+        case MJPEG_MARKER_SOF0:
+        case MJPEG_MARKER_SOF1:
+            if (!parse_sof(layout, data + pos + 4, len - 2, pos + 4,
+                           width, height, &n_components, &h_max, &v_max)) {
+                return FALSE;
+            }
+            break;
+        case MJPEG_MARKER_DRI:
+            if (len != 4) {
+                return FALSE;
+            }
+            layout->restart_interval = read_be16(data + pos + 4);
+            break;
+        case MJPEG_MARKER_SOS:
+            /* interleaved scan of all the components only */
+            if (n_components == 0 || len < 3 || data[pos + 4] != n_components) {
+                return FALSE;
+            }
+            break;
+        case MJPEG_MARKER_DHT:
+        case MJPEG_MARKER_DQT:
+        case MJPEG_MARKER_COM:
+            break;
+        default:
+            /* progressive, arithmetic, lossless, DNL... */
+            if (marker < MJPEG_MARKER_APP0 || marker > MJPEG_MARKER_APP15) {
+                return FALSE;
+            }
+            break;
+        }
+        pos += 2 + len;
+        if (marker == MJPEG_MARKER_SOS) {
+            break;
+        }
+    }
+    if (layout->restart_interval == 0) {
+        return FALSE;
+    }
+    layout->header_size = pos;
+
+    /* a single component scan is made of 8x8 blocks whatever the
+     * sampling factors */
+    if (n_components == 1) {
+        h_max = v_max = 1;
+    }
+    mcu_width = 8 * h_max;
+    layout->mcu_height = 8 * v_max;
+    layout->mcus_per_row = (width + mcu_width - 1) / mcu_width;
+    layout->mcu_rows = (height + layout->mcu_height - 1) / layout->mcu_height;
+    n_intervals = (layout->mcus_per_row * layout->mcu_rows + layout->restart_interval - 1) /
+                  layout->restart_interval;
+
+    /* the entropy coded data, up to the next marker that is neither
+     * a stuffed 0xff nor a restart */
+    interval_start = pos;
+    scan_end = size;
+    for (; pos + 1 < size; pos++) {
+        guint marker;
+
+        if (data[pos] != 0xff) {
+            continue;
+        }
+        marker = data[pos + 1];
+        if (marker == 0 || marker == 0xff) {
+            continue;
+        }
+        if (marker < MJPEG_MARKER_RST0 || marker > MJPEG_MARKER_RST7) {
+            scan_end = pos;
+            break;
+        }
+        g_array_append_val(layout->starts, interval_start);
+        g_array_append_val(layout->ends, pos);
+        interval_start = pos + 2;
+        pos++;
+    }
+    g_array_append_val(layout->starts, interval_start);
+    g_array_append_val(layout->ends, scan_end);
+
+    return layout->starts->len == n_intervals;
+}
+
+/* ------------------------------------------------------------------ */
+/* slices */
+
+typedef struct MJpegSliceBatch {
+    GMutex lock;
+    GCond cond;
+    guint pending;
+    gboolean failed;
+} MJpegSliceBatch;
+
+typedef struct MJpegSlice {
+    MJpegSliceBatch *batch;
+    guint8 *jpeg;
+    gsize jpeg_size;
+    guint8 *dest;
+    gsize stride;
+} MJpegSlice;
+
+typedef struct MJpegSliceContext {
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    jmp_buf jmp_env;
+} MJpegSliceContext;
+
+static GThreadPool *slice_pool;
+
+static void slice_error_exit(j_common_ptr cinfo)
+{
+    MJpegSliceContext *ctx = SPICE_CONTAINEROF(cinfo->err, MJpegSliceContext, jerr);
+
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(ctx->jmp_env, 1);
+}
+
+static void slice_output_message(j_common_ptr cinfo)
+{
+    char message[JMSG_LENGTH_MAX];
+
+    (*cinfo->err->format_message)(cinfo, message);
+    SPICE_DEBUG("mjpeg slice: %s", message);
+}
+
+static void slice_context_free(gpointer data)
+{
+    MJpegSliceContext *ctx = data;
+
+    jpeg_destroy_decompress(&ctx->cinfo);
+    g_free(ctx);
+}
+
+static GPrivate slice_context = G_PRIVATE_INIT(slice_context_free);
+
+static MJpegSliceContext *slice_context_get(void)
+{
+    MJpegSliceContext *ctx = g_private_get(&slice_context);
+
+    if (ctx != NULL) {
+        return ctx;
+    }
+
+    ctx = g_new0(MJpegSliceContext, 1);
+    ctx->cinfo.err = jpeg_std_error(&ctx->jerr);
+    ctx->jerr.error_exit = slice_error_exit;
+    ctx->jerr.output_message = slice_output_message;
+    jpeg_create_decompress(&ctx->cinfo);
+    g_private_set(&slice_context, ctx);
+
+    return ctx;
+}
+
+/* any thread */
+static gboolean slice_decode(MJpegSliceContext *ctx, MJpegSlice *slice)
+{
+    if (setjmp(ctx->jmp_env)) {
+        jpeg_abort_decompress(&ctx->cinfo);
+        return FALSE;
+    }
+
+    jpeg_mem_src(&ctx->cinfo, slice->jpeg, slice->jpeg_size);
+    jpeg_read_header(&ctx->cinfo, TRUE);
+    mjpeg_decompress_setup(&ctx->cinfo);
+
+    return mjpeg_decompress_read(&ctx->cinfo, slice->dest, slice->stride);
+}
+
+static void slice_done(MJpegSlice *slice, gboolean ok)
+{
+    MJpegSliceBatch *batch = slice->batch;
+
+    g_mutex_lock(&batch->lock);
+    if (!ok) {
+        batch->failed = TRUE;
+    }
+    if (--batch->pending == 0) {
+        g_cond_signal(&batch->cond);
+    }
+    g_mutex_unlock(&batch->lock);
+}
+
+/* slice thread */
+static void slice_func(gpointer data, gpointer user_data)
+{
+    MJpegSlice *slice = data;
+
+    slice_done(slice, slice_decode(slice_context_get(), slice));
+}
+
+static gpointer slice_pool_init(gpointer data)
+{
+    /* the calling thread decodes a slice too */
+    slice_pool = g_thread_pool_new(slice_func, NULL, MJPEG_MAX_SLICES - 1, FALSE, NULL);
+    return NULL;
+}
+
+/* Builds the standalone JPEG of the intervals [first, last) */
+static void slice_build(MJpegSlice *slice, const MJpegFrameLayout *layout,
+                        const guint8 *data, guint first, guint last, guint height)
+{
+    gsize size = layout->header_size + 2;
+    guint8 *p;
+    guint i;
+
+    for (i = first; i < last; i++) {
+        size += g_array_index(layout->ends, gsize, i) -
+                g_array_index(layout->starts, gsize, i) + 2;
+    }
+
+    slice->jpeg = p = g_malloc(size);
+    memcpy(p, data, layout->header_size);
+    p[layout->height_offset] = height >> 8;
+    p[layout->height_offset + 1] = height & 0xff;
+    p += layout->header_size;
+
+    for (i = first; i < last; i++) {
+        gsize start = g_array_index(layout->starts, gsize, i);
+        gsize end = g_array_index(layout->ends, gsize, i);
+
+        memcpy(p, data + start, end - start);
+        p += end - start;
+        if (i + 1 < last) {
+            *p++ = 0xff;
+            *p++ = MJPEG_MARKER_RST0 + (i - first) % 8;
+        }
+    }
+    *p++ = 0xff;
+    *p++ = MJPEG_MARKER_EOI;
+    slice->jpeg_size = p - slice->jpeg;
+}
+
+G_GNUC_INTERNAL
+gboolean mjpeg_decode_slices(const guint8 *data, gsize size,
+                             guint8 *dest, guint width, guint height,
+                             guint max_slices)
+{
+    static GOnce slice_pool_once = G_ONCE_INIT;
+    MJpegFrameLayout layout = { 0, };
+    MJpegSlice slices[MJPEG_MAX_SLICES];
+    MJpegSliceBatch batch;
+    guint n_slices = 0, rows_per_slice, next_row, first = 0;
+    gboolean ok = FALSE;
+    guint i;
+
+    max_slices = MIN(max_slices, MJPEG_MAX_SLICES);
+    if (max_slices < 2 || height < 2 * MJPEG_SLICE_MIN_ROWS) {
+        return FALSE;
+    }
+
+    layout.starts = g_array_new(FALSE, FALSE, sizeof(gsize));
+    layout.ends = g_array_new(FALSE, FALSE, sizeof(gsize));
+    if (!mjpeg_frame_parse(&layout, data, size, width, height)) {
+        goto end;
+    }
+
+    /* cut at the intervals starting an MCU row, once past the next
+     * share of rows */
+    rows_per_slice = MAX((layout.mcu_rows + max_slices - 1) / max_slices,
+                         (MJPEG_SLICE_MIN_ROWS + layout.mcu_height - 1) / layout.mcu_height);
+    next_row = rows_per_slice;
+    for (i = 1; i <= layout.starts->len; i++) {
+        guint mcu, row, y0, y1;
+
+        if (i < layout.starts->len) {
+            mcu = i * layout.restart_interval;
+            if (mcu % layout.mcus_per_row != 0 || mcu / layout.mcus_per_row < next_row) {
+                continue;
+            }
+            row = mcu / layout.mcus_per_row;
+            next_row = row + rows_per_slice;
+        } else {
+            row = layout.mcu_rows;
+        }
+        if (n_slices == MJPEG_MAX_SLICES) {
+            goto end;
+        }
+
+        y0 = (first * layout.restart_interval / layout.mcus_per_row) * layout.mcu_height;
+        y1 = MIN(row * layout.mcu_height, height);
+        slices[n_slices].batch = &batch;
+        slices[n_slices].dest = dest + (gsize)y0 * width * 4;
+        slices[n_slices].stride = (gsize)width * 4;
+        slice_build(&slices[n_slices], &layout, data, first, i, y1 - y0);
+        n_slices++;
+        first = i;
+    }
+    if (n_slices < 2) {
+        goto end;
+    }
+
+    g_once(&slice_pool_once, slice_pool_init, NULL);
+    g_mutex_init(&batch.lock);
+    g_cond_init(&batch.cond);
+    batch.pending = n_slices;
+    batch.failed = FALSE;
+    for (i = 1; i < n_slices; i++) {
+        g_thread_pool_push(slice_pool, &slices[i], NULL);
+    }
+    slice_done(&slices[0], slice_decode(slice_context_get(), &slices[0]));
+
+    g_mutex_lock(&batch.lock);
+    while (batch.pending > 0) {
+        g_cond_wait(&batch.cond, &batch.lock);
+    }
+    ok = !batch.failed;
+    g_mutex_unlock(&batch.lock);
+    g_mutex_clear(&batch.lock);
+    g_cond_clear(&batch.cond);
+
+end:
+    for (i = 0; i < n_slices; i++) {
+        g_free(slices[i].jpeg);
+    }
+    g_array_free(layout.starts, TRUE);
+    g_array_free(layout.ends, TRUE);
+
+    return ok;
+}
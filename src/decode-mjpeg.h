@@ -0,0 +1,55 @@
+/*
+   Copyright (C) 2026 The spice-gtk contributors
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <glib.h>
+#include <stdio.h>
+#include <jpeglib.h>
+
+G_BEGIN_DECLS
+
+/* the most slices a frame is split in */
+#define MJPEG_MAX_SLICES 8
+
+/* Selects the output format of the stream frames, 32 bits native
+ * endian xRGB, and the decoding speed options. To be called after
+ * jpeg_read_header(). */
+void mjpeg_decompress_setup(struct jpeg_decompress_struct *cinfo);
+
+/* Decodes the image whose header was read into @dest, with lines of
+ * @stride bytes. */
+gboolean mjpeg_decompress_read(struct jpeg_decompress_struct *cinfo,
+                               guint8 *dest, gsize stride);
+
+/* Number of slices the frames should be split in, from the number of
+ * processors or SPICE_MJPEG_SLICES, 1 when disabled. */
+guint mjpeg_slices_get_default(void);
+
+/* Splits a baseline JPEG frame at its restart markers in up to
+ * @max_slices bands of MCU rows and decodes them in parallel into
+ * @dest, like mjpeg_decompress_read() with a stride of @width * 4.
+ *
+ * Returns FALSE when the frame can't be split: no restart interval,
+ * interval not aligned on the MCU rows, progressive or multi-scan
+ * frame... or when a slice fails to decode. The frame should be decoded
+ * serially then.
+ */
+gboolean mjpeg_decode_slices(const guint8 *data, gsize size,
+                             guint8 *dest, guint width, guint height,
+                             guint max_slices);
+
+G_END_DECLS
@@ -24,9 +24,23 @@ G_BEGIN_DECLS
 
 typedef struct SpiceGlzDecoderWindow SpiceGlzDecoderWindow;
 
+typedef struct SpiceGlzDecoderWindowStats {
+    uint32_t window_size;   /* bytes, as announced to the server */
+    uint32_t capacity;      /* image slots in the ring */
+    uint32_t images;        /* images in the window */
+    uint64_t bytes;         /* pixels held by the images in the window */
+    uint64_t max_bytes;
+    uint64_t stalls;        /* decodes that waited for another display */
+    int64_t stall_us;
+    int64_t max_stall_us;
+} SpiceGlzDecoderWindowStats;
+
 SpiceGlzDecoderWindow *glz_decoder_window_new(void);
 void glz_decoder_window_clear(SpiceGlzDecoderWindow *w);
 void glz_decoder_window_destroy(SpiceGlzDecoderWindow *w);
+void glz_decoder_window_set_size(SpiceGlzDecoderWindow *w, uint32_t window_size);
+void glz_decoder_window_get_stats(SpiceGlzDecoderWindow *w,
+                                  SpiceGlzDecoderWindowStats *stats);
 
 SpiceGlzDecoder *glz_decoder_new(SpiceGlzDecoderWindow *w);
 void glz_decoder_destroy(SpiceGlzDecoder *d);
@@ -19,6 +19,8 @@
 */
 #include "config.h"
 
+#include <gobject/gvaluecollector.h>
+
 #include "gio-coroutine.h"
 #include "spice-util-priv.h"
 
@@ -29,6 +31,68 @@ typedef struct _GConditionWaitSource
     gpointer data;
 } GConditionWaitSource;
 
+/* The contexts with pending condition waits, with their count. The
+ * conditions are checked on each iteration of their context; when
+ * channel I/O threads are running, they may depend on state changed
+ * from another thread, which must then wake their context up, see
+ * g_coroutine_condition_changed() */
+static GMutex condition_lock;
+static GHashTable *condition_contexts;
+static gint condition_waits;
+
+static void condition_context_add(GMainContext *context)
+{
+    guint n;
+
+    g_mutex_lock(&condition_lock);
+    if (condition_contexts == NULL)
+        condition_contexts = g_hash_table_new(NULL, NULL);
+    n = GPOINTER_TO_UINT(g_hash_table_lookup(condition_contexts, context));
+    g_hash_table_insert(condition_contexts, context, GUINT_TO_POINTER(n + 1));
+    g_atomic_int_inc(&condition_waits);
+    g_mutex_unlock(&condition_lock);
+}
+
+static void condition_context_remove(GMainContext *context)
+{
+    guint n;
+
+    g_mutex_lock(&condition_lock);
+    n = GPOINTER_TO_UINT(g_hash_table_lookup(condition_contexts, context));
+    if (n > 1)
+        g_hash_table_insert(condition_contexts, context, GUINT_TO_POINTER(n - 1));
+    else
+        g_hash_table_remove(condition_contexts, context);
+    g_atomic_int_add(&condition_waits, -1);
+    g_mutex_unlock(&condition_lock);
+}
+
+/*
+ * g_coroutine_condition_changed:
+ *
+ * Tells that some state a condition of g_coroutine_condition_wait() may
+ * depend on changed. The contexts of the other threads with pending
+ * conditions are woken up to check them again; the conditions of the
+ * calling thread are checked on its next main loop iteration anyway.
+ */
+void g_coroutine_condition_changed(void)
+{
+    GHashTableIter iter;
+    gpointer context;
+
+    if (g_atomic_int_get(&condition_waits) == 0)
+        return;
+
+    g_mutex_lock(&condition_lock);
+    g_hash_table_iter_init(&iter, condition_contexts);
+    while (g_hash_table_iter_next(&iter, &context, NULL))
+    {
+        if (!g_main_context_is_owner(context))
+            g_main_context_wakeup(context);
+    }
+    g_mutex_unlock(&condition_lock);
+}
+
 GCoroutine *g_coroutine_self(void)
 {
     return (GCoroutine *)coroutine_self();
@@ -57,7 +121,7 @@ GIOCondition g_coroutine_socket_wait(GCoroutine *self,
 
     src = g_socket_create_source(sock, cond | G_IO_HUP | G_IO_ERR | G_IO_NVAL, NULL);
     g_source_set_callback(src, (GSourceFunc)g_io_wait_helper, self, NULL);
-    self->wait_id = g_source_attach(src, spice_util_main_context());
+    self->wait_id = g_source_attach(src, spice_main_context());
     ret = coroutine_yield(NULL);
     g_source_unref(src);
 
@@ -150,6 +214,7 @@ gboolean g_coroutine_condition_wait(GCoroutine *self, GConditionWaitFunc func, g
 {
     GSource *src;
     GConditionWaitSource *vsrc;
+    GMainContext *context;
 
     g_return_val_if_fail(self != NULL, FALSE);
     g_return_val_if_fail(self->condition_id == 0, FALSE);
@@ -169,10 +234,13 @@ gboolean g_coroutine_condition_wait(GCoroutine *self, GConditionWaitFunc func, g
     vsrc->func = func;
     vsrc->data = data;
 
-    self->condition_id = g_source_attach(src, spice_util_main_context());
+    context = spice_main_context();
+    condition_context_add(context);
+    self->condition_id = g_source_attach(src, context);
     g_source_set_callback(src, g_condition_wait_helper, self, NULL);
     coroutine_yield(NULL);
     g_source_unref(src);
+    condition_context_remove(context);
 
     /* it got woked up / cancelled? */
     if (self->condition_id == 0)
@@ -182,6 +250,70 @@ gboolean g_coroutine_condition_wait(GCoroutine *self, GConditionWaitFunc func, g
     return TRUE;
 }
 
+static GSourceFuncs eventFuncs = {
+    .dispatch = g_condition_wait_dispatch,
+};
+
+/*
+ * g_coroutine_event_new:
+ *
+ * Creates an event for g_coroutine_event_wait(). Unlike the conditions
+ * of g_coroutine_condition_wait(), nothing is evaluated from the main
+ * loop: the waiting coroutine stays asleep until g_coroutine_event_set()
+ * is called, possibly from another thread.
+ *
+ * An event is used for a single wait.
+ *
+ * Returns: (transfer full): the event
+ */
+GSource *g_coroutine_event_new(void)
+{
+    return g_source_new(&eventFuncs, sizeof(GSource));
+}
+
+/*
+ * g_coroutine_event_wait:
+ * @coroutine: the coroutine to wait on
+ * @event: an event from g_coroutine_event_new()
+ *
+ * Waits on caller coroutine until @event is set. Like a condition, the
+ * wait can be cancelled with g_coroutine_condition_cancel().
+ *
+ * Returns: %TRUE if @event was set, %FALSE if cancelled
+ */
+gboolean g_coroutine_event_wait(GCoroutine *self, GSource *event)
+{
+    g_return_val_if_fail(self != NULL, FALSE);
+    g_return_val_if_fail(self->condition_id == 0, FALSE);
+    g_return_val_if_fail(event != NULL, FALSE);
+
+    g_source_set_callback(event, g_condition_wait_helper, self, NULL);
+    self->condition_id = g_source_attach(event, spice_main_context());
+    coroutine_yield(NULL);
+
+    /* it got cancelled? */
+    if (self->condition_id == 0)
+        return FALSE;
+
+    self->condition_id = 0;
+    return TRUE;
+}
+
+/*
+ * g_coroutine_event_set:
+ * @event: an event from g_coroutine_event_new()
+ *
+ * Wakes up the coroutine waiting on @event. This is a no-op if the wait
+ * was cancelled. Can be called from any thread, before or during the
+ * wait.
+ */
+void g_coroutine_event_set(GSource *event)
+{
+    g_return_if_fail(event != NULL);
+
+    g_source_set_ready_time(event, 0);
+}
+
 struct signal_data
 {
     gpointer instance;
@@ -191,17 +323,173 @@ struct signal_data
     const gchar *propname;
     gboolean notified;
     va_list var_args;
+    /* only used when emitting from a channel I/O thread */
+    GMutex lock;
+    GCond cond;
+};
+
+/* main context */
+static void signal_done(struct signal_data *signal)
+{
+    if (signal->caller == NULL)
+    {
+        g_mutex_lock(&signal->lock);
+        signal->notified = TRUE;
+        g_cond_signal(&signal->cond);
+        g_mutex_unlock(&signal->lock);
+        return;
+    }
+
+    signal->notified = TRUE;
+    coroutine_yieldto(signal->caller, NULL);
+}
+
+/* coroutine or I/O thread context
+ *
+ * Runs @func from the SPICE main context and returns once it completed.
+ * From a coroutine of the main thread, this switches back to the system
+ * coroutine to let the idle function run; from a channel I/O thread it
+ * blocks the thread until the main loop dispatched it. The I/O threads
+ * only do this for the signals they can't emit asynchronously, see
+ * signal_emission_new().
+ */
+static void run_in_main_context(GSourceFunc func, struct signal_data *data)
+{
+    GSource *src;
+
+    if (!spice_util_in_io_thread())
+    {
+        data->caller = coroutine_self();
+        g_spice_idle_add(func, data);
+        coroutine_yield(NULL);
+        return;
+    }
+
+    data->caller = NULL;
+    g_mutex_init(&data->lock);
+    g_cond_init(&data->cond);
+
+    src = g_idle_source_new();
+    g_source_set_priority(src, G_PRIORITY_DEFAULT);
+    g_source_set_callback(src, func, data, NULL);
+    g_source_attach(src, spice_util_main_context());
+    g_source_unref(src);
+
+    g_mutex_lock(&data->lock);
+    while (!data->notified)
+        g_cond_wait(&data->cond, &data->lock);
+    g_mutex_unlock(&data->lock);
+
+    g_cond_clear(&data->cond);
+    g_mutex_clear(&data->lock);
+}
+
+/* a signal emitted from an I/O thread, without waiting for the main
+ * context to run the handlers */
+struct signal_emission
+{
+    guint signal_id;
+    GQuark detail;
+    guint n_values;
+    GValue *values;     /* the instance, then the parameters */
 };
 
+/* I/O thread context
+ *
+ * Copies the parameters of an emission of @signal_id, or returns NULL if
+ * it must be emitted synchronously: its return value is used, or it has
+ * pointer parameters, which may only be valid during the emission. */
+static struct signal_emission *signal_emission_new(gpointer instance, guint signal_id,
+                                                   GQuark detail, va_list var_args)
+{
+    struct signal_emission *emission;
+    GSignalQuery query;
+    guint i;
+
+    g_signal_query(signal_id, &query);
+    if (query.signal_id == 0 || query.return_type != G_TYPE_NONE)
+        return NULL;
+    for (i = 0; i < query.n_params; i++)
+    {
+        GType type = query.param_types[i] & ~G_SIGNAL_TYPE_STATIC_SCOPE;
+
+        if (G_TYPE_FUNDAMENTAL(type) == G_TYPE_POINTER)
+            return NULL;
+    }
+
+    emission = g_new0(struct signal_emission, 1);
+    emission->signal_id = signal_id;
+    emission->detail = detail;
+    emission->n_values = query.n_params + 1;
+    emission->values = g_new0(GValue, emission->n_values);
+
+    /* holds a reference on the instance until the emission */
+    g_value_init(&emission->values[0], G_TYPE_FROM_INSTANCE(instance));
+    g_value_set_object(&emission->values[0], instance);
+
+    for (i = 0; i < query.n_params; i++)
+    {
+        GType type = query.param_types[i] & ~G_SIGNAL_TYPE_STATIC_SCOPE;
+        gchar *error = NULL;
+
+        /* the strings and boxed values are copied */
+        G_VALUE_COLLECT_INIT(&emission->values[i + 1], type, var_args, 0, &error);
+        if (error != NULL)
+        {
+            g_warning("%s: %s", G_STRFUNC, error);
+            g_free(error);
+            /* the value isn't initialized, and the others can't be collected */
+            emission->n_values = i + 1;
+            emission->signal_id = 0;
+            break;
+        }
+    }
+
+    return emission;
+}
+
+/* main context */
+static gboolean signal_emission_run(gpointer data)
+{
+    struct signal_emission *emission = data;
+
+    if (emission->signal_id != 0)
+        g_signal_emitv(emission->values, emission->signal_id, emission->detail, NULL);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* main context */
+static void signal_emission_free(gpointer data)
+{
+    struct signal_emission *emission = data;
+    guint i;
+
+    for (i = 0; i < emission->n_values; i++)
+        g_value_unset(&emission->values[i]);
+    g_free(emission->values);
+    g_free(emission);
+}
+
+/* I/O thread context, the emissions keep their order with the other
+ * sources of the main context of the same priority */
+static void signal_emission_post(struct signal_emission *emission)
+{
+    GSource *src = g_idle_source_new();
+
+    g_source_set_priority(src, G_PRIORITY_DEFAULT);
+    g_source_set_callback(src, signal_emission_run, emission, signal_emission_free);
+    g_source_attach(src, spice_util_main_context());
+    g_source_unref(src);
+}
+
 static gboolean emit_main_context(gpointer opaque)
 {
     struct signal_data *signal = opaque;
 
     g_signal_emit_valist(signal->instance, signal->signal_id,
                          signal->detail, signal->var_args);
-    signal->notified = TRUE;
-
-    coroutine_yieldto(signal->caller, NULL);
+    signal_done(signal);
 
     return FALSE;
 }
@@ -213,22 +501,28 @@ void g_coroutine_signal_emit(gpointer instance, guint signal_id,
         .instance = instance,
         .signal_id = signal_id,
         .detail = detail,
-        .caller = coroutine_self(),
     };
+    struct signal_emission *emission;
 
     va_start(data.var_args, detail);
 
-    if (coroutine_self_is_main())
+    if (coroutine_self_is_main() && !spice_util_in_io_thread())
     {
         g_signal_emit_valist(instance, signal_id, detail, data.var_args);
     }
+    else if (spice_util_in_io_thread() &&
+             (emission = signal_emission_new(instance, signal_id, detail, data.var_args)) != NULL)
+    {
+        /* an I/O thread doesn't wait for the main thread, which may
+         * itself be waiting for it */
+        signal_emission_post(emission);
+    }
     else
     {
         g_object_ref(instance);
-        g_spice_idle_add(emit_main_context, &data);
-        coroutine_yield(NULL);
+        run_in_main_context(emit_main_context, &data);
         g_warn_if_fail(data.notified);
-        g_object_unref(instance);
+        spice_main_context_unref_object(instance);
     }
 
     va_end(data.var_args);
@@ -239,41 +533,67 @@ static gboolean notify_main_context(gpointer opaque)
     struct signal_data *signal = opaque;
 
     g_object_notify(signal->instance, signal->propname);
-    signal->notified = TRUE;
-
-    coroutine_yieldto(signal->caller, NULL);
+    signal_done(signal);
 
     return FALSE;
 }
 
+/* main context, for the notifications of the I/O threads */
+static gboolean notify_main_context_async(gpointer opaque)
+{
+    struct signal_data *signal = opaque;
+
+    g_object_notify(signal->instance, signal->propname);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void notify_data_free(gpointer opaque)
+{
+    struct signal_data *signal = opaque;
+
+    g_object_unref(signal->instance);
+    g_free(signal);
+}
+
 /* coroutine -> main context */
 void g_coroutine_object_notify(GObject *object,
                                const gchar *property_name)
 {
-    struct signal_data data;
+    struct signal_data data = { NULL, };
 
-    if (coroutine_self_is_main())
+    if (coroutine_self_is_main() && !spice_util_in_io_thread())
     {
         g_object_notify(object, property_name);
     }
+    else if (spice_util_in_io_thread())
+    {
+        /* asynchronous, see g_coroutine_signal_emit() */
+        struct signal_data *notify = g_new0(struct signal_data, 1);
+        GSource *src = g_idle_source_new();
+
+        notify->instance = g_object_ref(object);
+        notify->propname = g_intern_string(property_name);
+        g_source_set_priority(src, G_PRIORITY_DEFAULT);
+        g_source_set_callback(src, notify_main_context_async, notify, notify_data_free);
+        g_source_attach(src, spice_util_main_context());
+        g_source_unref(src);
+    }
     else
     {
 
         data.instance = g_object_ref(object);
-        data.caller = coroutine_self();
         data.propname = (gpointer)property_name;
         data.notified = FALSE;
 
-        g_spice_idle_add(notify_main_context, &data);
-
-        /* This switches to the system coroutine context, lets
-         * the idle function run to dispatch the signal, and
-         * finally returns once complete. ie this is synchronous
+        /* This switches to the system coroutine context (or waits for the
+         * main thread), lets the idle function run to dispatch the signal,
+         * and finally returns once complete. ie this is synchronous
          * from the POV of the coroutine despite there being
          * an idle function involved
          */
-        coroutine_yield(NULL);
+        run_in_main_context(notify_main_context, &data);
         g_warn_if_fail(data.notified);
-        g_object_unref(object);
+        spice_main_context_unref_object(object);
     }
 }
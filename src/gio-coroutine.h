@@ -54,6 +54,11 @@ GIOCondition g_coroutine_socket_wait    (GCoroutine *coroutine,
 gboolean     g_coroutine_condition_wait (GCoroutine *coroutine,
                                          GConditionWaitFunc func, gpointer data);
 void         g_coroutine_condition_cancel(GCoroutine *coroutine);
+void         g_coroutine_condition_changed(void);
+
+GSource*     g_coroutine_event_new      (void);
+gboolean     g_coroutine_event_wait     (GCoroutine *coroutine, GSource *event);
+void         g_coroutine_event_set      (GSource *event);
 
 void         g_coroutine_signal_emit (gpointer instance, guint signal_id,
                                       GQuark detail, ...);
@@ -0,0 +1,138 @@
+/*
+   Copyright (C) 2026 The spice-gtk contributors
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <string.h>
+#include <spice/vd_agent.h>
+
+#include "spice-agent-msg.h"
+#include "spice-channel-priv.h"
+
+/*
+ * The agent messages are split in SPICE_MSGC_MAIN_AGENT_DATA messages of
+ * at most VD_AGENT_MAX_DATA_SIZE bytes, the first one starting with the
+ * VDAgentMessage header. Both functions queue the same messages, but
+ * spice_agent_msg_queue_bytes() doesn't copy the data: the marshallers
+ * refer to it, and hold a reference on the GBytes until they are sent.
+ */
+
+G_STATIC_ASSERT(VD_AGENT_MAX_DATA_SIZE > sizeof(VDAgentMessage));
+
+/* expected arguments, pairs of data/data_size terminated with NULL */
+G_GNUC_INTERNAL
+void spice_agent_msg_queue_valist(SpiceChannel *channel, GQueue *queue, guint32 type,
+                                  const void *data, va_list args)
+{
+    SpiceMsgOut *out;
+    VDAgentMessage msg;
+    guint8 *payload;
+    gsize paysize, s, mins, size = 0;
+    const guint8 *d;
+    va_list sizes;
+
+    va_copy(sizes, args);
+    for (d = data; d != NULL; d = va_arg(sizes, void *))
+        size += va_arg(sizes, gsize);
+    va_end(sizes);
+
+    msg.protocol = VD_AGENT_PROTOCOL;
+    msg.type = type;
+    msg.opaque = 0;
+    msg.size = size;
+
+    paysize = MIN(VD_AGENT_MAX_DATA_SIZE, size + sizeof(VDAgentMessage));
+    out = spice_msg_out_new(channel, SPICE_MSGC_MAIN_AGENT_DATA);
+    payload = spice_marshaller_reserve_space(out->marshaller, paysize);
+    memcpy(payload, &msg, sizeof(VDAgentMessage));
+    payload += sizeof(VDAgentMessage);
+    paysize -= sizeof(VDAgentMessage);
+    if (paysize == 0) {
+        g_queue_push_tail(queue, out);
+        out = NULL;
+    }
+
+    for (d = data; size > 0; d = va_arg(args, void *)) {
+        s = va_arg(args, gsize);
+        while (s > 0) {
+            if (out == NULL) {
+                paysize = MIN(VD_AGENT_MAX_DATA_SIZE, size);
+                out = spice_msg_out_new(channel, SPICE_MSGC_MAIN_AGENT_DATA);
+                payload = spice_marshaller_reserve_space(out->marshaller, paysize);
+            }
+            mins = MIN(paysize, s);
+            memcpy(payload, d, mins);
+            d += mins;
+            payload += mins;
+            s -= mins;
+            size -= mins;
+            paysize -= mins;
+            if (paysize == 0) {
+                g_queue_push_tail(queue, out);
+                out = NULL;
+            }
+        }
+    }
+    g_warn_if_fail(out == NULL);
+}
+
+static void agent_msg_bytes_unref(uint8_t *data G_GNUC_UNUSED, void *opaque)
+{
+    g_bytes_unref(opaque);
+}
+
+/* @header, if any, is copied in the first message, before @bytes */
+G_GNUC_INTERNAL
+void spice_agent_msg_queue_bytes(SpiceChannel *channel, GQueue *queue, guint32 type,
+                                 const void *header, gsize header_size, GBytes *bytes)
+{
+    SpiceMsgOut *out;
+    VDAgentMessage msg;
+    guint8 *payload;
+    const guint8 *data;
+    gsize size, offset = 0, paysize;
+
+    g_return_if_fail(header_size <= VD_AGENT_MAX_DATA_SIZE - sizeof(VDAgentMessage));
+
+    data = g_bytes_get_data(bytes, &size);
+
+    msg.protocol = VD_AGENT_PROTOCOL;
+    msg.type = type;
+    msg.opaque = 0;
+    msg.size = header_size + size;
+
+    out = spice_msg_out_new(channel, SPICE_MSGC_MAIN_AGENT_DATA);
+    payload = spice_marshaller_reserve_space(out->marshaller, sizeof(VDAgentMessage) + header_size);
+    memcpy(payload, &msg, sizeof(VDAgentMessage));
+    if (header_size > 0)
+        memcpy(payload + sizeof(VDAgentMessage), header, header_size);
+    paysize = VD_AGENT_MAX_DATA_SIZE - sizeof(VDAgentMessage) - header_size;
+
+    for (;;) {
+        gsize n = MIN(paysize, size - offset);
+
+        if (n > 0)
+            spice_marshaller_add_by_ref_full(out->marshaller, (uint8_t *)data + offset, n,
+                                             agent_msg_bytes_unref, g_bytes_ref(bytes));
+        offset += n;
+        g_queue_push_tail(queue, out);
+        if (offset == size)
+            break;
+
+        out = spice_msg_out_new(channel, SPICE_MSGC_MAIN_AGENT_DATA);
+        paysize = VD_AGENT_MAX_DATA_SIZE;
+    }
+}
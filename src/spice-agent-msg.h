@@ -0,0 +1,31 @@
+/*
+   Copyright (C) 2026 The spice-gtk contributors
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <stdarg.h>
+#include <glib.h>
+
+#include "spice-channel.h"
+
+G_BEGIN_DECLS
+
+void spice_agent_msg_queue_valist(SpiceChannel *channel, GQueue *queue, guint32 type,
+                                  const void *data, va_list args);
+void spice_agent_msg_queue_bytes(SpiceChannel *channel, GQueue *queue, guint32 type,
+                                 const void *header, gsize header_size, GBytes *bytes);
+
+G_END_DECLS
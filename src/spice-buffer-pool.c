@@ -0,0 +1,210 @@
+/*
+   Copyright (C) 2026 The spice-gtk contributors
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include "spice-buffer-pool.h"
+
+/*
+ * A size-classed buffer pool.
+ *
+ * Buffers are grouped in power-of-two size classes, starting at
+ * 1 << MIN_CLASS_SHIFT bytes. Freed buffers are kept on a per-class
+ * free list and handed out again without being cleared. Requests bigger
+ * than the pool maximum size are allocated and released directly.
+ *
+ * The pool is refcounted and locked so buffers can be given back from
+ * any thread, and after the owner of the pool is gone.
+ */
+
+#define MIN_CLASS_SHIFT 6
+#define MAX_CLASSES     28
+#define LARGE_CLASS     G_MAXUINT32
+
+/* header in front of each buffer, keeps the data 16 bytes aligned */
+typedef union BufferHeader {
+    struct {
+        guint32 klass;
+        union BufferHeader *next;
+    };
+    guint8 pad[16];
+} BufferHeader;
+
+G_STATIC_ASSERT(sizeof(BufferHeader) == 16);
+
+struct SpiceBufferPool {
+    gint refcount;
+    GMutex lock;
+    guint nclasses;
+    gsize max_cached_bytes;
+    BufferHeader *free_list[MAX_CLASSES];
+    SpiceBufferPoolStats stats;
+};
+
+static inline gsize class_size(guint klass)
+{
+    return (gsize)1 << (klass + MIN_CLASS_SHIFT);
+}
+
+static guint size_to_class(gsize size)
+{
+    guint klass = 0;
+
+    while (class_size(klass) < size)
+        klass++;
+
+    return klass;
+}
+
+G_GNUC_INTERNAL
+SpiceBufferPool *spice_buffer_pool_new(gsize max_size, gsize max_cached_bytes)
+{
+    SpiceBufferPool *pool = g_new0(SpiceBufferPool, 1);
+
+    pool->refcount = 1;
+    g_mutex_init(&pool->lock);
+    pool->nclasses = MIN(size_to_class(max_size) + 1, MAX_CLASSES);
+    pool->max_cached_bytes = max_cached_bytes;
+
+    return pool;
+}
+
+G_GNUC_INTERNAL
+SpiceBufferPool *spice_buffer_pool_ref(SpiceBufferPool *pool)
+{
+    g_return_val_if_fail(pool != NULL, NULL);
+
+    g_atomic_int_inc(&pool->refcount);
+    return pool;
+}
+
+G_GNUC_INTERNAL
+void spice_buffer_pool_unref(SpiceBufferPool *pool)
+{
+    g_return_if_fail(pool != NULL);
+
+    if (!g_atomic_int_dec_and_test(&pool->refcount))
+        return;
+
+    spice_buffer_pool_trim(pool);
+    g_mutex_clear(&pool->lock);
+    g_free(pool);
+}
+
+/*
+ * Returns a buffer of at least @size bytes. The content of the buffer
+ * is undefined, it may contain data from a previous user.
+ */
+G_GNUC_INTERNAL
+gpointer spice_buffer_pool_alloc(SpiceBufferPool *pool, gsize size)
+{
+    BufferHeader *header;
+    guint klass;
+
+    g_return_val_if_fail(pool != NULL, NULL);
+
+    if (size > class_size(pool->nclasses - 1)) {
+        header = g_malloc(sizeof(BufferHeader) + size);
+        header->klass = LARGE_CLASS;
+        g_mutex_lock(&pool->lock);
+        pool->stats.allocations++;
+        pool->stats.large++;
+        g_mutex_unlock(&pool->lock);
+        return header + 1;
+    }
+
+    klass = size_to_class(size);
+    g_mutex_lock(&pool->lock);
+    pool->stats.allocations++;
+    header = pool->free_list[klass];
+    if (header) {
+        pool->free_list[klass] = header->next;
+        pool->stats.hits++;
+        pool->stats.recycled_bytes += class_size(klass);
+        pool->stats.cached_bytes -= class_size(klass);
+    } else {
+        pool->stats.misses++;
+    }
+    g_mutex_unlock(&pool->lock);
+
+    if (header == NULL) {
+        header = g_malloc(sizeof(BufferHeader) + class_size(klass));
+        header->klass = klass;
+    }
+
+    return header + 1;
+}
+
+G_GNUC_INTERNAL
+void spice_buffer_pool_free(SpiceBufferPool *pool, gpointer data)
+{
+    BufferHeader *header;
+
+    g_return_if_fail(pool != NULL);
+
+    if (data == NULL)
+        return;
+
+    header = (BufferHeader *)data - 1;
+    if (header->klass == LARGE_CLASS) {
+        g_free(header);
+        return;
+    }
+
+    g_return_if_fail(header->klass < pool->nclasses);
+
+    g_mutex_lock(&pool->lock);
+    if (pool->stats.cached_bytes + class_size(header->klass) <= pool->max_cached_bytes) {
+        header->next = pool->free_list[header->klass];
+        pool->free_list[header->klass] = header;
+        pool->stats.cached_bytes += class_size(header->klass);
+        header = NULL;
+    }
+    g_mutex_unlock(&pool->lock);
+
+    g_free(header);
+}
+
+/* Release all the buffers held in the free lists */
+G_GNUC_INTERNAL
+void spice_buffer_pool_trim(SpiceBufferPool *pool)
+{
+    guint i;
+
+    g_return_if_fail(pool != NULL);
+
+    g_mutex_lock(&pool->lock);
+    for (i = 0; i < pool->nclasses; i++) {
+        while (pool->free_list[i]) {
+            BufferHeader *header = pool->free_list[i];
+            pool->free_list[i] = header->next;
+            g_free(header);
+        }
+    }
+    pool->stats.cached_bytes = 0;
+    g_mutex_unlock(&pool->lock);
+}
+
+G_GNUC_INTERNAL
+void spice_buffer_pool_get_stats(SpiceBufferPool *pool, SpiceBufferPoolStats *stats)
+{
+    g_return_if_fail(pool != NULL);
+    g_return_if_fail(stats != NULL);
+
+    g_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    g_mutex_unlock(&pool->lock);
+}
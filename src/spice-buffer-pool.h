@@ -0,0 +1,43 @@
+/*
+   Copyright (C) 2026 The spice-gtk contributors
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct SpiceBufferPool SpiceBufferPool;
+
+typedef struct SpiceBufferPoolStats {
+    guint64 allocations;    /* total number of buffers handed out */
+    guint64 hits;           /* buffers recycled from a free list */
+    guint64 misses;         /* pooled size, but had to allocate */
+    guint64 large;          /* too big for the pool, allocated directly */
+    guint64 recycled_bytes; /* bytes handed out from the free lists */
+    guint64 cached_bytes;   /* bytes currently held in the free lists */
+} SpiceBufferPoolStats;
+
+SpiceBufferPool *spice_buffer_pool_new(gsize max_size, gsize max_cached_bytes);
+SpiceBufferPool *spice_buffer_pool_ref(SpiceBufferPool *pool);
+void spice_buffer_pool_unref(SpiceBufferPool *pool);
+
+gpointer spice_buffer_pool_alloc(SpiceBufferPool *pool, gsize size);
+void spice_buffer_pool_free(SpiceBufferPool *pool, gpointer data);
+void spice_buffer_pool_trim(SpiceBufferPool *pool);
+void spice_buffer_pool_get_stats(SpiceBufferPool *pool, SpiceBufferPoolStats *stats);
+
+G_END_DECLS
@@ -0,0 +1,131 @@
+/*
+   Copyright (C) 2026 The spice-gtk contributors
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include "spice-capture.h"
+
+#define CAPTURE_BUFFER_SIZE (1024 * 1024)
+
+struct SpiceCapture {
+    FILE *file;
+    gchar *filename;
+    gint64 start;           /* monotonic time of the header */
+    gboolean failed;
+};
+
+static gboolean capture_write(SpiceCapture *capture, gconstpointer data, gsize size)
+{
+    if (capture->failed)
+        return FALSE;
+
+    if (fwrite(data, 1, size, capture->file) != size) {
+        g_warning("failed to write capture %s: %s, stopping capture",
+                  capture->filename, g_strerror(errno));
+        capture->failed = TRUE;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Opens the capture @filename, started at the monotonic time @start. With
+ * @append, the capture was already started by a previous connection of
+ * the channel: its records are kept, a SPICE_CAPTURE_CONNECT record
+ * separates the new ones.
+ */
+G_GNUC_INTERNAL
+SpiceCapture *spice_capture_new(const gchar *filename, gint channel_type, gint channel_id,
+                                gint64 start, gboolean append, GError **error)
+{
+    SpiceCapture *capture;
+    FILE *file;
+
+    g_return_val_if_fail(filename != NULL, NULL);
+
+    file = g_fopen(filename, append ? "ab" : "wb");
+    if (file == NULL) {
+        int errsv = errno;
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errsv),
+                    "failed to open capture %s: %s", filename, g_strerror(errsv));
+        return NULL;
+    }
+    setvbuf(file, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+    capture = g_new0(SpiceCapture, 1);
+    capture->file = file;
+    capture->filename = g_strdup(filename);
+    capture->start = start;
+
+    if (append) {
+        SpiceCaptureRecord record = { 0, };
+
+        record.timestamp = GUINT64_TO_LE(g_get_monotonic_time() - capture->start);
+        record.direction = SPICE_CAPTURE_CONNECT;
+        capture_write(capture, &record, sizeof(record));
+    } else {
+        SpiceCaptureHeader header = { { 0, }, };
+
+        memcpy(header.magic, SPICE_CAPTURE_MAGIC, sizeof(header.magic));
+        header.version = GUINT32_TO_LE(SPICE_CAPTURE_VERSION);
+        header.channel_type = channel_type;
+        header.channel_id = channel_id;
+        header.start_time = GUINT64_TO_LE(g_get_real_time() -
+                                          (g_get_monotonic_time() - start));
+        capture_write(capture, &header, sizeof(header));
+    }
+
+    return capture;
+}
+
+G_GNUC_INTERNAL
+void spice_capture_record(SpiceCapture *capture, SpiceCaptureDirection direction,
+                          gconstpointer data, gsize size)
+{
+    SpiceCaptureRecord record = { 0, };
+
+    g_return_if_fail(capture != NULL);
+    g_return_if_fail(size <= G_MAXUINT32);
+
+    if (size == 0)
+        return;
+
+    record.timestamp = GUINT64_TO_LE(g_get_monotonic_time() - capture->start);
+    record.size = GUINT32_TO_LE(size);
+    record.direction = direction;
+
+    if (capture_write(capture, &record, sizeof(record)))
+        capture_write(capture, data, size);
+}
+
+G_GNUC_INTERNAL
+void spice_capture_free(SpiceCapture *capture)
+{
+    if (capture == NULL)
+        return;
+
+    if (fclose(capture->file) != 0 && !capture->failed)
+        g_warning("failed to write capture %s: %s", capture->filename, g_strerror(errno));
+
+    g_free(capture->filename);
+    g_free(capture);
+}
@@ -0,0 +1,76 @@
+/*
+   Copyright (C) 2026 The spice-gtk contributors
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Channel traffic captures.
+ *
+ * When SPICE_CAPTURE_DIR is set, each channel records the plain (after
+ * TLS/SASL) bytes it reads and writes to
+ * $SPICE_CAPTURE_DIR/<channel type>-<channel id>.spicecap, so that a
+ * session can be replayed offline (see tools/spicy-replay.c).
+ *
+ * A capture is a SpiceCaptureHeader followed by SpiceCaptureRecords, each
+ * followed by 'size' bytes of data. All the fields are little-endian.
+ *
+ * The reconnections of the channel in the same session are appended to
+ * its capture, each one starting with an empty SPICE_CAPTURE_CONNECT
+ * record.
+ */
+
+#define SPICE_CAPTURE_MAGIC "SPICECAP"
+#define SPICE_CAPTURE_VERSION 1
+#define SPICE_CAPTURE_FILENAME_FORMAT "%s-%d.spicecap"
+
+typedef enum {
+    SPICE_CAPTURE_IN,   /* read from the server */
+    SPICE_CAPTURE_OUT,  /* written to the server */
+    SPICE_CAPTURE_CONNECT, /* a new connection of the channel */
+} SpiceCaptureDirection;
+
+typedef struct SpiceCaptureHeader {
+    char magic[8];
+    guint32 version;
+    guint8 channel_type;
+    guint8 channel_id;
+    guint16 reserved;
+    guint64 start_time;     /* wall-clock time, in us since the epoch */
+} SpiceCaptureHeader;
+
+typedef struct SpiceCaptureRecord {
+    guint64 timestamp;      /* in us since start_time */
+    guint32 size;
+    guint8 direction;       /* SpiceCaptureDirection */
+    guint8 reserved[3];
+} SpiceCaptureRecord;
+
+G_STATIC_ASSERT(sizeof(SpiceCaptureHeader) == 24);
+G_STATIC_ASSERT(sizeof(SpiceCaptureRecord) == 16);
+
+typedef struct SpiceCapture SpiceCapture;
+
+SpiceCapture *spice_capture_new(const gchar *filename, gint channel_type, gint channel_id,
+                                gint64 start, gboolean append, GError **error);
+void spice_capture_record(SpiceCapture *capture, SpiceCaptureDirection direction,
+                          gconstpointer data, gsize size);
+void spice_capture_free(SpiceCapture *capture);
+
+G_END_DECLS
@@ -0,0 +1,407 @@
+/*
+   Copyright (C) 2026 The spice-gtk contributors
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include "spice-channel-cache.h"
+
+#define CACHE_MIN_CAPACITY 64
+
+/* once over budget, evict down to 7/8 of it so that the next adds
+ * don't each trigger an eviction */
+#define CACHE_BUDGET_LOW_WATERMARK(budget) ((budget) - (budget) / 8)
+
+/* the ids are server generated, often sequential: mix the bits so that
+ * they spread over the table (murmur3 finalizer) */
+static inline guint cache_hash(guint64 id)
+{
+    id ^= id >> 33;
+    id *= G_GUINT64_CONSTANT(0xff51afd7ed558ccd);
+    id ^= id >> 33;
+    id *= G_GUINT64_CONSTANT(0xc4ceb9fe1a85ec53);
+    id ^= id >> 33;
+
+    return (guint)id;
+}
+
+/* returns the used or evicted item of @id, or NULL */
+static display_cache_item *cache_lookup(display_cache *cache, guint64 id)
+{
+    guint mask = cache->capacity - 1;
+    guint i = cache_hash(id) & mask;
+
+    for (;; i = (i + 1) & mask) {
+        display_cache_item *item = &cache->items[i];
+
+        if (item->slot == CACHE_SLOT_EMPTY)
+            return NULL;
+        if (item->slot != CACHE_SLOT_DELETED && item->id == id)
+            return item;
+    }
+}
+
+static void cache_resize(display_cache *cache, guint capacity)
+{
+    display_cache_item *items = cache->items;
+    guint old_capacity = cache->capacity, i;
+
+    cache->items = g_new0(display_cache_item, capacity);
+    cache->capacity = capacity;
+    cache->tombstones = 0;
+
+    for (i = 0; i < old_capacity; i++) {
+        display_cache_item *item = &items[i];
+        guint j;
+
+        /* the deleted slots are dropped, the evicted ids kept */
+        if (item->slot != CACHE_SLOT_USED && item->slot != CACHE_SLOT_EVICTED)
+            continue;
+
+        j = cache_hash(item->id) & (capacity - 1);
+        while (cache->items[j].slot != CACHE_SLOT_EMPTY)
+            j = (j + 1) & (capacity - 1);
+        cache->items[j] = *item;
+        if (item->slot == CACHE_SLOT_EVICTED)
+            cache->tombstones++;
+    }
+
+    g_free(items);
+}
+
+/* returns the item of @id if used or evicted, or a free slot for it */
+static display_cache_item *cache_insert_slot(display_cache *cache, guint64 id)
+{
+    display_cache_item *item, *free_slot = NULL;
+    guint mask, i;
+
+    /* keep the load, including tombstones, under 3/4 */
+    if ((cache->stats.entries + cache->tombstones + 1) * 4 > cache->capacity * 3) {
+        guint capacity = CACHE_MIN_CAPACITY;
+
+        /* count the evicted ids, which are kept */
+        guint needed = cache->stats.entries + 1;
+        for (i = 0; i < cache->capacity; i++)
+            if (cache->items[i].slot == CACHE_SLOT_EVICTED)
+                needed++;
+        while (capacity < needed * 2)
+            capacity <<= 1;
+        cache_resize(cache, capacity);
+    }
+
+    mask = cache->capacity - 1;
+    for (i = cache_hash(id) & mask;; i = (i + 1) & mask) {
+        item = &cache->items[i];
+
+        if (item->slot == CACHE_SLOT_EMPTY)
+            return free_slot ? free_slot : item;
+        if (item->slot == CACHE_SLOT_DELETED) {
+            if (free_slot == NULL)
+                free_slot = item;
+            continue;
+        }
+        if (item->id == id)
+            return item;
+    }
+}
+
+/* destroys the value of a used item, the caller updates its slot */
+static void cache_item_release(display_cache *cache, display_cache_item *item)
+{
+    gpointer value = item->value;
+
+    cache->stats.bytes -= item->size;
+    cache->stats.entries--;
+    item->value = NULL;
+    item->size = 0;
+
+    if (cache->value_destroy)
+        cache->value_destroy(value);
+}
+
+static gint compare_eviction_order(gconstpointer a, gconstpointer b)
+{
+    const display_cache_item *ia = *(display_cache_item * const *)a;
+    const display_cache_item *ib = *(display_cache_item * const *)b;
+
+    if (ia->lossy != ib->lossy)
+        return ia->lossy ? -1 : 1;
+    if (ia->last_use != ib->last_use)
+        return ia->last_use < ib->last_use ? -1 : 1;
+    return 0;
+}
+
+/* evicts values until the cache is back under its budget, sparing @keep */
+static void cache_enforce_budget(display_cache *cache, display_cache_item *keep)
+{
+    GPtrArray *candidates;
+    gsize target;
+    guint i;
+
+    if (cache->budget == 0 || cache->stats.bytes <= cache->budget)
+        return;
+
+    candidates = g_ptr_array_sized_new(cache->stats.entries);
+    for (i = 0; i < cache->capacity; i++) {
+        display_cache_item *item = &cache->items[i];
+        if (item->slot == CACHE_SLOT_USED && item != keep)
+            g_ptr_array_add(candidates, item);
+    }
+    g_ptr_array_sort(candidates, compare_eviction_order);
+
+    target = CACHE_BUDGET_LOW_WATERMARK(cache->budget);
+    for (i = 0; i < candidates->len && cache->stats.bytes > target; i++) {
+        display_cache_item *item = g_ptr_array_index(candidates, i);
+
+        cache->stats.evictions++;
+        cache->stats.evicted_bytes += item->size;
+        cache_item_release(cache, item);
+        item->slot = CACHE_SLOT_EVICTED;
+        item->ref_count = 0;
+        cache->tombstones++;
+    }
+
+    g_ptr_array_free(candidates, TRUE);
+}
+
+static void cache_waiters_free(gpointer waiters)
+{
+    g_slist_free_full(waiters, (GDestroyNotify)g_source_unref);
+}
+
+/* sets the events of the coroutines waiting for @id */
+static void cache_wake_waiters(display_cache *cache, uint64_t id)
+{
+    gpointer key;
+    GSList *list, *l;
+
+    if (cache->waiters == NULL ||
+        !g_hash_table_lookup_extended(cache->waiters, &id, &key, (gpointer*)&list))
+        return;
+
+    g_hash_table_steal(cache->waiters, &id);
+    g_free(key);
+    for (l = list; l != NULL; l = l->next) {
+        /* see g_coroutine_event_set(), the wait may have been cancelled */
+        if (g_source_is_destroyed(l->data))
+            continue;
+        g_source_set_ready_time(l->data, 0);
+        cache->wait_stats.wakeups++;
+    }
+    cache_waiters_free(list);
+}
+
+static void cache_set(display_cache *cache, uint64_t id, gpointer value,
+                      gboolean lossy, gboolean add_ref)
+{
+    display_cache_item *item = cache_insert_slot(cache, id);
+    guint32 ref_count = 1;
+
+    if (item->slot == CACHE_SLOT_USED) {
+        if (cache->ref_counted)
+            ref_count = add_ref ? item->ref_count + 1 : item->ref_count;
+        cache_item_release(cache, item);
+    } else if (item->slot != CACHE_SLOT_EMPTY) {
+        cache->tombstones--;
+    }
+
+    item->id = id;
+    item->value = value;
+    item->size = cache->value_size ? cache->value_size(value) : 0;
+    item->last_use = ++cache->clock;
+    item->ref_count = ref_count;
+    item->slot = CACHE_SLOT_USED;
+    item->lossy = lossy;
+    cache->stats.bytes += item->size;
+    cache->stats.entries++;
+
+    cache_enforce_budget(cache, item);
+    cache_wake_waiters(cache, id);
+}
+
+G_GNUC_INTERNAL
+display_cache *cache_new(GDestroyNotify value_destroy)
+{
+    display_cache *self = g_new0(display_cache, 1);
+
+    self->capacity = CACHE_MIN_CAPACITY;
+    self->items = g_new0(display_cache_item, self->capacity);
+    self->value_destroy = value_destroy;
+
+    return self;
+}
+
+G_GNUC_INTERNAL
+display_cache *cache_image_new(GDestroyNotify value_destroy,
+                               display_cache_size_func value_size)
+{
+    display_cache *self = cache_new(value_destroy);
+
+    self->ref_counted = TRUE;
+    self->value_size = value_size;
+
+    return self;
+}
+
+G_GNUC_INTERNAL
+void cache_clear(display_cache *cache)
+{
+    guint i;
+
+    for (i = 0; i < cache->capacity; i++) {
+        if (cache->items[i].slot == CACHE_SLOT_USED)
+            cache_item_release(cache, &cache->items[i]);
+    }
+
+    g_free(cache->items);
+    cache->capacity = CACHE_MIN_CAPACITY;
+    cache->items = g_new0(display_cache_item, cache->capacity);
+    cache->tombstones = 0;
+}
+
+G_GNUC_INTERNAL
+void cache_free(display_cache *cache)
+{
+    cache_clear(cache);
+    g_free(cache->items);
+    g_clear_pointer(&cache->waiters, g_hash_table_unref);
+    g_free(cache);
+}
+
+G_GNUC_INTERNAL
+void cache_set_budget(display_cache *cache, gsize budget)
+{
+    cache->budget = budget;
+    cache_enforce_budget(cache, NULL);
+}
+
+G_GNUC_INTERNAL
+gpointer cache_find_lossy(display_cache *cache, uint64_t id, gboolean *lossy)
+{
+    display_cache_item *item = cache_lookup(cache, id);
+
+    if (item == NULL || item->slot != CACHE_SLOT_USED) {
+        cache->stats.misses++;
+        return NULL;
+    }
+
+    cache->stats.hits++;
+    item->last_use = ++cache->clock;
+    *lossy = item->lossy;
+
+    return item->value;
+}
+
+G_GNUC_INTERNAL
+gpointer cache_find(display_cache *cache, uint64_t id)
+{
+    gboolean lossy;
+
+    return cache_find_lossy(cache, id, &lossy);
+}
+
+G_GNUC_INTERNAL
+gboolean cache_is_evicted(display_cache *cache, uint64_t id)
+{
+    display_cache_item *item = cache_lookup(cache, id);
+
+    return item != NULL && item->slot == CACHE_SLOT_EVICTED;
+}
+
+G_GNUC_INTERNAL
+void cache_add_lossy(display_cache *cache, uint64_t id, gpointer value, gboolean lossy)
+{
+    /* if the value is currently in the table, add to its reference count */
+    cache_set(cache, id, value, lossy, TRUE);
+}
+
+G_GNUC_INTERNAL
+void cache_replace_lossy(display_cache *cache, uint64_t id, gpointer value, gboolean lossy)
+{
+    /* if the value is currently in the table, keep its reference count */
+    cache_set(cache, id, value, lossy, FALSE);
+}
+
+G_GNUC_INTERNAL
+gboolean cache_remove(display_cache *cache, uint64_t id)
+{
+    display_cache_item *item = cache_lookup(cache, id);
+
+    if (item == NULL)
+        return FALSE;
+
+    if (item->slot == CACHE_SLOT_EVICTED) {
+        /* the server caught up, forget about it */
+        item->slot = CACHE_SLOT_DELETED;
+        return TRUE;
+    }
+
+    --item->ref_count;
+    if (!cache->ref_counted || item->ref_count == 0) {
+        cache_item_release(cache, item);
+        item->slot = CACHE_SLOT_DELETED;
+        cache->tombstones++;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Registers @event, from g_coroutine_event_new(), to be set on the next
+ * add or replace of @id. A cancelled wait must unregister its event with
+ * cache_remove_waiter(), the image may never come.
+ */
+G_GNUC_INTERNAL
+void cache_add_waiter(display_cache *cache, uint64_t id, GSource *event)
+{
+    gpointer key;
+    GSList *list = NULL;
+
+    if (cache->waiters == NULL)
+        cache->waiters = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                               g_free, cache_waiters_free);
+
+    if (g_hash_table_lookup_extended(cache->waiters, &id, &key, (gpointer*)&list))
+        g_hash_table_steal(cache->waiters, &id);
+    else
+        key = g_memdup(&id, sizeof(id));
+
+    g_hash_table_insert(cache->waiters, key, g_slist_prepend(list, g_source_ref(event)));
+}
+
+/* Unregisters @event of a cancelled wait for @id, see cache_add_waiter() */
+G_GNUC_INTERNAL
+void cache_remove_waiter(display_cache *cache, uint64_t id, GSource *event)
+{
+    gpointer key;
+    GSList *list, *l;
+
+    if (cache->waiters == NULL ||
+        !g_hash_table_lookup_extended(cache->waiters, &id, &key, (gpointer*)&list))
+        return;
+
+    l = g_slist_find(list, event);
+    if (l == NULL)
+        return;
+
+    g_source_unref(l->data);
+    list = g_slist_delete_link(list, l);
+    if (list == NULL) {
+        g_hash_table_remove(cache->waiters, &id);
+    } else {
+        g_hash_table_steal(cache->waiters, &id);
+        g_hash_table_insert(cache->waiters, key, list);
+    }
+}
@@ -16,135 +16,97 @@
 */
 #pragma once
 
+#include <glib.h>
+
 #include "common/mem.h"
 
 G_BEGIN_DECLS
 
+/* Open addressing table, with the items stored inline and linear probing.
+ *
+ * A cache created with a size function accounts for the bytes held by
+ * its values, and may be given a budget: when adding a value makes it go
+ * over, the least recently used values are evicted, lossy ones first.
+ * The server doesn't know about these evictions, the ids are remembered
+ * so that lookups can tell an evicted value, which won't come back, from
+ * one yet to be added by another display channel. */
+
+typedef gsize (*display_cache_size_func)(gpointer value);
+
+typedef enum {
+    CACHE_SLOT_EMPTY = 0,
+    CACHE_SLOT_USED,
+    CACHE_SLOT_DELETED,
+    CACHE_SLOT_EVICTED,
+} display_cache_slot;
+
 typedef struct display_cache_item {
     guint64                     id;
-    gboolean                    lossy;
+    gpointer                    value;
+    gsize                       size;
+    guint64                     last_use;
     guint32                     ref_count;
+    guint8                      slot;
+    guint8                      lossy;
 } display_cache_item;
 
+typedef struct display_cache_stats {
+    guint64     hits;
+    guint64     misses;
+    guint64     evictions;
+    guint64     evicted_bytes;
+    gsize       bytes;          /* held by the cached values */
+    guint       entries;
+} display_cache_stats;
+
+typedef struct display_cache_wait_stats {
+    guint64     waits;          /* lookups that had to wait */
+    guint64     wakeups;        /* waiters woken by an add */
+    gint64      total_wait_us;
+    gint64      max_wait_us;
+} display_cache_wait_stats;
+
 typedef struct display_cache {
-    GHashTable  *table;
+    display_cache_item *items;
+    guint       capacity;       /* power of 2 */
+    guint       tombstones;     /* deleted and evicted slots */
+    guint64     clock;          /* last_use of the most recent access */
     gboolean    ref_counted;
+    gsize       budget;         /* 0 for no limit */
+    GDestroyNotify value_destroy;
+    display_cache_size_func value_size;
+    display_cache_stats stats;
+    GHashTable  *waiters;       /* id -> GSList of event GSource */
+    display_cache_wait_stats wait_stats;
 }display_cache;
 
-static inline display_cache_item* cache_item_new(guint64 id, gboolean lossy)
-{
-    display_cache_item *self = g_new(display_cache_item, 1);
-    self->id = id;
-    self->lossy = lossy;
-    self->ref_count = 1;
-    return self;
-}
-
-static inline void cache_item_free(display_cache_item *self)
-{
-    g_free(self);
-}
-
-static inline display_cache* cache_new(GDestroyNotify value_destroy)
-{
-    display_cache * self = g_new(display_cache, 1);
-    self->table = g_hash_table_new_full(g_int64_hash, g_int64_equal,
-                                       (GDestroyNotify) cache_item_free,
-                                       value_destroy);
-    self->ref_counted = FALSE;
-    return self;
-}
-
-static inline display_cache * cache_image_new(GDestroyNotify value_destroy)
-{
-    display_cache * self = cache_new(value_destroy);
-    self->ref_counted = TRUE;
-    return self;
-};
-
-static inline gpointer cache_find(display_cache *cache, uint64_t id)
-{
-    return g_hash_table_lookup(cache->table, &id);
-}
-
-static inline gpointer cache_find_lossy(display_cache *cache, uint64_t id, gboolean *lossy)
-{
-    gpointer value;
-    display_cache_item *item;
+display_cache *cache_new(GDestroyNotify value_destroy);
+display_cache *cache_image_new(GDestroyNotify value_destroy,
+                               display_cache_size_func value_size);
+void cache_free(display_cache *cache);
+void cache_clear(display_cache *cache);
+void cache_set_budget(display_cache *cache, gsize budget);
 
-    if (!g_hash_table_lookup_extended(cache->table, &id, (gpointer*)&item, &value))
-        return NULL;
+gpointer cache_find(display_cache *cache, uint64_t id);
+gpointer cache_find_lossy(display_cache *cache, uint64_t id, gboolean *lossy);
+gboolean cache_is_evicted(display_cache *cache, uint64_t id);
+void cache_add_lossy(display_cache *cache, uint64_t id, gpointer value, gboolean lossy);
+void cache_replace_lossy(display_cache *cache, uint64_t id, gpointer value, gboolean lossy);
+gboolean cache_remove(display_cache *cache, uint64_t id);
 
-    *lossy = item->lossy;
-
-    return value;
-}
-
-static inline void cache_add_lossy(display_cache *cache, uint64_t id,
-                                   gpointer value, gboolean lossy)
-{
-    display_cache_item *item = cache_item_new(id, lossy);
-    display_cache_item *current_item;
-    gpointer            current_image;
-
-    //If image is currently in the table add its reference count before replacing it
-    if(cache->ref_counted) {
-        if(g_hash_table_lookup_extended(cache->table, &id, (gpointer*) &current_item,
-                                        (gpointer*) &current_image)) {
-            item->ref_count = current_item->ref_count + 1;
-        }
-    }
-    g_hash_table_replace(cache->table, item, value);
-}
-
-static inline void cache_replace_lossy(display_cache *cache, uint64_t id,
-                                       gpointer value, gboolean lossy)
-{
-    display_cache_item *item = cache_item_new(id, lossy);
-
-    // If image is currently in the table consider its reference count before replacing it
-    if (cache->ref_counted) {
-        display_cache_item *current_item;
-        gpointer current_image;
-        if (g_hash_table_lookup_extended(cache->table, &id, (gpointer*) &current_item,
-                                         &current_image)) {
-            item->ref_count = current_item->ref_count;
-        }
-    }
-    g_hash_table_replace(cache->table, item, value);
-}
+void cache_add_waiter(display_cache *cache, uint64_t id, GSource *event);
+void cache_remove_waiter(display_cache *cache, uint64_t id, GSource *event);
 
 static inline void cache_add(display_cache *cache, uint64_t id, gpointer value)
 {
     cache_add_lossy(cache, id, value, FALSE);
 }
 
-static inline gboolean cache_remove(display_cache *cache, uint64_t id)
-{
-    display_cache_item * item;
-    gpointer value;
-
-    if( g_hash_table_lookup_extended(cache->table, &id, (gpointer*) &item, &value)) {
-        --item->ref_count;
-        if(!cache->ref_counted || item->ref_count == 0 ) {
-            return g_hash_table_remove(cache->table, &id);
-        }
-    }
-    else {
-        return FALSE;
-    }
-    return TRUE;
-}
-
-static inline void cache_clear(display_cache *cache)
-{
-    g_hash_table_remove_all(cache->table);
-}
-
-static inline void cache_free(display_cache *cache)
+static inline void cache_wait_done(display_cache *cache, gint64 wait_us)
 {
-    g_hash_table_unref(cache->table);
-    g_free(cache);
+    cache->wait_stats.waits++;
+    cache->wait_stats.total_wait_us += wait_us;
+    cache->wait_stats.max_wait_us = MAX(cache->wait_stats.max_wait_us, wait_us);
 }
 
 G_END_DECLS
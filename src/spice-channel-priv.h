@@ -29,6 +29,8 @@
 #include "spice-util-priv.h"
 #include "coroutine.h"
 #include "gio-coroutine.h"
+#include "spice-buffer-pool.h"
+#include "spice-capture.h"
 
 #include "common/client_marshallers.h"
 #include "common/demarshallers.h"
@@ -38,11 +40,54 @@ G_BEGIN_DECLS
 
 #define MAX_SPICE_DATA_HEADER_SIZE sizeof(SpiceDataHeader)
 
+/* size of the per-channel receive buffer, reads from the socket/TLS
+ * layer are done in chunks of up to this size */
+#define SPICE_CHANNEL_READ_BUFFER_SIZE (64 * 1024)
+
+/* incoming messages up to this size are recycled through the channel
+ * message pool, which keeps at most MSG_POOL_MAX_CACHED bytes around */
+#define SPICE_CHANNEL_MSG_POOL_MAX_SIZE   (4 * 1024 * 1024)
+#define SPICE_CHANNEL_MSG_POOL_MAX_CACHED (16 * 1024 * 1024)
+
+/* upper bounds of a batch of queued messages written at once */
+#define SPICE_CHANNEL_WRITE_BATCH_MAX_MSGS  64
+#define SPICE_CHANNEL_WRITE_BATCH_MAX_BYTES (256 * 1024)
+
 #define CHANNEL_DEBUG(channel, fmt, ...) \
     SPICE_DEBUG("%s: " fmt, SPICE_CHANNEL(channel)->priv->name, ## __VA_ARGS__)
 
 #define spice_mmtime_diff(t1, t2)       ((int32_t) ((t1)-(t2)))
 
+/* transmit queue classes, drained in this order */
+typedef enum {
+    SPICE_MSG_OUT_PRIORITY_HIGH = 0, /* acks, inputs, stream reports */
+    SPICE_MSG_OUT_PRIORITY_NORMAL,
+    SPICE_MSG_OUT_PRIORITY_BULK,     /* usbredir, agent data */
+
+    SPICE_MSG_OUT_PRIORITY_LAST
+} SpiceMsgOutPriority;
+
+typedef struct SpiceXmitQueueStats {
+    guint                 depth;         /* messages waiting */
+    guint64               size;          /* bytes waiting */
+    guint64               sent_msgs;
+    gint64                total_wait_us; /* time spent in the queue */
+    gint64                max_wait_us;
+} SpiceXmitQueueStats;
+
+/* per message type counters, see SpiceChannel:msg-stats */
+typedef struct SpiceMsgTypeStats {
+    guint64               count;
+    guint64               bytes;         /* including the header */
+    guint64               parse_us;      /* incoming messages only */
+    guint64               handler_us;    /* incoming messages only */
+} SpiceMsgTypeStats;
+
+typedef struct SpiceXmitQueue {
+    GQueue                msgs;
+    SpiceXmitQueueStats   stats;
+} SpiceXmitQueue;
+
 struct _SpiceMsgOut {
     int                   refcount;
     SpiceChannel          *channel;
@@ -50,11 +95,15 @@ struct _SpiceMsgOut {
     SpiceMarshaller       *marshaller;
     uint8_t               *header;
     gboolean              ro_check;
+    SpiceMsgOutPriority   priority;
+    gint64                queue_time;
+    guint64               queue_seq;     /* order of spice_msg_out_send() */
 };
 
 struct _SpiceMsgIn {
     int                   refcount;
     SpiceChannel          *channel;
+    SpiceBufferPool       *pool;
     uint8_t               header[MAX_SPICE_DATA_HEADER_SIZE];
     uint8_t               *data;
     int                   dpos;
@@ -96,6 +145,10 @@ struct _SpiceChannelPrivate {
     unsigned int                sasl_decoded_offset;
 #endif
 
+    guint8                      *read_buffer;
+    gsize                       read_buffer_offset;
+    gsize                       read_buffer_length;
+
     gboolean                    use_mini_header;
     uint64_t                    out_serial;
     uint64_t                    in_serial;
@@ -103,15 +156,17 @@ struct _SpiceChannelPrivate {
     /* not swapped */
     SpiceSession                *session;
     GCoroutine                  coroutine;
+    GMainContext                *io_context; /* NULL: SPICE main context */
     int                         fd;
     gboolean                    has_error;
     guint                       connect_delayed_id;
 
-    GQueue                      xmit_queue;
+    SpiceXmitQueue              xmit_queue[SPICE_MSG_OUT_PRIORITY_LAST];
     gboolean                    xmit_queue_blocked;
     GMutex                      xmit_queue_lock;
     guint                       xmit_queue_wakeup_id;
     guint64                     xmit_queue_size;
+    guint64                     xmit_queue_seq;
 
     char                        name[16];
     enum spice_channel_state    state;
@@ -136,7 +191,23 @@ struct _SpiceChannelPrivate {
     GArray                      *remote_caps;
     GArray                      *remote_common_caps;
 
-    gsize                       total_read_bytes;
+    SpiceBufferPool             *msg_pool;
+    SpiceCapture                *capture; /* SPICE_CAPTURE_DIR recording */
+
+    /* statistics, updated from the coroutine, read under stats_lock */
+    GMutex                      stats_lock;
+    GHashTable                  *msg_in_stats;  /* type -> SpiceMsgTypeStats */
+    GHashTable                  *msg_out_stats;
+    guint64                     socket_reads;
+    guint64                     socket_writes;
+    guint64                     tls_reads;
+    guint64                     tls_writes;
+    guint                       stats_interval;
+    guint                       stats_timer_id;
+
+    gsize                       total_read_bytes;       /* under stats_lock */
+    guint64                     total_read_requests;    /* under stats_lock */
+    guint64                     total_wire_reads;       /* under stats_lock */
     uint64_t                    last_message_serial;
     GSList                      *flushing;
 
@@ -157,6 +228,7 @@ void *spice_msg_in_raw(SpiceMsgIn *in, int *len);
 void spice_msg_in_hexdump(SpiceMsgIn *in);
 
 SpiceMsgOut *spice_msg_out_new(SpiceChannel *channel, int type);
+void spice_msg_out_set_priority(SpiceMsgOut *out, SpiceMsgOutPriority priority);
 void spice_msg_out_ref(SpiceMsgOut *out);
 void spice_msg_out_unref(SpiceMsgOut *out);
 void spice_msg_out_send(SpiceMsgOut *out);
@@ -168,10 +240,21 @@ uint32_t spice_header_get_msg_size(uint8_t *header, gboolean is_mini_header);
 
 void spice_channel_up(SpiceChannel *channel);
 void spice_channel_wakeup(SpiceChannel *channel, gboolean cancel);
+GMainContext *spice_channel_get_context(SpiceChannel *channel);
+guint spice_channel_timeout_add_full(SpiceChannel *channel, gint priority, guint interval,
+                                     GSourceFunc function, gpointer data, GDestroyNotify notify);
+guint spice_channel_timeout_add(SpiceChannel *channel, guint interval,
+                                GSourceFunc function, gpointer data);
+guint spice_channel_idle_add(SpiceChannel *channel, GSourceFunc function, gpointer data);
+gboolean spice_channel_source_remove(SpiceChannel *channel, guint tag);
 
 SpiceSession* spice_channel_get_session(SpiceChannel *channel);
 enum spice_channel_state spice_channel_get_state(SpiceChannel *channel);
 guint64 spice_channel_get_queue_size (SpiceChannel *channel);
+void spice_channel_get_queue_stats(SpiceChannel *channel, SpiceMsgOutPriority priority,
+                                   SpiceXmitQueueStats *stats);
+guint spice_channel_xmit_dequeue(SpiceChannel *channel,
+                                 SpiceMsgOut **batch, guint max_msgs);
 
 /* coroutine context */
 typedef void (*handler_msg_in)(SpiceChannel *channel, SpiceMsgIn *msg, gpointer data);
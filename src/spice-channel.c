@@ -43,9 +43,17 @@
 #include <arpa/inet.h>
 #endif
 #include <ctype.h>
+#include <limits.h>
 
 #include "gio-coroutine.h"
 
+/* the most vectors a single writev() takes */
+#ifdef IOV_MAX
+#define SPICE_CHANNEL_IOV_MAX IOV_MAX
+#else
+#define SPICE_CHANNEL_IOV_MAX 1024
+#endif
+
 G_STATIC_ASSERT(sizeof(SpiceChannelClass) == sizeof(GObjectClass) + 19 * sizeof(gpointer));
 
 static void spice_channel_handle_msg(SpiceChannel *channel, SpiceMsgIn *msg);
@@ -93,6 +101,11 @@ enum
     PROP_CHANNEL_ID,
     PROP_TOTAL_READ_BYTES,
     PROP_SOCKET,
+    PROP_TOTAL_WIRE_READS,
+    PROP_TOTAL_SAVED_READS,
+    PROP_MSG_POOL_STATS,
+    PROP_MSG_STATS,
+    PROP_STATS_INTERVAL,
 };
 
 /* Signals */
@@ -100,6 +113,7 @@ enum
 {
     SPICE_CHANNEL_EVENT,
     SPICE_CHANNEL_OPEN_FD,
+    SPICE_CHANNEL_STATS,
 
     SPICE_CHANNEL_LAST_SIGNAL,
 };
@@ -109,9 +123,18 @@ static guint signals[SPICE_CHANNEL_LAST_SIGNAL];
 static void spice_channel_iterate_write(SpiceChannel *channel);
 static void spice_channel_iterate_read(SpiceChannel *channel);
 
+/* bytes each transmit class may put in a batch before letting the lower
+ * priority classes go, see spice_channel_xmit_dequeue() */
+static const gsize xmit_budget[SPICE_MSG_OUT_PRIORITY_LAST] = {
+    [SPICE_MSG_OUT_PRIORITY_HIGH] = SPICE_CHANNEL_WRITE_BATCH_MAX_BYTES,
+    [SPICE_MSG_OUT_PRIORITY_NORMAL] = 64 * 1024,
+    [SPICE_MSG_OUT_PRIORITY_BULK] = 32 * 1024,
+};
+
 static void spice_channel_init(SpiceChannel *channel)
 {
     SpiceChannelPrivate *c;
+    int i;
 
     c = channel->priv = spice_channel_get_instance_private(channel);
 
@@ -130,8 +153,14 @@ static void spice_channel_init(SpiceChannel *channel)
 #ifdef HAVE_SASL
     spice_channel_set_common_capability(channel, SPICE_COMMON_CAP_AUTH_SASL);
 #endif
-    g_queue_init(&c->xmit_queue);
+    for (i = 0; i < SPICE_MSG_OUT_PRIORITY_LAST; i++)
+        g_queue_init(&c->xmit_queue[i].msgs);
     g_mutex_init(&c->xmit_queue_lock);
+    c->msg_pool = spice_buffer_pool_new(SPICE_CHANNEL_MSG_POOL_MAX_SIZE,
+                                        SPICE_CHANNEL_MSG_POOL_MAX_CACHED);
+    g_mutex_init(&c->stats_lock);
+    c->msg_in_stats = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+    c->msg_out_stats = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
 }
 
 static void spice_channel_constructed(GObject *gobject)
@@ -148,6 +177,10 @@ static void spice_channel_constructed(GObject *gobject)
     if (disabled && strstr(disabled, desc))
         c->disable_channel_msg = TRUE;
 
+    c->io_context = spice_session_get_io_context(c->session, c->channel_type);
+    if (c->io_context)
+        CHANNEL_DEBUG(channel, "running on its own thread");
+
     spice_session_channel_new(c->session, channel);
 
     /* Chain up to the parent class */
@@ -164,6 +197,12 @@ static void spice_channel_dispose(GObject *gobject)
 
     spice_channel_disconnect(channel, SPICE_CHANNEL_CLOSED);
 
+    if (c->stats_timer_id)
+    {
+        g_spice_source_remove(c->stats_timer_id);
+        c->stats_timer_id = 0;
+    }
+
     g_clear_object(&c->session);
 
     g_clear_error(&c->error);
@@ -183,6 +222,9 @@ static void spice_channel_finalize(GObject *gobject)
     g_idle_remove_by_data(gobject);
 
     g_mutex_clear(&c->xmit_queue_lock);
+    g_mutex_clear(&c->stats_lock);
+    g_clear_pointer(&c->msg_in_stats, g_hash_table_unref);
+    g_clear_pointer(&c->msg_out_stats, g_hash_table_unref);
 
     if (c->caps)
         g_array_free(c->caps, TRUE);
@@ -197,12 +239,158 @@ static void spice_channel_finalize(GObject *gobject)
         g_array_free(c->remote_common_caps, TRUE);
 
     g_clear_pointer(&c->peer_msg, g_free);
+    g_clear_pointer(&c->read_buffer, g_free);
+    g_clear_pointer(&c->msg_pool, spice_buffer_pool_unref);
+    g_clear_pointer(&c->capture, spice_capture_free);
+    g_clear_pointer(&c->io_context, g_main_context_unref);
 
     /* Chain up to the parent class */
     if (G_OBJECT_CLASS(spice_channel_parent_class)->finalize)
         G_OBJECT_CLASS(spice_channel_parent_class)->finalize(gobject);
 }
 
+static GVariant *spice_channel_msg_pool_stats(SpiceChannel *channel)
+{
+    SpiceBufferPoolStats stats;
+    GVariantBuilder builder;
+
+    spice_buffer_pool_get_stats(channel->priv->msg_pool, &stats);
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add(&builder, "{sv}", "allocations", g_variant_new_uint64(stats.allocations));
+    g_variant_builder_add(&builder, "{sv}", "hits", g_variant_new_uint64(stats.hits));
+    g_variant_builder_add(&builder, "{sv}", "misses", g_variant_new_uint64(stats.misses));
+    g_variant_builder_add(&builder, "{sv}", "large", g_variant_new_uint64(stats.large));
+    g_variant_builder_add(&builder, "{sv}", "recycled-bytes", g_variant_new_uint64(stats.recycled_bytes));
+    g_variant_builder_add(&builder, "{sv}", "cached-bytes", g_variant_new_uint64(stats.cached_bytes));
+
+    return g_variant_builder_end(&builder);
+}
+
+static gint compare_msg_type(gconstpointer a, gconstpointer b)
+{
+    return GPOINTER_TO_UINT(a) - GPOINTER_TO_UINT(b);
+}
+
+/* called with stats_lock held */
+static GVariant *spice_channel_msg_type_stats(GHashTable *table, gboolean incoming)
+{
+    GVariantBuilder builder;
+    GList *types, *l;
+
+    g_variant_builder_init(&builder, incoming ? G_VARIANT_TYPE("a(qtttt)") :
+                                                G_VARIANT_TYPE("a(qtt)"));
+    types = g_list_sort(g_hash_table_get_keys(table), compare_msg_type);
+    for (l = types; l != NULL; l = l->next)
+    {
+        SpiceMsgTypeStats *stats = g_hash_table_lookup(table, l->data);
+        guint16 type = GPOINTER_TO_UINT(l->data);
+
+        if (incoming)
+            g_variant_builder_add(&builder, "(qtttt)", type, stats->count, stats->bytes,
+                                  stats->parse_us, stats->handler_us);
+        else
+            g_variant_builder_add(&builder, "(qtt)", type, stats->count, stats->bytes);
+    }
+    g_list_free(types);
+
+    return g_variant_builder_end(&builder);
+}
+
+static GVariant *spice_channel_msg_stats(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    SpiceXmitQueueStats xmit;
+    guint64 xmit_sent = 0;
+    gint64 xmit_wait_us = 0, xmit_max_wait_us = 0;
+    GVariantBuilder builder;
+    int i;
+
+    for (i = 0; i < SPICE_MSG_OUT_PRIORITY_LAST; i++)
+    {
+        spice_channel_get_queue_stats(channel, i, &xmit);
+        xmit_sent += xmit.sent_msgs;
+        xmit_wait_us += xmit.total_wait_us;
+        xmit_max_wait_us = MAX(xmit_max_wait_us, xmit.max_wait_us);
+    }
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add(&builder, "{sv}", "timestamp", g_variant_new_int64(g_get_monotonic_time()));
+    g_variant_builder_add(&builder, "{sv}", "xmit-sent", g_variant_new_uint64(xmit_sent));
+    g_variant_builder_add(&builder, "{sv}", "xmit-wait-us", g_variant_new_int64(xmit_wait_us));
+    g_variant_builder_add(&builder, "{sv}", "xmit-max-wait-us", g_variant_new_int64(xmit_max_wait_us));
+
+    g_mutex_lock(&c->stats_lock);
+    g_variant_builder_add(&builder, "{sv}", "read-bytes", g_variant_new_uint64(c->total_read_bytes));
+    g_variant_builder_add(&builder, "{sv}", "socket-reads", g_variant_new_uint64(c->socket_reads));
+    g_variant_builder_add(&builder, "{sv}", "socket-writes", g_variant_new_uint64(c->socket_writes));
+    g_variant_builder_add(&builder, "{sv}", "tls-reads", g_variant_new_uint64(c->tls_reads));
+    g_variant_builder_add(&builder, "{sv}", "tls-writes", g_variant_new_uint64(c->tls_writes));
+    g_variant_builder_add(&builder, "{sv}", "messages-in",
+                          spice_channel_msg_type_stats(c->msg_in_stats, TRUE));
+    g_variant_builder_add(&builder, "{sv}", "messages-out",
+                          spice_channel_msg_type_stats(c->msg_out_stats, FALSE));
+    g_mutex_unlock(&c->stats_lock);
+
+    return g_variant_builder_end(&builder);
+}
+
+/* coroutine context, the counters are read from the main context */
+static inline void spice_channel_stats_inc(SpiceChannelPrivate *c, guint64 *counter)
+{
+    g_mutex_lock(&c->stats_lock);
+    (*counter)++;
+    g_mutex_unlock(&c->stats_lock);
+}
+
+/* coroutine context */
+static void spice_channel_msg_stats_add(SpiceChannel *channel, GHashTable *table,
+                                        guint type, gsize bytes,
+                                        gint64 parse_us, gint64 handler_us)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    SpiceMsgTypeStats *stats;
+
+    g_mutex_lock(&c->stats_lock);
+    stats = g_hash_table_lookup(table, GUINT_TO_POINTER(type));
+    if (stats == NULL)
+    {
+        stats = g_new0(SpiceMsgTypeStats, 1);
+        g_hash_table_insert(table, GUINT_TO_POINTER(type), stats);
+    }
+    stats->count++;
+    stats->bytes += bytes;
+    stats->parse_us += parse_us;
+    stats->handler_us += handler_us;
+    g_mutex_unlock(&c->stats_lock);
+}
+
+static gboolean spice_channel_stats_timeout(gpointer user_data)
+{
+    SpiceChannel *channel = SPICE_CHANNEL(user_data);
+    GVariant *stats = g_variant_ref_sink(spice_channel_msg_stats(channel));
+
+    g_signal_emit(channel, signals[SPICE_CHANNEL_STATS], 0, stats);
+    g_variant_unref(stats);
+
+    return TRUE;
+}
+
+static void spice_channel_set_stats_interval(SpiceChannel *channel, guint interval)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    if (c->stats_timer_id)
+    {
+        g_spice_source_remove(c->stats_timer_id);
+        c->stats_timer_id = 0;
+    }
+
+    c->stats_interval = interval;
+    if (interval > 0)
+        c->stats_timer_id = g_spice_timeout_add(interval, spice_channel_stats_timeout, channel);
+}
+
 static void spice_channel_get_property(GObject *gobject,
                                        guint prop_id,
                                        GValue *value,
@@ -223,11 +411,32 @@ static void spice_channel_get_property(GObject *gobject,
         g_value_set_int(value, c->channel_id);
         break;
     case PROP_TOTAL_READ_BYTES:
+        g_mutex_lock(&c->stats_lock);
         g_value_set_ulong(value, c->total_read_bytes);
+        g_mutex_unlock(&c->stats_lock);
         break;
     case PROP_SOCKET:
         g_value_set_object(value, c->sock);
         break;
+    case PROP_TOTAL_WIRE_READS:
+        g_mutex_lock(&c->stats_lock);
+        g_value_set_uint64(value, c->total_wire_reads);
+        g_mutex_unlock(&c->stats_lock);
+        break;
+    case PROP_TOTAL_SAVED_READS:
+        g_mutex_lock(&c->stats_lock);
+        g_value_set_uint64(value, c->total_read_requests - c->total_wire_reads);
+        g_mutex_unlock(&c->stats_lock);
+        break;
+    case PROP_MSG_POOL_STATS:
+        g_value_set_variant(value, spice_channel_msg_pool_stats(channel));
+        break;
+    case PROP_MSG_STATS:
+        g_value_set_variant(value, spice_channel_msg_stats(channel));
+        break;
+    case PROP_STATS_INTERVAL:
+        g_value_set_uint(value, c->stats_interval);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -271,6 +480,9 @@ static void spice_channel_set_property(GObject *gobject,
     case PROP_CHANNEL_ID:
         c->channel_id = g_value_get_int(value);
         break;
+    case PROP_STATS_INTERVAL:
+        spice_channel_set_stats_interval(channel, g_value_get_uint(value));
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -345,6 +557,105 @@ static void spice_channel_class_init(SpiceChannelClass *klass)
                                                         G_PARAM_READABLE |
                                                             G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceChannel:total-wire-reads:
+     *
+     * Number of reads issued to the socket or TLS layer.
+     *
+     * Since: 0.43
+     */
+    g_object_class_install_property(gobject_class, PROP_TOTAL_WIRE_READS,
+                                    g_param_spec_uint64("total-wire-reads",
+                                                        "Total wire reads",
+                                                        "Total reads from the socket/TLS layer",
+                                                        0, G_MAXUINT64, 0,
+                                                        G_PARAM_READABLE |
+                                                            G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceChannel:total-saved-reads:
+     *
+     * Number of reads that were served from the channel receive buffer
+     * instead of going to the socket or TLS layer.
+     *
+     * Since: 0.43
+     */
+    g_object_class_install_property(gobject_class, PROP_TOTAL_SAVED_READS,
+                                    g_param_spec_uint64("total-saved-reads",
+                                                        "Total saved reads",
+                                                        "Total reads served from the receive buffer",
+                                                        0, G_MAXUINT64, 0,
+                                                        G_PARAM_READABLE |
+                                                            G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceChannel:msg-pool-stats:
+     *
+     * Statistics of the incoming message pool, as a vardict of uint64
+     * values: "allocations", "hits", "misses", "large", "recycled-bytes"
+     * and "cached-bytes". The hit rate is hits / allocations.
+     *
+     * Since: 0.43
+     */
+    g_object_class_install_property(gobject_class, PROP_MSG_POOL_STATS,
+                                    g_param_spec_variant("msg-pool-stats",
+                                                         "Message pool statistics",
+                                                         "Incoming message pool statistics",
+                                                         G_VARIANT_TYPE_VARDICT,
+                                                         NULL,
+                                                         G_PARAM_READABLE |
+                                                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceChannel:msg-stats:
+     *
+     * Hot-path statistics of the channel, as a vardict:
+     *
+     * - "timestamp" (int64): monotonic time of the snapshot, in us
+     * - "read-bytes", "socket-reads", "socket-writes", "tls-reads",
+     *   "tls-writes" (uint64): bytes read and calls to the socket or
+     *   TLS layer
+     * - "xmit-sent" (uint64), "xmit-wait-us", "xmit-max-wait-us"
+     *   (int64): messages sent and the time they spent in the
+     *   transmit queue
+     * - "messages-in" (a(qtttt)): for each received message type, the
+     *   count, the bytes including the header, and the time spent in
+     *   the parser and in the handler, in us. The sub-messages of a
+     *   SPICE_MSG_LIST are accounted both on their own and in the
+     *   list bytes.
+     * - "messages-out" (a(qtt)): for each sent message type, the count
+     *   and the bytes including the header
+     *
+     * The counters are cumulative; rates are obtained by comparing two
+     * snapshots, see #SpiceChannel::stats.
+     *
+     * Since: 0.43
+     */
+    g_object_class_install_property(gobject_class, PROP_MSG_STATS,
+                                    g_param_spec_variant("msg-stats",
+                                                         "Message statistics",
+                                                         "Per message type statistics",
+                                                         G_VARIANT_TYPE_VARDICT,
+                                                         NULL,
+                                                         G_PARAM_READABLE |
+                                                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceChannel:stats-interval:
+     *
+     * Interval in milliseconds at which #SpiceChannel::stats is
+     * emitted, or 0 to disable it.
+     *
+     * Since: 0.43
+     */
+    g_object_class_install_property(gobject_class, PROP_STATS_INTERVAL,
+                                    g_param_spec_uint("stats-interval",
+                                                      "Statistics interval",
+                                                      "Interval of the stats signal in ms",
+                                                      0, G_MAXUINT, 0,
+                                                      G_PARAM_READWRITE |
+                                                          G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceChannel::channel-event:
      * @channel: the channel that emitted the signal
@@ -386,6 +697,27 @@ static void spice_channel_class_init(SpiceChannelClass *klass)
                      1,
                      G_TYPE_INT);
 
+    /**
+     * SpiceChannel::stats:
+     * @channel: the channel that emitted the signal
+     * @stats: a #GVariant snapshot, see #SpiceChannel:msg-stats
+     *
+     * The #SpiceChannel::stats signal is emitted every
+     * #SpiceChannel:stats-interval milliseconds, from the main context.
+     *
+     * Since: 0.43
+     **/
+    signals[SPICE_CHANNEL_STATS] =
+        g_signal_new("stats",
+                     G_OBJECT_CLASS_TYPE(gobject_class),
+                     G_SIGNAL_RUN_FIRST,
+                     0,
+                     NULL, NULL,
+                     g_cclosure_marshal_VOID__VARIANT,
+                     G_TYPE_NONE,
+                     1,
+                     G_TYPE_VARIANT);
+
     SSL_library_init();
     SSL_load_error_strings();
 }
@@ -514,13 +846,17 @@ static inline uint32_t spice_header_get_msg_sub_list(uint8_t *header, gboolean i
 G_GNUC_INTERNAL
 SpiceMsgIn *spice_msg_in_new(SpiceChannel *channel)
 {
+    SpiceBufferPool *pool;
     SpiceMsgIn *in;
 
     g_return_val_if_fail(channel != NULL, NULL);
 
-    in = g_new0(SpiceMsgIn, 1);
+    pool = channel->priv->msg_pool;
+    in = spice_buffer_pool_alloc(pool, sizeof(SpiceMsgIn));
+    memset(in, 0, sizeof(SpiceMsgIn));
     in->refcount = 1;
     in->channel = channel;
+    in->pool = spice_buffer_pool_ref(pool);
 
     return in;
 }
@@ -548,28 +884,32 @@ void spice_msg_in_ref(SpiceMsgIn *in)
 {
     g_return_if_fail(in != NULL);
 
-    in->refcount++;
+    /* frames may be released from a video decoder thread */
+    g_atomic_int_inc(&in->refcount);
 }
 
 G_GNUC_INTERNAL
 void spice_msg_in_unref(SpiceMsgIn *in)
 {
+    SpiceBufferPool *pool;
+
     g_return_if_fail(in != NULL);
 
-    in->refcount--;
-    if (in->refcount > 0)
+    if (!g_atomic_int_dec_and_test(&in->refcount))
         return;
     if (in->parsed)
         in->pfree(in->parsed);
+    pool = in->pool;
     if (in->parent)
     {
         spice_msg_in_unref(in->parent);
     }
     else
     {
-        g_free(in->data);
+        spice_buffer_pool_free(pool, in->data);
     }
-    g_free(in);
+    spice_buffer_pool_free(pool, in);
+    spice_buffer_pool_unref(pool);
 }
 
 G_GNUC_INTERNAL
@@ -669,6 +1009,41 @@ static gboolean msg_check_read_only(int channel_type, int msg_type)
     return TRUE;
 }
 
+/* Messages of a given type must always get the same priority, so that
+ * they are never reordered with respect to each other. Messages that
+ * depend on each other must get the same priority too, like ACK_SYNC
+ * and the ACKs following it. */
+static SpiceMsgOutPriority msg_get_priority(int channel_type, int msg_type)
+{
+    switch (msg_type)
+    {
+    case SPICE_MSGC_ACK_SYNC:
+    case SPICE_MSGC_ACK:
+    case SPICE_MSGC_PONG:
+        return SPICE_MSG_OUT_PRIORITY_HIGH;
+    }
+
+    switch (channel_type)
+    {
+    case SPICE_CHANNEL_INPUTS:
+        return SPICE_MSG_OUT_PRIORITY_HIGH;
+    case SPICE_CHANNEL_DISPLAY:
+        if (msg_type == SPICE_MSGC_DISPLAY_STREAM_REPORT)
+            return SPICE_MSG_OUT_PRIORITY_HIGH;
+        break;
+    case SPICE_CHANNEL_MAIN:
+        /* all the agent data must stay in order, as agent messages are
+         * split over several of them */
+        if (msg_type == SPICE_MSGC_MAIN_AGENT_DATA)
+            return SPICE_MSG_OUT_PRIORITY_BULK;
+        break;
+    case SPICE_CHANNEL_USBREDIR:
+        return SPICE_MSG_OUT_PRIORITY_BULK;
+    }
+
+    return SPICE_MSG_OUT_PRIORITY_NORMAL;
+}
+
 G_GNUC_INTERNAL
 SpiceMsgOut *spice_msg_out_new(SpiceChannel *channel, int type)
 {
@@ -681,6 +1056,7 @@ SpiceMsgOut *spice_msg_out_new(SpiceChannel *channel, int type)
     out->refcount = 1;
     out->channel = channel;
     out->ro_check = msg_check_read_only(c->channel_type, type);
+    out->priority = msg_get_priority(c->channel_type, type);
 
     out->marshallers = c->marshallers;
     out->marshaller = spice_marshaller_new();
@@ -696,6 +1072,16 @@ SpiceMsgOut *spice_msg_out_new(SpiceChannel *channel, int type)
     return out;
 }
 
+/* must be called before spice_msg_out_send() */
+G_GNUC_INTERNAL
+void spice_msg_out_set_priority(SpiceMsgOut *out, SpiceMsgOutPriority priority)
+{
+    g_return_if_fail(out != NULL);
+    g_return_if_fail(priority < SPICE_MSG_OUT_PRIORITY_LAST);
+
+    out->priority = priority;
+}
+
 G_GNUC_INTERNAL
 void spice_msg_out_ref(SpiceMsgOut *out)
 {
@@ -716,6 +1102,20 @@ void spice_msg_out_unref(SpiceMsgOut *out)
     g_free(out);
 }
 
+/* xmit_queue_lock must be held */
+static gboolean xmit_queue_is_empty(SpiceChannelPrivate *c)
+{
+    int i;
+
+    for (i = 0; i < SPICE_MSG_OUT_PRIORITY_LAST; i++)
+    {
+        if (!g_queue_is_empty(&c->xmit_queue[i].msgs))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
 /* system context */
 static gboolean spice_channel_idle_wakeup(gpointer user_data)
 {
@@ -765,8 +1165,11 @@ void spice_msg_out_send(SpiceMsgOut *out)
         goto end;
     }
 
-    was_empty = g_queue_is_empty(&c->xmit_queue);
-    g_queue_push_tail(&c->xmit_queue, out);
+    was_empty = xmit_queue_is_empty(c);
+    out->queue_time = g_get_monotonic_time();
+    out->queue_seq = c->xmit_queue_seq++;
+    g_queue_push_tail(&c->xmit_queue[out->priority].msgs, out);
+    c->xmit_queue[out->priority].stats.size += size;
     c->xmit_queue_size = (was_empty) ? size : c->xmit_queue_size + size;
 
     /* One wakeup is enough to empty the entire queue -> only do a wakeup
@@ -774,10 +1177,10 @@ void spice_msg_out_send(SpiceMsgOut *out)
     if (was_empty && !c->xmit_queue_wakeup_id)
     {
         c->xmit_queue_wakeup_id =
-            /* Use g_spice_timeout_add_full so that can specify the priority */
-            g_spice_timeout_add_full(G_PRIORITY_HIGH, 0,
-                                     spice_channel_idle_wakeup,
-                                     out->channel, NULL);
+            /* Use a timeout so that can specify the priority */
+            spice_channel_timeout_add_full(out->channel, G_PRIORITY_HIGH, 0,
+                                           spice_channel_idle_wakeup,
+                                           out->channel, NULL);
     }
 
 end:
@@ -828,6 +1231,7 @@ static gint spice_channel_flush_wire_nonblocking(SpiceChannel *channel,
 
     if (c->tls)
     {
+        spice_channel_stats_inc(c, &c->tls_writes);
         ret = SSL_write(c->ssl, ptr, len);
         if (ret < 0)
         {
@@ -839,6 +1243,7 @@ static gint spice_channel_flush_wire_nonblocking(SpiceChannel *channel,
     else
     {
         GError *error = NULL;
+        spice_channel_stats_inc(c, &c->socket_writes);
         ret = g_pollable_output_stream_write_nonblocking(G_POLLABLE_OUTPUT_STREAM(c->out),
                                                          ptr, len, NULL, &error);
         if (ret < 0)
@@ -935,6 +1340,9 @@ static void spice_channel_flush_sasl(SpiceChannel *channel, const void *data, si
 /* coroutine context */
 static void spice_channel_write(SpiceChannel *channel, const void *data, size_t len)
 {
+    if (channel->priv->capture)
+        spice_capture_record(channel->priv->capture, SPICE_CAPTURE_OUT, data, len);
+
 #ifdef HAVE_SASL
     if (channel->priv->sasl_conn)
     {
@@ -945,37 +1353,219 @@ static void spice_channel_write(SpiceChannel *channel, const void *data, size_t
     spice_channel_flush_wire(channel, data, len);
 }
 
+#if GLIB_CHECK_VERSION(2, 60, 0)
+G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+/*
+ * Write all the 'vectors' out to the wire with as few writev() as
+ * possible, at most SPICE_CHANNEL_IOV_MAX vectors at a time. 'vectors'
+ * is modified to keep track of partial writes, and must not hold empty
+ * vectors: a write of 0 bytes is an error.
+ */
 /* coroutine context */
-static void spice_channel_write_msg(SpiceChannel *channel, SpiceMsgOut *out)
+static void spice_channel_flush_wire_vectors(SpiceChannel *channel,
+                                             GOutputVector *vectors,
+                                             gsize n_vectors)
 {
-    uint8_t *data;
-    int free_data;
-    size_t len;
-    uint32_t msg_size;
+    SpiceChannelPrivate *c = channel->priv;
 
-    g_return_if_fail(channel != NULL);
-    g_return_if_fail(out != NULL);
-    g_return_if_fail(channel == out->channel);
+    while (n_vectors > 0)
+    {
+        GError *error = NULL;
+        GPollableReturn ret;
+        gsize written = 0;
+
+        if (c->has_error)
+            return;
+
+        spice_channel_stats_inc(c, &c->socket_writes);
+        ret = g_pollable_output_stream_writev_nonblocking(G_POLLABLE_OUTPUT_STREAM(c->out),
+                                                          vectors,
+                                                          MIN(n_vectors, SPICE_CHANNEL_IOV_MAX),
+                                                          &written, NULL, &error);
+        if (ret == G_POLLABLE_RETURN_WOULD_BLOCK)
+        {
+            g_coroutine_socket_wait(&c->coroutine, c->sock, G_IO_OUT);
+            continue;
+        }
+        if (ret == G_POLLABLE_RETURN_FAILED)
+        {
+            CHANNEL_DEBUG(channel, "Send error %s", error->message);
+            g_clear_error(&error);
+            c->has_error = TRUE;
+            return;
+        }
+        if (written == 0)
+        {
+            /* no progress with data to write, don't try again */
+            CHANNEL_DEBUG(channel, "Closing the connection: spice_channel_flush");
+            c->has_error = TRUE;
+            return;
+        }
+
+        while (n_vectors > 0 && written >= vectors->size)
+        {
+            written -= vectors->size;
+            vectors++;
+            n_vectors--;
+        }
+        if (n_vectors > 0)
+        {
+            vectors->buffer = (const guint8 *)vectors->buffer + written;
+            vectors->size -= written;
+        }
+    }
+}
+G_GNUC_END_IGNORE_DEPRECATIONS
+#endif
+
+/* coroutine context */
+static gboolean spice_channel_prepare_msg(SpiceChannel *channel, SpiceMsgOut *out)
+{
+    uint32_t msg_size;
 
     if (out->ro_check &&
         spice_channel_get_read_only(channel))
     {
         g_warning("Try to send message while read-only. Please report a bug.");
-        return;
+        return FALSE;
     }
 
     spice_marshaller_flush(out->marshaller);
     msg_size = spice_marshaller_get_total_size(out->marshaller) -
                spice_header_get_header_size(channel->priv->use_mini_header);
     spice_header_set_msg_size(out->header, channel->priv->use_mini_header, msg_size);
-    data = spice_marshaller_linearize(out->marshaller, 0, &len, &free_data);
+    spice_channel_msg_stats_add(channel, channel->priv->msg_out_stats,
+                                spice_header_get_msg_type(out->header,
+                                                          channel->priv->use_mini_header),
+                                spice_marshaller_get_total_size(out->marshaller), 0, 0);
     /* spice_msg_out_hexdump(out, data, len); */
-    spice_channel_write(channel, data, len);
 
-    if (free_data)
-        g_free(data);
+    return TRUE;
+}
+
+/* coroutine context */
+static void spice_channel_msg_append_iovecs(SpiceMsgOut *out, GArray *iovecs)
+{
+    size_t total, skip = 0;
+
+    total = spice_marshaller_get_total_size(out->marshaller);
+    while (skip < total)
+    {
+        struct iovec iov[16];
+        size_t last = skip;
+        int i, n;
+
+        n = spice_marshaller_fill_iovec(out->marshaller, iov, G_N_ELEMENTS(iov), skip);
+        for (i = 0; i < n; i++)
+        {
+            g_array_append_val(iovecs, iov[i]);
+            skip += iov[i].iov_len;
+        }
+        /* the marshaller is shorter than its total size */
+        if (skip == last)
+        {
+            g_warn_if_reached();
+            break;
+        }
+    }
+}
+
+/*
+ * Write a batch of messages. Without TLS or SASL, the marshaller chunks
+ * are written in place with a vectored write. Otherwise, the messages
+ * are coalesced in a single buffer so that they end up in as few
+ * SSL_write() or sasl_encode() calls as possible.
+ *
+ * The messages are unref'ed.
+ */
+/* coroutine context */
+static void spice_channel_write_msgs(SpiceChannel *channel, SpiceMsgOut **msgs, guint n_msgs)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    gboolean use_vectors = !c->tls;
+    GArray *iovecs;
+    guint i;
+
+#ifdef HAVE_SASL
+    if (c->sasl_conn)
+        use_vectors = FALSE;
+#endif
+
+    if (n_msgs == 1 && !use_vectors)
+    {
+        uint8_t *data;
+        int free_data;
+        size_t len;
+
+        /* a single message skips the batch buffer, it is only copied
+         * by spice_marshaller_linearize() if it spans several chunks */
+        if (spice_channel_prepare_msg(channel, msgs[0]))
+        {
+            data = spice_marshaller_linearize(msgs[0]->marshaller, 0, &len, &free_data);
+            spice_channel_write(channel, data, len);
+            if (free_data)
+                g_free(data);
+        }
+        goto end;
+    }
+
+    iovecs = g_array_new(FALSE, FALSE, sizeof(struct iovec));
+    for (i = 0; i < n_msgs; i++)
+    {
+        if (spice_channel_prepare_msg(channel, msgs[i]))
+            spice_channel_msg_append_iovecs(msgs[i], iovecs);
+    }
+
+#if GLIB_CHECK_VERSION(2, 60, 0)
+    if (use_vectors)
+    {
+        GOutputVector *vectors = g_new(GOutputVector, iovecs->len);
+        gsize n_vectors = 0;
+
+        for (i = 0; i < iovecs->len; i++)
+        {
+            struct iovec *iov = &g_array_index(iovecs, struct iovec, i);
+
+            if (iov->iov_len == 0)
+                continue;
+            vectors[n_vectors].buffer = iov->iov_base;
+            vectors[n_vectors].size = iov->iov_len;
+            if (c->capture)
+                spice_capture_record(c->capture, SPICE_CAPTURE_OUT,
+                                     iov->iov_base, iov->iov_len);
+            n_vectors++;
+        }
+        spice_channel_flush_wire_vectors(channel, vectors, n_vectors);
+        g_free(vectors);
+    }
+    else
+#endif
+    {
+        GByteArray *buffer = g_byte_array_new();
+
+        for (i = 0; i < iovecs->len; i++)
+        {
+            struct iovec *iov = &g_array_index(iovecs, struct iovec, i);
+            g_byte_array_append(buffer, iov->iov_base, iov->iov_len);
+        }
+        spice_channel_write(channel, buffer->data, buffer->len);
+        g_byte_array_unref(buffer);
+    }
+    g_array_free(iovecs, TRUE);
+
+end:
+    for (i = 0; i < n_msgs; i++)
+        spice_msg_out_unref(msgs[i]);
+}
+
+/* coroutine context */
+static void spice_channel_write_msg(SpiceChannel *channel, SpiceMsgOut *out)
+{
+    g_return_if_fail(channel != NULL);
+    g_return_if_fail(out != NULL);
+    g_return_if_fail(channel == out->channel);
 
-    spice_msg_out_unref(out);
+    spice_channel_write_msgs(channel, &out, 1);
 }
 
 #ifdef G_OS_UNIX
@@ -1033,6 +1623,7 @@ gint spice_channel_unix_read_fd(SpiceChannel *channel)
     gint fd = -1;
 
     g_return_val_if_fail(g_socket_get_family(c->sock) == G_SOCKET_FAMILY_UNIX, -1);
+    g_warn_if_fail(c->read_buffer_offset == c->read_buffer_length);
 
     while (1)
     {
@@ -1079,6 +1670,7 @@ static int spice_channel_read_wire_nonblocking(SpiceChannel *channel,
 
     if (c->tls)
     {
+        spice_channel_stats_inc(c, &c->tls_reads);
         ret = SSL_read(c->ssl, data, len);
         if (ret < 0)
         {
@@ -1090,6 +1682,7 @@ static int spice_channel_read_wire_nonblocking(SpiceChannel *channel,
     else
     {
         GError *error = NULL;
+        spice_channel_stats_inc(c, &c->socket_reads);
         ret = g_pollable_input_stream_read_nonblocking(G_POLLABLE_INPUT_STREAM(c->in),
                                                        data, len, NULL, &error);
         if (ret < 0)
@@ -1157,6 +1750,78 @@ static int spice_channel_read_wire(SpiceChannel *channel, void *data, size_t len
     }
 }
 
+/* coroutine context */
+static gboolean spice_channel_can_read_ahead(SpiceChannel *channel)
+{
+#ifdef G_OS_UNIX
+    SpiceChannelPrivate *c = channel->priv;
+
+    /* file descriptors sent with SCM_RIGHTS are attached to the byte they
+     * were sent with, reading ahead could drop them silently, see
+     * spice_channel_unix_read_fd() */
+    if (c->channel_type == SPICE_CHANNEL_DISPLAY &&
+        g_socket_get_family(c->sock) == G_SOCKET_FAMILY_UNIX)
+        return FALSE;
+#endif
+    return TRUE;
+}
+
+/*
+ * Read at least 1 more byte of data into the requested buffer, going
+ * through the channel receive buffer. The buffer is refilled with as
+ * much as the socket/TLS layer has available in a single call, so
+ * that consecutive headers and small bodies don't each cost a read.
+ */
+/* coroutine context */
+static int spice_channel_read_buffered(SpiceChannel *channel, void *data, size_t len)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    gsize available = c->read_buffer_length - c->read_buffer_offset;
+    int ret;
+
+    spice_channel_stats_inc(c, &c->total_read_requests);
+
+    if (available == 0)
+    {
+        /* large reads go straight to their destination, there is
+         * nothing to gain by bouncing them through the buffer */
+        if (len >= SPICE_CHANNEL_READ_BUFFER_SIZE ||
+            !spice_channel_can_read_ahead(channel))
+        {
+            spice_channel_stats_inc(c, &c->total_wire_reads);
+            return spice_channel_read_wire(channel, data, len);
+        }
+
+        if (c->read_buffer == NULL)
+            c->read_buffer = g_malloc(SPICE_CHANNEL_READ_BUFFER_SIZE);
+
+        spice_channel_stats_inc(c, &c->total_wire_reads);
+        ret = spice_channel_read_wire(channel, c->read_buffer,
+                                      SPICE_CHANNEL_READ_BUFFER_SIZE);
+        if (ret <= 0)
+            return ret;
+
+        c->read_buffer_offset = 0;
+        c->read_buffer_length = ret;
+        available = ret;
+    }
+
+    len = MIN(len, available);
+    memcpy(data, c->read_buffer + c->read_buffer_offset, len);
+    c->read_buffer_offset += len;
+    if (c->read_buffer_offset == c->read_buffer_length)
+        c->read_buffer_offset = c->read_buffer_length = 0;
+
+    return len;
+}
+
+static inline gboolean spice_channel_has_buffered_data(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    return c->read_buffer_offset < c->read_buffer_length;
+}
+
 #ifdef HAVE_SASL
 /*
  * Read at least 1 more byte of data out of the SASL decrypted
@@ -1176,7 +1841,7 @@ static int spice_channel_read_sasl(SpiceChannel *channel, void *data, size_t len
 
         g_warn_if_fail(c->sasl_decoded_offset == 0);
 
-        ret = spice_channel_read_wire(channel, encoded, sizeof(encoded));
+        ret = spice_channel_read_buffered(channel, encoded, sizeof(encoded));
         if (ret < 0)
             return ret;
 
@@ -1218,6 +1883,7 @@ static int spice_channel_read_sasl(SpiceChannel *channel, void *data, size_t len
 static int spice_channel_read(SpiceChannel *channel, void *data, size_t length)
 {
     SpiceChannelPrivate *c = channel->priv;
+    void *start = data;
     gsize len = length;
     int ret;
 
@@ -1231,7 +1897,7 @@ static int spice_channel_read(SpiceChannel *channel, void *data, size_t length)
             ret = spice_channel_read_sasl(channel, data, len);
         else
 #endif
-            ret = spice_channel_read_wire(channel, data, len);
+            ret = spice_channel_read_buffered(channel, data, len);
         if (ret < 0)
             return ret;
         g_assert(ret <= len);
@@ -1242,7 +1908,12 @@ static int spice_channel_read(SpiceChannel *channel, void *data, size_t length)
             CHANNEL_DEBUG(channel, "still needs %" G_GSIZE_FORMAT, len);
 #endif
     }
+    g_mutex_lock(&c->stats_lock);
     c->total_read_bytes += length;
+    g_mutex_unlock(&c->stats_lock);
+
+    if (c->capture)
+        spice_capture_record(c->capture, SPICE_CAPTURE_IN, start, length);
 
     return length;
 }
@@ -2220,6 +2891,18 @@ error:
     return FALSE;
 }
 
+static gboolean spice_channel_wakeup_cb(gpointer data)
+{
+    spice_channel_wakeup(SPICE_CHANNEL(data), FALSE);
+    return FALSE;
+}
+
+static gboolean spice_channel_cancel_cb(gpointer data)
+{
+    spice_channel_wakeup(SPICE_CHANNEL(data), TRUE);
+    return FALSE;
+}
+
 /* system context */
 G_GNUC_INTERNAL
 void spice_channel_wakeup(SpiceChannel *channel, gboolean cancel)
@@ -2229,12 +2912,99 @@ void spice_channel_wakeup(SpiceChannel *channel, gboolean cancel)
     g_return_if_fail(SPICE_IS_CHANNEL(channel));
     c = &channel->priv->coroutine;
 
+    /* the coroutine can only be resumed from the thread it runs on */
+    if (channel->priv->io_context &&
+        !g_main_context_is_owner(channel->priv->io_context))
+    {
+        g_main_context_invoke_full(channel->priv->io_context, G_PRIORITY_HIGH,
+                                   cancel ? spice_channel_cancel_cb : spice_channel_wakeup_cb,
+                                   g_object_ref(channel), spice_main_context_unref_object);
+        return;
+    }
+
     if (cancel)
         g_coroutine_condition_cancel(c);
 
     g_coroutine_wakeup(c);
 }
 
+/* any context */
+G_GNUC_INTERNAL
+GMainContext *spice_channel_get_context(SpiceChannel *channel)
+{
+    g_return_val_if_fail(SPICE_IS_CHANNEL(channel), NULL);
+
+    if (channel->priv->io_context)
+        return channel->priv->io_context;
+
+    return spice_util_main_context();
+}
+
+/* any context
+ *
+ * Like g_spice_timeout_add_full(), but dispatches @function from the
+ * context the channel runs on, whichever thread it is called from. */
+G_GNUC_INTERNAL
+guint spice_channel_timeout_add_full(SpiceChannel *channel, gint priority, guint interval,
+                                     GSourceFunc function, gpointer data, GDestroyNotify notify)
+{
+    GSource *source;
+    guint id;
+
+    g_return_val_if_fail(function != NULL, 0);
+
+    source = g_timeout_source_new(interval);
+    if (priority != G_PRIORITY_DEFAULT)
+        g_source_set_priority(source, priority);
+
+    g_source_set_callback(source, function, data, notify);
+    id = g_source_attach(source, spice_channel_get_context(channel));
+    g_source_unref(source);
+
+    return id;
+}
+
+G_GNUC_INTERNAL
+guint spice_channel_timeout_add(SpiceChannel *channel, guint interval,
+                                GSourceFunc function, gpointer data)
+{
+    return spice_channel_timeout_add_full(channel, G_PRIORITY_DEFAULT,
+                                          interval, function, data, NULL);
+}
+
+G_GNUC_INTERNAL
+guint spice_channel_idle_add(SpiceChannel *channel, GSourceFunc function, gpointer data)
+{
+    GSource *source;
+    guint id;
+
+    g_return_val_if_fail(function != NULL, 0);
+
+    source = g_idle_source_new();
+    g_source_set_callback(source, function, data, NULL);
+    id = g_source_attach(source, spice_channel_get_context(channel));
+    g_source_unref(source);
+
+    return id;
+}
+
+/* any context */
+G_GNUC_INTERNAL
+gboolean spice_channel_source_remove(SpiceChannel *channel, guint tag)
+{
+    GSource *source;
+
+    g_return_val_if_fail(tag > 0, FALSE);
+
+    source = g_main_context_find_source_by_id(spice_channel_get_context(channel), tag);
+    if (source)
+        g_source_destroy(source);
+    else
+        g_critical("Source ID %u was not found when attempting to remove it", tag);
+
+    return source != NULL;
+}
+
 G_GNUC_INTERNAL
 gboolean spice_channel_get_read_only(SpiceChannel *channel)
 {
@@ -2251,6 +3021,7 @@ void spice_channel_recv_msg(SpiceChannel *channel,
     int msg_size;
     int msg_type;
     int sub_list_offset = 0;
+    gint64 start, parsed, handled;
 
     in = spice_msg_in_new(channel);
 
@@ -2261,10 +3032,9 @@ void spice_channel_recv_msg(SpiceChannel *channel,
         goto end;
 
     msg_size = spice_header_get_msg_size(in->header, c->use_mini_header);
-    /* FIXME: do not allow others to take ref on in, and use realloc here?
-     * this would avoid malloc/free on each message?
-     */
-    in->data = g_malloc0(msg_size);
+    /* the body is entirely overwritten by spice_channel_read(), no
+     * need to clear the recycled buffer */
+    in->data = spice_buffer_pool_alloc(c->msg_pool, msg_size);
     spice_channel_read(channel, in->data, msg_size);
     if (c->has_error)
         goto end;
@@ -2283,20 +3053,28 @@ void spice_channel_recv_msg(SpiceChannel *channel,
         sub_list = (SpiceSubMessageList *)(in->data + sub_list_offset);
         for (i = 0; i < sub_list->size; i++)
         {
+            int sub_type;
+
             sub = (SpiceSubMessage *)(in->data + sub_list->sub_messages[i]);
             sub_in = spice_msg_in_sub_new(channel, in, sub);
+            sub_type = spice_header_get_msg_type(sub_in->header, c->use_mini_header);
+            start = g_get_monotonic_time();
             sub_in->parsed = c->parser(sub_in->data, sub_in->data + sub_in->dpos,
-                                       spice_header_get_msg_type(sub_in->header,
-                                                                 c->use_mini_header),
-                                       c->peer_hdr.minor_version,
+                                       sub_type, c->peer_hdr.minor_version,
                                        &sub_in->psize, &sub_in->pfree);
             if (sub_in->parsed == NULL)
             {
                 g_critical("failed to parse sub-message: %s type %d",
-                           c->name, spice_header_get_msg_type(sub_in->header, c->use_mini_header));
+                           c->name, sub_type);
                 goto end;
             }
+            parsed = g_get_monotonic_time();
             msg_handler(channel, sub_in, data);
+            handled = g_get_monotonic_time();
+            spice_channel_msg_stats_add(channel, c->msg_in_stats, sub_type,
+                                        spice_header_get_header_size(c->use_mini_header) +
+                                        sub_in->dpos,
+                                        parsed - start, handled - parsed);
             spice_msg_in_unref(sub_in);
         }
     }
@@ -2315,10 +3093,14 @@ void spice_channel_recv_msg(SpiceChannel *channel,
 
     if (msg_type == SPICE_MSG_LIST)
     {
+        spice_channel_msg_stats_add(channel, c->msg_in_stats, msg_type,
+                                    spice_header_get_header_size(c->use_mini_header) +
+                                    msg_size, 0, 0);
         goto end;
     }
 
     /* parse message */
+    start = g_get_monotonic_time();
     in->parsed = c->parser(in->data, in->data + msg_size, msg_type,
                            c->peer_hdr.minor_version, &in->psize, &in->pfree);
     if (in->parsed == NULL)
@@ -2327,16 +3109,23 @@ void spice_channel_recv_msg(SpiceChannel *channel,
                    c->name, msg_type);
         goto end;
     }
+    parsed = g_get_monotonic_time();
 
     /* process message */
     /* spice_msg_in_hexdump(in); */
     msg_handler(channel, in, data);
+    handled = g_get_monotonic_time();
+    spice_channel_msg_stats_add(channel, c->msg_in_stats, msg_type,
+                                spice_header_get_header_size(c->use_mini_header) + msg_size,
+                                parsed - start, handled - parsed);
 
 end:
     /* If the server uses full header, the serial is not necessarily equal
      * to c->in_serial (the server can sometimes skip serials) */
     c->last_message_serial = spice_header_get_in_msg_serial(in);
     c->in_serial++;
+    /* see wait_for_channel() */
+    g_coroutine_condition_changed();
     spice_msg_in_unref(in);
 }
 
@@ -2544,24 +3333,92 @@ static void spice_channel_flushed(SpiceChannel *channel, gboolean success)
     c->flushing = NULL;
 }
 
+/*
+ * Pick the next batch of messages to write. The classes are visited in
+ * priority order, each one taking messages up to its byte budget, then
+ * the remaining room in the batch is filled in priority order again.
+ * Each non-empty class gets at least one message in the batch, so that
+ * a large message can't be starved.
+ *
+ * The bulk data may follow the normal messages it depends on, like the
+ * agent data after MAIN_AGENT_START: a bulk message never overtakes a
+ * normal message queued before it.
+ */
+/* coroutine context, xmit_queue_lock must be held */
+G_GNUC_INTERNAL
+guint spice_channel_xmit_dequeue(SpiceChannel *channel,
+                                 SpiceMsgOut **batch, guint max_msgs)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    gsize class_size[SPICE_MSG_OUT_PRIORITY_LAST] = { 0, };
+    gint64 now = g_get_monotonic_time();
+    gsize batch_size = 0;
+    guint n_msgs = 0;
+    int pass, prio;
+
+    for (pass = 0; pass < 2; pass++)
+    {
+        for (prio = 0; prio < SPICE_MSG_OUT_PRIORITY_LAST; prio++)
+        {
+            SpiceXmitQueue *queue = &c->xmit_queue[prio];
+
+            while (n_msgs < max_msgs)
+            {
+                SpiceMsgOut *out = g_queue_peek_head(&queue->msgs);
+                gint64 wait;
+                guint32 size;
+
+                if (out == NULL)
+                    break;
+                if (prio == SPICE_MSG_OUT_PRIORITY_BULK)
+                {
+                    SpiceMsgOut *normal =
+                        g_queue_peek_head(&c->xmit_queue[SPICE_MSG_OUT_PRIORITY_NORMAL].msgs);
+
+                    if (normal != NULL && normal->queue_seq < out->queue_seq)
+                        break;
+                }
+                size = spice_marshaller_get_total_size(out->marshaller);
+                if (class_size[prio] > 0 &&
+                    (batch_size + size > SPICE_CHANNEL_WRITE_BATCH_MAX_BYTES ||
+                     (pass == 0 && class_size[prio] + size > xmit_budget[prio])))
+                    break;
+
+                g_queue_pop_head(&queue->msgs);
+                queue->stats.size = (queue->stats.size < size) ? 0 : queue->stats.size - size;
+                c->xmit_queue_size = (c->xmit_queue_size < size) ? 0 : c->xmit_queue_size - size;
+
+                wait = now - out->queue_time;
+                queue->stats.sent_msgs++;
+                queue->stats.total_wait_us += wait;
+                queue->stats.max_wait_us = MAX(queue->stats.max_wait_us, wait);
+
+                batch[n_msgs++] = out;
+                batch_size += size;
+                class_size[prio] += size;
+            }
+        }
+    }
+
+    return n_msgs;
+}
+
 /* coroutine context */
 static void spice_channel_iterate_write(SpiceChannel *channel)
 {
     SpiceChannelPrivate *c = channel->priv;
-    SpiceMsgOut *out;
+    SpiceMsgOut *batch[SPICE_CHANNEL_WRITE_BATCH_MAX_MSGS];
+    guint n_msgs;
 
     do
     {
         g_mutex_lock(&c->xmit_queue_lock);
-        out = g_queue_pop_head(&c->xmit_queue);
+        n_msgs = spice_channel_xmit_dequeue(channel, batch, G_N_ELEMENTS(batch));
         g_mutex_unlock(&c->xmit_queue_lock);
-        if (out)
-        {
-            guint32 size = spice_marshaller_get_total_size(out->marshaller);
-            c->xmit_queue_size = (c->xmit_queue_size < size) ? 0 : c->xmit_queue_size - size;
-            spice_channel_write_msg(channel, out);
-        }
-    } while (out);
+
+        if (n_msgs > 0)
+            spice_channel_write_msgs(channel, batch, n_msgs);
+    } while (n_msgs > 0);
 
     spice_channel_flushed(channel, TRUE);
 }
@@ -2571,12 +3428,14 @@ static void spice_channel_iterate_read(SpiceChannel *channel)
 {
     SpiceChannelPrivate *c = channel->priv;
 
-    g_coroutine_socket_wait(&c->coroutine, c->sock, G_IO_IN);
+    if (!spice_channel_has_buffered_data(channel))
+        g_coroutine_socket_wait(&c->coroutine, c->sock, G_IO_IN);
 
     /* treat all incoming data (block on message completion) */
     while (!c->has_error &&
            c->state != SPICE_CHANNEL_STATE_MIGRATING &&
-           (g_pollable_input_stream_is_readable(G_POLLABLE_INPUT_STREAM(c->in))
+           (spice_channel_has_buffered_data(channel) ||
+            g_pollable_input_stream_is_readable(G_POLLABLE_INPUT_STREAM(c->in))
 #ifdef HAVE_SASL
             /* flush the sasl buffer too */
             || c->sasl_decoded != NULL
@@ -2670,7 +3529,9 @@ static gboolean spice_channel_delayed_unref(gpointer data)
     if (was_ready)
         g_coroutine_signal_emit(channel, signals[SPICE_CHANNEL_EVENT], 0, SPICE_CHANNEL_CLOSED);
 
-    g_object_unref(channel);
+    /* the channel may be finalized by this unref, do it from the main
+     * context like for the other channels */
+    spice_main_context_unref_object(channel);
 
     return FALSE;
 }
@@ -2762,6 +3623,39 @@ const GError *spice_channel_get_error(SpiceChannel *self)
     return c->error;
 }
 
+/* coroutine context */
+static void spice_channel_capture_start(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    const gchar *dir = g_getenv("SPICE_CAPTURE_DIR");
+    GError *error = NULL;
+    gchar *basename, *filename;
+    gboolean append;
+    gint64 start;
+
+    if (dir == NULL || c->capture != NULL)
+        return;
+
+    basename = g_strdup_printf(SPICE_CAPTURE_FILENAME_FORMAT,
+                               spice_channel_type_to_string(c->channel_type),
+                               c->channel_id);
+    filename = g_build_filename(dir, basename, NULL);
+
+    /* a reconnection doesn't overwrite the previous ones */
+    start = spice_session_get_capture_start(c->session, filename, &append);
+    c->capture = spice_capture_new(filename, c->channel_type, c->channel_id,
+                                   start, append, &error);
+    if (c->capture)
+        CHANNEL_DEBUG(channel, "%s traffic to %s",
+                      append ? "appending" : "capturing", filename);
+    else
+        g_warning("%s: %s", c->name, error->message);
+
+    g_clear_error(&error);
+    g_free(filename);
+    g_free(basename);
+}
+
 /* coroutine context */
 static void *spice_channel_coroutine(void *data)
 {
@@ -2921,6 +3815,7 @@ connected:
     c->has_error = FALSE;
     c->in = g_io_stream_get_input_stream(G_IO_STREAM(c->conn));
     c->out = g_io_stream_get_output_stream(G_IO_STREAM(c->conn));
+    spice_channel_capture_start(channel);
 
     rc = setsockopt(g_socket_get_fd(c->sock), IPPROTO_TCP, TCP_NODELAY,
                     (const char *)&delay_val, sizeof(delay_val));
@@ -2954,14 +3849,14 @@ cleanup:
         g_warn_if_fail(c->event == SPICE_CHANNEL_NONE);
         if (channel_connect(channel, c->tls))
         {
-            g_object_unref(channel);
+            spice_main_context_unref_object(channel);
             return NULL;
         }
 
         c->event = SPICE_CHANNEL_ERROR_CONNECT;
     }
 
-    g_spice_idle_add(spice_channel_delayed_unref, channel);
+    spice_channel_idle_add(channel, spice_channel_delayed_unref, channel);
     /* Co-routine exits now - the SpiceChannel object may no longer exist,
        so don't do anything else now unless you like SEGVs */
     return NULL;
@@ -2974,7 +3869,11 @@ static gboolean connect_delayed(gpointer data)
     struct coroutine *co;
 
     CHANNEL_DEBUG(channel, "Open coroutine starting %p", channel);
+    /* locked as with xmit_queue_wakeup_id, the channel may be connected
+     * from another thread than the one it runs on */
+    g_mutex_lock(&c->xmit_queue_lock);
     c->connect_delayed_id = 0;
+    g_mutex_unlock(&c->xmit_queue_lock);
 
     co = &c->coroutine.coroutine;
 
@@ -3023,7 +3922,9 @@ static gboolean channel_connect(SpiceChannel *channel, gboolean tls)
     g_object_ref(G_OBJECT(channel)); /* Unref'd when co-routine exits */
 
     /* we connect in idle, to let previous coroutine exit, if present */
-    c->connect_delayed_id = g_spice_idle_add(connect_delayed, channel);
+    g_mutex_lock(&c->xmit_queue_lock);
+    c->connect_delayed_id = spice_channel_idle_add(channel, connect_delayed, channel);
+    g_mutex_unlock(&c->xmit_queue_lock);
 
     return true;
 }
@@ -3087,13 +3988,16 @@ gboolean spice_channel_open_fd(SpiceChannel *channel, int fd)
 static void channel_reset(SpiceChannel *channel, gboolean migrating)
 {
     SpiceChannelPrivate *c = channel->priv;
+    int i;
 
     CHANNEL_DEBUG(channel, "channel reset");
+    g_mutex_lock(&c->xmit_queue_lock);
     if (c->connect_delayed_id)
     {
-        g_spice_source_remove(c->connect_delayed_id);
+        spice_channel_source_remove(channel, c->connect_delayed_id);
         c->connect_delayed_id = 0;
     }
+    g_mutex_unlock(&c->xmit_queue_lock);
 
 #ifdef HAVE_SASL
     if (c->sasl_conn)
@@ -3111,6 +4015,11 @@ static void channel_reset(SpiceChannel *channel, gboolean migrating)
     g_clear_object(&c->conn);
     g_clear_object(&c->sock);
 
+    g_clear_pointer(&c->read_buffer, g_free);
+    c->read_buffer_offset = c->read_buffer_length = 0;
+    spice_buffer_pool_trim(c->msg_pool);
+    g_clear_pointer(&c->capture, spice_capture_free);
+
     c->fd = -1;
 
     c->auth_needs_username = FALSE;
@@ -3120,12 +4029,17 @@ static void channel_reset(SpiceChannel *channel, gboolean migrating)
 
     g_mutex_lock(&c->xmit_queue_lock);
     c->xmit_queue_blocked = TRUE; /* Disallow queuing new messages */
-    gboolean was_empty = g_queue_is_empty(&c->xmit_queue);
-    g_queue_foreach(&c->xmit_queue, (GFunc)spice_msg_out_unref, NULL);
-    g_queue_clear(&c->xmit_queue);
+    gboolean was_empty = xmit_queue_is_empty(c);
+    for (i = 0; i < SPICE_MSG_OUT_PRIORITY_LAST; i++)
+    {
+        g_queue_foreach(&c->xmit_queue[i].msgs, (GFunc)spice_msg_out_unref, NULL);
+        g_queue_clear(&c->xmit_queue[i].msgs);
+        c->xmit_queue[i].stats.size = 0;
+    }
+    c->xmit_queue_size = 0;
     if (c->xmit_queue_wakeup_id)
     {
-        g_spice_source_remove(c->xmit_queue_wakeup_id);
+        spice_channel_source_remove(channel, c->xmit_queue_wakeup_id);
         c->xmit_queue_wakeup_id = 0;
     }
     g_mutex_unlock(&c->xmit_queue_lock);
@@ -3178,6 +4092,8 @@ void spice_channel_disconnect(SpiceChannel *channel, SpiceChannelEvent reason)
     if (c->state == SPICE_CHANNEL_STATE_MIGRATING)
     {
         c->state = SPICE_CHANNEL_STATE_READY;
+        /* see wait_migration() */
+        g_coroutine_condition_changed();
     }
     else
         spice_channel_wakeup(channel, TRUE);
@@ -3314,6 +4230,21 @@ guint64 spice_channel_get_queue_size(SpiceChannel *channel)
     return size;
 }
 
+G_GNUC_INTERNAL
+void spice_channel_get_queue_stats(SpiceChannel *channel, SpiceMsgOutPriority priority,
+                                   SpiceXmitQueueStats *stats)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    g_return_if_fail(priority < SPICE_MSG_OUT_PRIORITY_LAST);
+    g_return_if_fail(stats != NULL);
+
+    g_mutex_lock(&c->xmit_queue_lock);
+    *stats = c->xmit_queue[priority].stats;
+    stats->depth = g_queue_get_length(&c->xmit_queue[priority].msgs);
+    g_mutex_unlock(&c->xmit_queue_lock);
+}
+
 G_GNUC_INTERNAL
 void spice_channel_swap(SpiceChannel *channel, SpiceChannel *swap, gboolean swap_msgs)
 {
@@ -3342,10 +4273,20 @@ void spice_channel_swap(SpiceChannel *channel, SpiceChannel *swap, gboolean swap
     SWAP(ssl);
     SWAP(sslverify);
     SWAP(tls);
+    SWAP(read_buffer);
+    SWAP(read_buffer_offset);
+    SWAP(read_buffer_length);
     SWAP(use_mini_header);
     if (swap_msgs)
     {
-        SWAP(xmit_queue);
+        int i;
+
+        for (i = 0; i < SPICE_MSG_OUT_PRIORITY_LAST; i++)
+        {
+            SpiceXmitQueue queue = c->xmit_queue[i];
+            c->xmit_queue[i] = s->xmit_queue[i];
+            s->xmit_queue[i] = queue;
+        }
         SWAP(xmit_queue_blocked);
         SWAP(in_serial);
         SWAP(out_serial);
@@ -3430,7 +4371,7 @@ void spice_channel_flush_async(SpiceChannel *self, GCancellable *cancellable,
     task = g_task_new(self, cancellable, callback, user_data);
 
     g_mutex_lock(&c->xmit_queue_lock);
-    was_empty = g_queue_is_empty(&c->xmit_queue);
+    was_empty = xmit_queue_is_empty(c);
     g_mutex_unlock(&c->xmit_queue_lock);
     if (was_empty)
     {
@@ -28,6 +28,10 @@
 
 G_BEGIN_DECLS
 
+#define FILE_XFER_CHUNK_SIZE (VD_AGENT_MAX_DATA_SIZE * 32)
+/* chunks allocated by all the transfers of a channel to read ahead */
+#define FILE_XFER_CHANNEL_CHUNKS 6
+
 void spice_file_transfer_task_completed(SpiceFileTransferTask *self, GError *error);
 guint32 spice_file_transfer_task_get_id(SpiceFileTransferTask *self);
 SpiceMainChannel *spice_file_transfer_task_get_channel(SpiceFileTransferTask *self);
@@ -49,6 +53,10 @@ gssize spice_file_transfer_task_read_finish(SpiceFileTransferTask *self,
                                             GAsyncResult *result,
                                             char **buffer,
                                             GError **error);
+GBytes *spice_file_transfer_task_read_finish_bytes(SpiceFileTransferTask *self,
+                                                   GAsyncResult *result,
+                                                   GError **error);
 gboolean spice_file_transfer_task_is_completed(SpiceFileTransferTask *self);
+guint spice_file_transfer_task_get_max_chunks(SpiceFileTransferTask *self);
 
 G_END_DECLS
@@ -37,6 +37,22 @@
  * Since: 0.31
  */
 
+typedef struct FileTransferChunk
+{
+    char                           *data;
+    gsize                          size;
+    SpiceFileTransferTask          *task; /* while lent as GBytes */
+} FileTransferChunk;
+
+/* The chunks of all the transfers of a channel, the read ahead of its
+ * tasks shares FILE_XFER_CHANNEL_CHUNKS of them */
+typedef struct FileTransferBudget
+{
+    guint                          ref;
+    guint                          chunks;
+    guint                          max_chunks;
+} FileTransferBudget;
+
 struct _SpiceFileTransferTask
 {
     GObject parent;
@@ -51,12 +67,26 @@ struct _SpiceFileTransferTask
     GCancellable                   *cancellable;
     GAsyncReadyCallback            callback;
     gpointer                       user_data;
-    char                           *buffer;
     uint64_t                       read_bytes;
     uint64_t                       file_size;
     gint64                         start_time;
     gint64                         last_update;
     GError                         *error;
+
+    /* read ahead of the channel, see spice_file_transfer_task_read_ahead() */
+    FileTransferBudget             *budget;
+    GTask                          *read_task;
+    FileTransferChunk              *chunk;
+    FileTransferChunk              *reading;
+    GQueue                         ready;
+    GQueue                         spare;
+    uint64_t                       stream_bytes;
+    gboolean                       eof;
+    GError                         *read_error;
+
+    gint64                         rate_time;
+    uint64_t                       rate_bytes;
+    uint64_t                       transfer_rate;
 };
 
 struct _SpiceFileTransferTaskClass
@@ -66,7 +96,10 @@ struct _SpiceFileTransferTaskClass
 
 G_DEFINE_TYPE(SpiceFileTransferTask, spice_file_transfer_task, G_TYPE_OBJECT)
 
-#define FILE_XFER_CHUNK_SIZE (VD_AGENT_MAX_DATA_SIZE * 32)
+/* chunks read from the file ahead of the channel, by a task */
+#define FILE_XFER_READ_AHEAD 4
+/* period over which the transfer rate is measured */
+#define FILE_XFER_RATE_INTERVAL G_TIME_SPAN_SECOND
 
 enum {
     PROP_TASK_ID = 1,
@@ -76,6 +109,7 @@ enum {
     PROP_TASK_TOTAL_BYTES,
     PROP_TASK_TRANSFERRED_BYTES,
     PROP_TASK_PROGRESS,
+    PROP_TASK_TRANSFER_RATE,
 };
 
 enum {
@@ -89,8 +123,47 @@ static guint task_signals[LAST_TASK_SIGNAL];
  * Helpers
  ******************************************************************************/
 
+static FileTransferBudget *file_transfer_budget_ref(FileTransferBudget *budget)
+{
+    budget->ref++;
+    return budget;
+}
+
+static void file_transfer_budget_unref(gpointer user_data)
+{
+    FileTransferBudget *budget = user_data;
+
+    if (--budget->ref > 0)
+        return;
+
+    g_warn_if_fail(budget->chunks == 0);
+    g_free(budget);
+}
+
+/* the budget of the tasks of @channel, or of the tasks created together
+ * without a channel */
+static FileTransferBudget *file_transfer_budget_get(SpiceMainChannel *channel)
+{
+    FileTransferBudget *budget;
+
+    if (channel != NULL) {
+        budget = g_object_get_data(G_OBJECT(channel), "spice-file-xfer-budget");
+        if (budget != NULL)
+            return file_transfer_budget_ref(budget);
+    }
+
+    budget = g_new0(FileTransferBudget, 1);
+    budget->ref = 1;
+    if (channel != NULL)
+        g_object_set_data_full(G_OBJECT(channel), "spice-file-xfer-budget",
+                               file_transfer_budget_ref(budget),
+                               file_transfer_budget_unref);
+    return budget;
+}
+
 static SpiceFileTransferTask *
 spice_file_transfer_task_new(SpiceMainChannel *channel,
+                             FileTransferBudget *budget,
                              GFile *file,
                              GFileCopyFlags flags,
                              GCancellable *cancellable)
@@ -112,6 +185,7 @@ spice_file_transfer_task_new(SpiceMainChannel *channel,
                         "cancellable", task_cancellable,
                         NULL);
     self->flags = flags;
+    self->budget = file_transfer_budget_ref(budget);
 
     /* if we created a GCancellable above, unref it */
     if (!cancellable)
@@ -198,53 +272,6 @@ static void spice_file_transfer_task_read_file_cb(GObject *obj,
                             task);
 }
 
-static void spice_file_transfer_task_read_stream_cb(GObject *source_object,
-                                                    GAsyncResult *res,
-                                                    gpointer userdata)
-{
-    SpiceFileTransferTask *self;
-    GTask *task;
-    gssize nbytes;
-    GError *error = NULL;
-
-    task = G_TASK(userdata);
-    self = g_task_get_source_object(task);
-
-    g_return_if_fail(self->pending == TRUE);
-    self->pending = FALSE;
-
-    nbytes = g_input_stream_read_finish(G_INPUT_STREAM(self->file_stream), res, &error);
-    if (self->error) {
-        g_clear_error(&error);
-        /* On any pending error on SpiceFileTransferTask */
-        g_task_return_error(task, g_error_copy(self->error));
-        g_object_unref(task);
-        return;
-    } else if (error) {
-        g_task_return_error(task, error);
-        g_object_unref(task);
-        return;
-    }
-
-    self->read_bytes += nbytes;
-
-    if (spice_util_get_debug()) {
-        const GTimeSpan interval = 20 * G_TIME_SPAN_SECOND;
-        gint64 now = g_get_monotonic_time();
-
-        if (interval < now - self->last_update) {
-            gchar *basename = g_file_get_basename(self->file);
-            self->last_update = now;
-            SPICE_DEBUG("read %.2f%% of the file %s",
-                        100.0 * self->read_bytes / self->file_size, basename);
-            g_free(basename);
-        }
-    }
-
-    g_task_return_int(task, nbytes);
-    g_object_unref(task);
-}
-
 /* main context */
 static void spice_file_transfer_task_close_stream_cb(GObject      *object,
                                                      GAsyncResult *close_res,
@@ -283,6 +310,178 @@ static void spice_file_transfer_task_close_stream_cb(GObject      *object,
     g_object_unref(self);
 }
 
+static void file_transfer_chunk_free(FileTransferChunk *chunk)
+{
+    g_free(chunk->data);
+    g_free(chunk);
+}
+
+static FileTransferChunk *spice_file_transfer_task_new_chunk(SpiceFileTransferTask *self)
+{
+    FileTransferChunk *chunk = g_new0(FileTransferChunk, 1);
+
+    chunk->data = g_malloc(FILE_XFER_CHUNK_SIZE);
+    self->budget->chunks++;
+    self->budget->max_chunks = MAX(self->budget->max_chunks, self->budget->chunks);
+
+    return chunk;
+}
+
+static void spice_file_transfer_task_free_chunk(SpiceFileTransferTask *self,
+                                                FileTransferChunk *chunk)
+{
+    self->budget->chunks--;
+    file_transfer_chunk_free(chunk);
+}
+
+/* keeps a chunk done with for the next reads, unless the transfer is over
+ * or a pending read took it over the budget of the channel */
+static void spice_file_transfer_task_recycle_chunk(SpiceFileTransferTask *self,
+                                                   FileTransferChunk *chunk)
+{
+    if (self->completed || self->budget->chunks > FILE_XFER_CHANNEL_CHUNKS)
+        spice_file_transfer_task_free_chunk(self, chunk);
+    else
+        g_queue_push_tail(&self->spare, chunk);
+}
+
+/* The rate is measured over periods of FILE_XFER_RATE_INTERVAL, or over
+ * the whole transfer when it is shorter than that */
+static void spice_file_transfer_task_update_rate(SpiceFileTransferTask *self)
+{
+    gint64 now = g_get_monotonic_time();
+    gint64 elapsed = now - self->rate_time;
+
+    if (elapsed < FILE_XFER_RATE_INTERVAL &&
+        (self->read_bytes < self->file_size || self->rate_bytes != 0))
+        return;
+
+    self->transfer_rate = (self->read_bytes - self->rate_bytes) * G_TIME_SPAN_SECOND / MAX(elapsed, 1);
+    self->rate_time = now;
+    self->rate_bytes = self->read_bytes;
+    g_coroutine_object_notify(G_OBJECT(self), "transfer-rate");
+}
+
+/* hands the oldest chunk read ahead to the caller of read_async() */
+static void spice_file_transfer_task_return_chunk(SpiceFileTransferTask *self,
+                                                  GTask *task)
+{
+    FileTransferChunk *chunk = g_queue_pop_head(&self->ready);
+
+    g_warn_if_fail(self->chunk == NULL);
+    self->chunk = chunk;
+    self->read_bytes += chunk->size;
+    spice_file_transfer_task_update_rate(self);
+
+    if (spice_util_get_debug()) {
+        const GTimeSpan interval = 20 * G_TIME_SPAN_SECOND;
+        gint64 now = g_get_monotonic_time();
+
+        if (interval < now - self->last_update) {
+            gchar *basename = g_file_get_basename(self->file);
+            self->last_update = now;
+            SPICE_DEBUG("read %.2f%% of the file %s",
+                        100.0 * self->read_bytes / self->file_size, basename);
+            g_free(basename);
+        }
+    }
+
+    g_task_return_int(task, chunk->size);
+    g_object_unref(task);
+}
+
+static void spice_file_transfer_task_read_ahead(SpiceFileTransferTask *self);
+
+static void spice_file_transfer_task_read_stream_cb(GObject *source_object,
+                                                    GAsyncResult *res,
+                                                    gpointer userdata)
+{
+    SpiceFileTransferTask *self = userdata;
+    FileTransferChunk *chunk = self->reading;
+    GTask *task = self->read_task;
+    gssize nbytes;
+    GError *error = NULL;
+
+    self->reading = NULL;
+    nbytes = g_input_stream_read_finish(G_INPUT_STREAM(source_object), res, &error);
+    if (nbytes > 0) {
+        chunk->size = nbytes;
+        self->stream_bytes += nbytes;
+        g_queue_push_tail(&self->ready, chunk);
+    } else {
+        spice_file_transfer_task_recycle_chunk(self, chunk);
+        self->eof = (error == NULL);
+    }
+
+    if (task != NULL) {
+        self->read_task = NULL;
+        self->pending = FALSE;
+        if (self->error) {
+            g_clear_error(&error);
+            /* On any pending error on SpiceFileTransferTask */
+            g_task_return_error(task, g_error_copy(self->error));
+            g_object_unref(task);
+        } else if (error) {
+            g_task_return_error(task, error);
+            g_object_unref(task);
+        } else if (nbytes == 0) {
+            g_task_return_int(task, 0);
+            g_object_unref(task);
+        } else {
+            spice_file_transfer_task_return_chunk(self, task);
+        }
+    } else if (self->completed) {
+        /* completed while reading ahead, the stream can be closed now */
+        g_clear_error(&error);
+        g_input_stream_close_async(G_INPUT_STREAM(self->file_stream),
+                                   G_PRIORITY_DEFAULT,
+                                   self->cancellable,
+                                   spice_file_transfer_task_close_stream_cb,
+                                   self);
+    } else if (error) {
+        /* reported by the next read_async() */
+        self->read_error = error;
+    }
+
+    spice_file_transfer_task_read_ahead(self);
+    g_object_unref(self);
+}
+
+/* Reads the next chunks of the file while the channel is sending the
+ * previous ones, so that the disk reads and the network writes overlap.
+ * A stream has only one pending operation, the chunks are read one after
+ * the other, up to FILE_XFER_READ_AHEAD of them waiting for read_async(),
+ * and new chunks are only allocated within the budget of the channel */
+static void spice_file_transfer_task_read_ahead(SpiceFileTransferTask *self)
+{
+    FileTransferChunk *chunk;
+
+    if (self->reading != NULL || self->completed || self->eof || self->read_error != NULL)
+        return;
+
+    /* a pending read_async() always reads, to find the end of the file */
+    if (self->read_task == NULL &&
+        (g_queue_get_length(&self->ready) >= FILE_XFER_READ_AHEAD ||
+         self->stream_bytes >= self->file_size))
+        return;
+
+    chunk = g_queue_pop_head(&self->spare);
+    if (chunk == NULL) {
+        if (self->read_task == NULL && self->budget->chunks >= FILE_XFER_CHANNEL_CHUNKS)
+            return;
+        chunk = spice_file_transfer_task_new_chunk(self);
+    }
+
+    self->reading = chunk;
+    g_input_stream_read_async(G_INPUT_STREAM(self->file_stream),
+                              chunk->data,
+                              FILE_XFER_CHUNK_SIZE,
+                              G_PRIORITY_DEFAULT,
+                              self->cancellable,
+                              spice_file_transfer_task_read_stream_cb,
+                              g_object_ref(self));
+}
+
 
 /*******************************************************************************
  * Internal API
@@ -292,8 +491,16 @@ G_GNUC_INTERNAL
 void spice_file_transfer_task_completed(SpiceFileTransferTask *self,
                                         GError *error)
 {
+    FileTransferChunk *chunk;
+
     self->completed = TRUE;
 
+    /* give the chunks read ahead back to the other transfers */
+    while ((chunk = g_queue_pop_head(&self->ready)) != NULL)
+        spice_file_transfer_task_free_chunk(self, chunk);
+    while ((chunk = g_queue_pop_head(&self->spare)) != NULL)
+        spice_file_transfer_task_free_chunk(self, chunk);
+
     /* In case of multiple errors we only report the first error */
     if (self->error)
         g_clear_error(&error);
@@ -320,11 +527,14 @@ void spice_file_transfer_task_completed(SpiceFileTransferTask *self,
         goto signal;
     }
 
-    g_input_stream_close_async(G_INPUT_STREAM(self->file_stream),
-                               G_PRIORITY_DEFAULT,
-                               self->cancellable,
-                               spice_file_transfer_task_close_stream_cb,
-                               self);
+    /* with a read ahead going on, the stream is closed once it is done */
+    if (self->reading == NULL) {
+        g_input_stream_close_async(G_INPUT_STREAM(self->file_stream),
+                                   G_PRIORITY_DEFAULT,
+                                   self->cancellable,
+                                   spice_file_transfer_task_close_stream_cb,
+                                   self);
+    }
     self->pending = TRUE;
 signal:
     g_coroutine_signal_emit(self, task_signals[SIGNAL_FINISHED], 0, self->error);
@@ -365,19 +575,22 @@ GHashTable *spice_file_transfer_task_create_tasks(GFile **files,
                                                   GCancellable *cancellable)
 {
     GHashTable *xfer_ht;
+    FileTransferBudget *budget;
     gint i;
 
     g_return_val_if_fail(files != NULL && files[0] != NULL, NULL);
 
+    budget = file_transfer_budget_get(channel);
     xfer_ht = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_object_unref);
     for (i = 0; files[i] != NULL && !g_cancellable_is_cancelled(cancellable); i++) {
         SpiceFileTransferTask *xfer_task;
         guint32 task_id;
 
-        xfer_task = spice_file_transfer_task_new(channel, files[i], flags, cancellable);
+        xfer_task = spice_file_transfer_task_new(channel, budget, files[i], flags, cancellable);
         task_id = spice_file_transfer_task_get_id(xfer_task);
         g_hash_table_insert(xfer_ht, GUINT_TO_POINTER(task_id), g_object_ref(xfer_task));
     }
+    file_transfer_budget_unref(budget);
     return xfer_ht;
 }
 
@@ -430,6 +643,12 @@ void spice_file_transfer_task_read_async(SpiceFileTransferTask *self,
         return;
     }
 
+    /* The chunk returned by the previous read is done with */
+    if (self->chunk != NULL) {
+        spice_file_transfer_task_recycle_chunk(self, self->chunk);
+        self->chunk = NULL;
+    }
+
     /* Notify the progress prior the read to make the info be related to the
      * data that was already sent. To notify the 100% (completed), channel-main
      * should call read-async when it expects EOF. */
@@ -437,8 +656,27 @@ void spice_file_transfer_task_read_async(SpiceFileTransferTask *self,
     g_coroutine_object_notify(G_OBJECT(self), "transferred-bytes");
 
     task = g_task_new(self, self->cancellable, callback, userdata);
+    if (g_task_return_error_if_cancelled(task)) {
+        g_object_unref(task);
+        return;
+    }
+
+    if (self->rate_time == 0)
+        self->rate_time = g_get_monotonic_time();
+
+    if (!g_queue_is_empty(&self->ready)) {
+        spice_file_transfer_task_return_chunk(self, task);
+        spice_file_transfer_task_read_ahead(self);
+        return;
+    }
+
+    if (self->read_error != NULL) {
+        g_task_return_error(task, g_steal_pointer(&self->read_error));
+        g_object_unref(task);
+        return;
+    }
 
-    if (self->read_bytes == self->file_size) {
+    if (self->read_bytes == self->file_size || self->eof) {
         /* channel-main might request data after reading the whole file as it
          * expects EOF. Let's return immediately its request as we don't want to
          * reach a state where agent says file-transfer SUCCEED but we are in a
@@ -449,15 +687,11 @@ void spice_file_transfer_task_read_async(SpiceFileTransferTask *self,
     }
 
     self->pending = TRUE;
-    g_input_stream_read_async(G_INPUT_STREAM(self->file_stream),
-                              self->buffer,
-                              FILE_XFER_CHUNK_SIZE,
-                              G_PRIORITY_DEFAULT,
-                              self->cancellable,
-                              spice_file_transfer_task_read_stream_cb,
-                              task);
+    self->read_task = task;
+    spice_file_transfer_task_read_ahead(self);
 }
 
+/* @buffer stays valid until the next read_async() */
 G_GNUC_INTERNAL
 gssize spice_file_transfer_task_read_finish(SpiceFileTransferTask *self,
                                             GAsyncResult *result,
@@ -471,11 +705,55 @@ gssize spice_file_transfer_task_read_finish(SpiceFileTransferTask *self,
 
     nbytes = g_task_propagate_int(task, error);
     if (nbytes >= 0 && buffer != NULL)
-        *buffer = self->buffer;
+        *buffer = nbytes > 0 ? self->chunk->data : NULL;
 
     return nbytes;
 }
 
+static void file_transfer_chunk_release(gpointer user_data)
+{
+    FileTransferChunk *chunk = user_data;
+    SpiceFileTransferTask *self = chunk->task;
+
+    chunk->task = NULL;
+    spice_file_transfer_task_recycle_chunk(self, chunk);
+    g_object_unref(self);
+}
+
+/* Like read_finish(), but the data is lent in a GBytes that may outlive
+ * the next read_async(), the chunk is only read into again once the
+ * GBytes is freed. */
+G_GNUC_INTERNAL
+GBytes *spice_file_transfer_task_read_finish_bytes(SpiceFileTransferTask *self,
+                                                   GAsyncResult *result,
+                                                   GError **error)
+{
+    FileTransferChunk *chunk;
+    gssize nbytes;
+
+    g_return_val_if_fail(self != NULL, NULL);
+
+    nbytes = g_task_propagate_int(G_TASK(result), error);
+    if (nbytes < 0)
+        return NULL;
+    if (nbytes == 0)
+        return g_bytes_new(NULL, 0);
+
+    chunk = self->chunk;
+    self->chunk = NULL;
+    chunk->task = g_object_ref(self);
+
+    return g_bytes_new_with_free_func(chunk->data, nbytes, file_transfer_chunk_release, chunk);
+}
+
+/* the most chunks allocated at once by the tasks sharing the budget of @self */
+G_GNUC_INTERNAL
+guint spice_file_transfer_task_get_max_chunks(SpiceFileTransferTask *self)
+{
+    g_return_val_if_fail(self != NULL, 0);
+    return self->budget->max_chunks;
+}
+
 G_GNUC_INTERNAL
 gboolean spice_file_transfer_task_is_completed(SpiceFileTransferTask *self)
 {
@@ -608,6 +886,9 @@ spice_file_transfer_task_get_property(GObject *object,
         case PROP_TASK_PROGRESS:
             g_value_set_double(value, spice_file_transfer_task_get_progress(self));
             break;
+        case PROP_TASK_TRANSFER_RATE:
+            g_value_set_uint64(value, self->transfer_rate);
+            break;
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
     }
@@ -658,8 +939,16 @@ static void
 spice_file_transfer_task_finalize(GObject *object)
 {
     SpiceFileTransferTask *self = SPICE_FILE_TRANSFER_TASK(object);
+    FileTransferChunk *chunk;
 
-    g_free(self->buffer);
+    if (self->chunk != NULL)
+        spice_file_transfer_task_free_chunk(self, self->chunk);
+    while ((chunk = g_queue_pop_head(&self->ready)) != NULL)
+        spice_file_transfer_task_free_chunk(self, chunk);
+    while ((chunk = g_queue_pop_head(&self->spare)) != NULL)
+        spice_file_transfer_task_free_chunk(self, chunk);
+    g_clear_pointer(&self->budget, file_transfer_budget_unref);
+    g_clear_error(&self->read_error);
 
     G_OBJECT_CLASS(spice_file_transfer_task_parent_class)->finalize(object);
 }
@@ -799,6 +1088,23 @@ spice_file_transfer_task_class_init(SpiceFileTransferTaskClass *klass)
                                                         G_PARAM_READABLE |
                                                         G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceFileTransferTask:transfer-rate:
+     *
+     * The number of bytes per second handed to the guest agent over the
+     * last second of the transfer, or over the whole transfer if it was
+     * shorter than that.
+     *
+     * Since: 0.43
+     **/
+    g_object_class_install_property(object_class, PROP_TASK_TRANSFER_RATE,
+                                    g_param_spec_uint64("transfer-rate",
+                                                        "Transfer rate",
+                                                        "The bytes transferred per second",
+                                                        0, G_MAXUINT64, 0,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceFileTransferTask::finished:
      * @task: the file transfer task that emitted the signal
@@ -821,5 +1127,6 @@ spice_file_transfer_task_class_init(SpiceFileTransferTaskClass *klass)
 static void
 spice_file_transfer_task_init(SpiceFileTransferTask *self)
 {
-    self->buffer = g_malloc0(FILE_XFER_CHUNK_SIZE);
+    g_queue_init(&self->ready);
+    g_queue_init(&self->spare);
 }
@@ -26,14 +26,17 @@
 #include "spice-session.h"
 #include "spice-util.h"
 #include "spice-util-priv.h"
+#include "channel-playback-priv.h"
 
 struct stream
 {
     GstElement *pipe;
     GstElement *src;
+    GstElement *queue;
     GstElement *sink;
     guint rate;
     guint channels;
+    GstClockTime play_end; /* position the queued audio plays until */
     gboolean fake; /* fake channel just for getting info about audio (volume) */
 };
 
@@ -71,6 +74,7 @@ static void stream_dispose(struct stream *s)
     }
 
     g_clear_pointer(&s->src, gst_object_unref);
+    g_clear_pointer(&s->queue, gst_object_unref);
     g_clear_pointer(&s->sink, gst_object_unref);
 }
 
@@ -266,6 +270,7 @@ static void playback_stop(SpiceGstaudio *gstaudio)
 
     if (p->playback.pipe)
         gst_element_set_state(p->playback.pipe, GST_STATE_READY);
+    p->playback.play_end = 0;
     if (p->mmtime_id != 0)
     {
         g_spice_source_remove(p->mmtime_id);
@@ -311,6 +316,7 @@ static void playback_start(SpicePlaybackChannel *channel, gint format, gint chan
     {
         playback_stop(gstaudio);
         g_clear_pointer(&p->playback.pipe, gst_object_unref);
+        g_clear_pointer(&p->playback.queue, gst_object_unref);
     }
 
     if (!p->playback.pipe)
@@ -322,7 +328,7 @@ static void playback_start(SpicePlaybackChannel *channel, gint format, gint chan
                             channels, frequency);
         gchar *pipeline = g_strdup(g_getenv("SPICE_GST_AUDIOSINK"));
         if (pipeline == NULL)
-            pipeline = g_strdup_printf("appsrc is-live=1 do-timestamp=0 format=time caps=\"%s\" name=\"appsrc\" ! queue ! "
+            pipeline = g_strdup_printf("appsrc is-live=1 do-timestamp=0 format=time caps=\"%s\" name=\"appsrc\" ! queue name=\"queue\" ! "
                                        "audioconvert ! audioresample ! autoaudiosink name=\"audiosink\"",
                                        audio_caps);
         SPICE_DEBUG("audio pipeline: %s", pipeline);
@@ -333,6 +339,7 @@ static void playback_start(SpicePlaybackChannel *channel, gint format, gint chan
             goto cleanup;
         }
         p->playback.src = gst_bin_get_by_name(GST_BIN(p->playback.pipe), "appsrc");
+        p->playback.queue = gst_bin_get_by_name(GST_BIN(p->playback.pipe), "queue");
         p->playback.sink = gst_bin_get_by_name(GST_BIN(p->playback.pipe), "audiosink");
         p->playback.rate = frequency;
         p->playback.channels = channels;
@@ -355,6 +362,53 @@ static void playback_start(SpicePlaybackChannel *channel, gint format, gint chan
     }
 }
 
+/* the audio waiting before the sink, in ns */
+static GstClockTime playback_level(SpiceGstaudioPrivate *p)
+{
+    guint64 bytes, level = 0;
+
+    bytes = gst_app_src_get_current_level_bytes(GST_APP_SRC(p->playback.src));
+    if (p->playback.queue != NULL)
+        g_object_get(p->playback.queue, "current-level-time", &level, NULL);
+
+    return level + gst_util_uint64_scale(bytes, GST_SECOND,
+                                         p->playback.rate * p->playback.channels * 2);
+}
+
+/* the audio waiting in the pipeline, in ms, up to what the sink plays:
+ * the buffer of the sink itself is included, its latency alone doesn't
+ * tell how full it is */
+static guint32 playback_queued(SpiceGstaudioPrivate *p, gsize size)
+{
+    guint64 queued;
+    GstClockTime duration;
+    gint64 position;
+
+    if (p->playback.rate == 0 || p->playback.channels == 0)
+        return 0;
+
+    duration = gst_util_uint64_scale(size, GST_SECOND,
+                                     p->playback.rate * p->playback.channels * 2);
+    if (gst_element_query_position(p->playback.pipe, GST_FORMAT_TIME, &position) &&
+        position >= 0)
+    {
+        if (p->playback.play_end == 0)
+            /* just started playing: the audio pushed until now, this
+             * buffer included, still waits at least before the sink */
+            p->playback.play_end = position + playback_level(p);
+        else
+            /* after an underrun the audio plays from the current position */
+            p->playback.play_end = MAX(p->playback.play_end, (GstClockTime)position) + duration;
+        queued = (p->playback.play_end - position) / GST_MSECOND;
+        return MIN(queued, G_MAXUINT32);
+    }
+
+    /* not playing yet: only what waits before the sink is known */
+    queued = playback_level(p) / GST_MSECOND;
+
+    return MIN(queued, G_MAXUINT32);
+}
+
 static void playback_data(SpicePlaybackChannel *channel,
                           gpointer *audio, gint size,
                           gpointer data)
@@ -362,12 +416,27 @@ static void playback_data(SpicePlaybackChannel *channel,
     SpiceGstaudio *gstaudio = data;
     SpiceGstaudioPrivate *p = gstaudio->priv;
     GstBuffer *buf;
+    GBytes *bytes;
 
     g_return_if_fail(p != NULL);
 
-    audio = g_memdup(audio, size); /* TODO: try to avoid memory copy */
-    buf = gst_buffer_new_wrapped(audio, size);
+    /* queue the data of the channel itself rather than a copy */
+    bytes = spice_playback_channel_ref_data(channel);
+    if (bytes != NULL && g_bytes_get_data(bytes, NULL) == (gconstpointer)audio)
+    {
+        buf = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, audio, size, 0, size,
+                                          bytes, (GDestroyNotify)g_bytes_unref);
+    }
+    else
+    {
+        g_clear_pointer(&bytes, g_bytes_unref);
+        spice_playback_channel_data_copied(channel, size);
+        audio = g_memdup(audio, size);
+        buf = gst_buffer_new_wrapped(audio, size);
+    }
     gst_app_src_push_buffer(GST_APP_SRC(p->playback.src), buf);
+
+    spice_playback_channel_set_queued(channel, playback_queued(p, size));
 }
 
 #define VOLUME_NORMAL 65535
@@ -0,0 +1,276 @@
+/*
+   Copyright (C) 2026 The spice-gtk contributors
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <string.h>
+
+#include "spice-jitter-buffer.h"
+
+/*
+ * An adaptive jitter buffer for the playback packets.
+ *
+ * The audio itself is queued by the sink, which reports how much it
+ * holds after each packet. The jitter buffer estimates the depth of that
+ * queue when the next packet arrives, and keeps it close to a target
+ * derived from the packet arrival jitter, like RFC 3550:
+ *
+ * - a packet arriving on an empty queue is an underrun, the target is
+ *   raised for a while and the queue is refilled with silence;
+ * - a packet arriving with far too much queued is an overrun, it is
+ *   dropped;
+ * - in between, packets are stretched or shrunk by a few percent to
+ *   slowly bring the queue to the target without audible gaps.
+ *
+ * It is only used from the channel context, it isn't locked.
+ */
+
+/* bounds of the target queue depth */
+#define JITTER_MIN_MS           20
+#define JITTER_MAX_MS           400
+/* how many times the arrival jitter to keep queued */
+#define JITTER_FACTOR           3
+/* depth over the target from which packets are dropped */
+#define JITTER_DROP_MS          120
+/* most a packet is stretched or shrunk, in percent of its length */
+#define JITTER_STRETCH_PERCENT  2
+/* the target raise after an underrun, held a while then decaying */
+#define UNDERRUN_BOOST_MS       20
+#define UNDERRUN_HOLD_US        (5 * G_USEC_PER_SEC)
+#define UNDERRUN_DECAY_MS_PER_S 10
+
+struct SpiceJitterBuffer {
+    guint rate;
+
+    /* the last depth reported by the sink */
+    gboolean has_depth;
+    gint64 depth_time;
+    guint32 depth_ms;
+    gboolean playing;
+
+    /* the last packet */
+    gboolean has_packet;
+    gint64 packet_time;
+    guint32 packet_mm_time;
+
+    gdouble jitter;
+    gdouble avg_depth;
+    gdouble boost;
+    gint64 underrun_time;
+
+    SpiceJitterBufferStats stats;
+};
+
+G_GNUC_INTERNAL
+SpiceJitterBuffer *spice_jitter_buffer_new(void)
+{
+    SpiceJitterBuffer *jitter = g_new0(SpiceJitterBuffer, 1);
+
+    jitter->rate = 48000;
+    jitter->stats.min_depth_ms = G_MAXUINT32;
+    jitter->stats.target_ms = JITTER_MIN_MS;
+
+    return jitter;
+}
+
+G_GNUC_INTERNAL
+void spice_jitter_buffer_free(SpiceJitterBuffer *jitter)
+{
+    g_free(jitter);
+}
+
+/* forgets the stream state, for a new stream of @rate frames per
+ * second, but keeps the counters */
+G_GNUC_INTERNAL
+void spice_jitter_buffer_restart(SpiceJitterBuffer *jitter, guint rate)
+{
+    g_return_if_fail(rate > 0);
+
+    jitter->rate = rate;
+    jitter->has_depth = FALSE;
+    jitter->playing = FALSE;
+    jitter->has_packet = FALSE;
+    jitter->jitter = 0;
+    jitter->avg_depth = 0;
+    jitter->boost = 0;
+}
+
+/* what the sink has queued, right after it was given a packet */
+G_GNUC_INTERNAL
+void spice_jitter_buffer_set_depth(SpiceJitterBuffer *jitter, gint64 time_us, guint32 depth_ms)
+{
+    jitter->has_depth = TRUE;
+    jitter->depth_time = time_us;
+    jitter->depth_ms = depth_ms;
+    if (depth_ms > 0)
+        jitter->playing = TRUE;
+}
+
+/* the estimated sink queue depth at @time_us, FALSE if never reported */
+G_GNUC_INTERNAL
+gboolean spice_jitter_buffer_get_depth(SpiceJitterBuffer *jitter, gint64 time_us, guint32 *depth_ms)
+{
+    gint64 played;
+
+    if (!jitter->has_depth)
+        return FALSE;
+
+    played = MAX(time_us - jitter->depth_time, 0) / 1000;
+    *depth_ms = played < jitter->depth_ms ? jitter->depth_ms - played : 0;
+
+    return TRUE;
+}
+
+static void jitter_update(SpiceJitterBuffer *jitter, gint64 time_us, guint32 mm_time)
+{
+    if (jitter->has_packet) {
+        gdouble arrival = (time_us - jitter->packet_time) / 1000.0;
+        gint32 sent = (gint32)(mm_time - jitter->packet_mm_time);
+
+        jitter->jitter += (ABS(arrival - sent) - jitter->jitter) / 16;
+    }
+    jitter->has_packet = TRUE;
+    jitter->packet_time = time_us;
+    jitter->packet_mm_time = mm_time;
+}
+
+static void boost_update(SpiceJitterBuffer *jitter, gint64 time_us, gint64 elapsed_us)
+{
+    if (jitter->boost <= 0 || time_us - jitter->underrun_time < UNDERRUN_HOLD_US)
+        return;
+
+    jitter->boost -= UNDERRUN_DECAY_MS_PER_S * elapsed_us / (gdouble)G_USEC_PER_SEC;
+    jitter->boost = MAX(jitter->boost, 0);
+}
+
+static guint32 jitter_target(SpiceJitterBuffer *jitter)
+{
+    return CLAMP(JITTER_MIN_MS + JITTER_FACTOR * jitter->jitter + jitter->boost,
+                 JITTER_MIN_MS, JITTER_MAX_MS);
+}
+
+/*
+ * Accounts a packet of @frames audio frames sent at @mm_time and
+ * arriving at @time_us. After an underrun, @silence is set to the
+ * frames of silence to queue before the packet.
+ *
+ * Returns: the number of frames the packet should be stretched to, 0 if
+ * it should be dropped.
+ */
+G_GNUC_INTERNAL
+guint spice_jitter_buffer_packet(SpiceJitterBuffer *jitter, gint64 time_us,
+                                 guint32 mm_time, guint frames, guint *silence)
+{
+    SpiceJitterBufferStats *stats = &jitter->stats;
+    gint64 elapsed_us = jitter->has_packet ? time_us - jitter->packet_time : 0;
+    guint32 depth, target;
+
+    *silence = 0;
+    stats->packets++;
+    jitter_update(jitter, time_us, mm_time);
+    boost_update(jitter, time_us, elapsed_us);
+    target = jitter_target(jitter);
+    stats->jitter_ms = jitter->jitter;
+    stats->target_ms = target;
+
+    /* nothing to steer without the sink depth */
+    if (!spice_jitter_buffer_get_depth(jitter, time_us, &depth) || frames == 0)
+        return frames;
+
+    stats->depth_ms = depth;
+    stats->min_depth_ms = MIN(stats->min_depth_ms, depth);
+    stats->max_depth_ms = MAX(stats->max_depth_ms, depth);
+
+    if (depth == 0 && jitter->playing) {
+        guint64 packet_ms = frames * (guint64)1000 / jitter->rate;
+
+        stats->underruns++;
+        jitter->playing = FALSE;
+        jitter->underrun_time = time_us;
+        jitter->boost = MIN(jitter->boost + UNDERRUN_BOOST_MS, JITTER_MAX_MS);
+        target = jitter_target(jitter);
+        stats->target_ms = target;
+        jitter->avg_depth = target;
+
+        /* the sink played a gap already, refill it to the target */
+        if (packet_ms < target) {
+            *silence = (target - packet_ms) * jitter->rate / 1000;
+            stats->silence_frames += *silence;
+        }
+        return frames;
+    }
+
+    if (depth > target + JITTER_DROP_MS) {
+        stats->overruns++;
+        stats->dropped_frames += frames;
+        return 0;
+    }
+
+    jitter->avg_depth += (depth - jitter->avg_depth) / 8;
+
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+    /* the stretching works on native S16 samples */
+    guint32 hysteresis = MAX(target / 4, 5);
+    guint step = MAX(frames * JITTER_STRETCH_PERCENT / 100, 1);
+
+    if (jitter->avg_depth > target + hysteresis) {
+        stats->stretched_frames += step;
+        return frames > step ? frames - step : 1;
+    }
+    if (jitter->avg_depth < target - MIN(hysteresis, target)) {
+        stats->stretched_frames += step;
+        return frames + step;
+    }
+#endif
+
+    return frames;
+}
+
+/* linear resampling of interleaved S16 frames */
+G_GNUC_INTERNAL
+void spice_jitter_buffer_stretch(const gint16 *in, guint in_frames,
+                                 gint16 *out, guint out_frames, guint channels)
+{
+    guint i, c;
+
+    g_return_if_fail(in_frames > 0);
+
+    if (in_frames == out_frames) {
+        memcpy(out, in, in_frames * channels * sizeof(gint16));
+        return;
+    }
+
+    for (i = 0; i < out_frames; i++) {
+        /* 16.16 fixed point position, the first and last frames are kept */
+        guint64 pos = out_frames > 1 ?
+            ((guint64)i * (in_frames - 1) << 16) / (out_frames - 1) : 0;
+        guint index = pos >> 16;
+        gint64 frac = pos & 0xffff;
+        const gint16 *a = in + index * channels;
+        const gint16 *b = index + 1 < in_frames ? a + channels : a;
+
+        for (c = 0; c < channels; c++)
+            out[i * channels + c] = a[c] + (((b[c] - a[c]) * frac) >> 16);
+    }
+}
+
+G_GNUC_INTERNAL
+void spice_jitter_buffer_get_stats(SpiceJitterBuffer *jitter, SpiceJitterBufferStats *stats)
+{
+    *stats = jitter->stats;
+    if (stats->min_depth_ms == G_MAXUINT32)
+        stats->min_depth_ms = 0;
+}
@@ -0,0 +1,53 @@
+/*
+   Copyright (C) 2026 The spice-gtk contributors
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct SpiceJitterBuffer SpiceJitterBuffer;
+
+typedef struct SpiceJitterBufferStats {
+    guint64 packets;          /* packets seen */
+    guint64 underruns;        /* packets arriving after the sink ran dry */
+    guint64 overruns;         /* packets dropped, too much audio queued */
+    guint64 dropped_frames;   /* audio frames of the dropped packets */
+    guint64 stretched_frames; /* audio frames added or removed by stretching */
+    guint64 silence_frames;   /* frames of silence queued after the underruns */
+    guint32 jitter_ms;        /* packet arrival jitter estimate */
+    guint32 target_ms;        /* queue depth aimed for */
+    guint32 depth_ms;         /* queue depth when the last packet arrived */
+    guint32 min_depth_ms;     /* smallest and biggest queue depth seen */
+    guint32 max_depth_ms;
+} SpiceJitterBufferStats;
+
+SpiceJitterBuffer *spice_jitter_buffer_new(void);
+void spice_jitter_buffer_free(SpiceJitterBuffer *jitter);
+void spice_jitter_buffer_restart(SpiceJitterBuffer *jitter, guint rate);
+
+void spice_jitter_buffer_set_depth(SpiceJitterBuffer *jitter, gint64 time_us, guint32 depth_ms);
+gboolean spice_jitter_buffer_get_depth(SpiceJitterBuffer *jitter, gint64 time_us, guint32 *depth_ms);
+
+guint spice_jitter_buffer_packet(SpiceJitterBuffer *jitter, gint64 time_us,
+                                 guint32 mm_time, guint frames, guint *silence);
+void spice_jitter_buffer_stretch(const gint16 *in, guint in_frames,
+                                 gint16 *out, guint out_frames, guint channels);
+
+void spice_jitter_buffer_get_stats(SpiceJitterBuffer *jitter, SpiceJitterBufferStats *stats);
+
+G_END_DECLS
@@ -37,7 +37,9 @@ static gboolean disable_audio = FALSE;
 static gboolean disable_usbredir = FALSE;
 static gint cache_size = 0;
 static gint glz_window_size = 0;
+static gint64 image_cache_budget = 0;
 static gchar *secure_channels = NULL;
+static gchar *io_thread_channels = NULL;
 static gchar *shared_dir = NULL;
 static gchar **cd_share_files = NULL;
 static SpiceImageCompression preferred_compression = SPICE_IMAGE_COMPRESSION_INVALID;
@@ -116,6 +118,45 @@ static gboolean parse_secure_channels(const gchar *option_name, const gchar *val
     return TRUE;
 }
 
+static gboolean parse_io_thread_channels(const gchar *option_name, const gchar *value,
+                                         gpointer data, GError **error)
+{
+    gint i;
+    gchar **channels = g_strsplit(value, ",", -1);
+    GPtrArray *threaded;
+
+    g_return_val_if_fail(channels != NULL, FALSE);
+
+    threaded = g_ptr_array_new();
+    for (i = 0; channels[i]; i++) {
+        gint type = spice_channel_string_to_type(channels[i]);
+
+        if (type == -1) {
+            g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                        _("invalid channel name (%s)"), channels[i]);
+            g_ptr_array_free(threaded, TRUE);
+            g_strfreev(channels);
+            return FALSE;
+        }
+
+        /* the other channels, like usbredir, stay on the main thread */
+        if (type != SPICE_CHANNEL_DISPLAY && type != SPICE_CHANNEL_PLAYBACK) {
+            g_warning("%s channels can't run on their own thread, ignored", channels[i]);
+            continue;
+        }
+        g_ptr_array_add(threaded, channels[i]);
+    }
+    g_ptr_array_add(threaded, NULL);
+
+    g_free(io_thread_channels);
+    io_thread_channels = g_strjoinv(",", (gchar **)threaded->pdata);
+
+    g_ptr_array_free(threaded, TRUE);
+    g_strfreev(channels);
+
+    return TRUE;
+}
+
 static gboolean parse_preferred_compression(const gchar *option_name, const gchar *value,
                                             gpointer data, GError **error)
 {
@@ -163,6 +204,8 @@ GOptionGroup* spice_get_option_group(void)
           N_("Force the specified channels to be secured"), "<main,display,inputs,...,all>" },
         { "spice-disable-effects", '\0', 0, G_OPTION_ARG_CALLBACK, parse_disable_effects,
           N_("Disable guest display effects"), "<wallpaper,font-smooth,animation,all>" },
+        { "spice-io-thread-channels", '\0', 0, G_OPTION_ARG_CALLBACK, parse_io_thread_channels,
+          N_("Run the specified channels on their own thread"), "<display,playback>" },
         /* Deprecated */
         { "spice-color-depth", '\0', G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_CALLBACK, parse_color_depth,
           N_("Guest display color depth (deprecated)"), "<16,32>" },
@@ -190,6 +233,8 @@ GOptionGroup* spice_get_option_group(void)
           N_("Image cache size (deprecated)"), N_("<bytes>") },
         { "spice-glz-window-size", '\0', 0, G_OPTION_ARG_INT, &glz_window_size,
           N_("Glz compression history size (deprecated)"), N_("<bytes>") },
+        { "spice-image-cache-budget", '\0', 0, G_OPTION_ARG_INT64, &image_cache_budget,
+          N_("Maximum memory used by the image cache"), N_("<bytes>") },
         { "spice-shared-dir", '\0', 0, G_OPTION_ARG_FILENAME, &shared_dir,
           N_("Shared directory"), N_("<dir>") },
         { "spice-preferred-compression", '\0', 0, G_OPTION_ARG_CALLBACK, parse_preferred_compression,
@@ -259,6 +304,14 @@ void spice_set_session_option(SpiceSession *session)
         g_strfreev(channels);
     }
 
+    if (io_thread_channels) {
+        GStrv channels;
+        channels = g_strsplit(io_thread_channels, ",", -1);
+        if (channels)
+            g_object_set(session, "io-thread-channels", channels, NULL);
+        g_strfreev(channels);
+    }
+
     if (ca_file)
         g_object_set(session, "ca-file", ca_file, NULL);
     if (host_subject)
@@ -324,6 +377,8 @@ void spice_set_session_option(SpiceSession *session)
         g_object_set(session, "cache-size", cache_size, NULL);
     if (glz_window_size)
         g_object_set(session, "glz-window-size", glz_window_size, NULL);
+    if (image_cache_budget > 0)
+        g_object_set(session, "image-cache-budget", (guint64)image_cache_budget, NULL);
     if (shared_dir)
         g_object_set(session, "shared-dir", shared_dir, NULL);
     if (preferred_compression != SPICE_IMAGE_COMPRESSION_INVALID)
@@ -0,0 +1,286 @@
+/*
+   Copyright (C) 2026 The spice-gtk contributors
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <string.h>
+
+#include "spice-pixel-convert.h"
+
+/*
+ * 16bpp to 32bpp pixel conversion.
+ *
+ * Each 5 or 6 bits component is expanded to 8 bits by replicating its
+ * top bits in the low bits, so that full intensity stays full intensity.
+ *
+ * The vector versions compute the three components of 8 (or 16) pixels
+ * in 16 bits lanes and interleave them. The best version supported by
+ * the CPU is picked at run time, SPICE_PIXEL_CONVERT can force one by
+ * name.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+static inline guint32 convert_555(guint16 s)
+{
+    return ((((s) & 0x001f) << 3) | (((s) & 0x001c) >> 2)) |
+           ((((s) & 0x03e0) << 6) | (((s) & 0x0380) << 1)) |
+           ((((s) & 0x7c00) << 9) | ((((s) & 0x7000)) << 4));
+}
+
+static inline guint32 convert_565(guint16 s)
+{
+    return ((((s) << 3) & 0xf8) | (((s) >> 2) & 0x7)) |
+           ((((s) << 5) & 0xfc00) | (((s) >> 1) & 0x300)) |
+           ((((s) << 8) & 0xf80000) | (((s) << 3) & 0x70000));
+}
+
+static void row_555_scalar(guint32 *dest, const guint16 *src, gsize width)
+{
+    gsize x;
+
+    for (x = 0; x < width; x++)
+        dest[x] = convert_555(src[x]);
+}
+
+static void row_565_scalar(guint32 *dest, const guint16 *src, gsize width)
+{
+    gsize x;
+
+    for (x = 0; x < width; x++)
+        dest[x] = convert_565(src[x]);
+}
+
+#ifdef HAVE_X86_SIMD
+/* in: 8 pixels, out: blue | green << 8 and red in 16 bits lanes */
+#define SSE2_SPLIT_555(s, bg, r)                                               \
+    do {                                                                       \
+        __m128i b_ = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(s, c1f), 3),    \
+                                  _mm_srli_epi16(_mm_and_si128(s, c1c), 2));   \
+        __m128i g_ = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(s, 2), cf8),    \
+                                  _mm_and_si128(_mm_srli_epi16(s, 7), c07));   \
+        r = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(s, 7), cf8),             \
+                         _mm_and_si128(_mm_srli_epi16(s, 12), c07));           \
+        bg = _mm_or_si128(b_, _mm_slli_epi16(g_, 8));                          \
+    } while (0)
+
+#define SSE2_SPLIT_565(s, bg, r)                                               \
+    do {                                                                       \
+        __m128i b_ = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(s, c1f), 3),    \
+                                  _mm_srli_epi16(_mm_and_si128(s, c1c), 2));   \
+        __m128i g_ = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(s, 3), cfc),    \
+                                  _mm_and_si128(_mm_srli_epi16(s, 9), c03));   \
+        r = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(s, 8), cf8),             \
+                         _mm_srli_epi16(s, 13));                               \
+        bg = _mm_or_si128(b_, _mm_slli_epi16(g_, 8));                          \
+    } while (0)
+
+#define SSE2_ROW(name, split, scalar)                                          \
+__attribute__((target("sse2")))                                                \
+static void name(guint32 *dest, const guint16 *src, gsize width)               \
+{                                                                              \
+    const __m128i c1f = _mm_set1_epi16(0x1f), c1c = _mm_set1_epi16(0x1c);      \
+    const __m128i cf8 = _mm_set1_epi16(0xf8), cfc = _mm_set1_epi16(0xfc);      \
+    const __m128i c07 = _mm_set1_epi16(0x07), c03 = _mm_set1_epi16(0x03);      \
+    gsize x;                                                                   \
+                                                                               \
+    (void)cfc; (void)c03; (void)c07;                                           \
+    for (x = 0; x + 8 <= width; x += 8) {                                      \
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + x));               \
+        __m128i bg, r;                                                         \
+        split(s, bg, r);                                                       \
+        _mm_storeu_si128((__m128i *)(dest + x), _mm_unpacklo_epi16(bg, r));    \
+        _mm_storeu_si128((__m128i *)(dest + x + 4), _mm_unpackhi_epi16(bg, r));\
+    }                                                                          \
+    scalar(dest + x, src + x, width - x);                                      \
+}
+
+SSE2_ROW(row_555_sse2, SSE2_SPLIT_555, row_555_scalar)
+SSE2_ROW(row_565_sse2, SSE2_SPLIT_565, row_565_scalar)
+
+#define AVX2_SPLIT_555(s, bg, r)                                                        \
+    do {                                                                                \
+        __m256i b_ = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(s, c1f), 3),    \
+                                     _mm256_srli_epi16(_mm256_and_si256(s, c1c), 2));   \
+        __m256i g_ = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(s, 2), cf8),    \
+                                     _mm256_and_si256(_mm256_srli_epi16(s, 7), c07));   \
+        r = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(s, 7), cf8),             \
+                            _mm256_and_si256(_mm256_srli_epi16(s, 12), c07));           \
+        bg = _mm256_or_si256(b_, _mm256_slli_epi16(g_, 8));                             \
+    } while (0)
+
+#define AVX2_SPLIT_565(s, bg, r)                                                        \
+    do {                                                                                \
+        __m256i b_ = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(s, c1f), 3),    \
+                                     _mm256_srli_epi16(_mm256_and_si256(s, c1c), 2));   \
+        __m256i g_ = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(s, 3), cfc),    \
+                                     _mm256_and_si256(_mm256_srli_epi16(s, 9), c03));   \
+        r = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(s, 8), cf8),             \
+                            _mm256_srli_epi16(s, 13));                                  \
+        bg = _mm256_or_si256(b_, _mm256_slli_epi16(g_, 8));                             \
+    } while (0)
+
+/* the unpacks work within 128 bits halves, the permutes put the
+ * pixels back in order */
+#define AVX2_ROW(name, split, sse2)                                                     \
+__attribute__((target("avx2")))                                                         \
+static void name(guint32 *dest, const guint16 *src, gsize width)                        \
+{                                                                                       \
+    const __m256i c1f = _mm256_set1_epi16(0x1f), c1c = _mm256_set1_epi16(0x1c);        \
+    const __m256i cf8 = _mm256_set1_epi16(0xf8), cfc = _mm256_set1_epi16(0xfc);        \
+    const __m256i c07 = _mm256_set1_epi16(0x07), c03 = _mm256_set1_epi16(0x03);        \
+    gsize x;                                                                            \
+                                                                                        \
+    (void)cfc; (void)c03; (void)c07;                                                    \
+    for (x = 0; x + 16 <= width; x += 16) {                                             \
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + x));                     \
+        __m256i bg, r, lo, hi;                                                          \
+        split(s, bg, r);                                                                \
+        lo = _mm256_unpacklo_epi16(bg, r);                                              \
+        hi = _mm256_unpackhi_epi16(bg, r);                                              \
+        _mm256_storeu_si256((__m256i *)(dest + x),                                      \
+                            _mm256_permute2x128_si256(lo, hi, 0x20));                   \
+        _mm256_storeu_si256((__m256i *)(dest + x + 8),                                  \
+                            _mm256_permute2x128_si256(lo, hi, 0x31));                   \
+    }                                                                                   \
+    sse2(dest + x, src + x, width - x);                                                 \
+}
+
+AVX2_ROW(row_555_avx2, AVX2_SPLIT_555, row_555_sse2)
+AVX2_ROW(row_565_avx2, AVX2_SPLIT_565, row_565_sse2)
+#endif
+
+#ifdef HAVE_NEON
+static void row_neon(guint32 *dest, const guint16 *src, gsize width, gboolean is_565)
+{
+    const uint16x8_t c1f = vdupq_n_u16(0x1f), c1c = vdupq_n_u16(0x1c);
+    const uint16x8_t cf8 = vdupq_n_u16(0xf8), cfc = vdupq_n_u16(0xfc);
+    const uint16x8_t c07 = vdupq_n_u16(0x07), c03 = vdupq_n_u16(0x03);
+    gsize x;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        uint16x8_t s = vld1q_u16(src + x);
+        uint16x8_t b, g, r;
+        uint8x8x4_t out;
+
+        b = vorrq_u16(vshlq_n_u16(vandq_u16(s, c1f), 3), vshrq_n_u16(vandq_u16(s, c1c), 2));
+        if (is_565) {
+            g = vorrq_u16(vandq_u16(vshrq_n_u16(s, 3), cfc), vandq_u16(vshrq_n_u16(s, 9), c03));
+            r = vorrq_u16(vandq_u16(vshrq_n_u16(s, 8), cf8), vshrq_n_u16(s, 13));
+        } else {
+            g = vorrq_u16(vandq_u16(vshrq_n_u16(s, 2), cf8), vandq_u16(vshrq_n_u16(s, 7), c07));
+            r = vorrq_u16(vandq_u16(vshrq_n_u16(s, 7), cf8), vandq_u16(vshrq_n_u16(s, 12), c07));
+        }
+        out.val[0] = vmovn_u16(b);
+        out.val[1] = vmovn_u16(g);
+        out.val[2] = vmovn_u16(r);
+        out.val[3] = vdup_n_u8(0);
+        vst4_u8((uint8_t *)(dest + x), out);
+    }
+
+    if (is_565)
+        row_565_scalar(dest + x, src + x, width - x);
+    else
+        row_555_scalar(dest + x, src + x, width - x);
+}
+
+static void row_555_neon(guint32 *dest, const guint16 *src, gsize width)
+{
+    row_neon(dest, src, width, FALSE);
+}
+
+static void row_565_neon(guint32 *dest, const guint16 *src, gsize width)
+{
+    row_neon(dest, src, width, TRUE);
+}
+#endif
+
+/* from the slowest to the fastest */
+static const SpicePixelConvert converts[] = {
+    { "scalar", row_555_scalar, row_565_scalar },
+#ifdef HAVE_X86_SIMD
+    { "sse2", row_555_sse2, row_565_sse2 },
+    { "avx2", row_555_avx2, row_565_avx2 },
+#endif
+#ifdef HAVE_NEON
+    { "neon", row_555_neon, row_565_neon },
+#endif
+};
+
+static gboolean convert_supported(const SpicePixelConvert *convert)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (strcmp(convert->name, "sse2") == 0)
+        return __builtin_cpu_supports("sse2");
+    if (strcmp(convert->name, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+#endif
+    return TRUE;
+}
+
+/* Returns the conversions supported by the CPU, slowest first */
+G_GNUC_INTERNAL
+const SpicePixelConvert *spice_pixel_convert_get_all(guint *n_converts)
+{
+    static gsize supported = 0;
+
+    g_return_val_if_fail(n_converts != NULL, NULL);
+
+    if (g_once_init_enter(&supported)) {
+        gsize n = 1;
+
+        /* the vector versions are listed in order of requirements */
+        while (n < G_N_ELEMENTS(converts) && convert_supported(&converts[n]))
+            n++;
+        g_once_init_leave(&supported, n);
+    }
+
+    *n_converts = supported;
+    return converts;
+}
+
+G_GNUC_INTERNAL
+const SpicePixelConvert *spice_pixel_convert_get(void)
+{
+    static const SpicePixelConvert *best = NULL;
+
+    if (g_once_init_enter(&best)) {
+        const SpicePixelConvert *all;
+        const gchar *name = g_getenv("SPICE_PIXEL_CONVERT");
+        const SpicePixelConvert *convert;
+        guint i, n;
+
+        all = spice_pixel_convert_get_all(&n);
+        convert = &all[n - 1];
+        for (i = 0; name != NULL && i < n; i++) {
+            if (g_str_equal(all[i].name, name))
+                convert = &all[i];
+        }
+        g_debug("16bpp conversion: %s", convert->name);
+        g_once_init_leave(&best, convert);
+    }
+
+    return best;
+}
@@ -0,0 +1,36 @@
+/*
+   Copyright (C) 2026 The spice-gtk contributors
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Converts a row of @width 16bpp pixels to x8r8g8b8, the unused byte
+ * is left to 0 */
+typedef void (*SpicePixelConvertRow)(guint32 *dest, const guint16 *src, gsize width);
+
+typedef struct SpicePixelConvert {
+    const gchar *name;
+    SpicePixelConvertRow row_555;
+    SpicePixelConvertRow row_565;
+} SpicePixelConvert;
+
+const SpicePixelConvert *spice_pixel_convert_get(void);
+const SpicePixelConvert *spice_pixel_convert_get_all(guint *n_converts);
+
+G_END_DECLS
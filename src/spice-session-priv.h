@@ -32,6 +32,7 @@ typedef struct _PhodavServer PhodavServer;
 #include "spice-gtk-session.h"
 #include "spice-channel-cache.h"
 #include "decode.h"
+#include "spice-surface-pool.h"
 
 G_BEGIN_DECLS
 
@@ -44,6 +45,7 @@ gboolean spice_session_get_client_provided_socket(SpiceSession *session);
 GSocketConnection* spice_session_channel_open_host(SpiceSession *session, SpiceChannel *channel,
                                                    gboolean *use_tls, GError **error);
 void spice_session_channel_new(SpiceSession *session, SpiceChannel *channel);
+GMainContext *spice_session_get_io_context(SpiceSession *session, gint channel_type);
 void spice_session_channel_migrate(SpiceSession *session, SpiceChannel *channel);
 
 void spice_session_set_mm_time(SpiceSession *session, guint32 time);
@@ -72,6 +74,9 @@ void spice_session_set_caches_hints(SpiceSession *session,
 void spice_session_get_caches(SpiceSession *session,
                               display_cache **images,
                               SpiceGlzDecoderWindow **glz_window);
+SpiceSurfacePool *spice_session_get_surface_pool(SpiceSession *session);
+gint64 spice_session_get_capture_start(SpiceSession *session, const gchar *filename,
+                                       gboolean *append);
 void spice_session_palettes_clear(SpiceSession *session);
 void spice_session_images_clear(SpiceSession *session);
 void spice_session_migrate_end(SpiceSession *session);
@@ -22,6 +22,7 @@
 #include <glib.h>
 #ifdef G_OS_UNIX
 #include <gio/gunixsocketaddress.h>
+#include <unistd.h>
 #endif
 
 #include "spice-client.h"
@@ -44,6 +45,11 @@ G_STATIC_ASSERT(sizeof(SpiceSessionClass) == sizeof(GObjectClass) + 12 * sizeof(
 #endif
 
 #define IMAGES_CACHE_SIZE_DEFAULT (1024 * 1024 * 80)
+/* share of the physical memory the image cache may use by default */
+#define IMAGES_CACHE_BUDGET_MEMORY_SHARE 8
+/* the server accounts the cached images in pixels, the budget is in bytes
+ * of the 32-bit client copies */
+#define IMAGES_CACHE_BYTES_PER_PIXEL 4
 #define MIN_GLZ_WINDOW_SIZE_DEFAULT (1024 * 1024 * 12)
 #define MAX_GLZ_WINDOW_SIZE_DEFAULT MIN((LZ_MAX_WINDOW_SIZE * 4), 1024 * 1024 * 64)
 
@@ -97,6 +103,11 @@ struct _SpiceSessionPrivate
     GStrv disable_effects;
     GStrv secure_channels;
 
+    /* channel types dispatched from their own thread, and the running
+     * threads keyed by channel type */
+    GStrv io_thread_channels;
+    GHashTable *io_threads;
+
     int connection_id;
     int protocol;
     SpiceChannel *cmain; /* weak reference */
@@ -115,7 +126,10 @@ struct _SpiceSessionPrivate
 
     display_cache *images;
     SpiceGlzDecoderWindow *glz_window;
+    SpiceSurfacePool *surface_pool;
+    GHashTable *capture_starts; /* capture filename -> gint64 monotonic start */
     int images_cache_size;
+    guint64 images_cache_budget;
     int glz_window_size;
     uint32_t n_display_channels;
     guint8 uuid[16];
@@ -204,6 +218,11 @@ enum
     PROP_UNIX_PATH,
     PROP_PREF_COMPRESSION,
     PROP_GL_SCANOUT,
+    PROP_IO_THREAD_CHANNELS,
+    PROP_IMAGE_CACHE_STATS,
+    PROP_IMAGE_CACHE_BUDGET,
+    PROP_GLZ_WINDOW_STATS,
+    PROP_SURFACE_POOL_STATS,
 };
 
 /* signals */
@@ -253,6 +272,7 @@ GType spice_image_compress_get_type(void)
 static guint signals[SPICE_SESSION_LAST_SIGNAL];
 
 static void spice_session_channel_destroy(SpiceSession *session, SpiceChannel *channel);
+static void update_images_cache_budget(SpiceSession *session, guint64 budget);
 
 static void update_proxy(SpiceSession *self, const gchar *str)
 {
@@ -284,6 +304,26 @@ static void update_proxy(SpiceSession *self, const gchar *str)
     }
 }
 
+static gsize image_size(gpointer value)
+{
+    pixman_image_t *image = value;
+
+    return (gsize)ABS(pixman_image_get_stride(image)) * pixman_image_get_height(image);
+}
+
+/* enough to keep the buffers of a couple of 4K primaries around */
+#define SURFACE_POOL_DEFAULT_SIZE (128 * 1024 * 1024)
+
+static gsize surface_pool_size(void)
+{
+    const gchar *str = g_getenv("SPICE_SURFACE_POOL_SIZE");
+
+    if (str != NULL)
+        return g_ascii_strtoull(str, NULL, 10) * 1024 * 1024;
+
+    return SURFACE_POOL_DEFAULT_SIZE;
+}
+
 static void spice_session_init(SpiceSession *session)
 {
     SpiceSessionPrivate *s;
@@ -296,8 +336,9 @@ static void spice_session_init(SpiceSession *session)
     SPICE_DEBUG("Supported channels: %s", channels);
     g_free(channels);
 
-    s->images = cache_image_new((GDestroyNotify)pixman_image_unref);
+    s->images = cache_image_new((GDestroyNotify)pixman_image_unref, image_size);
     s->glz_window = glz_decoder_window_new();
+    s->surface_pool = spice_surface_pool_new(surface_pool_size());
     update_proxy(session, NULL);
 }
 
@@ -378,10 +419,17 @@ spice_session_finalize(GObject *gobject)
     g_free(s->smartcard_db);
     g_strfreev(s->disable_effects);
     g_strfreev(s->secure_channels);
+    g_strfreev(s->io_thread_channels);
     g_free(s->shared_dir);
 
+    /* the caches may hold waiters attached to the I/O thread contexts */
     g_clear_pointer(&s->images, cache_free);
     glz_decoder_window_destroy(s->glz_window);
+    /* the display channels may still hold a reference */
+    g_clear_pointer(&s->surface_pool, spice_surface_pool_unref);
+    g_clear_pointer(&s->capture_starts, g_hash_table_unref);
+
+    g_clear_pointer(&s->io_threads, g_hash_table_unref);
 
     g_clear_pointer(&s->pubkey, g_byte_array_unref);
     g_clear_pointer(&s->ca, g_byte_array_unref);
@@ -653,6 +701,68 @@ fail:
     return -1;
 }
 
+static GVariant *spice_session_image_cache_stats(SpiceSession *session)
+{
+    display_cache *images = session->priv->images;
+    display_cache_wait_stats *stats = &images->wait_stats;
+    GVariantBuilder builder;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add(&builder, "{sv}", "hits", g_variant_new_uint64(images->stats.hits));
+    g_variant_builder_add(&builder, "{sv}", "misses", g_variant_new_uint64(images->stats.misses));
+    g_variant_builder_add(&builder, "{sv}", "evictions", g_variant_new_uint64(images->stats.evictions));
+    g_variant_builder_add(&builder, "{sv}", "evicted-bytes", g_variant_new_uint64(images->stats.evicted_bytes));
+    g_variant_builder_add(&builder, "{sv}", "bytes", g_variant_new_uint64(images->stats.bytes));
+    g_variant_builder_add(&builder, "{sv}", "entries", g_variant_new_uint64(images->stats.entries));
+    g_variant_builder_add(&builder, "{sv}", "budget", g_variant_new_uint64(images->budget));
+    g_variant_builder_add(&builder, "{sv}", "waits", g_variant_new_uint64(stats->waits));
+    g_variant_builder_add(&builder, "{sv}", "wakeups", g_variant_new_uint64(stats->wakeups));
+    g_variant_builder_add(&builder, "{sv}", "wait-us", g_variant_new_int64(stats->total_wait_us));
+    g_variant_builder_add(&builder, "{sv}", "max-wait-us", g_variant_new_int64(stats->max_wait_us));
+
+    return g_variant_builder_end(&builder);
+}
+
+static GVariant *spice_session_surface_pool_stats(SpiceSession *session)
+{
+    SpiceSurfacePoolStats stats;
+    GVariantBuilder builder;
+
+    spice_surface_pool_get_stats(session->priv->surface_pool, &stats);
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add(&builder, "{sv}", "allocations", g_variant_new_uint64(stats.allocations));
+    g_variant_builder_add(&builder, "{sv}", "hits", g_variant_new_uint64(stats.hits));
+    g_variant_builder_add(&builder, "{sv}", "huge", g_variant_new_uint64(stats.huge));
+    g_variant_builder_add(&builder, "{sv}", "clears", g_variant_new_uint64(stats.clears));
+    g_variant_builder_add(&builder, "{sv}", "clears-skipped", g_variant_new_uint64(stats.clears_skipped));
+    g_variant_builder_add(&builder, "{sv}", "trimmed-bytes", g_variant_new_uint64(stats.trimmed_bytes));
+    g_variant_builder_add(&builder, "{sv}", "bytes", g_variant_new_uint64(stats.cached_bytes));
+    g_variant_builder_add(&builder, "{sv}", "buffers", g_variant_new_uint64(stats.cached_buffers));
+
+    return g_variant_builder_end(&builder);
+}
+
+static GVariant *spice_session_glz_window_stats(SpiceSession *session)
+{
+    SpiceGlzDecoderWindowStats stats;
+    GVariantBuilder builder;
+
+    glz_decoder_window_get_stats(session->priv->glz_window, &stats);
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add(&builder, "{sv}", "window-size", g_variant_new_uint32(stats.window_size));
+    g_variant_builder_add(&builder, "{sv}", "capacity", g_variant_new_uint32(stats.capacity));
+    g_variant_builder_add(&builder, "{sv}", "images", g_variant_new_uint32(stats.images));
+    g_variant_builder_add(&builder, "{sv}", "bytes", g_variant_new_uint64(stats.bytes));
+    g_variant_builder_add(&builder, "{sv}", "max-bytes", g_variant_new_uint64(stats.max_bytes));
+    g_variant_builder_add(&builder, "{sv}", "stalls", g_variant_new_uint64(stats.stalls));
+    g_variant_builder_add(&builder, "{sv}", "stall-us", g_variant_new_int64(stats.stall_us));
+    g_variant_builder_add(&builder, "{sv}", "max-stall-us", g_variant_new_int64(stats.max_stall_us));
+
+    return g_variant_builder_end(&builder);
+}
+
 static void spice_session_get_property(GObject *gobject,
                                        guint prop_id,
                                        GValue *value,
@@ -771,6 +881,21 @@ static void spice_session_get_property(GObject *gobject,
     case PROP_GL_SCANOUT:
         g_value_set_boolean(value, s->gl_scanout);
         break;
+    case PROP_IO_THREAD_CHANNELS:
+        g_value_set_boxed(value, s->io_thread_channels);
+        break;
+    case PROP_IMAGE_CACHE_STATS:
+        g_value_set_variant(value, spice_session_image_cache_stats(session));
+        break;
+    case PROP_IMAGE_CACHE_BUDGET:
+        g_value_set_uint64(value, s->images_cache_budget);
+        break;
+    case PROP_GLZ_WINDOW_STATS:
+        g_value_set_variant(value, spice_session_glz_window_stats(session));
+        break;
+    case PROP_SURFACE_POOL_STATS:
+        g_value_set_variant(value, spice_session_surface_pool_stats(session));
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -918,6 +1043,15 @@ static void spice_session_set_property(GObject *gobject,
         g_warning("SpiceSession:gl-scanout is only available on Unix");
 #endif
         break;
+    case PROP_IO_THREAD_CHANNELS:
+        g_strfreev(s->io_thread_channels);
+        s->io_thread_channels = g_value_dup_boxed(value);
+        break;
+    case PROP_IMAGE_CACHE_BUDGET:
+        s->images_cache_budget = g_value_get_uint64(value);
+        if (s->images_cache_budget != 0)
+            update_images_cache_budget(session, s->images_cache_budget);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -1569,6 +1703,137 @@ static void spice_session_class_init(SpiceSessionClass *klass)
 #endif
                                                              G_PARAM_READWRITE |
                                                              G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:io-thread-channels:
+     *
+     * A string array of channel types to run on their own thread rather
+     * than from the main context, for example "display" or "playback".
+     * All the channels of a given type share one thread, and their
+     * signals are still emitted on the main context, after the thread
+     * moved on: only the signals with a return value or with pointer
+     * arguments make the thread wait for their handlers.
+     *
+     * Only the display and playback channels can be moved off the main
+     * context. This must be set before the channels are created.
+     *
+     * Since: 0.43
+     **/
+    g_object_class_install_property(gobject_class, PROP_IO_THREAD_CHANNELS,
+                                    g_param_spec_boxed("io-thread-channels",
+                                                       "I/O thread channels",
+                                                       "Array of channel types to run on their own thread",
+                                                       G_TYPE_STRV,
+                                                       G_PARAM_READWRITE |
+                                                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:image-cache-stats:
+     *
+     * Statistics of the image cache shared by the display channels, as
+     * a vardict:
+     *
+     * - "hits", "misses" (uint64): image lookups
+     * - "evictions", "evicted-bytes" (uint64): images dropped to stay
+     *   within #SpiceSession:image-cache-budget
+     * - "bytes", "entries" (uint64): memory held by the cached images
+     *   and their count
+     * - "budget" (uint64): the budget in use, 0 if unlimited
+     * - "waits" (uint64): lookups that waited for another display
+     *   channel to add the image, "wakeups" (uint64): waiters woken by
+     *   an add, and "wait-us", "max-wait-us" (int64): the total and
+     *   longest time spent waiting
+     *
+     * Since: 0.43
+     **/
+    g_object_class_install_property(gobject_class, PROP_IMAGE_CACHE_STATS,
+                                    g_param_spec_variant("image-cache-stats",
+                                                         "Image cache statistics",
+                                                         "Shared image cache statistics",
+                                                         G_VARIANT_TYPE_VARDICT,
+                                                         NULL,
+                                                         G_PARAM_READABLE |
+                                                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:image-cache-budget:
+     *
+     * Maximum memory, in bytes, the images cached on behalf of the
+     * server may use on the client. When going over it, the least
+     * recently used images are dropped, lossy ones first; a later
+     * drawing referencing them will be incomplete until the area is
+     * redrawn.
+     *
+     * If 0, the budget is a share of the physical memory, when known.
+     * The server counts its cached images in pixels, 4 bytes each on the
+     * client: the cache size announced to the server is limited to a
+     * quarter of the budget. When #SpiceSession:cache-size is set above
+     * that, the budget is raised to 4 bytes per pixel of it: the images
+     * the server still counts as cached are never dropped.
+     *
+     * Since: 0.43
+     **/
+    g_object_class_install_property(gobject_class, PROP_IMAGE_CACHE_BUDGET,
+                                    g_param_spec_uint64("image-cache-budget",
+                                                        "Image cache budget",
+                                                        "Maximum memory of the image cache (bytes)",
+                                                        0, G_MAXUINT64, 0,
+                                                        G_PARAM_READWRITE |
+                                                            G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:glz-window-stats:
+     *
+     * Statistics of the GLZ decoding window shared by the display
+     * channels, as a vardict:
+     *
+     * - "window-size" (uint32): the window size announced to the server,
+     *   in bytes
+     * - "capacity", "images" (uint32): image slots of the window and the
+     *   images it holds
+     * - "bytes", "max-bytes" (uint64): memory held by the images, now
+     *   and at most
+     * - "stalls" (uint64): decodes that waited for an image from another
+     *   display channel, "stall-us", "max-stall-us" (int64): the total
+     *   and longest wait
+     *
+     * Since: 0.43
+     **/
+    g_object_class_install_property(gobject_class, PROP_GLZ_WINDOW_STATS,
+                                    g_param_spec_variant("glz-window-stats",
+                                                         "GLZ window statistics",
+                                                         "Shared GLZ window statistics",
+                                                         G_VARIANT_TYPE_VARDICT,
+                                                         NULL,
+                                                         G_PARAM_READABLE |
+                                                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:surface-pool-stats:
+     *
+     * Statistics of the pool recycling the pixel buffers of the display
+     * surfaces, as a vardict:
+     *
+     * - "allocations" (uint64): surface buffers handed out, "hits"
+     *   (uint64): how many were recycled from the pool
+     * - "huge" (uint64): new buffers aligned for huge pages
+     * - "clears" (uint64): recycled buffers that had to be cleared,
+     *   "clears-skipped" (uint64): recycled buffers entirely painted by
+     *   the server before being read
+     * - "trimmed-bytes" (uint64): memory released to stay within the
+     *   pool limit
+     * - "bytes", "buffers" (uint64): memory and buffers held by the pool
+     *
+     * Since: 0.43
+     **/
+    g_object_class_install_property(gobject_class, PROP_SURFACE_POOL_STATS,
+                                    g_param_spec_variant("surface-pool-stats",
+                                                         "Surface pool statistics",
+                                                         "Surface buffer pool statistics",
+                                                         G_VARIANT_TYPE_VARDICT,
+                                                         NULL,
+                                                         G_PARAM_READABLE |
+                                                             G_PARAM_STATIC_STRINGS));
 }
 
 G_GNUC_INTERNAL
@@ -1915,7 +2180,7 @@ void spice_session_channel_migrate(SpiceSession *session, SpiceChannel *channel)
     c = spice_session_lookup_channel(s->migration, id, type);
     g_return_if_fail(c != NULL);
 
-    if (!g_queue_is_empty(&c->priv->xmit_queue) && s->full_migration)
+    if (spice_channel_get_queue_size(c) != 0 && s->full_migration)
     {
         CHANNEL_DEBUG(channel, "mig channel xmit queue is not empty. type %s", c->priv->name);
     }
@@ -1945,6 +2210,7 @@ static gboolean after_main_init(gpointer data)
 
         spice_session_channel_migrate(self, channel);
         channel->priv->state = SPICE_CHANNEL_STATE_READY;
+        g_coroutine_condition_changed();
         spice_channel_up(channel);
     }
 
@@ -2401,6 +2667,157 @@ void spice_session_channel_new(SpiceSession *session, SpiceChannel *channel)
     g_signal_emit(session, signals[SPICE_SESSION_CHANNEL_NEW], 0, channel);
 }
 
+typedef struct
+{
+    GMainContext *context;
+    GMainLoop *loop;
+    GThread *thread;
+} SpiceIOThread;
+
+static gpointer io_thread_run(gpointer data)
+{
+    SpiceIOThread *t = data;
+
+    g_main_context_push_thread_default(t->context);
+    spice_util_set_thread_context(t->context);
+
+    g_main_loop_run(t->loop);
+
+    spice_util_set_thread_context(NULL);
+    g_main_context_pop_thread_default(t->context);
+
+    return NULL;
+}
+
+static void io_thread_free(SpiceIOThread *t)
+{
+    g_main_loop_quit(t->loop);
+
+    /* the channels and the session are always released on the main
+     * context, see spice_main_context_unref_object() */
+    if (t->thread == g_thread_self())
+    {
+        g_warn_if_reached();
+        g_thread_unref(t->thread);
+    }
+    else
+        g_thread_join(t->thread);
+
+    g_main_loop_unref(t->loop);
+    g_main_context_unref(t->context);
+    g_free(t);
+}
+
+typedef struct
+{
+    SpiceSession *session;
+    gsize budget;
+} CacheBudgetUpdate;
+
+/* display channels context */
+static gboolean apply_images_cache_budget(gpointer data)
+{
+    CacheBudgetUpdate *update = data;
+    SpiceSessionPrivate *s = update->session->priv;
+
+    if (s->images != NULL)
+        cache_set_budget(s->images, update->budget);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void cache_budget_update_free(gpointer data)
+{
+    CacheBudgetUpdate *update = data;
+
+    spice_main_context_unref_object(update->session);
+    g_free(update);
+}
+
+/* The server evicts the images it cached to stay within the cache size
+ * announced to it, and the drawings reference the images it still counts
+ * as cached: the budget never goes below the memory of that many pixels,
+ * only the images beyond what was announced are dropped.
+ *
+ * The cache is used by the display channels, possibly from their I/O
+ * thread: the budget is changed from their context. */
+static void update_images_cache_budget(SpiceSession *session, guint64 budget)
+{
+    SpiceSessionPrivate *s = session->priv;
+    guint64 announced = (guint64)MAX(s->images_cache_size, 0) * IMAGES_CACHE_BYTES_PER_PIXEL;
+    SpiceIOThread *t = NULL;
+    CacheBudgetUpdate *update;
+
+    if (budget != 0)
+        budget = MAX(budget, announced);
+
+    update = g_new(CacheBudgetUpdate, 1);
+    update->session = g_object_ref(session);
+    update->budget = MIN(budget, G_MAXSIZE);
+
+    if (s->io_threads != NULL)
+        t = g_hash_table_lookup(s->io_threads, GINT_TO_POINTER(SPICE_CHANNEL_DISPLAY));
+    g_main_context_invoke_full(t != NULL ? t->context : spice_util_main_context(),
+                               G_PRIORITY_DEFAULT, apply_images_cache_budget,
+                               update, cache_budget_update_free);
+}
+
+/*
+ * spice_session_get_io_context:
+ *
+ * Returns the context @channel_type channels must be dispatched from if
+ * they were selected with SpiceSession:io-thread-channels, starting its
+ * thread if needed. Returns %NULL for the SPICE main context.
+ */
+G_GNUC_INTERNAL
+GMainContext *spice_session_get_io_context(SpiceSession *session, gint channel_type)
+{
+    g_return_val_if_fail(SPICE_IS_SESSION(session), NULL);
+
+    SpiceSessionPrivate *s = session->priv;
+    const gchar *name = spice_channel_type_to_string(channel_type);
+    SpiceIOThread *t;
+
+    if (!spice_strv_contains(s->io_thread_channels, name))
+        return NULL;
+
+    /* Other channels either rely on main context objects from their
+     * handlers (usb device manager, agent, clipboard...) or are too
+     * lightweight to benefit from it */
+    if (channel_type != SPICE_CHANNEL_DISPLAY &&
+        channel_type != SPICE_CHANNEL_PLAYBACK)
+    {
+        g_warning("%s channels can't run on their own thread", name);
+        return NULL;
+    }
+
+#if !WITH_UCONTEXT
+    g_warning("channel I/O threads need ucontext coroutines");
+    return NULL;
+#endif
+
+    if (s->io_threads == NULL)
+        s->io_threads = g_hash_table_new_full(NULL, NULL, NULL,
+                                              (GDestroyNotify)io_thread_free);
+
+    t = g_hash_table_lookup(s->io_threads, GINT_TO_POINTER(channel_type));
+    if (t == NULL)
+    {
+        gchar *thread_name = g_strdup_printf("spice-%s", name);
+
+        t = g_new0(SpiceIOThread, 1);
+        t->context = g_main_context_new();
+        t->loop = g_main_loop_new(t->context, FALSE);
+        t->thread = g_thread_new(thread_name, io_thread_run, t);
+        g_hash_table_insert(s->io_threads, GINT_TO_POINTER(channel_type), t);
+        g_free(thread_name);
+
+        SPICE_DEBUG("started I/O thread for %s channels", name);
+    }
+
+    return g_main_context_ref(t->context);
+}
+
 static void channel_finally_destroyed(gpointer data, GObject *channel)
 {
     SpiceSession *session = SPICE_SESSION(data);
@@ -2646,6 +3063,60 @@ void spice_session_get_caches(SpiceSession *session,
         *glz_window = s->glz_window;
 }
 
+G_GNUC_INTERNAL
+SpiceSurfacePool *spice_session_get_surface_pool(SpiceSession *session)
+{
+    g_return_val_if_fail(SPICE_IS_SESSION(session), NULL);
+
+    return session->priv->surface_pool;
+}
+
+/*
+ * Returns the monotonic time the capture @filename was started at in
+ * this session, and whether the channel reopening it should @append to
+ * it. The first channel to open it starts it now.
+ */
+G_GNUC_INTERNAL
+gint64 spice_session_get_capture_start(SpiceSession *session, const gchar *filename,
+                                       gboolean *append)
+{
+    static GMutex mutex;
+    SpiceSessionPrivate *s;
+    gint64 *start;
+
+    g_return_val_if_fail(SPICE_IS_SESSION(session), 0);
+    g_return_val_if_fail(filename != NULL, 0);
+    s = session->priv;
+
+    g_mutex_lock(&mutex);
+    if (s->capture_starts == NULL)
+        s->capture_starts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+    start = g_hash_table_lookup(s->capture_starts, filename);
+    *append = start != NULL;
+    if (start == NULL)
+    {
+        start = g_new(gint64, 1);
+        *start = g_get_monotonic_time();
+        g_hash_table_insert(s->capture_starts, g_strdup(filename), start);
+    }
+    g_mutex_unlock(&mutex);
+
+    return *start;
+}
+
+static guint64 get_physical_memory(void)
+{
+#if defined(G_OS_UNIX) && defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    if (pages > 0 && page_size > 0)
+        return (guint64)pages * page_size;
+#endif
+    return 0;
+}
+
 G_GNUC_INTERNAL
 void spice_session_set_caches_hints(SpiceSession *session,
                                     uint32_t pci_ram_size,
@@ -2654,21 +3125,30 @@ void spice_session_set_caches_hints(SpiceSession *session,
     g_return_if_fail(SPICE_IS_SESSION(session));
 
     SpiceSessionPrivate *s = session->priv;
+    guint64 budget;
 
     s->n_display_channels = n_display_channels;
 
-    /* TODO: when setting cache and window size, we should consider the client's
-     *       available memory and the number of display channels */
+    /* TODO: consider the number of display channels for the window size */
+    budget = s->images_cache_budget;
+    if (budget == 0)
+        budget = get_physical_memory() / IMAGES_CACHE_BUDGET_MEMORY_SHARE;
+
     if (s->images_cache_size == 0)
     {
         s->images_cache_size = IMAGES_CACHE_SIZE_DEFAULT;
+        if (budget != 0)
+            s->images_cache_size = MIN(s->images_cache_size,
+                                       budget / IMAGES_CACHE_BYTES_PER_PIXEL);
     }
+    update_images_cache_budget(session, budget);
 
     if (s->glz_window_size == 0)
     {
         s->glz_window_size = MIN(MAX_GLZ_WINDOW_SIZE_DEFAULT, pci_ram_size / 2);
         s->glz_window_size = MAX(MIN_GLZ_WINDOW_SIZE_DEFAULT, s->glz_window_size);
     }
+    glz_decoder_window_set_size(s->glz_window, s->glz_window_size);
 }
 
 G_GNUC_INTERNAL
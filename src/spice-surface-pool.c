@@ -0,0 +1,353 @@
+/*
+   Copyright (C) 2026 The spice-gtk contributors
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#define _GNU_SOURCE
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_MEMFD_CREATE
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "spice-surface-pool.h"
+
+/*
+ * A pool of surface pixel buffers.
+ *
+ * Surfaces are created and destroyed with the same few sizes over and
+ * over (mode switches, off-screen surfaces used by the guest driver), so
+ * released buffers are kept and handed out again for the next surface
+ * of the same bucket. Buckets are the size rounded up to a page, or to
+ * a huge page for big buffers, which are also allocated huge page
+ * aligned so the kernel can back them with transparent huge pages.
+ *
+ * Fresh buffers are zeroed, recycled ones are not: the caller is told
+ * through the @zeroed argument of spice_surface_pool_alloc() and clears
+ * the buffer itself, unless it knows the content will be overwritten.
+ *
+ * Cached buffers are kept in least recently released order and the
+ * oldest ones are freed when the pool grows over its limit.
+ */
+
+#define PAGE_SIZE_SMALL  ((gsize)4096)
+#define PAGE_SIZE_HUGE   ((gsize)2 * 1024 * 1024)
+
+typedef struct SurfaceBuffer {
+    gpointer data;
+    gsize size;     /* bucket size */
+} SurfaceBuffer;
+
+struct SpiceSurfacePool {
+    gint refcount;
+    GMutex lock;
+    gsize max_cached_bytes;
+    GQueue cached;  /* SurfaceBuffer, most recently released first */
+    SpiceSurfacePoolStats stats;
+};
+
+static inline gboolean is_huge(gsize size)
+{
+    return size >= PAGE_SIZE_HUGE;
+}
+
+static gsize bucket_size(gsize size)
+{
+    gsize page = is_huge(size) ? PAGE_SIZE_HUGE : PAGE_SIZE_SMALL;
+
+    return (size + page - 1) & ~(page - 1);
+}
+
+/* Returns zeroed memory */
+static gpointer buffer_alloc(gsize size)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+    if (is_huge(size)) {
+        /* map an extra huge page and cut the slack to get the alignment */
+        guint8 *map = mmap(NULL, size + PAGE_SIZE_HUGE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        guint8 *data;
+        gsize head;
+
+        if (map == MAP_FAILED)
+            g_error("%s: failed to map %" G_GSIZE_FORMAT " bytes", G_STRFUNC, size);
+
+        data = (guint8 *)(((guintptr)map + PAGE_SIZE_HUGE - 1) & ~(PAGE_SIZE_HUGE - 1));
+        head = data - map;
+        if (head)
+            munmap(map, head);
+        munmap(data + size, PAGE_SIZE_HUGE - head);
+#ifdef MADV_HUGEPAGE
+        madvise(data, size, MADV_HUGEPAGE);
+#endif
+        return data;
+    }
+#endif
+
+    return g_malloc0(size);
+}
+
+static void buffer_free(gpointer data, gsize size)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+    if (is_huge(size)) {
+        munmap(data, size);
+        return;
+    }
+#endif
+
+    g_free(data);
+}
+
+G_GNUC_INTERNAL
+SpiceSurfacePool *spice_surface_pool_new(gsize max_cached_bytes)
+{
+    SpiceSurfacePool *pool = g_new0(SpiceSurfacePool, 1);
+
+    pool->refcount = 1;
+    g_mutex_init(&pool->lock);
+    g_queue_init(&pool->cached);
+    pool->max_cached_bytes = max_cached_bytes;
+
+    return pool;
+}
+
+G_GNUC_INTERNAL
+SpiceSurfacePool *spice_surface_pool_ref(SpiceSurfacePool *pool)
+{
+    g_return_val_if_fail(pool != NULL, NULL);
+
+    g_atomic_int_inc(&pool->refcount);
+    return pool;
+}
+
+G_GNUC_INTERNAL
+void spice_surface_pool_unref(SpiceSurfacePool *pool)
+{
+    g_return_if_fail(pool != NULL);
+
+    if (!g_atomic_int_dec_and_test(&pool->refcount))
+        return;
+
+    spice_surface_pool_trim(pool);
+    g_mutex_clear(&pool->lock);
+    g_free(pool);
+}
+
+/*
+ * Returns a buffer of at least @size bytes. If @zeroed is set to FALSE,
+ * the buffer was used by a previous surface and holds its pixels.
+ */
+G_GNUC_INTERNAL
+gpointer spice_surface_pool_alloc(SpiceSurfacePool *pool, gsize size, gboolean *zeroed)
+{
+    SurfaceBuffer *buffer = NULL;
+    gpointer data;
+    GList *l;
+
+    g_return_val_if_fail(pool != NULL, NULL);
+    g_return_val_if_fail(zeroed != NULL, NULL);
+
+    size = bucket_size(size);
+
+    g_mutex_lock(&pool->lock);
+    pool->stats.allocations++;
+    for (l = pool->cached.head; l != NULL; l = l->next) {
+        SurfaceBuffer *b = l->data;
+        if (b->size == size) {
+            buffer = b;
+            g_queue_delete_link(&pool->cached, l);
+            pool->stats.hits++;
+            pool->stats.cached_bytes -= size;
+            pool->stats.cached_buffers--;
+            break;
+        }
+    }
+    if (buffer == NULL && is_huge(size))
+        pool->stats.huge++;
+    g_mutex_unlock(&pool->lock);
+
+    if (buffer == NULL) {
+        *zeroed = TRUE;
+        return buffer_alloc(size);
+    }
+
+    data = buffer->data;
+    g_free(buffer);
+    *zeroed = FALSE;
+
+    return data;
+}
+
+/* @size must be the size given to spice_surface_pool_alloc() */
+G_GNUC_INTERNAL
+void spice_surface_pool_free(SpiceSurfacePool *pool, gpointer data, gsize size)
+{
+    SurfaceBuffer *buffer;
+    GList *trimmed = NULL, *l;
+
+    g_return_if_fail(pool != NULL);
+
+    if (data == NULL)
+        return;
+
+    size = bucket_size(size);
+    if (size > pool->max_cached_bytes) {
+        buffer_free(data, size);
+        return;
+    }
+
+    buffer = g_new(SurfaceBuffer, 1);
+    buffer->data = data;
+    buffer->size = size;
+
+    g_mutex_lock(&pool->lock);
+    g_queue_push_head(&pool->cached, buffer);
+    pool->stats.cached_bytes += size;
+    pool->stats.cached_buffers++;
+    while (pool->stats.cached_bytes > pool->max_cached_bytes) {
+        SurfaceBuffer *old = g_queue_pop_tail(&pool->cached);
+        pool->stats.cached_bytes -= old->size;
+        pool->stats.cached_buffers--;
+        pool->stats.trimmed_bytes += old->size;
+        trimmed = g_list_prepend(trimmed, old);
+    }
+    g_mutex_unlock(&pool->lock);
+
+    for (l = trimmed; l != NULL; l = l->next) {
+        SurfaceBuffer *old = l->data;
+        buffer_free(old->data, old->size);
+        g_free(old);
+    }
+    g_list_free(trimmed);
+}
+
+/* Accounts whether a recycled buffer had to be cleared by the caller */
+G_GNUC_INTERNAL
+void spice_surface_pool_count_clear(SpiceSurfacePool *pool, gboolean skipped)
+{
+    g_return_if_fail(pool != NULL);
+
+    g_mutex_lock(&pool->lock);
+    if (skipped)
+        pool->stats.clears_skipped++;
+    else
+        pool->stats.clears++;
+    g_mutex_unlock(&pool->lock);
+}
+
+/* Release all the cached buffers */
+G_GNUC_INTERNAL
+void spice_surface_pool_trim(SpiceSurfacePool *pool)
+{
+    SurfaceBuffer *buffer;
+    GQueue cached;
+
+    g_return_if_fail(pool != NULL);
+
+    g_mutex_lock(&pool->lock);
+    cached = pool->cached;
+    g_queue_init(&pool->cached);
+    pool->stats.trimmed_bytes += pool->stats.cached_bytes;
+    pool->stats.cached_bytes = 0;
+    pool->stats.cached_buffers = 0;
+    g_mutex_unlock(&pool->lock);
+
+    while ((buffer = g_queue_pop_head(&cached)) != NULL) {
+        buffer_free(buffer->data, buffer->size);
+        g_free(buffer);
+    }
+}
+
+G_GNUC_INTERNAL
+void spice_surface_pool_get_stats(SpiceSurfacePool *pool, SpiceSurfacePoolStats *stats)
+{
+    g_return_if_fail(pool != NULL);
+    g_return_if_fail(stats != NULL);
+
+    g_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    g_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Shared surface buffers.
+ *
+ * A buffer backed by an anonymous memory file, which another process can
+ * map from the returned @fd. Its size is sealed so a consumer mapping it
+ * can't be faulted by the buffer shrinking. Returns NULL if shared
+ * memory is not available, the buffer is zeroed otherwise.
+ */
+G_GNUC_INTERNAL
+gpointer spice_surface_shm_alloc(gsize size, int *fd)
+{
+#ifdef HAVE_MEMFD_CREATE
+    gpointer data;
+    int memfd;
+
+    g_return_val_if_fail(fd != NULL, NULL);
+
+#ifdef F_ADD_SEALS
+    memfd = memfd_create("spice-surface", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+    memfd = memfd_create("spice-surface", MFD_CLOEXEC);
+#endif
+    if (memfd < 0) {
+        g_debug("%s: memfd_create failed: %s", G_STRFUNC, g_strerror(errno));
+        return NULL;
+    }
+
+    if (ftruncate(memfd, size) < 0) {
+        g_debug("%s: failed to size the buffer: %s", G_STRFUNC, g_strerror(errno));
+        close(memfd);
+        return NULL;
+    }
+
+#ifdef F_ADD_SEALS
+    /* older C libraries have memfd_create() without the sealing API */
+    if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+        g_debug("%s: failed to seal the buffer: %s", G_STRFUNC, g_strerror(errno));
+#endif
+
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (data == MAP_FAILED) {
+        g_debug("%s: failed to map the buffer: %s", G_STRFUNC, g_strerror(errno));
+        close(memfd);
+        return NULL;
+    }
+
+    *fd = memfd;
+    return data;
+#else
+    return NULL;
+#endif
+}
+
+G_GNUC_INTERNAL
+void spice_surface_shm_free(gpointer data, gsize size, int fd)
+{
+#ifdef HAVE_MEMFD_CREATE
+    if (data != NULL)
+        munmap(data, size);
+    if (fd >= 0)
+        close(fd);
+#else
+    g_return_if_reached();
+#endif
+}
@@ -0,0 +1,49 @@
+/*
+   Copyright (C) 2026 The spice-gtk contributors
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct SpiceSurfacePool SpiceSurfacePool;
+
+typedef struct SpiceSurfacePoolStats {
+    guint64 allocations;    /* buffers handed out */
+    guint64 hits;           /* recycled from the pool */
+    guint64 huge;           /* fresh buffers aligned for huge pages */
+    guint64 clears;         /* recycled buffers that had to be cleared */
+    guint64 clears_skipped; /* recycled buffers overwritten by the server first */
+    guint64 trimmed_bytes;  /* released to stay within the limit */
+    guint64 cached_bytes;   /* currently held by the pool */
+    guint64 cached_buffers;
+} SpiceSurfacePoolStats;
+
+SpiceSurfacePool *spice_surface_pool_new(gsize max_cached_bytes);
+SpiceSurfacePool *spice_surface_pool_ref(SpiceSurfacePool *pool);
+void spice_surface_pool_unref(SpiceSurfacePool *pool);
+
+gpointer spice_surface_pool_alloc(SpiceSurfacePool *pool, gsize size, gboolean *zeroed);
+void spice_surface_pool_free(SpiceSurfacePool *pool, gpointer data, gsize size);
+void spice_surface_pool_count_clear(SpiceSurfacePool *pool, gboolean skipped);
+void spice_surface_pool_trim(SpiceSurfacePool *pool);
+void spice_surface_pool_get_stats(SpiceSurfacePool *pool, SpiceSurfacePoolStats *stats);
+
+gpointer spice_surface_shm_alloc(gsize size, int *fd);
+void spice_surface_shm_free(gpointer data, gsize size, int fd);
+
+G_END_DECLS
@@ -31,6 +31,11 @@ gchar* spice_dos2unix(const gchar *str, gssize len);
 void spice_mono_edge_highlight(unsigned width, unsigned hight,
                                const guint8 *and, const guint8 *xor, guint8 *dest);
 GMainContext *spice_util_main_context(void);
+GMainContext *spice_main_context(void);
+void spice_util_set_thread_context(GMainContext *context);
+gboolean spice_util_in_io_thread(void);
+gboolean spice_util_has_io_threads(void);
+void spice_main_context_unref_object(gpointer object);
 guint g_spice_timeout_add(guint interval, GSourceFunc function, gpointer data);
 guint g_spice_timeout_add_seconds(guint interval, GSourceFunc function, gpointer data);
 guint g_spice_timeout_add_full(gint priority, guint interval, GSourceFunc function,
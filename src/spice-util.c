@@ -377,10 +377,75 @@ GMainContext *spice_util_main_context(void) {
     return spice_context;
 }
 
+static GPrivate thread_context;
+static gint io_threads;
+
+/* Set the context the calling thread dispatches its channels from. Once
+ * set, the g_spice_*() helpers called from this thread attach their
+ * sources to @context instead of the SPICE main context. */
+G_GNUC_INTERNAL
+void spice_util_set_thread_context(GMainContext *context)
+{
+    GMainContext *old = g_private_get(&thread_context);
+
+    if (old == context)
+        return;
+
+    if (old == NULL)
+        g_atomic_int_inc(&io_threads);
+    else if (context == NULL)
+        g_atomic_int_add(&io_threads, -1);
+
+    g_private_set(&thread_context, context);
+}
+
+/* TRUE if the calling thread is a channel I/O thread */
+G_GNUC_INTERNAL
+gboolean spice_util_in_io_thread(void)
+{
+    return g_private_get(&thread_context) != NULL;
+}
+
+static gboolean unref_object_cb(gpointer data)
+{
+    g_object_unref(data);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Drops a reference on @object. From an I/O thread, the unref is done on
+ * the SPICE main context: the objects shared with the main thread must
+ * never be finalized on an I/O thread. */
+G_GNUC_INTERNAL
+void spice_main_context_unref_object(gpointer object)
+{
+    GSource *source;
+
+    if (!spice_util_in_io_thread())
+    {
+        g_object_unref(object);
+        return;
+    }
+
+    source = g_idle_source_new();
+    g_source_set_callback(source, unref_object_cb, object, NULL);
+    g_source_attach(source, spice_util_main_context());
+    g_source_unref(source);
+}
+
+/* TRUE if any channel I/O thread is running */
+G_GNUC_INTERNAL
+gboolean spice_util_has_io_threads(void)
+{
+    return g_atomic_int_get(&io_threads) != 0;
+}
+
 G_GNUC_INTERNAL
 GMainContext *spice_main_context(void)
 {
-    return spice_context;
+    GMainContext *context = g_private_get(&thread_context);
+
+    return context ? context : spice_context;
 }
 
 G_GNUC_INTERNAL
@@ -495,6 +560,8 @@ g_spice_source_remove(guint tag)
     g_return_val_if_fail(tag > 0, FALSE);
 
     source = g_main_context_find_source_by_id(spice_main_context(), tag);
+    if (!source && spice_util_in_io_thread())
+        source = g_main_context_find_source_by_id(spice_context, tag);
     if (source)
         g_source_destroy(source);
     else
@@ -21,14 +21,15 @@
 #include "spice-gtk-session-priv.h"
 
 
+/* Returns TRUE if a new image was created, its content is to be updated */
 G_GNUC_INTERNAL
-int spice_cairo_image_create(SpiceDisplay *display)
+gboolean spice_cairo_image_create(SpiceDisplay *display)
 {
     SpiceDisplayPrivate *d = display->priv;
     gint scale_factor;
 
     if (d->canvas.surface != NULL)
-        return 0;
+        return FALSE;
 
     if (d->canvas.format == SPICE_SURFACE_FMT_16_555 ||
         d->canvas.format == SPICE_SURFACE_FMT_16_565) {
@@ -50,7 +51,7 @@ int spice_cairo_image_create(SpiceDisplay *display)
     scale_factor = gtk_widget_get_scale_factor(GTK_WIDGET(display));
     cairo_surface_set_device_scale(d->canvas.surface, scale_factor, scale_factor);
 
-    return 0;
+    return TRUE;
 }
 
 G_GNUC_INTERNAL
@@ -155,7 +155,7 @@ struct _SpiceDisplayPrivate {
     GWeakRef overlay_weak_ref;
 };
 
-int      spice_cairo_image_create                 (SpiceDisplay *display);
+gboolean spice_cairo_image_create                 (SpiceDisplay *display);
 void     spice_cairo_image_destroy                (SpiceDisplay *display);
 void     spice_cairo_draw_event                   (SpiceDisplay *display, cairo_t *cr);
 gboolean spice_allow_scaling                      (SpiceDisplay *display);
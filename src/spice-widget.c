@@ -56,6 +56,7 @@
 #include "vncdisplaykeymap.h"
 #include "spice-grabsequence-priv.h"
 #include "spice-util-priv.h"
+#include "spice-pixel-convert.h"
 
 /**
  * SECTION:spice-widget
@@ -1478,26 +1479,13 @@ static void recalc_geometry(GtkWidget *widget)
 
 /* ---------------------------------------------------------------- */
 
-#define CONVERT_0565_TO_0888(s)                       \
-    (((((s) << 3) & 0xf8) | (((s) >> 2) & 0x7)) |     \
-     ((((s) << 5) & 0xfc00) | (((s) >> 1) & 0x300)) | \
-     ((((s) << 8) & 0xf80000) | (((s) << 3) & 0x70000)))
-
-#define CONVERT_0565_TO_8888(s) (CONVERT_0565_TO_0888(s) | 0xff000000)
-
-#define CONVERT_0555_TO_0888(s)                        \
-    (((((s) & 0x001f) << 3) | (((s) & 0x001c) >> 2)) | \
-     ((((s) & 0x03e0) << 6) | (((s) & 0x0380) << 1)) | \
-     ((((s) & 0x7c00) << 9) | ((((s) & 0x7000)) << 4)))
-
-#define CONVERT_0555_TO_8888(s) (CONVERT_0555_TO_0888(s) | 0xff000000)
-
 static gboolean do_color_convert(SpiceDisplay *display, GdkRectangle *r)
 {
     SpiceDisplayPrivate *d = display->priv;
     guint32 *dest = d->canvas.data;
     guint16 *src = d->canvas.data_origin;
-    gint x, y;
+    SpicePixelConvertRow convert_row;
+    gint y;
 
     g_return_val_if_fail(r != NULL, false);
     g_return_val_if_fail(d->canvas.format == SPICE_SURFACE_FMT_16_555 ||
@@ -1508,30 +1496,16 @@ static gboolean do_color_convert(SpiceDisplay *display, GdkRectangle *r)
     dest += d->area.width * (r->y - d->area.y) + (r->x - d->area.x);
 
     if (d->canvas.format == SPICE_SURFACE_FMT_16_555)
-    {
-        for (y = 0; y < r->height; y++)
-        {
-            for (x = 0; x < r->width; x++)
-            {
-                dest[x] = CONVERT_0555_TO_0888(src[x]);
-            }
+        convert_row = spice_pixel_convert_get()->row_555;
+    else
+        convert_row = spice_pixel_convert_get()->row_565;
 
-            dest += d->area.width;
-            src += d->canvas.stride / 2;
-        }
-    }
-    else if (d->canvas.format == SPICE_SURFACE_FMT_16_565)
+    for (y = 0; y < r->height; y++)
     {
-        for (y = 0; y < r->height; y++)
-        {
-            for (x = 0; x < r->width; x++)
-            {
-                dest[x] = CONVERT_0565_TO_0888(src[x]);
-            }
+        convert_row(dest, src, r->width);
 
-            dest += d->area.width;
-            src += d->canvas.stride / 2;
-        }
+        dest += d->area.width;
+        src += d->canvas.stride / 2;
     }
 
     return true;
@@ -2473,8 +2447,9 @@ static void update_image(SpiceDisplay *display)
 {
     SpiceDisplayPrivate *d = display->priv;
 
-    spice_cairo_image_create(display);
-    if (d->canvas.convert)
+    /* an existing image is kept up to date by invalidate(), which only
+     * converts the updated area */
+    if (spice_cairo_image_create(display) && d->canvas.convert)
         do_color_convert(display, &d->area);
 }
 
@@ -3138,6 +3113,18 @@ static void invalidate(SpiceChannel *channel,
                     x2 - x1, y2 - y1);
 }
 
+static void invalidate_region(SpiceChannel *channel, GArray *rects, gpointer data)
+{
+    guint i;
+
+    for (i = 0; i < rects->len; i++)
+    {
+        SpiceDisplayRect *rect = &g_array_index(rects, SpiceDisplayRect, i);
+
+        invalidate(channel, rect->x, rect->y, rect->width, rect->height, data);
+    }
+}
+
 static void mark(SpiceDisplay *display, gint mark)
 {
     SpiceDisplayPrivate *d = display->priv;
@@ -3575,8 +3562,8 @@ static void channel_new(SpiceSession *s, SpiceChannel *channel, SpiceDisplay *di
                                       G_CALLBACK(primary_create), display, 0);
         spice_g_signal_connect_object(channel, "display-primary-destroy",
                                       G_CALLBACK(primary_destroy), display, 0);
-        spice_g_signal_connect_object(channel, "display-invalidate",
-                                      G_CALLBACK(invalidate), display, 0);
+        spice_g_signal_connect_object(channel, "display-invalidate-region",
+                                      G_CALLBACK(invalidate_region), display, 0);
         spice_g_signal_connect_object(channel, "display-mark",
                                       G_CALLBACK(mark), display, G_CONNECT_AFTER | G_CONNECT_SWAPPED);
         spice_g_signal_connect_object(channel, "notify::monitors",
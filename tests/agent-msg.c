@@ -0,0 +1,220 @@
+#include <glib.h>
+#include <string.h>
+#include <time.h>
+#include <spice/vd_agent.h>
+
+#include "spice-client.h"
+#include "spice-agent-msg.h"
+#include "spice-channel-priv.h"
+
+typedef struct {
+    SpiceSession *session;
+    SpiceChannel *channel;
+    gsize header_size;      /* of the SPICE messages */
+} Fixture;
+
+static void
+f_setup(Fixture *f, gconstpointer user_data G_GNUC_UNUSED)
+{
+    SpiceMsgOut *out;
+
+    f->session = spice_session_new();
+    f->channel = spice_channel_new(f->session, SPICE_CHANNEL_MAIN, 0);
+    g_assert_nonnull(f->channel);
+
+    out = spice_msg_out_new(f->channel, SPICE_MSGC_MAIN_AGENT_DATA);
+    f->header_size = spice_marshaller_get_total_size(out->marshaller);
+    spice_msg_out_unref(out);
+}
+
+static void
+f_teardown(Fixture *f, gconstpointer user_data G_GNUC_UNUSED)
+{
+    spice_session_disconnect(f->session);
+    g_object_unref(f->session);
+    while (g_main_context_iteration(NULL, FALSE)) {
+        continue;
+    }
+}
+
+static void queue_copy(Fixture *f, GQueue *queue, guint32 type, ...)
+{
+    va_list args;
+    const void *data;
+
+    va_start(args, type);
+    data = va_arg(args, const void *);
+    spice_agent_msg_queue_valist(f->channel, queue, type, data, args);
+    va_end(args);
+}
+
+/* the agent data of the messages, without their SPICE header */
+static GByteArray *queue_payload(Fixture *f, GQueue *queue)
+{
+    GByteArray *payload = g_byte_array_new();
+    SpiceMsgOut *out;
+
+    while ((out = g_queue_pop_head(queue)) != NULL) {
+        uint8_t *data;
+        size_t len;
+        int free_data;
+
+        spice_marshaller_flush(out->marshaller);
+        g_assert_cmpuint(spice_marshaller_get_total_size(out->marshaller), <=,
+                         f->header_size + VD_AGENT_MAX_DATA_SIZE);
+        data = spice_marshaller_linearize(out->marshaller, f->header_size, &len, &free_data);
+        g_byte_array_append(payload, data, len);
+        if (free_data)
+            g_free(data);
+        spice_msg_out_unref(out);
+    }
+
+    return payload;
+}
+
+static void bytes_freed(gpointer user_data)
+{
+    gboolean *freed = user_data;
+
+    *freed = TRUE;
+}
+
+/* the data queued by reference makes the same messages as copied */
+static void test_agent_msg_same(Fixture *f, gconstpointer user_data G_GNUC_UNUSED)
+{
+    static const gsize sizes[] = {
+        0, 1,
+        VD_AGENT_MAX_DATA_SIZE - sizeof(VDAgentMessage) - sizeof(VDAgentFileXferDataMessage),
+        VD_AGENT_MAX_DATA_SIZE - sizeof(VDAgentMessage) - sizeof(VDAgentFileXferDataMessage) + 1,
+        VD_AGENT_MAX_DATA_SIZE * 3,
+        1024 * 1024 + 7,
+    };
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(sizes); i++) {
+        VDAgentFileXferDataMessage header = { 42, sizes[i] };
+        GQueue copy = G_QUEUE_INIT, by_ref = G_QUEUE_INIT;
+        GByteArray *copy_payload, *by_ref_payload;
+        VDAgentMessage *msg;
+        gboolean freed = FALSE;
+        guint8 *data;
+        GBytes *bytes;
+        gsize j;
+
+        data = g_malloc(sizes[i] + 1);
+        for (j = 0; j < sizes[i]; j++)
+            data[j] = j * 13 + (j >> 8);
+        bytes = g_bytes_new_with_free_func(data, sizes[i], bytes_freed, &freed);
+
+        queue_copy(f, &copy, VD_AGENT_FILE_XFER_DATA, &header, sizeof(header),
+                   data, sizes[i], NULL);
+        spice_agent_msg_queue_bytes(f->channel, &by_ref, VD_AGENT_FILE_XFER_DATA,
+                                    &header, sizeof(header), bytes);
+        g_assert_cmpuint(copy.length, ==, by_ref.length);
+        g_assert_cmpuint(copy.length, ==,
+                         (sizeof(*msg) + sizeof(header) + sizes[i] + VD_AGENT_MAX_DATA_SIZE - 1) /
+                         VD_AGENT_MAX_DATA_SIZE);
+
+        copy_payload = queue_payload(f, &copy);
+        by_ref_payload = queue_payload(f, &by_ref);
+        g_assert_cmpmem(copy_payload->data, copy_payload->len,
+                        by_ref_payload->data, by_ref_payload->len);
+
+        msg = (VDAgentMessage *)by_ref_payload->data;
+        g_assert_cmpuint(msg->type, ==, VD_AGENT_FILE_XFER_DATA);
+        g_assert_cmpuint(msg->size, ==, sizeof(header) + sizes[i]);
+        g_assert_cmpmem(msg->data + sizeof(header), sizes[i], data, sizes[i]);
+
+        g_byte_array_unref(copy_payload);
+        g_byte_array_unref(by_ref_payload);
+
+        /* the messages are gone, they don't hold the data anymore */
+        g_assert_false(freed);
+        g_bytes_unref(bytes);
+        g_assert_true(freed);
+        g_free(data);
+    }
+}
+
+#define BENCH_PAYLOAD (64 * 1024 * 1024)
+#define BENCH_ROUNDS 16
+
+/* the CPU time to queue a GiB of file data to the agent, then to write
+ * the messages out as the channel does, without the socket itself */
+static gdouble bench_cpu_ms_per_gb(Fixture *f, GBytes *bytes, gboolean by_ref)
+{
+    VDAgentFileXferDataMessage header = { 42, BENCH_PAYLOAD };
+    clock_t start = clock();
+    guint round;
+
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        GQueue queue = G_QUEUE_INIT;
+        SpiceMsgOut *out;
+        gsize written = 0;
+
+        if (by_ref)
+            spice_agent_msg_queue_bytes(f->channel, &queue, VD_AGENT_FILE_XFER_DATA,
+                                        &header, sizeof(header), bytes);
+        else
+            queue_copy(f, &queue, VD_AGENT_FILE_XFER_DATA, &header, sizeof(header),
+                       g_bytes_get_data(bytes, NULL), (gsize)BENCH_PAYLOAD, NULL);
+
+        while ((out = g_queue_pop_head(&queue)) != NULL) {
+            struct iovec iov[16];
+            size_t total, skip = 0;
+
+            spice_marshaller_flush(out->marshaller);
+            total = spice_marshaller_get_total_size(out->marshaller);
+            while (skip < total) {
+                size_t last = skip;
+                int i, n = spice_marshaller_fill_iovec(out->marshaller, iov,
+                                                       G_N_ELEMENTS(iov), skip);
+                for (i = 0; i < n; i++)
+                    skip += iov[i].iov_len;
+                if (skip == last) {
+                    g_warn_if_reached();
+                    break;
+                }
+            }
+            written += total;
+            spice_msg_out_unref(out);
+        }
+        g_assert_cmpuint(written, >, BENCH_PAYLOAD);
+    }
+
+    return (clock() - start) * 1000.0 / CLOCKS_PER_SEC *
+        (1024.0 * 1024 * 1024) / ((gdouble)BENCH_PAYLOAD * BENCH_ROUNDS);
+}
+
+static void test_agent_msg_benchmark(Fixture *f, gconstpointer user_data G_GNUC_UNUSED)
+{
+    GBytes *bytes;
+    gdouble copy_ms, by_ref_ms;
+
+    if (!g_test_perf()) {
+        g_test_skip("run with -m perf");
+        return;
+    }
+
+    bytes = g_bytes_new_take(g_malloc0(BENCH_PAYLOAD), BENCH_PAYLOAD);
+
+    copy_ms = bench_cpu_ms_per_gb(f, bytes, FALSE);
+    g_test_minimized_result(copy_ms, "copied: %.0f ms CPU per GiB", copy_ms);
+    by_ref_ms = bench_cpu_ms_per_gb(f, bytes, TRUE);
+    g_test_minimized_result(by_ref_ms, "by reference: %.0f ms CPU per GiB, x%.2f",
+                            by_ref_ms, copy_ms / MAX(by_ref_ms, 0.001));
+
+    g_bytes_unref(bytes);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add("/agent-msg/same", Fixture, NULL,
+               f_setup, test_agent_msg_same, f_teardown);
+    g_test_add("/agent-msg/benchmark", Fixture, NULL,
+               f_setup, test_agent_msg_benchmark, f_teardown);
+
+    return g_test_run();
+}
@@ -0,0 +1,93 @@
+#include <glib.h>
+#include <string.h>
+
+#include "spice-buffer-pool.h"
+
+static void test_buffer_pool_recycle(void)
+{
+    SpiceBufferPool *pool = spice_buffer_pool_new(4096, 1024 * 1024);
+    SpiceBufferPoolStats stats;
+    guint8 *a, *b;
+
+    a = spice_buffer_pool_alloc(pool, 1000);
+    g_assert_nonnull(a);
+    memset(a, 0xaa, 1000);
+    spice_buffer_pool_free(pool, a);
+
+    /* same size class, the buffer is handed out again */
+    b = spice_buffer_pool_alloc(pool, 600);
+    g_assert(a == b);
+    spice_buffer_pool_free(pool, b);
+
+    spice_buffer_pool_get_stats(pool, &stats);
+    g_assert_cmpuint(stats.allocations, ==, 2);
+    g_assert_cmpuint(stats.hits, ==, 1);
+    g_assert_cmpuint(stats.misses, ==, 1);
+    g_assert_cmpuint(stats.recycled_bytes, ==, 1024);
+    g_assert_cmpuint(stats.cached_bytes, ==, 1024);
+
+    spice_buffer_pool_trim(pool);
+    spice_buffer_pool_get_stats(pool, &stats);
+    g_assert_cmpuint(stats.cached_bytes, ==, 0);
+
+    spice_buffer_pool_unref(pool);
+}
+
+static void test_buffer_pool_large(void)
+{
+    SpiceBufferPool *pool = spice_buffer_pool_new(4096, 1024 * 1024);
+    SpiceBufferPoolStats stats;
+    guint8 *a;
+
+    a = spice_buffer_pool_alloc(pool, 8192);
+    memset(a, 0, 8192);
+    spice_buffer_pool_free(pool, a);
+
+    spice_buffer_pool_get_stats(pool, &stats);
+    g_assert_cmpuint(stats.large, ==, 1);
+    g_assert_cmpuint(stats.cached_bytes, ==, 0);
+
+    spice_buffer_pool_unref(pool);
+}
+
+static void test_buffer_pool_cache_limit(void)
+{
+    SpiceBufferPool *pool = spice_buffer_pool_new(4096, 4096);
+    SpiceBufferPoolStats stats;
+    gpointer a, b;
+
+    a = spice_buffer_pool_alloc(pool, 4096);
+    b = spice_buffer_pool_alloc(pool, 4096);
+    spice_buffer_pool_free(pool, a);
+    spice_buffer_pool_free(pool, b);
+
+    spice_buffer_pool_get_stats(pool, &stats);
+    g_assert_cmpuint(stats.cached_bytes, ==, 4096);
+
+    spice_buffer_pool_unref(pool);
+}
+
+static void test_buffer_pool_outlives_owner(void)
+{
+    SpiceBufferPool *pool = spice_buffer_pool_new(4096, 1024 * 1024);
+    gpointer a;
+
+    /* a buffer keeping a reference can be released after the owner */
+    a = spice_buffer_pool_alloc(pool, 100);
+    spice_buffer_pool_ref(pool);
+    spice_buffer_pool_unref(pool);
+    spice_buffer_pool_free(pool, a);
+    spice_buffer_pool_unref(pool);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/buffer-pool/recycle", test_buffer_pool_recycle);
+    g_test_add_func("/buffer-pool/large", test_buffer_pool_large);
+    g_test_add_func("/buffer-pool/cache-limit", test_buffer_pool_cache_limit);
+    g_test_add_func("/buffer-pool/outlives-owner", test_buffer_pool_outlives_owner);
+
+    return g_test_run();
+}
@@ -3,7 +3,8 @@
 #include <string.h>
 #include <stdlib.h>
 
-#include "coroutine.h"
+#include "gio-coroutine.h"
+#include "spice-channel-cache.h"
 
 static gpointer co_entry_check_self(gpointer data)
 {
@@ -152,6 +153,67 @@ static void test_coroutine_yield(void)
     g_test_assert_expected_messages();
 }
 
+typedef struct {
+    GCoroutine coroutine;
+    display_cache *cache;
+    gboolean woken;
+    gboolean done;
+} EventWaiter;
+
+static gpointer co_entry_event_wait(gpointer data)
+{
+    EventWaiter *waiter = data;
+    GSource *event = g_coroutine_event_new();
+
+    g_assert_null(cache_find(waiter->cache, 1));
+    cache_add_waiter(waiter->cache, 1, event);
+    waiter->woken = g_coroutine_event_wait(&waiter->coroutine, event);
+    g_source_unref(event);
+
+    g_assert(cache_find(waiter->cache, 1) == GINT_TO_POINTER(1));
+    waiter->done = TRUE;
+
+    return NULL;
+}
+
+static gboolean add_items(gpointer data)
+{
+    display_cache *cache = data;
+
+    /* only the waiters of the added id are woken */
+    cache_add(cache, 2, GINT_TO_POINTER(2));
+    g_assert_cmpuint(cache->wait_stats.wakeups, ==, 0);
+    cache_add(cache, 1, GINT_TO_POINTER(1));
+    g_assert_cmpuint(cache->wait_stats.wakeups, ==, 1);
+
+    return FALSE;
+}
+
+static void test_coroutine_event_wait(void)
+{
+    EventWaiter waiter = { .cache = cache_new(NULL), };
+    struct coroutine *co = &waiter.coroutine.coroutine;
+
+    co->stack_size = 1 << 20;
+    co->entry = co_entry_event_wait;
+    coroutine_init(co);
+    coroutine_yieldto(co, &waiter);
+    g_assert_false(waiter.done);
+
+    /* nothing wakes the waiter up until the item is added */
+    while (g_main_context_iteration(NULL, FALSE))
+        ;
+    g_assert_false(waiter.done);
+
+    g_idle_add(add_items, waiter.cache);
+    while (!waiter.done)
+        g_main_context_iteration(NULL, TRUE);
+
+    g_assert_true(waiter.woken);
+    g_assert_cmpuint(g_hash_table_size(waiter.cache->waiters), ==, 0);
+    cache_free(waiter.cache);
+}
+
 int main(int argc, char* argv[])
 {
     g_test_init(&argc, &argv, NULL);
@@ -159,6 +221,7 @@ int main(int argc, char* argv[])
     g_test_add_func("/coroutine/simple", test_coroutine_simple);
     g_test_add_func("/coroutine/two", test_coroutine_two);
     g_test_add_func("/coroutine/yield", test_coroutine_yield);
+    g_test_add_func("/coroutine/event-wait", test_coroutine_event_wait);
 
     return g_test_run ();
 }
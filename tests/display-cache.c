@@ -0,0 +1,157 @@
+#include <glib.h>
+
+#include "spice-channel-cache.h"
+#include "gio-coroutine.h"
+
+/* the values are their own size */
+static gsize value_size(gpointer value)
+{
+    return GPOINTER_TO_SIZE(value);
+}
+
+static void test_display_cache_ref_count(void)
+{
+    display_cache *cache = cache_image_new(NULL, value_size);
+    gboolean lossy;
+
+    cache_add(cache, 1, GSIZE_TO_POINTER(10));
+    cache_add(cache, 1, GSIZE_TO_POINTER(20));
+    g_assert_cmpuint(cache->stats.entries, ==, 1);
+    g_assert_cmpuint(cache->stats.bytes, ==, 20);
+
+    /* added twice, removed once: still there */
+    g_assert_true(cache_remove(cache, 1));
+    g_assert(cache_find_lossy(cache, 1, &lossy) == GSIZE_TO_POINTER(20));
+    g_assert_false(lossy);
+
+    /* a replace keeps the reference count */
+    cache_replace_lossy(cache, 1, GSIZE_TO_POINTER(30), TRUE);
+    g_assert(cache_find_lossy(cache, 1, &lossy) == GSIZE_TO_POINTER(30));
+    g_assert_true(lossy);
+
+    g_assert_true(cache_remove(cache, 1));
+    g_assert_null(cache_find(cache, 1));
+    g_assert_false(cache_remove(cache, 1));
+    g_assert_cmpuint(cache->stats.bytes, ==, 0);
+    g_assert_cmpuint(cache->stats.hits, ==, 2);
+    g_assert_cmpuint(cache->stats.misses, ==, 1);
+
+    cache_free(cache);
+}
+
+static void test_display_cache_many(void)
+{
+    display_cache *cache = cache_new(NULL);
+    guint64 i;
+
+    /* sequential and sparse ids, with deletions in between */
+    for (i = 1; i <= 20000; i++)
+        cache_add(cache, i << (i % 2 ? 0 : 32), GSIZE_TO_POINTER(i));
+    for (i = 1; i <= 20000; i += 3)
+        g_assert_true(cache_remove(cache, i << (i % 2 ? 0 : 32)));
+    for (i = 1; i <= 20000; i++)
+        cache_add(cache, i + 100000, GSIZE_TO_POINTER(i));
+
+    for (i = 1; i <= 20000; i++) {
+        gpointer value = cache_find(cache, i << (i % 2 ? 0 : 32));
+
+        if ((i - 1) % 3 == 0)
+            g_assert_null(value);
+        else
+            g_assert(value == GSIZE_TO_POINTER(i));
+        g_assert(cache_find(cache, i + 100000) == GSIZE_TO_POINTER(i));
+    }
+
+    cache_clear(cache);
+    g_assert_cmpuint(cache->stats.entries, ==, 0);
+    g_assert_null(cache_find(cache, 2));
+
+    cache_free(cache);
+}
+
+static void test_display_cache_budget(void)
+{
+    display_cache *cache = cache_image_new(NULL, value_size);
+
+    cache_set_budget(cache, 400);
+
+    cache_add(cache, 1, GSIZE_TO_POINTER(100));
+    cache_add_lossy(cache, 2, GSIZE_TO_POINTER(100), TRUE);
+    cache_add(cache, 3, GSIZE_TO_POINTER(100));
+    cache_add(cache, 4, GSIZE_TO_POINTER(100));
+    g_assert_cmpuint(cache->stats.evictions, ==, 0);
+
+    /* 1 is now more recently used than 3 */
+    g_assert_nonnull(cache_find(cache, 1));
+
+    /* going over 400 evicts down to 350: the lossy image first, then
+     * the least recently used one */
+    cache_add(cache, 5, GSIZE_TO_POINTER(100));
+    g_assert_cmpuint(cache->stats.evictions, ==, 2);
+    g_assert_cmpuint(cache->stats.evicted_bytes, ==, 200);
+    g_assert_cmpuint(cache->stats.bytes, ==, 300);
+    g_assert_true(cache_is_evicted(cache, 2));
+    g_assert_true(cache_is_evicted(cache, 3));
+    g_assert_null(cache_find(cache, 2));
+    g_assert_nonnull(cache_find(cache, 1));
+    g_assert_nonnull(cache_find(cache, 4));
+    g_assert_nonnull(cache_find(cache, 5));
+
+    /* once the server invalidates an evicted image, it is forgotten */
+    g_assert_true(cache_remove(cache, 2));
+    g_assert_false(cache_is_evicted(cache, 2));
+
+    /* and if it sends it again, it is cached again */
+    cache_add(cache, 3, GSIZE_TO_POINTER(50));
+    g_assert_false(cache_is_evicted(cache, 3));
+    g_assert_nonnull(cache_find(cache, 3));
+
+    /* a value bigger than the budget is kept, others make room */
+    cache_add(cache, 6, GSIZE_TO_POINTER(1000));
+    g_assert_nonnull(cache_find(cache, 6));
+    g_assert_cmpuint(cache->stats.entries, ==, 1);
+
+    cache_free(cache);
+}
+
+/* the waiters of cancelled waits don't stay until the image comes */
+static void test_display_cache_waiters(void)
+{
+    display_cache *cache = cache_new(NULL);
+    GSource *cancelled = g_coroutine_event_new();
+    GSource *waiting = g_coroutine_event_new();
+
+    cache_add_waiter(cache, 7, cancelled);
+    cache_add_waiter(cache, 7, waiting);
+    cache_add_waiter(cache, 8, cancelled);
+    g_assert_cmpuint(g_hash_table_size(cache->waiters), ==, 2);
+
+    cache_remove_waiter(cache, 8, cancelled);
+    g_assert_cmpuint(g_hash_table_size(cache->waiters), ==, 1);
+    cache_remove_waiter(cache, 7, cancelled);
+    cache_remove_waiter(cache, 7, cancelled);
+    g_assert_cmpuint(g_hash_table_size(cache->waiters), ==, 1);
+
+    /* only the remaining waiter is woken */
+    cache_add(cache, 7, GSIZE_TO_POINTER(1));
+    g_assert_cmpuint(cache->wait_stats.wakeups, ==, 1);
+    g_assert_cmpint(g_source_get_ready_time(waiting), ==, 0);
+    g_assert_cmpint(g_source_get_ready_time(cancelled), ==, -1);
+    g_assert_cmpuint(g_hash_table_size(cache->waiters), ==, 0);
+
+    g_source_unref(cancelled);
+    g_source_unref(waiting);
+    cache_free(cache);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/display-cache/ref-count", test_display_cache_ref_count);
+    g_test_add_func("/display-cache/many", test_display_cache_many);
+    g_test_add_func("/display-cache/budget", test_display_cache_budget);
+    g_test_add_func("/display-cache/waiters", test_display_cache_waiters);
+
+    return g_test_run();
+}
@@ -338,6 +338,230 @@ test_agent_cancel_on_read(Fixture *f, gconstpointer user_data G_GNUC_UNUSED)
     g_main_loop_run (f->loop);
 }
 
+/*******************************************************************************
+ * TEST READ AHEAD
+ ******************************************************************************/
+
+#define READ_AHEAD_SIZE (FILE_XFER_CHUNK_SIZE * 5 + 1234)
+
+static guint8 read_ahead_byte(gsize offset)
+{
+    return (offset * 7 + (offset >> 11)) & 0xff;
+}
+
+typedef struct {
+    gsize offset;
+    gboolean wait;
+} ReadAhead;
+
+static void transfer_read_ahead_read_async_cb(GObject *source_object,
+                                              GAsyncResult *res,
+                                              gpointer user_data);
+
+/* lets the task read ahead before asking for the next chunk */
+static gboolean
+transfer_read_ahead_timeout(gpointer user_data)
+{
+    SpiceFileTransferTask *xfer_task = user_data;
+    ReadAhead *ra = g_object_get_data(G_OBJECT(xfer_task), "read-ahead");
+
+    spice_file_transfer_task_read_async(xfer_task, transfer_read_ahead_read_async_cb, ra);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+transfer_read_ahead_read_async_cb(GObject *source_object,
+                                  GAsyncResult *res,
+                                  gpointer user_data)
+{
+    SpiceFileTransferTask *xfer_task;
+    ReadAhead *ra = user_data;
+    gssize count, i;
+    char *buffer;
+    GError *error = NULL;
+
+    xfer_task = SPICE_FILE_TRANSFER_TASK(source_object);
+    count = spice_file_transfer_task_read_finish(xfer_task, res, &buffer, &error);
+    g_assert_no_error(error);
+
+    if (count == 0) {
+        guint64 rate;
+
+        g_assert_cmpuint(ra->offset, ==, READ_AHEAD_SIZE);
+        g_assert_cmpuint(spice_file_transfer_task_get_transferred_bytes(xfer_task), ==,
+                         READ_AHEAD_SIZE);
+        g_object_get(xfer_task, "transfer-rate", &rate, NULL);
+        g_assert_cmpuint(rate, >, 0);
+        spice_file_transfer_task_completed(xfer_task, NULL);
+        return;
+    }
+
+    g_assert_cmpint(count, <=, FILE_XFER_CHUNK_SIZE);
+    for (i = 0; i < count; i++) {
+        if ((guint8)buffer[i] != read_ahead_byte(ra->offset + i))
+            g_error("byte %" G_GSIZE_FORMAT " differs", ra->offset + i);
+    }
+    ra->offset += count;
+
+    /* alternate waiting reads and reads served by the read ahead */
+    ra->wait = !ra->wait;
+    if (ra->wait)
+        g_timeout_add(10, transfer_read_ahead_timeout, xfer_task);
+    else
+        spice_file_transfer_task_read_async(xfer_task, transfer_read_ahead_read_async_cb, ra);
+}
+
+static void
+transfer_read_ahead_init_async_cb(GObject *obj, GAsyncResult *res, gpointer data G_GNUC_UNUSED)
+{
+    SpiceFileTransferTask *xfer_task;
+    GFileInfo *info;
+    GError *error = NULL;
+    ReadAhead *ra;
+
+    xfer_task = SPICE_FILE_TRANSFER_TASK(obj);
+    info = spice_file_transfer_task_init_task_finish(xfer_task, res, &error);
+    g_assert_no_error(error);
+    g_assert_nonnull(info);
+    g_object_unref(info);
+
+    ra = g_new0(ReadAhead, 1);
+    g_object_set_data_full(G_OBJECT(xfer_task), "read-ahead", ra, g_free);
+    spice_file_transfer_task_read_async(xfer_task, transfer_read_ahead_read_async_cb, ra);
+}
+
+static void
+test_read_ahead(Fixture *f, gconstpointer user_data G_GNUC_UNUSED)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    guint8 *data;
+    gsize i;
+    GError *err = NULL;
+
+    data = g_malloc(READ_AHEAD_SIZE);
+    for (i = 0; i < READ_AHEAD_SIZE; i++)
+        data[i] = read_ahead_byte(i);
+    for (i = 0; i < f->num_files; i++) {
+        g_assert_true(g_file_replace_contents(f->files[i], (const char *)data, READ_AHEAD_SIZE,
+                                              NULL, FALSE, G_FILE_CREATE_NONE, NULL,
+                                              f->cancellable, &err));
+        g_assert_no_error(err);
+    }
+    g_free(data);
+
+    f->xfer_tasks = spice_file_transfer_task_create_tasks(f->files, NULL, G_FILE_COPY_NONE, f->cancellable);
+    g_hash_table_iter_init(&iter, f->xfer_tasks);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        SpiceFileTransferTask *xfer_task = SPICE_FILE_TRANSFER_TASK(value);
+        g_signal_connect(xfer_task, "finished", G_CALLBACK(transfer_xfer_task_on_finished), f);
+        spice_file_transfer_task_init_task_async(xfer_task, transfer_read_ahead_init_async_cb, f);
+    }
+    g_main_loop_run (f->loop);
+}
+
+/*******************************************************************************
+ * TEST READ AHEAD BUDGET
+ ******************************************************************************/
+
+/* the tasks read a chunk each in turn, like SpiceMainChannel does, while
+ * the others read ahead within the budget of the channel */
+typedef struct {
+    Fixture *f;
+    GQueue waiting;
+} ReadAheadTurns;
+
+static void
+transfer_budget_read_async_cb(GObject *source_object,
+                              GAsyncResult *res,
+                              gpointer user_data)
+{
+    SpiceFileTransferTask *xfer_task, *next;
+    ReadAheadTurns *turns = user_data;
+    GBytes *data;
+    GError *error = NULL;
+
+    xfer_task = SPICE_FILE_TRANSFER_TASK(source_object);
+    data = spice_file_transfer_task_read_finish_bytes(xfer_task, res, &error);
+    g_assert_no_error(error);
+    g_assert_nonnull(data);
+
+    g_assert_cmpuint(spice_file_transfer_task_get_max_chunks(xfer_task), <=,
+                     FILE_XFER_CHANNEL_CHUNKS + 1);
+    if (g_bytes_get_size(data) == 0) {
+        g_assert_cmpuint(spice_file_transfer_task_get_transferred_bytes(xfer_task), ==,
+                         READ_AHEAD_SIZE);
+        spice_file_transfer_task_completed(xfer_task, NULL);
+    } else {
+        g_queue_push_tail(&turns->waiting, xfer_task);
+    }
+    g_bytes_unref(data);
+
+    next = g_queue_pop_head(&turns->waiting);
+    if (next != NULL)
+        spice_file_transfer_task_read_async(next, transfer_budget_read_async_cb, turns);
+}
+
+static void
+transfer_budget_init_async_cb(GObject *obj, GAsyncResult *res, gpointer data)
+{
+    SpiceFileTransferTask *xfer_task;
+    ReadAheadTurns *turns = data;
+    GFileInfo *info;
+    GError *error = NULL;
+
+    xfer_task = SPICE_FILE_TRANSFER_TASK(obj);
+    info = spice_file_transfer_task_init_task_finish(xfer_task, res, &error);
+    g_assert_no_error(error);
+    g_assert_nonnull(info);
+    g_object_unref(info);
+
+    g_queue_push_tail(&turns->waiting, xfer_task);
+    if (g_queue_get_length(&turns->waiting) == turns->f->num_files) {
+        xfer_task = g_queue_pop_head(&turns->waiting);
+        spice_file_transfer_task_read_async(xfer_task, transfer_budget_read_async_cb, turns);
+    }
+}
+
+static void
+test_read_ahead_budget(Fixture *f, gconstpointer user_data G_GNUC_UNUSED)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    ReadAheadTurns turns = { f, G_QUEUE_INIT };
+    guint8 *data;
+    gsize i;
+    GError *err = NULL;
+
+    data = g_malloc(READ_AHEAD_SIZE);
+    for (i = 0; i < READ_AHEAD_SIZE; i++)
+        data[i] = read_ahead_byte(i);
+    for (i = 0; i < f->num_files; i++) {
+        g_assert_true(g_file_replace_contents(f->files[i], (const char *)data, READ_AHEAD_SIZE,
+                                              NULL, FALSE, G_FILE_CREATE_NONE, NULL,
+                                              f->cancellable, &err));
+        g_assert_no_error(err);
+    }
+    g_free(data);
+
+    f->xfer_tasks = spice_file_transfer_task_create_tasks(f->files, NULL, G_FILE_COPY_NONE, f->cancellable);
+    g_hash_table_iter_init(&iter, f->xfer_tasks);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        SpiceFileTransferTask *xfer_task = SPICE_FILE_TRANSFER_TASK(value);
+        g_signal_connect(xfer_task, "finished", G_CALLBACK(transfer_xfer_task_on_finished), f);
+        spice_file_transfer_task_init_task_async(xfer_task, transfer_budget_init_async_cb, &turns);
+    }
+    g_main_loop_run (f->loop);
+
+    /* the tasks read ahead, but no more than the budget of the channel */
+    g_hash_table_iter_init(&iter, f->xfer_tasks);
+    g_assert_true(g_hash_table_iter_next(&iter, &key, &value));
+    g_assert_cmpuint(spice_file_transfer_task_get_max_chunks(value), >, 1);
+    g_assert_cmpuint(spice_file_transfer_task_get_max_chunks(value), <=,
+                     FILE_XFER_CHANNEL_CHUNKS + 1);
+    g_assert_true(g_queue_is_empty(&turns.waiting));
+}
+
 /* Tests summary:
  *
  * This tests are specific to SpiceFileTransferTask in order to verify:
@@ -362,9 +586,11 @@ test_agent_cancel_on_read(Fixture *f, gconstpointer user_data G_GNUC_UNUSED)
  *     protocol with VD_AGENT_FILE_XFER_START. Agent responds with
  *     VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA which starts the read IO using
  *     spice_file_transfer_task_read_async()
- * 4.) After the read is done, SpiceMainChannel does an async flush to the
- *     agent, using the buffer provided by SpiceFileTransferTask; The read IO
- *     will be kept going while SpiceMainChannel has agent tokens to use.
+ * 4.) After the read is done, SpiceMainChannel queues the buffer provided by
+ *     SpiceFileTransferTask to the agent, and reads again once the agent
+ *     tokens made room in the queue, in turn with the other transfers.
+ *     Meanwhile SpiceFileTransferTask reads the next chunks of the file
+ *     ahead.
  * 5-) After SpiceMainChannel sends enough data, it can always receive:
  *     - VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA: to send more data;
  *     - VD_AGENT_FILE_XFER_STATUS_SUCCESS: all data was sent;
@@ -383,6 +609,10 @@ int main(int argc, char* argv[])
                Fixture, GUINT_TO_POINTER(SINGLE_FILE),
                f_setup, test_simple_transfer, f_teardown);
 
+    g_test_add("/spice-file-transfer-task/single/read-ahead",
+               Fixture, GUINT_TO_POINTER(SINGLE_FILE),
+               f_setup, test_read_ahead, f_teardown);
+
     g_test_add("/spice-file-transfer-task/single/cancel/before-task-init",
                Fixture, GUINT_TO_POINTER(SINGLE_FILE),
                f_setup, test_cancel_before_task_init, f_teardown);
@@ -407,6 +637,14 @@ int main(int argc, char* argv[])
                Fixture, GUINT_TO_POINTER(MULTIPLE_FILES),
                f_setup, test_simple_transfer, f_teardown);
 
+    g_test_add("/spice-file-transfer-task/multiple/read-ahead",
+               Fixture, GUINT_TO_POINTER(MULTIPLE_FILES),
+               f_setup, test_read_ahead, f_teardown);
+
+    g_test_add("/spice-file-transfer-task/multiple/read-ahead-budget",
+               Fixture, GUINT_TO_POINTER(MULTIPLE_FILES),
+               f_setup, test_read_ahead_budget, f_teardown);
+
     g_test_add("/spice-file-transfer-task/multiple/cancel/before-task-init",
                Fixture, GUINT_TO_POINTER(MULTIPLE_FILES),
                f_setup, test_cancel_before_task_init, f_teardown);
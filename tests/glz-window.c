@@ -0,0 +1,157 @@
+#include <glib.h>
+#include <string.h>
+
+#include "config.h"
+#include "decode.h"
+#include "common/canvas_utils.h"
+
+/* a 1x1 RGB32 glz image, top down */
+static gsize glz_image(guint8 *buf, guint64 id, guint32 win_head_dist)
+{
+    guint8 *p = buf;
+    guint32 words[] = { LZ_MAGIC, LZ_VERSION };
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(words); i++, p += 4) {
+        p[0] = words[i] >> 24; p[1] = words[i] >> 16; p[2] = words[i] >> 8; p[3] = words[i];
+    }
+    *p++ = LZ_IMAGE_TYPE_RGB32 | (1 << LZ_IMAGE_TYPE_LOG);
+    for (i = 0; i < 3; i++, p += 4) {   /* width, height, stride */
+        guint32 v = (i == 2) ? 4 : 1;
+        p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+    }
+    for (i = 0; i < 8; i++)
+        *p++ = id >> (56 - 8 * i);
+    for (i = 0; i < 4; i++)
+        *p++ = win_head_dist >> (24 - 8 * i);
+
+    return p - buf;
+}
+
+/* the pixel is a literal */
+static guint32 decode_literal(SpiceGlzDecoder *d, guint64 id, guint32 win_head_dist,
+                              guint32 pixel)
+{
+    LzDecodeUsrData usr_data = { NULL };
+    guint8 buf[64], *p;
+    guint32 out;
+
+    p = buf + glz_image(buf, id, win_head_dist);
+    *p++ = 0;   /* copy of 1 pixel */
+    *p++ = pixel;
+    *p++ = pixel >> 8;
+    *p++ = pixel >> 16;
+
+    d->ops->decode(d, buf, NULL, &usr_data);
+    g_assert_nonnull(usr_data.out_surface);
+    out = *(guint32 *)pixman_image_get_data(usr_data.out_surface) & 0xffffff;
+    pixman_image_unref(usr_data.out_surface);
+
+    return out;
+}
+
+/* the pixel is copied from the image @image_dist before */
+static guint32 decode_reference(SpiceGlzDecoder *d, guint64 id, guint32 win_head_dist,
+                                guint8 image_dist)
+{
+    LzDecodeUsrData usr_data = { NULL };
+    guint8 buf[64], *p;
+    guint32 out;
+
+    g_assert_cmpuint(image_dist, <, 0x40);
+    p = buf + glz_image(buf, id, win_head_dist);
+    *p++ = 1 << 5;      /* match of 1 pixel, short offset 0 */
+    *p++ = 0;
+    *p++ = image_dist;
+
+    d->ops->decode(d, buf, NULL, &usr_data);
+    g_assert_nonnull(usr_data.out_surface);
+    out = *(guint32 *)pixman_image_get_data(usr_data.out_surface) & 0xffffff;
+    pixman_image_unref(usr_data.out_surface);
+
+    return out;
+}
+
+/* two displays share the window, the first image received is the
+ * newest: the older images of the other display are still kept */
+static void test_glz_window_out_of_order(void)
+{
+    SpiceGlzDecoderWindow *w = glz_decoder_window_new();
+    SpiceGlzDecoder *display1 = glz_decoder_new(w);
+    SpiceGlzDecoder *display2 = glz_decoder_new(w);
+    SpiceGlzDecoderWindowStats stats;
+
+    g_assert_cmphex(decode_literal(display2, 105, 105, 0x123456), ==, 0x123456);
+    g_assert_cmphex(decode_literal(display1, 103, 103, 0xabcdef), ==, 0xabcdef);
+    g_assert_cmphex(decode_reference(display1, 104, 104, 1), ==, 0xabcdef);
+    g_assert_cmphex(decode_reference(display2, 106, 106, 3), ==, 0xabcdef);
+
+    glz_decoder_window_get_stats(w, &stats);
+    g_assert_cmpuint(stats.images, ==, 4);
+    g_assert_cmpuint(stats.stalls, ==, 0);
+
+    /* the server released the images before 105 */
+    g_assert_cmphex(decode_reference(display2, 107, 2, 2), ==, 0x123456);
+    g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "*older than the window*");
+    decode_literal(display1, 102, 102, 0);
+    g_test_assert_expected_messages();
+
+    glz_decoder_window_get_stats(w, &stats);
+    g_assert_cmpuint(stats.images, ==, 3);
+
+    glz_decoder_destroy(display1);
+    glz_decoder_destroy(display2);
+    glz_decoder_window_destroy(w);
+}
+
+/* the ring doesn't grow past its maximum capacity */
+static void test_glz_window_capacity(void)
+{
+    SpiceGlzDecoderWindow *w = glz_decoder_window_new();
+    SpiceGlzDecoder *d = glz_decoder_new(w);
+    SpiceGlzDecoderWindowStats stats;
+
+    decode_literal(d, 0, 0, 0x010203);
+    g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "*too far from the window*");
+    decode_literal(d, G_GUINT64_CONSTANT(1) << 40, 0, 0x040506);
+    g_test_assert_expected_messages();
+
+    glz_decoder_window_get_stats(w, &stats);
+    g_assert_cmpuint(stats.images, ==, 1);
+    g_assert_cmpuint(stats.capacity, <=, 64 * 1024);
+
+    glz_decoder_destroy(d);
+    glz_decoder_window_destroy(w);
+}
+
+/* an id received twice replaces the first image */
+static void test_glz_window_duplicate(void)
+{
+    SpiceGlzDecoderWindow *w = glz_decoder_window_new();
+    SpiceGlzDecoder *d = glz_decoder_new(w);
+    SpiceGlzDecoderWindowStats stats;
+
+    decode_literal(d, 10, 10, 0x010203);
+    g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "*replaces image*");
+    decode_literal(d, 10, 10, 0x040506);
+    g_test_assert_expected_messages();
+    g_assert_cmphex(decode_reference(d, 11, 1, 1), ==, 0x040506);
+
+    glz_decoder_window_get_stats(w, &stats);
+    g_assert_cmpuint(stats.images, ==, 2);
+    g_assert_cmpuint(stats.bytes, ==, 2 * 4);
+
+    glz_decoder_destroy(d);
+    glz_decoder_window_destroy(w);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/glz-window/out-of-order", test_glz_window_out_of_order);
+    g_test_add_func("/glz-window/capacity", test_glz_window_capacity);
+    g_test_add_func("/glz-window/duplicate", test_glz_window_duplicate);
+
+    return g_test_run();
+}
@@ -0,0 +1,337 @@
+#include <glib-object.h>
+#include <string.h>
+
+#include "gio-coroutine.h"
+#include "spice-util-priv.h"
+
+/* A fake display channel: a coroutine repeatedly rendering and emitting
+ * "invalidate", running either from the main context or from its own
+ * I/O thread, while the main context handles periodic "input" events. */
+
+typedef struct {
+    GObject parent;
+} TestEmitter;
+
+typedef struct {
+    GObjectClass parent_class;
+} TestEmitterClass;
+
+static GType test_emitter_get_type(void);
+G_DEFINE_TYPE(TestEmitter, test_emitter, G_TYPE_OBJECT)
+
+static guint invalidate_signal;
+
+static void test_emitter_init(TestEmitter *self G_GNUC_UNUSED)
+{
+}
+
+static void test_emitter_class_init(TestEmitterClass *klass)
+{
+    invalidate_signal = g_signal_new("invalidate",
+                                     G_OBJECT_CLASS_TYPE(klass),
+                                     G_SIGNAL_RUN_LAST,
+                                     0, NULL, NULL, NULL,
+                                     G_TYPE_NONE, 1, G_TYPE_INT);
+}
+
+typedef struct {
+    GCoroutine coroutine;
+    GObject *emitter;
+    GMainContext *context;   /* NULL: main context */
+    GMainLoop *loop;
+    GThread *thread;
+    gpointer (*entry)(gpointer); /* display_coroutine() if NULL */
+    guint work_us;           /* CPU time spent per rendered frame */
+    gint frames;             /* frames to render, -1 until stopped */
+    gint stop;
+    gint emitted;            /* atomic, read by the main thread */
+    gboolean done;
+} FakeDisplay;
+
+typedef struct {
+    GThread *main_thread;
+    gint received;
+    gboolean wrong_thread;
+} InvalidateData;
+
+static void invalidate_cb(GObject *emitter G_GNUC_UNUSED, gint frame, gpointer user_data)
+{
+    InvalidateData *data = user_data;
+
+    if (g_thread_self() != data->main_thread)
+        data->wrong_thread = TRUE;
+    g_assert_cmpint(frame, ==, data->received);
+    data->received++;
+}
+
+static gboolean resume_cb(gpointer user_data)
+{
+    coroutine_yieldto(user_data, NULL);
+    return FALSE;
+}
+
+static gboolean display_done_cb(gpointer user_data)
+{
+    FakeDisplay *display = user_data;
+
+    display->done = TRUE;
+    return FALSE;
+}
+
+static void burn_cpu(guint us)
+{
+    gint64 end = g_get_monotonic_time() + us;
+
+    while (g_get_monotonic_time() < end)
+        ;
+}
+
+static gpointer display_coroutine(gpointer user_data)
+{
+    FakeDisplay *display = user_data;
+    GSource *source;
+
+    while (!g_atomic_int_get(&display->stop) &&
+           (display->frames < 0 || g_atomic_int_get(&display->emitted) < display->frames)) {
+        burn_cpu(display->work_us);
+        g_coroutine_signal_emit(display->emitter, invalidate_signal, 0,
+                                g_atomic_int_get(&display->emitted));
+        g_atomic_int_inc(&display->emitted);
+
+        /* let the context this runs from dispatch other sources */
+        g_spice_idle_add(resume_cb, coroutine_self());
+        coroutine_yield(NULL);
+    }
+
+    source = g_idle_source_new();
+    g_source_set_callback(source, display_done_cb, display, NULL);
+    g_source_attach(source, spice_util_main_context());
+    g_source_unref(source);
+
+    return NULL;
+}
+
+static gboolean display_stopped(gpointer user_data)
+{
+    FakeDisplay *display = user_data;
+
+    return g_atomic_int_get(&display->stop);
+}
+
+/* waits for the main thread to stop it */
+static gpointer waiting_coroutine(gpointer user_data)
+{
+    FakeDisplay *display = user_data;
+    GSource *source;
+
+    g_assert_true(g_coroutine_condition_wait(&display->coroutine, display_stopped, display));
+
+    source = g_idle_source_new();
+    g_source_set_callback(source, display_done_cb, display, NULL);
+    g_source_attach(source, spice_util_main_context());
+    g_source_unref(source);
+
+    return NULL;
+}
+
+static gboolean display_start(gpointer user_data)
+{
+    FakeDisplay *display = user_data;
+    struct coroutine *co = &display->coroutine.coroutine;
+
+    co->stack_size = 1 << 20;
+    co->entry = display->entry ? display->entry : display_coroutine;
+    coroutine_init(co);
+    coroutine_yieldto(co, display);
+
+    return FALSE;
+}
+
+static gpointer display_thread(gpointer user_data)
+{
+    FakeDisplay *display = user_data;
+
+    g_main_context_push_thread_default(display->context);
+    spice_util_set_thread_context(display->context);
+    g_main_loop_run(display->loop);
+    spice_util_set_thread_context(NULL);
+    g_main_context_pop_thread_default(display->context);
+
+    return NULL;
+}
+
+static void fake_display_start(FakeDisplay *display, gboolean threaded)
+{
+    GSource *source;
+
+    if (!threaded) {
+        g_idle_add(display_start, display);
+        return;
+    }
+
+    display->context = g_main_context_new();
+    display->loop = g_main_loop_new(display->context, FALSE);
+    display->thread = g_thread_new("fake-display", display_thread, display);
+
+    source = g_idle_source_new();
+    g_source_set_callback(source, display_start, display, NULL);
+    g_source_attach(source, display->context);
+    g_source_unref(source);
+}
+
+static void fake_display_finish(FakeDisplay *display)
+{
+    g_atomic_int_set(&display->stop, TRUE);
+    while (!display->done)
+        g_main_context_iteration(NULL, TRUE);
+
+    if (display->thread) {
+        g_main_loop_quit(display->loop);
+        g_thread_join(display->thread);
+        g_main_loop_unref(display->loop);
+        g_main_context_unref(display->context);
+    }
+    g_object_unref(display->emitter);
+}
+
+static void test_io_thread_signal_emit(void)
+{
+    FakeDisplay display = { .frames = 20, };
+    InvalidateData data = { .main_thread = g_thread_self(), };
+
+    display.emitter = g_object_new(test_emitter_get_type(), NULL);
+    g_signal_connect(display.emitter, "invalidate", G_CALLBACK(invalidate_cb), &data);
+    fake_display_start(&display, TRUE);
+
+    while (!display.done)
+        g_main_context_iteration(NULL, TRUE);
+    fake_display_finish(&display);
+
+    g_assert_false(data.wrong_thread);
+    g_assert_cmpint(data.received, ==, 20);
+    g_assert_cmpint(g_atomic_int_get(&display.emitted), ==, 20);
+    g_assert_false(spice_util_has_io_threads());
+}
+
+/* the I/O thread doesn't wait for the main thread to run the handlers:
+ * it emits all its frames while the main context isn't iterated */
+static void test_io_thread_signal_async(void)
+{
+    FakeDisplay display = { .frames = 20, };
+    InvalidateData data = { .main_thread = g_thread_self(), };
+    gint64 end = g_get_monotonic_time() + 10 * G_USEC_PER_SEC;
+
+    display.emitter = g_object_new(test_emitter_get_type(), NULL);
+    g_signal_connect(display.emitter, "invalidate", G_CALLBACK(invalidate_cb), &data);
+    fake_display_start(&display, TRUE);
+
+    while (g_atomic_int_get(&display.emitted) < 20 && g_get_monotonic_time() < end)
+        g_usleep(1000);
+    g_assert_cmpint(g_atomic_int_get(&display.emitted), ==, 20);
+    g_assert_cmpint(data.received, ==, 0);
+
+    /* the emissions are then run in order */
+    while (!display.done)
+        g_main_context_iteration(NULL, TRUE);
+    fake_display_finish(&display);
+
+    g_assert_false(data.wrong_thread);
+    g_assert_cmpint(data.received, ==, 20);
+}
+
+/* a condition changed from the main thread wakes up the I/O thread
+ * waiting on it, which has nothing else to wake it up */
+static void test_io_thread_condition_wait(void)
+{
+    FakeDisplay display = { .entry = waiting_coroutine, };
+
+    display.emitter = g_object_new(test_emitter_get_type(), NULL);
+    fake_display_start(&display, TRUE);
+
+    /* let it go to sleep */
+    g_usleep(50 * 1000);
+    g_atomic_int_set(&display.stop, TRUE);
+    g_coroutine_condition_changed();
+
+    while (!display.done)
+        g_main_context_iteration(NULL, TRUE);
+    fake_display_finish(&display);
+}
+
+#define INPUT_INTERVAL_MS 5
+#define BENCH_DURATION_MS 1000
+
+typedef struct {
+    gint64 expected;
+    gint64 total_latency;
+    gint64 max_latency;
+    guint events;
+    GMainLoop *loop;
+} InputData;
+
+static gboolean input_cb(gpointer user_data)
+{
+    InputData *input = user_data;
+    gint64 now = g_get_monotonic_time();
+    gint64 latency = MAX(now - input->expected, 0);
+
+    input->total_latency += latency;
+    input->max_latency = MAX(input->max_latency, latency);
+    input->events++;
+    input->expected = now + INPUT_INTERVAL_MS * 1000;
+
+    if (input->events * INPUT_INTERVAL_MS >= BENCH_DURATION_MS) {
+        g_main_loop_quit(input->loop);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void bench_input_latency(gboolean threaded)
+{
+    FakeDisplay display = { .frames = -1, .work_us = 20000, };
+    InputData input = { 0, };
+
+    input.loop = g_main_loop_new(NULL, FALSE);
+    display.emitter = g_object_new(test_emitter_get_type(), NULL);
+    fake_display_start(&display, threaded);
+
+    input.expected = g_get_monotonic_time() + INPUT_INTERVAL_MS * 1000;
+    g_timeout_add(INPUT_INTERVAL_MS, input_cb, &input);
+    g_main_loop_run(input.loop);
+
+    fake_display_finish(&display);
+    g_main_loop_unref(input.loop);
+
+    g_test_message("display %s: %u input events, latency avg %.2f ms, max %.2f ms, %d frames",
+                   threaded ? "thread" : "main context", input.events,
+                   input.total_latency / 1000.0 / input.events,
+                   input.max_latency / 1000.0, g_atomic_int_get(&display.emitted));
+    g_test_minimized_result(input.max_latency / 1000.0,
+                            "max input latency (display %s): %.2f ms",
+                            threaded ? "thread" : "main context",
+                            input.max_latency / 1000.0);
+}
+
+static void test_io_thread_input_latency(void)
+{
+    if (!g_test_perf()) {
+        g_test_skip("run with -m perf");
+        return;
+    }
+
+    bench_input_latency(FALSE);
+    bench_input_latency(TRUE);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/io-thread/signal-emit", test_io_thread_signal_emit);
+    g_test_add_func("/io-thread/signal-async", test_io_thread_signal_async);
+    g_test_add_func("/io-thread/condition-wait", test_io_thread_condition_wait);
+    g_test_add_func("/io-thread/input-latency", test_io_thread_input_latency);
+
+    return g_test_run();
+}
@@ -0,0 +1,170 @@
+#include <glib.h>
+#include <string.h>
+
+#include "spice-jitter-buffer.h"
+
+#define RATE 48000
+#define PACKET_MS 20
+#define PACKET_FRAMES (RATE / 1000 * PACKET_MS)
+
+/* a sink playing its queue in real time */
+typedef struct {
+    SpiceJitterBuffer *jitter;
+    gint64 time;
+    guint32 mm_time;
+    gdouble depth;
+} Sink;
+
+static void sink_init(Sink *sink, gdouble depth)
+{
+    sink->jitter = spice_jitter_buffer_new();
+    sink->time = G_USEC_PER_SEC;
+    sink->mm_time = 1000;
+    sink->depth = depth;
+    spice_jitter_buffer_set_depth(sink->jitter, sink->time, depth);
+}
+
+/* a packet arriving @delay_ms after the previous one */
+static guint sink_packet(Sink *sink, gint delay_ms)
+{
+    guint frames, silence;
+
+    sink->time += delay_ms * 1000;
+    sink->mm_time += PACKET_MS;
+    sink->depth = MAX(sink->depth - delay_ms, 0);
+
+    frames = spice_jitter_buffer_packet(sink->jitter, sink->time, sink->mm_time,
+                                        PACKET_FRAMES, &silence);
+    if (frames > 0) {
+        sink->depth += (silence + frames) * 1000.0 / RATE;
+        spice_jitter_buffer_set_depth(sink->jitter, sink->time, sink->depth);
+    }
+
+    return frames;
+}
+
+/* a backlog is brought back to the target, dropping then stretching */
+static void test_jitter_buffer_catch_up(void)
+{
+    SpiceJitterBufferStats stats;
+    Sink sink;
+    guint i, frames;
+
+    sink_init(&sink, 500);
+    for (i = 0; i < 20 * 1000 / PACKET_MS; i++)
+        sink_packet(&sink, PACKET_MS);
+
+    spice_jitter_buffer_get_stats(sink.jitter, &stats);
+    g_assert_cmpuint(stats.underruns, ==, 0);
+    g_assert_cmpuint(stats.overruns, >, 0);
+    g_assert_cmpuint(stats.dropped_frames, ==, stats.overruns * PACKET_FRAMES);
+    g_assert_cmpuint(stats.stretched_frames, >, 0);
+    g_assert_cmpuint(stats.max_depth_ms, >=, 480);
+    g_assert_cmpuint(stats.target_ms, ==, 20);
+    g_assert_cmpfloat(sink.depth, <, stats.target_ms * 2 + PACKET_MS);
+
+    /* settled, the packets are left untouched */
+    frames = sink_packet(&sink, PACKET_MS);
+    g_assert_cmpuint(frames, ==, PACKET_FRAMES);
+
+    spice_jitter_buffer_free(sink.jitter);
+}
+
+/* a late packet finding the sink dry raises the target */
+static void test_jitter_buffer_underrun(void)
+{
+    SpiceJitterBufferStats stats;
+    Sink sink;
+    guint i, target;
+
+    sink_init(&sink, 40);
+    for (i = 0; i < 100; i++)
+        sink_packet(&sink, PACKET_MS);
+    spice_jitter_buffer_get_stats(sink.jitter, &stats);
+    g_assert_cmpuint(stats.underruns, ==, 0);
+    target = stats.target_ms;
+
+    g_assert_cmpuint(sink_packet(&sink, 200), ==, PACKET_FRAMES);
+    spice_jitter_buffer_get_stats(sink.jitter, &stats);
+    g_assert_cmpuint(stats.underruns, ==, 1);
+    g_assert_cmpuint(stats.min_depth_ms, ==, 0);
+    g_assert_cmpuint(stats.target_ms, >, target);
+    /* refilled to the target */
+    g_assert_cmpuint(stats.silence_frames, ==, (stats.target_ms - PACKET_MS) * RATE / 1000);
+    g_assert_cmpfloat(sink.depth, ==, stats.target_ms);
+
+    for (i = 0; i < 50; i++)
+        sink_packet(&sink, PACKET_MS);
+    spice_jitter_buffer_get_stats(sink.jitter, &stats);
+    g_assert_cmpuint(stats.underruns, ==, 1);
+
+    spice_jitter_buffer_free(sink.jitter);
+}
+
+/* the target follows the arrival jitter */
+static void test_jitter_buffer_jitter(void)
+{
+    SpiceJitterBufferStats stats;
+    Sink sink;
+    guint i, silence;
+
+    sink_init(&sink, 100);
+    for (i = 0; i < 200; i++)
+        sink_packet(&sink, i % 2 ? PACKET_MS - 15 : PACKET_MS + 15);
+
+    spice_jitter_buffer_get_stats(sink.jitter, &stats);
+    g_assert_cmpuint(stats.jitter_ms, >=, 12);
+    g_assert_cmpuint(stats.target_ms, >=, 20 + 3 * 12);
+    g_assert_cmpuint(stats.underruns, ==, 0);
+
+    /* a new stream starts over, without the sink depth */
+    spice_jitter_buffer_restart(sink.jitter, RATE);
+    g_assert_cmpuint(spice_jitter_buffer_packet(sink.jitter, sink.time, 0, 100, &silence), ==, 100);
+    g_assert_cmpuint(silence, ==, 0);
+    spice_jitter_buffer_get_stats(sink.jitter, &stats);
+    g_assert_cmpuint(stats.target_ms, ==, 20);
+    g_assert_cmpuint(stats.packets, ==, 201);
+
+    spice_jitter_buffer_free(sink.jitter);
+}
+
+static void test_jitter_buffer_stretch(void)
+{
+    gint16 in[100 * 2], out[110 * 2];
+    guint i;
+
+    for (i = 0; i < 100; i++) {
+        in[i * 2] = i * 100;
+        in[i * 2 + 1] = -i * 100;
+    }
+
+    spice_jitter_buffer_stretch(in, 100, out, 100, 2);
+    g_assert_cmpmem(in, sizeof(in), out, sizeof(in));
+
+    /* a ramp stays a ramp, with the same ends */
+    spice_jitter_buffer_stretch(in, 100, out, 110, 2);
+    g_assert_cmpint(out[0], ==, 0);
+    g_assert_cmpint(out[109 * 2], ==, 9900);
+    g_assert_cmpint(out[109 * 2 + 1], ==, -9900);
+    for (i = 1; i < 110; i++) {
+        g_assert_cmpint(out[i * 2], >, out[(i - 1) * 2]);
+        g_assert_cmpint(out[i * 2] + out[i * 2 + 1], <=, 1);
+    }
+
+    spice_jitter_buffer_stretch(in, 100, out, 98, 2);
+    g_assert_cmpint(out[97 * 2], ==, 9900);
+    for (i = 1; i < 98; i++)
+        g_assert_cmpint(out[i * 2], >, out[(i - 1) * 2]);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/jitter-buffer/catch-up", test_jitter_buffer_catch_up);
+    g_test_add_func("/jitter-buffer/underrun", test_jitter_buffer_underrun);
+    g_test_add_func("/jitter-buffer/jitter", test_jitter_buffer_jitter);
+    g_test_add_func("/jitter-buffer/stretch", test_jitter_buffer_stretch);
+
+    return g_test_run();
+}
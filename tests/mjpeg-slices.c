@@ -0,0 +1,189 @@
+#include <glib.h>
+#include <string.h>
+
+#include "decode-mjpeg.h"
+
+typedef struct {
+    guint width;
+    guint height;
+    guint h_samp;
+    guint v_samp;
+    guint components;
+    guint restart_rows;         /* in MCU rows */
+    guint restart_interval;     /* in MCUs, when restart_rows is 0 */
+} FrameParams;
+
+/* a synthetic frame with some texture, encoded by libjpeg */
+static guint8 *frame_new(const FrameParams *params, unsigned long *size)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    guint8 *jpeg = NULL;
+    guint8 *row;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &jpeg, size);
+
+    cinfo.image_width = params->width;
+    cinfo.image_height = params->height;
+    cinfo.input_components = params->components;
+    cinfo.in_color_space = params->components == 3 ? JCS_RGB : JCS_GRAYSCALE;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 80, TRUE);
+    if (params->components == 3) {
+        cinfo.comp_info[0].h_samp_factor = params->h_samp;
+        cinfo.comp_info[0].v_samp_factor = params->v_samp;
+    }
+    cinfo.restart_in_rows = params->restart_rows;
+    cinfo.restart_interval = params->restart_interval;
+
+    jpeg_start_compress(&cinfo, TRUE);
+    row = g_malloc(params->width * params->components);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        guint x, y = cinfo.next_scanline;
+
+        for (x = 0; x < params->width * params->components; x++)
+            row[x] = (x * 7 + y * 3 + ((x * y) >> 5)) & 0xff;
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    g_free(row);
+
+    return jpeg;
+}
+
+static void decode_serial(const guint8 *jpeg, unsigned long size, guint8 *dest, guint width)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (guint8 *)jpeg, size);
+    jpeg_read_header(&cinfo, TRUE);
+    mjpeg_decompress_setup(&cinfo);
+    g_assert_true(mjpeg_decompress_read(&cinfo, dest, width * 4));
+    jpeg_destroy_decompress(&cinfo);
+}
+
+/* the slices decode to the same pixels as the whole frame */
+static void test_mjpeg_slices_exact(void)
+{
+    static const FrameParams frames[] = {
+        { 1920, 1080, 2, 2, 3, 1, 0 },
+        { 1920, 1080, 2, 2, 3, 2, 0 },
+        { 1000, 333, 2, 1, 3, 1, 0 },
+        { 1001, 257, 1, 1, 3, 1, 0 },
+        /* 40 MCUs per row, cut every 7 rows */
+        { 640, 480, 2, 2, 3, 0, 7 },
+        { 640, 480, 2, 2, 3, 0, 20 },
+        { 640, 480, 1, 1, 1, 1, 0 },
+    };
+    guint i, slices;
+
+    for (i = 0; i < G_N_ELEMENTS(frames); i++) {
+        const FrameParams *params = &frames[i];
+        gsize dest_size = params->width * params->height * 4;
+        guint8 *expected = g_malloc0(dest_size);
+        guint8 *dest = g_malloc0(dest_size);
+        unsigned long size;
+        guint8 *jpeg = frame_new(params, &size);
+
+        decode_serial(jpeg, size, expected, params->width);
+        for (slices = 2; slices <= MJPEG_MAX_SLICES; slices++) {
+            memset(dest, 0xaa, dest_size);
+            g_assert_true(mjpeg_decode_slices(jpeg, size, dest,
+                                              params->width, params->height, slices));
+            if (memcmp(expected, dest, dest_size) != 0)
+                g_error("frame %u differs with %u slices", i, slices);
+        }
+
+        g_free(jpeg);
+        g_free(expected);
+        g_free(dest);
+    }
+}
+
+/* the frames that can't be split are left to the serial decoding */
+static void test_mjpeg_slices_fallback(void)
+{
+    static const FrameParams no_restart = { 640, 480, 2, 2, 3, 0, 0 };
+    static const FrameParams small = { 100, 40, 2, 2, 3, 1, 0 };
+    unsigned long size;
+    guint8 *dest = g_malloc0(640 * 480 * 4);
+    guint8 *jpeg;
+
+    jpeg = frame_new(&no_restart, &size);
+    g_assert_false(mjpeg_decode_slices(jpeg, size, dest, 640, 480, 4));
+    /* dimensions not matching the frame */
+    g_assert_false(mjpeg_decode_slices(jpeg, size, dest, 320, 480, 4));
+    g_free(jpeg);
+
+    jpeg = frame_new(&small, &size);
+    g_assert_false(mjpeg_decode_slices(jpeg, size, dest, 100, 40, 4));
+    g_free(jpeg);
+
+    /* truncated headers */
+    g_assert_false(mjpeg_decode_slices((const guint8 *)"\xff\xd8\xff", 3, dest, 640, 480, 4));
+
+    g_free(dest);
+}
+
+#define BENCH_WIDTH 1920
+#define BENCH_HEIGHT 1080
+#define BENCH_FRAMES 30
+
+static void test_mjpeg_slices_benchmark(void)
+{
+    static const FrameParams params = { BENCH_WIDTH, BENCH_HEIGHT, 2, 2, 3, 1, 0 };
+    unsigned long size;
+    guint8 *jpeg, *dest;
+    guint slices, frame;
+    gdouble serial_fps = 0;
+
+    if (!g_test_perf()) {
+        g_test_skip("run with -m perf");
+        return;
+    }
+
+    jpeg = frame_new(&params, &size);
+    dest = g_malloc(BENCH_WIDTH * BENCH_HEIGHT * 4);
+
+    for (slices = 1; slices <= MJPEG_MAX_SLICES; slices++) {
+        gdouble fps;
+
+        g_test_timer_start();
+        for (frame = 0; frame < BENCH_FRAMES; frame++) {
+            if (slices == 1)
+                decode_serial(jpeg, size, dest, BENCH_WIDTH);
+            else
+                g_assert_true(mjpeg_decode_slices(jpeg, size, dest,
+                                                  BENCH_WIDTH, BENCH_HEIGHT, slices));
+        }
+        fps = BENCH_FRAMES / g_test_timer_elapsed();
+        if (slices == 1)
+            serial_fps = fps;
+
+        g_test_maximized_result(fps, "%u slices: %.1f frames/s, x%.2f",
+                                slices, fps, fps / serial_fps);
+    }
+
+    g_test_message("%u processors, default slices: %u",
+                   g_get_num_processors(), mjpeg_slices_get_default());
+
+    g_free(jpeg);
+    g_free(dest);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/mjpeg-slices/exact", test_mjpeg_slices_exact);
+    g_test_add_func("/mjpeg-slices/fallback", test_mjpeg_slices_fallback);
+    g_test_add_func("/mjpeg-slices/benchmark", test_mjpeg_slices_benchmark);
+
+    return g_test_run();
+}
@@ -0,0 +1,121 @@
+#include <glib.h>
+#include <string.h>
+
+#include "spice-pixel-convert.h"
+
+#define N_PIXELS 65536
+
+static void convert_row(const SpicePixelConvert *convert, gboolean is_565,
+                        guint32 *dest, const guint16 *src, gsize width)
+{
+    if (is_565)
+        convert->row_565(dest, src, width);
+    else
+        convert->row_555(dest, src, width);
+}
+
+/* every pixel value, at every alignment and tail length */
+static void test_pixel_convert_exact(void)
+{
+    const SpicePixelConvert *all;
+    guint16 *src = g_new(guint16, N_PIXELS + 32);
+    guint32 *expected = g_new(guint32, N_PIXELS + 32);
+    guint32 *dest = g_new(guint32, N_PIXELS + 32);
+    guint i, n, offset, is_565;
+
+    for (i = 0; i < N_PIXELS + 32; i++)
+        src[i] = i;
+
+    all = spice_pixel_convert_get_all(&n);
+    g_assert_cmpuint(n, >=, 1);
+    g_assert_cmpstr(all[0].name, ==, "scalar");
+
+    /* a few reference values */
+    all[0].row_555(dest, (const guint16[]){ 0x7fff, 0x001f, 0x03e0, 0x7c00, 0x8000 }, 5);
+    g_assert_cmphex(dest[0], ==, 0xffffff);
+    g_assert_cmphex(dest[1], ==, 0x0000ff);
+    g_assert_cmphex(dest[2], ==, 0x00ff00);
+    g_assert_cmphex(dest[3], ==, 0xff0000);
+    g_assert_cmphex(dest[4], ==, 0);
+    all[0].row_565(dest, (const guint16[]){ 0xffff, 0x001f, 0x07e0, 0xf800 }, 4);
+    g_assert_cmphex(dest[0], ==, 0xffffff);
+    g_assert_cmphex(dest[1], ==, 0x0000ff);
+    g_assert_cmphex(dest[2], ==, 0x00ff00);
+    g_assert_cmphex(dest[3], ==, 0xff0000);
+
+    for (i = 1; i < n; i++) {
+        for (is_565 = 0; is_565 < 2; is_565++) {
+            for (offset = 0; offset < 17; offset++) {
+                gsize width = N_PIXELS - offset * 3;
+
+                memset(expected, 0xaa, (N_PIXELS + 32) * sizeof(guint32));
+                memset(dest, 0xaa, (N_PIXELS + 32) * sizeof(guint32));
+                convert_row(&all[0], is_565, expected + offset, src + offset, width);
+                convert_row(&all[i], is_565, dest + offset, src + offset, width);
+                if (memcmp(expected, dest, (N_PIXELS + 32) * sizeof(guint32)) != 0)
+                    g_error("%s %s conversion differs at offset %u",
+                            all[i].name, is_565 ? "565" : "555", offset);
+            }
+        }
+    }
+
+    g_free(src);
+    g_free(expected);
+    g_free(dest);
+}
+
+#define BENCH_WIDTH 1920
+#define BENCH_HEIGHT 1080
+#define BENCH_FRAMES 50
+
+static void test_pixel_convert_benchmark(void)
+{
+    const SpicePixelConvert *all;
+    guint16 *src;
+    guint32 *dest;
+    guint i, n, y, frame, is_565;
+
+    if (!g_test_perf()) {
+        g_test_skip("run with -m perf");
+        return;
+    }
+
+    src = g_new(guint16, BENCH_WIDTH * BENCH_HEIGHT);
+    dest = g_new(guint32, BENCH_WIDTH * BENCH_HEIGHT);
+    for (i = 0; i < BENCH_WIDTH * BENCH_HEIGHT; i++)
+        src[i] = g_random_int();
+
+    all = spice_pixel_convert_get_all(&n);
+    for (i = 0; i < n; i++) {
+        for (is_565 = 0; is_565 < 2; is_565++) {
+            gdouble elapsed, mpixels;
+
+            g_test_timer_start();
+            for (frame = 0; frame < BENCH_FRAMES; frame++) {
+                for (y = 0; y < BENCH_HEIGHT; y++)
+                    convert_row(&all[i], is_565, dest + y * BENCH_WIDTH,
+                                src + y * BENCH_WIDTH, BENCH_WIDTH);
+            }
+            elapsed = g_test_timer_elapsed();
+            mpixels = BENCH_WIDTH * BENCH_HEIGHT * BENCH_FRAMES / elapsed / 1e6;
+
+            g_test_maximized_result(mpixels, "%s %s: %.0f Mpixels/s",
+                                    all[i].name, is_565 ? "565" : "555", mpixels);
+        }
+    }
+
+    g_test_message("selected conversion: %s", spice_pixel_convert_get()->name);
+
+    g_free(src);
+    g_free(dest);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/pixel-convert/exact", test_pixel_convert_exact);
+    g_test_add_func("/pixel-convert/benchmark", test_pixel_convert_benchmark);
+
+    return g_test_run();
+}
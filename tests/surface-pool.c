@@ -0,0 +1,113 @@
+#include <glib.h>
+#include <string.h>
+
+#include "spice-surface-pool.h"
+
+#define MB (1024 * 1024)
+
+static void test_surface_pool_recycle(void)
+{
+    SpiceSurfacePool *pool = spice_surface_pool_new(16 * MB);
+    SpiceSurfacePoolStats stats;
+    gboolean zeroed;
+    guint8 *a, *b;
+
+    a = spice_surface_pool_alloc(pool, 64 * 64 * 4, &zeroed);
+    g_assert_nonnull(a);
+    g_assert_true(zeroed);
+    g_assert_cmpint(a[0], ==, 0);
+    g_assert_cmpint(a[64 * 64 * 4 - 1], ==, 0);
+    memset(a, 0xaa, 64 * 64 * 4);
+    spice_surface_pool_free(pool, a, 64 * 64 * 4);
+
+    /* same bucket, handed out again with its old content */
+    b = spice_surface_pool_alloc(pool, 64 * 64 * 4 - 100, &zeroed);
+    g_assert(a == b);
+    g_assert_false(zeroed);
+    spice_surface_pool_free(pool, b, 64 * 64 * 4 - 100);
+
+    /* another bucket */
+    a = spice_surface_pool_alloc(pool, 128 * 64 * 4, &zeroed);
+    g_assert(a != b);
+    g_assert_true(zeroed);
+    spice_surface_pool_free(pool, a, 128 * 64 * 4);
+
+    spice_surface_pool_get_stats(pool, &stats);
+    g_assert_cmpuint(stats.allocations, ==, 3);
+    g_assert_cmpuint(stats.hits, ==, 1);
+    g_assert_cmpuint(stats.cached_buffers, ==, 2);
+    g_assert_cmpuint(stats.cached_bytes, ==, 64 * 64 * 4 + 128 * 64 * 4);
+
+    spice_surface_pool_trim(pool);
+    spice_surface_pool_get_stats(pool, &stats);
+    g_assert_cmpuint(stats.cached_bytes, ==, 0);
+    g_assert_cmpuint(stats.cached_buffers, ==, 0);
+
+    spice_surface_pool_unref(pool);
+}
+
+static void test_surface_pool_huge(void)
+{
+    SpiceSurfacePool *pool = spice_surface_pool_new(64 * MB);
+    SpiceSurfacePoolStats stats;
+    gboolean zeroed;
+    guint8 *a, *b;
+    gsize size = 1920 * 1080 * 4;
+
+    a = spice_surface_pool_alloc(pool, size, &zeroed);
+    g_assert_true(zeroed);
+    g_assert_cmpint(a[size - 1], ==, 0);
+    memset(a, 0xff, size);
+    spice_surface_pool_free(pool, a, size);
+
+    b = spice_surface_pool_alloc(pool, size, &zeroed);
+    g_assert(a == b);
+    g_assert_false(zeroed);
+    g_assert_cmpint(b[size - 1], ==, 0xff);
+    spice_surface_pool_free(pool, b, size);
+
+    spice_surface_pool_get_stats(pool, &stats);
+    g_assert_cmpuint(stats.huge, ==, 1);
+    /* rounded up to a huge page */
+    g_assert_cmpuint(stats.cached_bytes, ==, 4 * 2 * MB);
+
+    spice_surface_pool_unref(pool);
+}
+
+static void test_surface_pool_lru(void)
+{
+    SpiceSurfacePool *pool = spice_surface_pool_new(2 * 4096);
+    SpiceSurfacePoolStats stats;
+    gboolean zeroed;
+    gpointer a, b, c;
+
+    a = spice_surface_pool_alloc(pool, 4096, &zeroed);
+    b = spice_surface_pool_alloc(pool, 4096 * 2, &zeroed);
+    c = spice_surface_pool_alloc(pool, 4096, &zeroed);
+    spice_surface_pool_free(pool, a, 4096);
+    spice_surface_pool_free(pool, c, 4096);
+    /* the two older buffers are released to make room */
+    spice_surface_pool_free(pool, b, 4096 * 2);
+
+    spice_surface_pool_get_stats(pool, &stats);
+    g_assert_cmpuint(stats.cached_buffers, ==, 1);
+    g_assert_cmpuint(stats.cached_bytes, ==, 4096 * 2);
+    g_assert_cmpuint(stats.trimmed_bytes, ==, 4096 * 2);
+
+    a = spice_surface_pool_alloc(pool, 4096 * 2, &zeroed);
+    g_assert(a == b);
+    spice_surface_pool_free(pool, a, 4096 * 2);
+
+    spice_surface_pool_unref(pool);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/surface-pool/recycle", test_surface_pool_recycle);
+    g_test_add_func("/surface-pool/huge", test_surface_pool_huge);
+    g_test_add_func("/surface-pool/lru", test_surface_pool_lru);
+
+    return g_test_run();
+}
@@ -0,0 +1,117 @@
+#include <glib.h>
+#include <string.h>
+
+#include "spice-client.h"
+#include "spice-channel-priv.h"
+
+typedef struct {
+    SpiceSession *session;
+    SpiceChannel *channel;
+} Fixture;
+
+static void
+f_setup(Fixture *f, gconstpointer user_data G_GNUC_UNUSED)
+{
+    f->session = spice_session_new();
+    f->channel = spice_channel_new(f->session, SPICE_CHANNEL_MAIN, 0);
+    g_assert_nonnull(f->channel);
+}
+
+static void
+f_teardown(Fixture *f, gconstpointer user_data G_GNUC_UNUSED)
+{
+    spice_session_disconnect(f->session);
+    g_object_unref(f->session);
+    while (g_main_context_iteration(NULL, FALSE)) {
+        continue;
+    }
+}
+
+static void send_msg(Fixture *f, int type, gsize size)
+{
+    SpiceMsgOut *out = spice_msg_out_new(f->channel, type);
+
+    if (size > 0) {
+        spice_marshaller_reserve_space(out->marshaller, size);
+    }
+    spice_msg_out_send(out);
+}
+
+/* the types of the messages written next, in order */
+static guint dequeue_types(Fixture *f, int *types, guint max_types)
+{
+    SpiceChannelPrivate *c = f->channel->priv;
+    SpiceMsgOut *batch[SPICE_CHANNEL_WRITE_BATCH_MAX_MSGS];
+    guint n_types = 0, n_msgs, i;
+
+    do {
+        g_mutex_lock(&c->xmit_queue_lock);
+        n_msgs = spice_channel_xmit_dequeue(f->channel, batch, G_N_ELEMENTS(batch));
+        g_mutex_unlock(&c->xmit_queue_lock);
+
+        for (i = 0; i < n_msgs; i++) {
+            g_assert_cmpuint(n_types, <, max_types);
+            types[n_types++] = spice_header_get_msg_type(batch[i]->header, c->use_mini_header);
+            spice_msg_out_unref(batch[i]);
+        }
+    } while (n_msgs > 0);
+
+    return n_types;
+}
+
+/* the server must see the ACK_SYNC before the ACKs it sets the window of */
+static void test_xmit_queue_ack_sync(Fixture *f, gconstpointer user_data G_GNUC_UNUSED)
+{
+    int types[8];
+    guint n_types;
+
+    send_msg(f, SPICE_MSGC_MAIN_AGENT_TOKEN, 0);
+    send_msg(f, SPICE_MSGC_ACK_SYNC, 0);
+    send_msg(f, SPICE_MSGC_ACK, 0);
+
+    n_types = dequeue_types(f, types, G_N_ELEMENTS(types));
+    g_assert_cmpuint(n_types, ==, 3);
+    g_assert_cmpint(types[0], ==, SPICE_MSGC_ACK_SYNC);
+    g_assert_cmpint(types[1], ==, SPICE_MSGC_ACK);
+    g_assert_cmpint(types[2], ==, SPICE_MSGC_MAIN_AGENT_TOKEN);
+}
+
+/* the agent data doesn't go before the MAIN_AGENT_START queued earlier,
+ * even when the normal messages are over their budget in the batch */
+static void test_xmit_queue_bulk_after_normal(Fixture *f, gconstpointer user_data G_GNUC_UNUSED)
+{
+    int types[8];
+    guint n_types, i;
+
+    send_msg(f, SPICE_MSGC_MAIN_AGENT_TOKEN, 48 * 1024);
+    send_msg(f, SPICE_MSGC_MAIN_AGENT_TOKEN, 48 * 1024);
+    send_msg(f, SPICE_MSGC_MAIN_AGENT_START, 0);
+    send_msg(f, SPICE_MSGC_MAIN_AGENT_DATA, 1024);
+    send_msg(f, SPICE_MSGC_MAIN_AGENT_TOKEN, 0);
+
+    n_types = dequeue_types(f, types, G_N_ELEMENTS(types));
+    g_assert_cmpuint(n_types, ==, 5);
+    for (i = 0; i < n_types; i++) {
+        if (types[i] == SPICE_MSGC_MAIN_AGENT_START) {
+            break;
+        }
+        g_assert_cmpint(types[i], !=, SPICE_MSGC_MAIN_AGENT_DATA);
+    }
+    g_assert_cmpuint(i, <, n_types);
+
+    /* the later normal message may still pass the bulk data */
+    g_assert_cmpint(types[3], ==, SPICE_MSGC_MAIN_AGENT_TOKEN);
+    g_assert_cmpint(types[4], ==, SPICE_MSGC_MAIN_AGENT_DATA);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add("/xmit-queue/ack-sync", Fixture, NULL,
+               f_setup, test_xmit_queue_ack_sync, f_teardown);
+    g_test_add("/xmit-queue/bulk-after-normal", Fixture, NULL,
+               f_setup, test_xmit_queue_bulk_after_normal, f_teardown);
+
+    return g_test_run();
+}
@@ -0,0 +1,431 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 The spice-gtk contributors
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+#include "spice-client.h"
+#include "spice-capture.h"
+
+/*
+ * Replays the channel captures recorded with SPICE_CAPTURE_DIR: each
+ * channel is given one end of a socketpair through the open-fd signal,
+ * and a thread writes the recorded server data to the other end, at the
+ * original pace or as fast as the client consumes it. What the client
+ * sends is read and dropped.
+ *
+ * Captures of SASL authenticated channels can't be replayed. Only the
+ * first connection of a channel is replayed, the reconnections appended
+ * to its capture are skipped.
+ *
+ * With --canvas-bands, the captures are replayed once for each of the
+ * given SPICE_CANVAS_BANDS values, to compare the banded rasterisation
+ * of the display canvas, best with --max-speed.
+ */
+
+/* config */
+static gchar *capture_dir;
+static gboolean max_speed = FALSE;
+static gchar *canvas_bands;
+
+/* state */
+static SpiceSession  *session;
+static GMainLoop     *mainloop;
+static guint         running;
+
+typedef struct Replay {
+    gchar *name;
+    gchar *filename;
+    int fd;                 /* our end of the socketpair */
+    GThread *thread;
+
+    /* results */
+    guint64 bytes;
+    guint64 records;
+    gint64 elapsed;         /* until the client closed its end, in us */
+    gchar *error;
+} Replay;
+
+static GList *replays;
+
+/* ------------------------------------------------------------------ */
+/* replay thread */
+
+/* read and drop what the client sent, returns FALSE once it closed */
+static gboolean replay_drain(Replay *replay)
+{
+    char scratch[16 * 1024];
+
+    for (;;) {
+        ssize_t ret = read(replay->fd, scratch, sizeof(scratch));
+
+        if (ret > 0)
+            continue;
+        if (ret == 0)
+            return FALSE;
+        if (errno == EINTR)
+            continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+}
+
+/* wait for @events on the socket until @deadline (-1 for no deadline),
+ * draining client data meanwhile. Returns FALSE if the client closed */
+static gboolean replay_poll(Replay *replay, short events, gint64 deadline, gboolean *ready)
+{
+    struct pollfd pfd = { .fd = replay->fd, .events = events | POLLIN, };
+    int timeout = -1;
+
+    *ready = FALSE;
+    if (deadline >= 0) {
+        gint64 now = g_get_monotonic_time();
+        if (now >= deadline) {
+            *ready = TRUE;
+            return TRUE;
+        }
+        timeout = (deadline - now + 999) / 1000;
+    }
+
+    if (poll(&pfd, 1, timeout) < 0)
+        return errno == EINTR;
+
+    if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+        if (!replay_drain(replay))
+            return FALSE;
+    }
+    if (deadline < 0)
+        *ready = (pfd.revents & events) != 0;
+
+    return TRUE;
+}
+
+static gboolean replay_send(Replay *replay, const guint8 *data, gsize size)
+{
+    gboolean ready;
+
+    while (size > 0) {
+        ssize_t ret = write(replay->fd, data, size);
+
+        if (ret > 0) {
+            data += ret;
+            size -= ret;
+            continue;
+        }
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return FALSE;
+
+        if (!replay_poll(replay, POLLOUT, -1, &ready))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean replay_done(gpointer user_data)
+{
+    Replay *replay = user_data;
+
+    g_thread_join(replay->thread);
+    replay->thread = NULL;
+
+    if (replay->error)
+        g_warning("%s: %s", replay->name, replay->error);
+
+    if (--running == 0)
+        g_main_loop_quit(mainloop);
+
+    return FALSE;
+}
+
+static gpointer replay_thread(gpointer user_data)
+{
+    Replay *replay = user_data;
+    SpiceCaptureHeader header;
+    SpiceCaptureRecord record;
+    guint8 *buffer = NULL;
+    gsize buffer_size = 0;
+    gint64 start = 0;
+    gboolean ready;
+    FILE *file;
+
+    file = g_fopen(replay->filename, "rb");
+    if (file == NULL) {
+        replay->error = g_strdup_printf("failed to open %s: %s",
+                                        replay->filename, g_strerror(errno));
+        goto end;
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, SPICE_CAPTURE_MAGIC, sizeof(header.magic)) != 0 ||
+        GUINT32_FROM_LE(header.version) != SPICE_CAPTURE_VERSION) {
+        replay->error = g_strdup_printf("%s is not a supported capture", replay->filename);
+        goto end;
+    }
+
+    start = g_get_monotonic_time();
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        gsize size = GUINT32_FROM_LE(record.size);
+
+        if (record.direction == SPICE_CAPTURE_CONNECT) {
+            g_message("%s: skipping the reconnections", replay->name);
+            break;
+        }
+
+        if (size > buffer_size) {
+            buffer_size = size;
+            buffer = g_realloc(buffer, buffer_size);
+        }
+        if (fread(buffer, size, 1, file) != 1) {
+            replay->error = g_strdup_printf("truncated capture %s", replay->filename);
+            break;
+        }
+
+        if (record.direction != SPICE_CAPTURE_IN)
+            continue;
+
+        if (!max_speed) {
+            gint64 due = start + GUINT64_FROM_LE(record.timestamp);
+            do {
+                if (!replay_poll(replay, 0, due, &ready))
+                    goto client_closed;
+            } while (!ready);
+        }
+
+        if (!replay_send(replay, buffer, size))
+            goto client_closed;
+
+        replay->bytes += size;
+        replay->records++;
+    }
+
+    /* let the client process what it got, it closes the socket on EOF */
+    shutdown(replay->fd, SHUT_WR);
+    do {
+        if (!replay_poll(replay, POLLIN, -1, &ready))
+            break;
+    } while (TRUE);
+
+client_closed:
+    replay->elapsed = g_get_monotonic_time() - start;
+
+end:
+    if (file)
+        fclose(file);
+    g_free(buffer);
+    close(replay->fd);
+    replay->fd = -1;
+    g_idle_add(replay_done, replay);
+
+    return NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/* main context */
+
+static void replay_free(Replay *replay)
+{
+    g_free(replay->name);
+    g_free(replay->filename);
+    g_free(replay->error);
+    g_free(replay);
+}
+
+static void channel_open_fd(SpiceChannel *channel, gint with_tls G_GNUC_UNUSED,
+                            gpointer data G_GNUC_UNUSED)
+{
+    Replay *replay;
+    gchar *basename;
+    int type, id, fds[2];
+
+    g_object_get(channel, "channel-type", &type, "channel-id", &id, NULL);
+    basename = g_strdup_printf(SPICE_CAPTURE_FILENAME_FORMAT,
+                               spice_channel_type_to_string(type), id);
+
+    replay = g_new0(Replay, 1);
+    replay->name = g_strdup_printf("%s-%d", spice_channel_type_to_string(type), id);
+    replay->filename = g_build_filename(capture_dir, basename, NULL);
+    g_free(basename);
+
+    if (!g_file_test(replay->filename, G_FILE_TEST_EXISTS)) {
+        g_message("%s: no capture, not connecting", replay->name);
+        replay_free(replay);
+        return;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        g_warning("%s: socketpair failed: %s", replay->name, g_strerror(errno));
+        replay_free(replay);
+        return;
+    }
+
+    replay->fd = fds[1];
+    fcntl(replay->fd, F_SETFL, fcntl(replay->fd, F_GETFL) | O_NONBLOCK);
+    replays = g_list_append(replays, replay);
+    running++;
+
+    replay->thread = g_thread_new(replay->name, replay_thread, replay);
+    spice_channel_open_fd(channel, fds[0]);
+}
+
+static void channel_new(SpiceSession *s, SpiceChannel *channel, gpointer data)
+{
+    g_signal_connect(channel, "open-fd", G_CALLBACK(channel_open_fd), data);
+
+    /* the main channel is connected by spice_session_open_fd() */
+    if (!SPICE_IS_MAIN_CHANNEL(channel))
+        spice_channel_connect(channel);
+}
+
+static void print_results(const gchar *bands)
+{
+    GList *l;
+
+    if (bands)
+        printf("SPICE_CANVAS_BANDS=%s\n", bands);
+    printf("%-12s %14s %10s %10s %12s\n", "channel", "bytes", "records", "seconds", "MiB/s");
+    for (l = replays; l != NULL; l = l->next) {
+        Replay *replay = l->data;
+        double seconds = replay->elapsed / 1e6;
+
+        printf("%-12s %14" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT " %10.3f %12.2f\n",
+               replay->name, replay->bytes, replay->records, seconds,
+               seconds > 0 ? replay->bytes / seconds / (1024 * 1024) : 0.0);
+    }
+}
+
+/* ------------------------------------------------------------------ */
+
+static GOptionEntry app_entries[] = {
+    {
+        .long_name        = "capture-dir",
+        .short_name       = 'd',
+        .arg              = G_OPTION_ARG_FILENAME,
+        .arg_data         = &capture_dir,
+        .description      = "Directory holding the captures (SPICE_CAPTURE_DIR of the recording)",
+        .arg_description  = "<dir>",
+    },
+    {
+        .long_name        = "max-speed",
+        .arg              = G_OPTION_ARG_NONE,
+        .arg_data         = &max_speed,
+        .description      = "Replay as fast as the client reads rather than at the recorded pace",
+    },
+    {
+        .long_name        = "canvas-bands",
+        .arg              = G_OPTION_ARG_STRING,
+        .arg_data         = &canvas_bands,
+        .description      = "Replay once for each number of canvas bands, comma separated",
+        .arg_description  = "<n,...>",
+    },
+    {
+        /* end of list */
+    }
+};
+
+/* replays the captures once, with a new session */
+static gboolean replay_run(const gchar *bands)
+{
+    mainloop = g_main_loop_new(NULL, false);
+
+    session = spice_session_new();
+    g_signal_connect(session, "channel-new",
+                     G_CALLBACK(channel_new), NULL);
+    spice_set_session_option(session);
+
+    if (!spice_session_open_fd(session, -1) || running == 0) {
+        fprintf(stderr, "failed to replay the main channel\n");
+        return FALSE;
+    }
+
+    g_main_loop_run(mainloop);
+
+    spice_session_disconnect(session);
+    while (running > 0)
+        g_main_context_iteration(NULL, TRUE);
+
+    print_results(bands);
+
+    g_list_free_full(replays, (GDestroyNotify)replay_free);
+    replays = NULL;
+    g_clear_object(&session);
+    g_clear_pointer(&mainloop, g_main_loop_unref);
+
+    return TRUE;
+}
+
+static void
+signal_handler(int signum)
+{
+    g_main_loop_quit(mainloop);
+}
+
+int main(int argc, char *argv[])
+{
+    GError *error = NULL;
+    GOptionContext *context;
+
+    signal(SIGINT, signal_handler);
+
+    /* parse opts */
+    context = g_option_context_new(NULL);
+    g_option_context_set_summary(context, "Replays SPICE channel captures, for benchmarks.");
+    g_option_context_set_description(context, "Report bugs to " PACKAGE_BUGREPORT ".");
+    g_option_context_add_main_entries(context, app_entries, NULL);
+    g_option_context_add_group(context, spice_get_option_group());
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_print("option parsing failed: %s\n", error->message);
+        exit(1);
+    }
+    g_option_context_free(context);
+
+    if (capture_dir == NULL) {
+        g_print("no --capture-dir given\n");
+        exit(1);
+    }
+
+    if (canvas_bands == NULL) {
+        if (!replay_run(NULL))
+            exit(1);
+    } else {
+        gchar **bands = g_strsplit(canvas_bands, ",", -1);
+        guint i;
+
+        for (i = 0; bands[i] != NULL; i++) {
+            g_setenv("SPICE_CANVAS_BANDS", bands[i], TRUE);
+            if (!replay_run(bands[i]))
+                exit(1);
+        }
+        g_strfreev(bands);
+    }
+
+    g_free(canvas_bands);
+    g_free(capture_dir);
+
+    return 0;
+}
@@ -23,6 +23,8 @@
 
 /* config */
 static gboolean version = FALSE;
+static gint interval = 0;
+static gint top_types = 5;
 
 /* state */
 static SpiceSession  *session;
@@ -41,6 +43,138 @@ static void main_channel_event(SpiceChannel *channel, SpiceChannelEvent event,
     }
 }
 
+static guint64 lookup_counter(GVariant *stats, const char *key)
+{
+    GVariant *value = g_variant_lookup_value(stats, key, NULL);
+    guint64 counter = 0;
+
+    if (value == NULL)
+        return 0;
+    if (g_variant_is_of_type(value, G_VARIANT_TYPE_UINT64))
+        counter = g_variant_get_uint64(value);
+    else if (g_variant_is_of_type(value, G_VARIANT_TYPE_INT64))
+        counter = g_variant_get_int64(value);
+    g_variant_unref(value);
+
+    return counter;
+}
+
+typedef struct MsgTypeRate {
+    guint16 type;
+    guint64 count;
+    guint64 bytes;
+    guint64 parse_us;
+    guint64 handler_us;
+} MsgTypeRate;
+
+/* the difference of the "messages-in" arrays of two snapshots */
+static GArray *msg_type_rates(GVariant *stats, GVariant *previous)
+{
+    GArray *rates = g_array_new(FALSE, TRUE, sizeof(MsgTypeRate));
+    GHashTable *before = g_hash_table_new(g_direct_hash, g_direct_equal);
+    GVariant *array, *prev_array = NULL;
+    GVariantIter iter;
+    MsgTypeRate rate;
+    guint i;
+
+    if (previous) {
+        prev_array = g_variant_lookup_value(previous, "messages-in", G_VARIANT_TYPE("a(qtttt)"));
+        for (i = 0; prev_array && i < g_variant_n_children(prev_array); i++) {
+            guint16 type;
+            g_variant_get_child(prev_array, i, "(qtttt)", &type, NULL, NULL, NULL, NULL);
+            g_hash_table_insert(before, GUINT_TO_POINTER(type), GUINT_TO_POINTER(i + 1));
+        }
+    }
+
+    array = g_variant_lookup_value(stats, "messages-in", G_VARIANT_TYPE("a(qtttt)"));
+    if (array == NULL)
+        goto end;
+
+    g_variant_iter_init(&iter, array);
+    while (g_variant_iter_next(&iter, "(qtttt)", &rate.type, &rate.count, &rate.bytes,
+                               &rate.parse_us, &rate.handler_us)) {
+        guint index = GPOINTER_TO_UINT(g_hash_table_lookup(before, GUINT_TO_POINTER(rate.type)));
+
+        if (index > 0) {
+            guint64 count, bytes, parse_us, handler_us;
+            g_variant_get_child(prev_array, index - 1, "(qtttt)", NULL,
+                                &count, &bytes, &parse_us, &handler_us);
+            rate.count -= count;
+            rate.bytes -= bytes;
+            rate.parse_us -= parse_us;
+            rate.handler_us -= handler_us;
+        }
+        if (rate.count > 0)
+            g_array_append_val(rates, rate);
+    }
+    g_variant_unref(array);
+
+end:
+    if (prev_array)
+        g_variant_unref(prev_array);
+    g_hash_table_unref(before);
+    return rates;
+}
+
+static gint compare_cpu_time(gconstpointer a, gconstpointer b)
+{
+    const MsgTypeRate *ra = a, *rb = b;
+    guint64 ta = ra->parse_us + ra->handler_us;
+    guint64 tb = rb->parse_us + rb->handler_us;
+
+    return ta < tb ? 1 : ta > tb ? -1 : 0;
+}
+
+/* live mode: print the rates over the last interval */
+static void channel_stats(SpiceChannel *channel, GVariant *stats, gpointer data)
+{
+    GVariant *previous = g_object_get_data(G_OBJECT(channel), "spicy-stats-previous");
+    gint64 elapsed;
+    double seconds;
+    GArray *rates;
+    gint type, id;
+    guint i;
+
+    if (previous == NULL) {
+        g_object_set_data_full(G_OBJECT(channel), "spicy-stats-previous",
+                               g_variant_ref(stats), (GDestroyNotify)g_variant_unref);
+        return;
+    }
+
+    elapsed = lookup_counter(stats, "timestamp") - lookup_counter(previous, "timestamp");
+    if (elapsed <= 0)
+        return;
+    seconds = elapsed / 1e6;
+
+#define RATE(Key) ((lookup_counter(stats, Key) - lookup_counter(previous, Key)) / seconds)
+    g_object_get(channel, "channel-type", &type, "channel-id", &id, NULL);
+    printf("%s-%d: %.1f KiB/s in, reads %.0f/s (tls %.0f/s), writes %.0f/s (tls %.0f/s), "
+           "sent %.0f msg/s",
+           spice_channel_type_to_string(type), id,
+           RATE("read-bytes") / 1024,
+           RATE("socket-reads"), RATE("tls-reads"),
+           RATE("socket-writes"), RATE("tls-writes"),
+           RATE("xmit-sent"));
+    if (RATE("xmit-sent") > 0)
+        printf(", queued %.2f ms avg", RATE("xmit-wait-us") / RATE("xmit-sent") / 1000);
+    printf("\n");
+#undef RATE
+
+    rates = msg_type_rates(stats, previous);
+    g_array_sort(rates, compare_cpu_time);
+    for (i = 0; i < rates->len && (gint)i < top_types; i++) {
+        MsgTypeRate *rate = &g_array_index(rates, MsgTypeRate, i);
+
+        printf("    type %3u: %8.1f msg/s %10.1f KiB/s  parse %6.2f%%  handler %6.2f%%\n",
+               rate->type, rate->count / seconds, rate->bytes / seconds / 1024,
+               100.0 * rate->parse_us / elapsed, 100.0 * rate->handler_us / elapsed);
+    }
+    g_array_unref(rates);
+
+    g_object_set_data_full(G_OBJECT(channel), "spicy-stats-previous",
+                           g_variant_ref(stats), (GDestroyNotify)g_variant_unref);
+}
+
 static void channel_new(SpiceSession *s, SpiceChannel *channel, gpointer *data)
 {
     int id;
@@ -57,6 +191,11 @@ static void channel_new(SpiceSession *s, SpiceChannel *channel, gpointer *data)
             return;
     }
 
+    if (interval > 0) {
+        g_signal_connect(channel, "stats", G_CALLBACK(channel_stats), NULL);
+        g_object_set(channel, "stats-interval", interval, NULL);
+    }
+
     spice_channel_connect(channel);
 }
 
@@ -69,6 +208,21 @@ static GOptionEntry app_entries[] = {
         .arg_data         = &version,
         .description      = "Display version and quit",
     },
+    {
+        .long_name        = "interval",
+        .short_name       = 'i',
+        .arg              = G_OPTION_ARG_INT,
+        .arg_data         = &interval,
+        .description      = "Print the channel rates every <ms> milliseconds",
+        .arg_description  = "<ms>",
+    },
+    {
+        .long_name        = "top",
+        .arg              = G_OPTION_ARG_INT,
+        .arg_data         = &top_types,
+        .description      = "Message types listed per channel in live mode, by CPU time (default 5)",
+        .arg_description  = "<n>",
+    },
     {
         /* end of list */
     }
@@ -119,18 +273,197 @@ int main(int argc, char *argv[])
     {
         GList *iter, *list = spice_session_get_channels(session);
         gulong total_read_bytes;
+        guint64 total_wire_reads, total_saved_reads;
         gint  channel_type;
-        printf("total bytes read:\n");
+        printf("total bytes read (wire reads, saved reads):\n");
         for (iter = list ; iter ; iter = iter->next) {
             g_object_get(iter->data,
                 "total-read-bytes", &total_read_bytes,
+                "total-wire-reads", &total_wire_reads,
+                "total-saved-reads", &total_saved_reads,
+                "channel-type", &channel_type,
+                NULL);
+            printf("%s: %lu (%" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT ")\n",
+                   spice_channel_type_to_string(channel_type),
+                   total_read_bytes, total_wire_reads, total_saved_reads);
+        }
+        printf("message pool (hit rate, recycled bytes):\n");
+        for (iter = list ; iter ; iter = iter->next) {
+            GVariant *stats;
+            guint64 allocations = 0, hits = 0, recycled = 0;
+
+            g_object_get(iter->data,
+                "msg-pool-stats", &stats,
                 "channel-type", &channel_type,
                 NULL);
-            printf("%s: %lu\n",
+            g_variant_lookup(stats, "allocations", "t", &allocations);
+            g_variant_lookup(stats, "hits", "t", &hits);
+            g_variant_lookup(stats, "recycled-bytes", "t", &recycled);
+            g_variant_unref(stats);
+            printf("%s: %.1f%%, %" G_GUINT64_FORMAT "\n",
                    spice_channel_type_to_string(channel_type),
-                   total_read_bytes);
+                   allocations ? 100.0 * hits / allocations : 0.0,
+                   recycled);
+        }
+        for (iter = list ; iter ; iter = iter->next) {
+            GVariant *stats;
+            guint32 threads = 0;
+            guint64 images = 0, declined = 0, waits = 0;
+            gint64 decode_us = 0, wait_us = 0;
+
+            if (!SPICE_IS_DISPLAY_CHANNEL(iter->data))
+                continue;
+
+            g_object_get(iter->data, "decode-stats", &stats, NULL);
+            g_variant_lookup(stats, "threads", "u", &threads);
+            g_variant_lookup(stats, "images", "t", &images);
+            g_variant_lookup(stats, "declined", "t", &declined);
+            g_variant_lookup(stats, "decode-us", "x", &decode_us);
+            g_variant_lookup(stats, "waits", "t", &waits);
+            g_variant_lookup(stats, "wait-us", "x", &wait_us);
+            g_variant_unref(stats);
+            printf("image decoding: %u threads, %" G_GUINT64_FORMAT " images "
+                   "(%" G_GUINT64_FORMAT " declined, avg %.2f ms), "
+                   "%" G_GUINT64_FORMAT " waits (avg %.2f ms)\n",
+                   threads, images, declined,
+                   images + declined ? decode_us / 1000.0 / (images + declined) : 0.0,
+                   waits, waits ? wait_us / 1000.0 / waits : 0.0);
+        }
+        for (iter = list ; iter ; iter = iter->next) {
+            GVariant *stats;
+            guint64 frames = 0, dropped = 0, batches = 0, packets = 0, encode_us = 0;
+
+            if (!SPICE_IS_RECORD_CHANNEL(iter->data))
+                continue;
+
+            g_object_get(iter->data, "encode-stats", &stats, NULL);
+            g_variant_lookup(stats, "frames", "t", &frames);
+            g_variant_lookup(stats, "dropped-frames", "t", &dropped);
+            g_variant_lookup(stats, "batches", "t", &batches);
+            g_variant_lookup(stats, "packets", "t", &packets);
+            g_variant_lookup(stats, "encode-time", "t", &encode_us);
+            g_variant_unref(stats);
+            printf("record: %" G_GUINT64_FORMAT " frames (%" G_GUINT64_FORMAT " dropped), "
+                   "%" G_GUINT64_FORMAT " batches (avg %.2f ms), %" G_GUINT64_FORMAT " packets\n",
+                   frames, dropped, batches,
+                   batches ? encode_us / 1000.0 / batches : 0.0, packets);
+        }
+        for (iter = list ; iter ; iter = iter->next) {
+            GVariant *stats;
+            guint64 packets = 0, bytes = 0, shared = 0, copied = 0;
+            guint64 underruns = 0, overruns = 0;
+            guint32 target = 0, depth = 0, max_depth = 0, latency = 0;
+
+            if (!SPICE_IS_PLAYBACK_CHANNEL(iter->data))
+                continue;
+
+            g_object_get(iter->data, "data-stats", &stats, NULL);
+            g_variant_lookup(stats, "packets", "t", &packets);
+            g_variant_lookup(stats, "bytes", "t", &bytes);
+            g_variant_lookup(stats, "shared-bytes", "t", &shared);
+            g_variant_lookup(stats, "copied-bytes", "t", &copied);
+            g_variant_unref(stats);
+            printf("playback: %" G_GUINT64_FORMAT " packets, %" G_GUINT64_FORMAT " bytes, "
+                   "%" G_GUINT64_FORMAT " shared, %" G_GUINT64_FORMAT " copied\n",
+                   packets, bytes, shared, copied);
+
+            g_object_get(iter->data, "jitter-stats", &stats, NULL);
+            g_variant_lookup(stats, "underruns", "t", &underruns);
+            g_variant_lookup(stats, "overruns", "t", &overruns);
+            g_variant_lookup(stats, "target-ms", "u", &target);
+            g_variant_lookup(stats, "depth-ms", "u", &depth);
+            g_variant_lookup(stats, "max-depth-ms", "u", &max_depth);
+            g_variant_lookup(stats, "latency-ms", "u", &latency);
+            g_variant_unref(stats);
+            printf("playback jitter: %" G_GUINT64_FORMAT " underruns, %" G_GUINT64_FORMAT " overruns, "
+                   "depth %u ms (target %u, max %u), latency %u ms\n",
+                   underruns, overruns, depth, target, max_depth, latency);
+        }
+        for (iter = list ; iter ; iter = iter->next) {
+            GVariant *stats, *stream;
+            GVariantIter streams;
+            const gchar *id;
+
+            if (!SPICE_IS_DISPLAY_CHANNEL(iter->data))
+                continue;
+
+            g_object_get(iter->data, "stream-stats", &stats, NULL);
+            g_variant_iter_init(&streams, stats);
+            while (g_variant_iter_next(&streams, "{&sv}", &id, &stream)) {
+                const gchar *hists[] = { "arrive-late-histogram",
+                                         "present-late-histogram",
+                                         "present-jitter-histogram" };
+                guint32 frames = 0, presented = 0;
+                guint i;
+
+                g_variant_lookup(stream, "frames", "u", &frames);
+                g_variant_lookup(stream, "presented", "u", &presented);
+                printf("stream %s: %u frames, %u presented\n", id, frames, presented);
+                for (i = 0; i < G_N_ELEMENTS(hists); i++) {
+                    GVariant *hist = g_variant_lookup_value(stream, hists[i],
+                                                            G_VARIANT_TYPE("au"));
+                    const guint32 *buckets;
+                    gsize j, n;
+
+                    if (hist == NULL)
+                        continue;
+                    buckets = g_variant_get_fixed_array(hist, &n, sizeof(guint32));
+                    printf("  %s:", hists[i]);
+                    for (j = 0; j < n; j++)
+                        printf(" %u", buckets[j]);
+                    printf("\n");
+                    g_variant_unref(hist);
+                }
+                g_variant_unref(stream);
+            }
+            g_variant_unref(stats);
         }
         g_list_free(list);
     }
+    {
+        GVariant *stats;
+        guint64 hits = 0, misses = 0, evictions = 0, bytes = 0, waits = 0;
+        gint64 wait_us = 0, max_wait_us = 0;
+
+        g_object_get(session, "image-cache-stats", &stats, NULL);
+        g_variant_lookup(stats, "hits", "t", &hits);
+        g_variant_lookup(stats, "misses", "t", &misses);
+        g_variant_lookup(stats, "evictions", "t", &evictions);
+        g_variant_lookup(stats, "bytes", "t", &bytes);
+        g_variant_lookup(stats, "waits", "t", &waits);
+        g_variant_lookup(stats, "wait-us", "x", &wait_us);
+        g_variant_lookup(stats, "max-wait-us", "x", &max_wait_us);
+        g_variant_unref(stats);
+        printf("image cache: %.1f%% hits, %" G_GUINT64_FORMAT " evictions, %" G_GUINT64_FORMAT " bytes\n",
+               hits + misses ? 100.0 * hits / (hits + misses) : 0.0, evictions, bytes);
+        printf("image cache waits: %" G_GUINT64_FORMAT " (avg %.2f ms, max %.2f ms)\n",
+               waits, waits ? wait_us / 1000.0 / waits : 0.0, max_wait_us / 1000.0);
+
+        g_object_get(session, "glz-window-stats", &stats, NULL);
+        g_variant_lookup(stats, "max-bytes", "t", &bytes);
+        g_variant_lookup(stats, "stalls", "t", &waits);
+        g_variant_lookup(stats, "stall-us", "x", &wait_us);
+        g_variant_lookup(stats, "max-stall-us", "x", &max_wait_us);
+        g_variant_unref(stats);
+        printf("glz window: %" G_GUINT64_FORMAT " bytes at most, "
+               "%" G_GUINT64_FORMAT " stalls (avg %.2f ms, max %.2f ms)\n",
+               bytes, waits, waits ? wait_us / 1000.0 / waits : 0.0, max_wait_us / 1000.0);
+    }
+    {
+        GVariant *stats;
+        guint64 allocations = 0, hits = 0, clears = 0, clears_skipped = 0, bytes = 0;
+
+        g_object_get(session, "surface-pool-stats", &stats, NULL);
+        g_variant_lookup(stats, "allocations", "t", &allocations);
+        g_variant_lookup(stats, "hits", "t", &hits);
+        g_variant_lookup(stats, "clears", "t", &clears);
+        g_variant_lookup(stats, "clears-skipped", "t", &clears_skipped);
+        g_variant_lookup(stats, "bytes", "t", &bytes);
+        g_variant_unref(stats);
+        printf("surface pool: %" G_GUINT64_FORMAT " surfaces, %" G_GUINT64_FORMAT " recycled "
+               "(%" G_GUINT64_FORMAT " cleared, %" G_GUINT64_FORMAT " overwritten), "
+               "%" G_GUINT64_FORMAT " bytes cached\n",
+               allocations, hits, clears, clears_skipped, bytes);
+    }
     return 0;
 }